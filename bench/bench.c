@@ -0,0 +1,1569 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+
+// Include the GPSD routines as-is, so we can reach its static functions...
+#include "gpsd.c"
+
+#include "evloop.h"
+#include "expr.h"
+#include "log.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "sparkplug.h"
+#include "timespec.h"
+#include "topic.h"
+#include "uring.h"
+#include "wheel.h"
+#include "worker.h"
+
+// the minimal duration of a single sample, in nanoseconds...
+#define SAMPLE_NS 5000000ULL
+// the duration of the warm-up of each benchmark, in nanoseconds...
+#define WARMUP_NS 50000000ULL
+#define DEFAULT_RUNS 21
+#define MAX_RUNS 101
+// the allowed slowdown compared to the baseline, in percent...
+#define DEFAULT_TOLERANCE 15.0
+
+#define MAX_BASELINE 64
+#define MAX_BENCH_FILTERS 8
+
+typedef void (*bench_fn_t)(void *context, uint64_t iterations);
+
+typedef struct bench {
+    const char *name;
+    bench_fn_t fn;
+    void *context;
+} bench_t;
+
+typedef struct bench_result {
+    uint64_t iterations;
+    double median;
+    double mad;
+    double min;
+    double max;
+    // the system calls per iteration, for the benchmarks that count them...
+    double syscalls;
+} bench_result_t;
+
+typedef struct baseline {
+    char name[64];
+    double median;
+} baseline_t;
+
+// keeps the compiler from optimizing away the work of a benchmark...
+static volatile uint64_t bench_sink;
+// the system calls made by a benchmark, counted by the benchmark itself at its call sites...
+static uint64_t bench_syscalls;
+// the time a benchmark measured itself, for the benchmarks that wait in between, 0 to use the wall time...
+static uint64_t bench_measured_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Fills an event like GPSD would report it, with the given number of satellites...
+static void fill_event(gps_event_t *event, int sats) {
+    bzero(event, sizeof(gps_event_t));
+
+    strcpy(event->device, "/dev/ttyACM0");
+    event->time = (struct timespec) {
+        .tv_sec = 1577836800, .tv_nsec = 123456789
+    };
+    event->tdop = 1.2;
+    event->qErr = -2345;
+    event->toff = 0.000123;
+    event->pps = -0.000001;
+    event->osc_running = true;
+    event->osc_reference = true;
+    event->osc_disciplined = true;
+    event->osc_delta = 12;
+
+    for (int i = 0; i < sats && i < GPS_MAX_SATS; i++) {
+        gps_sat_t *sat = &event->sats[event->sats_cnt++];
+        sat->gnssid = (uint8_t)(i % GNSSID_CNT);
+        sat->svid = (uint8_t)(i + 1);
+        sat->used = (i % 3) != 0;
+        sat->ss = (float)(20 + i % 30);
+        sat->elevation = (float)(i % 90);
+        sat->azimuth = (float)(i * 7 % 360);
+
+        event->sats_visible++;
+        if (sat->used) {
+            event->sats_used++;
+            event->sats_seen[sat->gnssid]++;
+        }
+    }
+    event->avg_snr = 35.5;
+}
+
+// create_event_payload...
+
+static void bench_create_event(void *context, uint64_t iterations) {
+    gpsd_handle_t *handle = context;
+    gps_event_t event;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        create_event_payload(handle, handle->tracks[0], &event);
+        bench_sink += (uint64_t) event.sats_cnt;
+    }
+}
+
+static gpsd_handle_t *create_handle(int sats) {
+    gpsd_source_t source = {
+        .name = "bench", .host = "localhost", .port = "2947",
+    };
+
+    gpsd_handle_t *handle = gpsd_init(&source);
+    if (handle == NULL) {
+        return NULL;
+    }
+
+    strcpy(handle->gpsd.dev.path, "/dev/ttyACM0");
+    handle->gpsd.satellites_visible = sats;
+    for (int i = 0; i < sats && i < MAXCHANNELS; i++) {
+        struct satellite_t *sat = &handle->gpsd.skyview[i];
+#if GPSD_API_MAJOR_VERSION >= 8
+        sat->gnssid = (unsigned char)(i % GNSSID_CNT);
+        sat->svid = (unsigned char)(i + 1);
+#else
+        sat->PRN = (short)(i + 1);
+#endif
+        sat->used = (i % 3) != 0;
+        sat->ss = 20 + i % 30;
+        sat->elevation = i % 90;
+        sat->azimuth = i * 7 % 360;
+        if (sat->used) {
+            handle->gpsd.satellites_used++;
+        }
+    }
+    handle->gpsd.fix.mode = MODE_3D;
+
+    // the pipeline of the device, as created by its first message...
+    if (find_track(handle) == NULL) {
+        gpsd_destroy(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+// track_cn0...
+
+static void bench_track_cn0(void *context, uint64_t iterations) {
+    gpsd_handle_t *handle = context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        track_cn0(handle, handle->tracks[0], SATELLITE_SET);
+    }
+    bench_sink += handle->tracks[0]->cn0[GNSSID_GPS].visible_cnt;
+}
+
+static gpsd_handle_t *create_cn0_handle(int sats) {
+    gpsd_handle_t *handle = create_handle(sats);
+    if (handle) {
+        // no window completes during a run...
+        handle->cn0_window = UINT64_MAX / 2;
+    }
+    return handle;
+}
+
+// GPSD message parsing...
+
+typedef struct parse_ctx {
+    gpsd_handle_t *handle;
+    char *msg;
+    char *buf;
+    size_t len;
+} parse_ctx_t;
+
+static void count_event(gps_event_t *event, void *context) {
+    (void)context;
+    bench_sink += (uint64_t) event->sats_used;
+}
+
+static void bench_parse(void *context, uint64_t iterations) {
+    parse_ctx_t *ctx = context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // parsing modifies the data in place...
+        memcpy(ctx->buf, ctx->msg, ctx->len);
+        bench_sink += (uint64_t) gpsd_feed_data(ctx->handle, ctx->buf, ctx->len, count_event, NULL);
+    }
+}
+
+#define TPV_MSG "{\"class\":\"TPV\",\"device\":\"/dev/ttyACM0\",\"mode\":3,\"time\":\"2020-01-01T00:00:00.000Z\"," \
+    "\"ept\":0.005,\"lat\":51.123456789,\"lon\":4.123456789,\"alt\":12.345,\"epx\":2.1,\"epy\":2.3,\"epv\":5.4," \
+    "\"track\":12.3,\"speed\":0.012,\"climb\":0.001,\"eps\":0.1,\"epc\":0.2}\n"
+
+static char *create_sky_msg(int sats) {
+    size_t size = 256 + (size_t) sats * 96;
+    char *msg = malloc(size);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    int len = snprintf(msg, size, "{\"class\":\"SKY\",\"device\":\"/dev/ttyACM0\",\"xdop\":0.6,\"ydop\":0.7,"
+                       "\"vdop\":1.1,\"tdop\":1.2,\"hdop\":0.9,\"gdop\":2.0,\"pdop\":1.4,\"satellites\":[");
+    for (int i = 0; i < sats; i++) {
+        len += snprintf(msg + len, size - (size_t) len, "%s{\"PRN\":%d,\"el\":%d,\"az\":%d,\"ss\":%d,\"used\":%s,\"gnssid\":%d,\"svid\":%d}",
+                        i ? "," : "", i + 1, i % 90, i * 7 % 360, 20 + i % 30, (i % 3) ? "true" : "false", i % 7, i + 1);
+    }
+    snprintf(msg + len, size - (size_t) len, "]}\n");
+
+    return msg;
+}
+
+// A cycle of a typical receiver, the checksums are added by create_nmea_msg...
+static const char *nmea_cycle[] = {
+    "GPRMC,000000.00,A,5107.40741,N,00407.40741,E,0.012,,010120,,,A",
+    "GPVTG,,T,,M,0.012,N,0.022,K,A",
+    "GPGGA,000000.00,5107.40741,N,00407.40741,E,1,12,0.90,12.3,M,46.0,M,,",
+    "GPGSA,A,3,01,02,04,05,07,08,10,11,13,14,16,17,1.40,0.90,1.10",
+    "GPGSV,3,1,12,01,10,007,20,02,20,014,21,03,30,021,22,04,40,028,23",
+    "GPGSV,3,2,12,05,50,035,24,06,60,042,25,07,70,049,26,08,80,056,27",
+    "GPGSV,3,3,12,09,10,063,28,10,20,070,29,11,30,077,30,12,40,084,31",
+    "GPGLL,5107.40741,N,00407.40741,E,000000.00,A,A",
+};
+
+static char *create_nmea_msg(void) {
+    size_t cnt = sizeof(nmea_cycle) / sizeof(nmea_cycle[0]);
+    size_t size = cnt * 96;
+    char *msg = malloc(size);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    int len = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        uint8_t sum = 0;
+        for (const char *p = nmea_cycle[i]; *p; p++) {
+            sum ^= (uint8_t) *p;
+        }
+        len += snprintf(msg + len, size - (size_t) len, "$%s*%02X\r\n", nmea_cycle[i], sum);
+    }
+
+    return msg;
+}
+
+static parse_ctx_t *create_parse_ctx(char *msg, bool nmea) {
+    parse_ctx_t *ctx = malloc(sizeof(parse_ctx_t));
+    if (ctx == NULL || msg == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    gpsd_source_t source = {
+        .name = "bench", .host = "localhost", .port = "2947", .nmea = nmea,
+    };
+    ctx->handle = gpsd_init(&source);
+    ctx->msg = msg;
+    ctx->len = strlen(msg);
+    ctx->buf = malloc(ctx->len + 1);
+    if (ctx->handle == NULL || ctx->buf == NULL) {
+        return NULL;
+    }
+
+    // a fix is needed before SKY messages result in events...
+    char tpv[] = TPV_MSG;
+    gpsd_feed_data(ctx->handle, tpv, strlen(tpv), count_event, NULL);
+
+    return ctx;
+}
+
+// Timestamp arithmetic...
+
+static struct timespec timestamps[3] = {
+    { .tv_sec = 1000, .tv_nsec = 100 },
+    { .tv_sec = 999, .tv_nsec = 999999000 },
+    { .tv_sec = 0, .tv_nsec = 0 },
+};
+
+static void bench_ts_sub(void *context, uint64_t iterations) {
+    struct timespec *ts = context;
+    struct timespec r;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // alternate between borrowing, carrying and negative results...
+        ts[0].tv_nsec = (long)(i % 3) * 400000000;
+        TS_SUB(&r, &ts[i & 1], &ts[!(i & 1)]);
+        bench_sink += (uint64_t) r.tv_nsec;
+    }
+}
+
+static void bench_tstons(void *context, uint64_t iterations) {
+    struct timespec *ts = context;
+    double total = 0;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        ts->tv_nsec = (long) i & 0xfffff;
+        total += TSTONS(ts);
+    }
+    bench_sink += (uint64_t) total;
+}
+
+// Payload encoders...
+
+static void bench_json(void *context, uint64_t iterations) {
+    const gps_event_t *event = context;
+    char buf[PAYLOAD_MAX_SIZE];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        bench_sink += (uint64_t) payload_encode_json(event, buf, sizeof(buf));
+    }
+}
+
+static void bench_field_values(void *context, uint64_t iterations) {
+    const gps_event_t *event = context;
+    payload_value_t values[PAYLOAD_FIELD_CNT];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        payload_field_values(event, values);
+        bench_sink += values[0].bits;
+    }
+}
+
+static void bench_sparkplug_birth(void *context, uint64_t iterations) {
+    const gps_event_t *event = context;
+    sparkplug_state_t state;
+    sparkplug_device_t device;
+    sparkplug_update_t update;
+    uint8_t buf[PAYLOAD_MAX_SIZE];
+
+    sparkplug_init(&state, 0);
+    sparkplug_device_init(&state, &device);
+    for (uint64_t i = 0; i < iterations; i++) {
+        bench_sink += (uint64_t) sparkplug_encode_device_birth(&state, &device, event, &update, buf, sizeof(buf));
+        sparkplug_commit(&state, &device, &update);
+    }
+}
+
+static void bench_sparkplug_data(void *context, uint64_t iterations) {
+    gps_event_t event = *(const gps_event_t *) context;
+    sparkplug_state_t state;
+    sparkplug_device_t device;
+    sparkplug_update_t update;
+    uint8_t buf[PAYLOAD_MAX_SIZE];
+
+    sparkplug_init(&state, 0);
+    sparkplug_device_init(&state, &device);
+    for (uint64_t i = 0; i < iterations; i++) {
+        // make sure a few metrics change each time...
+        event.time.tv_sec++;
+        event.qErr = (long)(i & 0xff);
+        bench_sink += (uint64_t) sparkplug_encode_device_data(&state, &device, &event, &update, buf, sizeof(buf));
+        sparkplug_commit(&state, &device, &update);
+    }
+}
+
+// Expressions of derived fields and filters...
+
+typedef struct expr_ctx {
+    expr_t *expr;
+    gps_event_t event;
+} expr_ctx_t;
+
+static void bench_expr(void *context, uint64_t iterations) {
+    const expr_ctx_t *ctx = context;
+    double total = 0;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        total += expr_eval(ctx->expr, &ctx->event);
+    }
+    bench_sink += (uint64_t) total;
+}
+
+static expr_ctx_t *create_expr_ctx(const char *src, int sats) {
+    char error[256];
+
+    expr_ctx_t *ctx = calloc(1, sizeof(expr_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->expr = expr_compile(src, error, sizeof(error));
+    if (ctx->expr == NULL) {
+        fprintf(stderr, "Unable to compile %s: %s\n", src, error);
+        free(ctx);
+        return NULL;
+    }
+    fill_event(&ctx->event, sats);
+    return ctx;
+}
+
+// Logging, of which the writer writes to stderr, which is redirected to a sink that keeps up or stalls...
+
+#define LOG_BURST 32
+#define LOG_PAUSE_NS 1000000
+
+typedef struct log_ctx {
+    int stderr_fd;
+    int null_fd;
+    // nobody reads from this pipe while a benchmark runs...
+    int pipe_fds[2];
+} log_ctx_t;
+
+// Does not flush stderr, as a stalled writer holds its lock (stderr is unbuffered anyway)...
+static void redirect_stderr(int fd) {
+    dup2(fd, STDERR_FILENO);
+}
+
+// Fills a pipe, so the next (blocking) write to it stalls...
+static void fill_pipe(int fd) {
+    char buf[4096] = { 0 };
+    int flags = fcntl(fd, F_GETFL);
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    while (write(fd, buf, sizeof(buf)) > 0) {
+    }
+    while (write(fd, buf, 1) > 0) {
+    }
+    fcntl(fd, F_SETFL, flags);
+}
+
+static void drain_pipe(int fd) {
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void bench_log_sync(void *context, uint64_t iterations) {
+    log_ctx_t *ctx = context;
+
+    redirect_stderr(ctx->null_fd);
+    for (uint64_t i = 0; i < iterations; i++) {
+        log_info("Benchmark message %" PRIu64 " of %" PRIu64, i, iterations);
+    }
+    redirect_stderr(ctx->stderr_fd);
+}
+
+// Logs in bursts that fit in the queue, and gives the writer time to catch up in between, which is not measured...
+static void bench_log_async(void *context, uint64_t iterations) {
+    log_ctx_t *ctx = context;
+    const struct timespec pause = {
+        .tv_nsec = LOG_PAUSE_NS
+    };
+    uint64_t dropped = log_async_dump_stats().dropped;
+
+    redirect_stderr(ctx->null_fd);
+    log_async_start();
+    for (uint64_t i = 0; i < iterations;) {
+        uint64_t t = now_ns();
+        for (int j = 0; j < LOG_BURST && i < iterations; j++, i++) {
+            log_info("Benchmark message %" PRIu64 " of %" PRIu64, i, iterations);
+        }
+        bench_measured_ns += now_ns() - t;
+        nanosleep(&pause, NULL);
+    }
+    log_async_stop();
+    redirect_stderr(ctx->stderr_fd);
+
+    if (log_async_dump_stats().dropped != dropped) {
+        fprintf(stderr, "Log writer did not keep up, %" PRIu64 " messages dropped!\n", log_async_dump_stats().dropped - dropped);
+    }
+}
+
+static void bench_log_stalled(void *context, uint64_t iterations) {
+    log_ctx_t *ctx = context;
+
+    fill_pipe(ctx->pipe_fds[1]);
+    redirect_stderr(ctx->pipe_fds[1]);
+    log_async_start();
+    for (uint64_t i = 0; i < iterations; i++) {
+        log_info("Benchmark message %" PRIu64 " of %" PRIu64, i, iterations);
+    }
+
+    // Let the writer continue, into the void...
+    redirect_stderr(ctx->null_fd);
+    drain_pipe(ctx->pipe_fds[0]);
+    log_async_stop();
+    redirect_stderr(ctx->stderr_fd);
+}
+
+static void bench_log_debug(void *context, uint64_t iterations) {
+    (void)context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        log_debug("Benchmark message %" PRIu64 " of %" PRIu64, i, iterations);
+    }
+}
+
+// All but the first warnings of an interval are suppressed...
+static void bench_log_suppressed(void *context, uint64_t iterations) {
+    log_ctx_t *ctx = context;
+
+    redirect_stderr(ctx->null_fd);
+    for (uint64_t i = 0; i < iterations; i++) {
+        log_warning("Benchmark message %" PRIu64 " of %" PRIu64, i, iterations);
+    }
+    redirect_stderr(ctx->stderr_fd);
+}
+
+static void destroy_log_ctx(log_ctx_t *ctx) {
+    if (ctx) {
+        close(ctx->stderr_fd);
+        close(ctx->null_fd);
+        close(ctx->pipe_fds[0]);
+        close(ctx->pipe_fds[1]);
+        free(ctx);
+    }
+}
+
+static log_ctx_t *create_log_ctx(void) {
+    log_ctx_t *ctx = calloc(1, sizeof(log_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->stderr_fd = dup(STDERR_FILENO);
+    ctx->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (ctx->stderr_fd < 0 || ctx->null_fd < 0 || pipe(ctx->pipe_fds)) {
+        fprintf(stderr, "Unable to create log sinks: %s\n", strerror(errno));
+        return NULL;
+    }
+    fcntl(ctx->pipe_fds[0], F_SETFL, O_NONBLOCK);
+
+    // udaemon logs to stderr in the foreground...
+    setup_logging(true);
+    return ctx;
+}
+
+// MQTT publishing against a loopback stand-in for a broker...
+
+typedef struct mqtt_ctx {
+    mqtt_handle_t *handle;
+    gps_event_t event;
+    int listen_fd;
+    pthread_t thread;
+} mqtt_ctx_t;
+
+// Accepts a single client, acknowledges its CONNECT and discards everything else...
+static void *broker_main(void *arg) {
+    mqtt_ctx_t *ctx = arg;
+    char buf[65536];
+
+    int fd = accept(ctx->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // CONNECT: fixed header followed by the remaining length...
+    uint8_t hdr[5];
+    size_t len = 0;
+    int shift = 0;
+    if (read(fd, hdr, 1) == 1) {
+        for (int i = 1; i < 5 && read(fd, &hdr[i], 1) == 1; i++) {
+            len |= (size_t)(hdr[i] & 0x7f) << shift;
+            shift += 7;
+            if (!(hdr[i] & 0x80)) {
+                break;
+            }
+        }
+    }
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        len -= (size_t) n;
+    }
+
+    static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    if (write(fd, connack, sizeof(connack)) == (ssize_t) sizeof(connack)) {
+        while (read(fd, buf, sizeof(buf)) > 0) {
+            // discard...
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void bench_mqtt(void *context, uint64_t iterations) {
+    mqtt_ctx_t *ctx = context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        ctx->event.time.tv_sec++;
+        mqtt_send_event(ctx->handle, &ctx->event);
+        while (mqtt_want_write(ctx->handle)) {
+            mqtt_write_data(ctx->handle);
+        }
+    }
+}
+
+static mqtt_ctx_t *create_mqtt_ctx(void) {
+    static config_t cfg;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+
+    mqtt_ctx_t *ctx = malloc(sizeof(mqtt_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    fill_event(&ctx->event, 12);
+
+    ctx->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ctx->listen_fd < 0 ||
+            bind(ctx->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(ctx->listen_fd, 1) ||
+            getsockname(ctx->listen_fd, (struct sockaddr *) &addr, &addr_len) ||
+            pthread_create(&ctx->thread, NULL, broker_main, ctx)) {
+        fprintf(stderr, "Unable to start MQTT stand-in: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    bzero(&cfg, sizeof(cfg));
+    cfg.client_id = "gpsstats_bench";
+    cfg.group_id = "gpsstats";
+    cfg.mqtt_host = "127.0.0.1";
+    cfg.mqtt_port = ntohs(addr.sin_port);
+    cfg.gpsd_host = "localhost";
+    cfg.qos = 0;
+    cfg.format = FORMAT_JSON;
+    cfg.topic = topic_parse("gpsstats/{device}");
+
+    ctx->handle = mqtt_init(&cfg, cfg.mqtt_host, cfg.mqtt_port);
+    if (ctx->handle == NULL || mqtt_connect(ctx->handle)) {
+        fprintf(stderr, "Unable to connect to MQTT stand-in!\n");
+        return NULL;
+    }
+
+    // Wait for the CONNACK...
+    struct pollfd pfd = {
+        .fd = mqtt_fd(ctx->handle), .events = POLLIN,
+    };
+    while (mqtt_want_write(ctx->handle)) {
+        mqtt_write_data(ctx->handle);
+    }
+    if (poll(&pfd, 1, 1000) == 1) {
+        mqtt_read_data(ctx->handle);
+    }
+
+    return ctx;
+}
+
+static void destroy_mqtt_ctx(mqtt_ctx_t *ctx) {
+    if (ctx) {
+        mqtt_disconnect(ctx->handle);
+        mqtt_destroy(ctx->handle);
+        pthread_join(ctx->thread, NULL);
+        close(ctx->listen_fd);
+        free(ctx);
+    }
+}
+
+// Worker pool, reading from stand-ins for GPSD on the loopback interface...
+
+#define WORKER_SOURCES 8
+// the number of messages per burst, and the number of bursts in flight per source, which
+// keeps the workers busy without ever filling their queues...
+#define WORKER_BURST 8
+#define WORKER_INFLIGHT 2
+
+typedef struct worker_ctx {
+    worker_pool_t *pool;
+    gpsd_handle_t *handles[WORKER_SOURCES];
+    // our ends of the connections of the sources...
+    int fds[WORKER_SOURCES];
+    char *burst;
+    size_t len;
+    uint64_t sent;
+    uint64_t received;
+} worker_ctx_t;
+
+static void count_worker_event(gps_event_t *event, void *source, void *context) {
+    (void)source;
+    worker_ctx_t *ctx = context;
+    ctx->received++;
+    bench_sink += (uint64_t) event->sats_used;
+}
+
+static void ignore_detach(void *source, bool lost, void *context) {
+    (void)source;
+    (void)lost;
+    (void)context;
+}
+
+static void bench_workers(void *context, uint64_t iterations) {
+    worker_ctx_t *ctx = context;
+    uint64_t target = ctx->received + iterations;
+    struct pollfd pfd = {
+        .fd = worker_pool_fd(ctx->pool), .events = POLLIN,
+    };
+
+    while (ctx->received < target) {
+        while (ctx->sent - ctx->received < WORKER_SOURCES * WORKER_BURST * WORKER_INFLIGHT) {
+            for (int i = 0; i < WORKER_SOURCES; i++) {
+                if (write(ctx->fds[i], ctx->burst, ctx->len) != (ssize_t) ctx->len) {
+                    fprintf(stderr, "Unable to write to GPSD stand-in: %s\n", strerror(errno));
+                    return;
+                }
+            }
+            ctx->sent += WORKER_SOURCES * WORKER_BURST;
+        }
+
+        if (poll(&pfd, 1, 1000) != 1) {
+            // Events got lost, do not wait for them forever...
+            fprintf(stderr, "Worker pool stalled, %" PRIu64 " events missing!\n", ctx->sent - ctx->received);
+            ctx->sent = ctx->received;
+            continue;
+        }
+        worker_pool_process(ctx->pool);
+    }
+}
+
+static worker_ctx_t *create_worker_ctx(uint8_t workers) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    char port[8];
+
+    worker_ctx_t *ctx = calloc(1, sizeof(worker_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    // a burst like GPSD sends each cycle, in which every message results in an event...
+    char *sky = create_sky_msg(32);
+    size_t tpv_len = strlen(TPV_MSG), sky_len = sky ? strlen(sky) : 0;
+    ctx->burst = malloc((tpv_len + sky_len) * (WORKER_BURST / 2) + 1);
+    if (sky == NULL || ctx->burst == NULL) {
+        free(sky);
+        return NULL;
+    }
+    for (int i = 0; i < WORKER_BURST / 2; i++) {
+        memcpy(ctx->burst + ctx->len, TPV_MSG, tpv_len);
+        memcpy(ctx->burst + ctx->len + tpv_len, sky, sky_len);
+        ctx->len += tpv_len + sky_len;
+    }
+    free(sky);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+            bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(listen_fd, WORKER_SOURCES) ||
+            getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "Unable to start GPSD stand-in: %s\n", strerror(errno));
+        return NULL;
+    }
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+
+    gpsd_source_t source = {
+        .name = "bench", .host = "127.0.0.1", .port = port,
+    };
+    for (int i = 0; i < WORKER_SOURCES; i++) {
+        ctx->handles[i] = gpsd_init(&source);
+        if (ctx->handles[i] == NULL || gpsd_connect(ctx->handles[i]) ||
+                (ctx->fds[i] = accept(listen_fd, NULL, NULL)) < 0) {
+            fprintf(stderr, "Unable to connect to GPSD stand-in!\n");
+            close(listen_fd);
+            return NULL;
+        }
+
+        // like GPSD does, otherwise the tail of a burst waits for a delayed ACK...
+        int one = 1;
+        setsockopt(ctx->fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    close(listen_fd);
+
+    ctx->pool = worker_pool_init(workers, count_worker_event, ignore_detach, ctx);
+    if (ctx->pool == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < WORKER_SOURCES; i++) {
+        if (worker_pool_assign(ctx->pool, ctx->handles[i], ctx->handles[i]) < 0) {
+            fprintf(stderr, "Unable to assign GPSD stand-in to worker!\n");
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+static void destroy_worker_ctx(worker_ctx_t *ctx) {
+    if (ctx) {
+        worker_pool_destroy(ctx->pool);
+        for (int i = 0; i < WORKER_SOURCES; i++) {
+            gpsd_disconnect(ctx->handles[i]);
+            gpsd_destroy(ctx->handles[i]);
+            close(ctx->fds[i]);
+        }
+        free(ctx->burst);
+        free(ctx);
+    }
+}
+
+// The larger cases need more descriptors than the default soft limit of 1024...
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Wakeups of poll and of our event loop, with a single ready descriptor out of many...
+
+typedef struct evloop_ctx {
+    evloop_t *loop;
+    struct pollfd *pfds;
+    // both ends of each socket pair...
+    int *fds;
+    int cnt;
+} evloop_ctx_t;
+
+static void count_ready(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)context;
+    bench_sink += (uint64_t) fd + events;
+}
+
+static void bench_poll(void *context, uint64_t iterations) {
+    evloop_ctx_t *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        // like udaemon, find the ready descriptors after each wakeup...
+        if (poll(ctx->pfds, (nfds_t) ctx->cnt, 0) > 0) {
+            for (int j = 0; j < ctx->cnt; j++) {
+                if (ctx->pfds[j].revents) {
+                    count_ready(NULL, ctx->pfds[j].fd, (uint32_t) ctx->pfds[j].revents, NULL);
+                }
+            }
+        }
+    }
+}
+
+static void bench_epoll(void *context, uint64_t iterations) {
+    evloop_ctx_t *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        evloop_dispatch(ctx->loop, 0);
+    }
+}
+
+static void destroy_evloop_ctx(evloop_ctx_t *ctx) {
+    if (ctx) {
+        evloop_destroy(ctx->loop);
+        for (int i = 0; ctx->fds && i < 2 * ctx->cnt; i++) {
+            if (ctx->fds[i] >= 0) {
+                close(ctx->fds[i]);
+            }
+        }
+        free(ctx->fds);
+        free(ctx->pfds);
+        free(ctx);
+    }
+}
+
+static evloop_ctx_t *create_evloop_ctx(int cnt) {
+    evloop_ctx_t *ctx = calloc(1, sizeof(evloop_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->cnt = cnt;
+    ctx->loop = evloop_init();
+    ctx->pfds = calloc((size_t) cnt, sizeof(struct pollfd));
+    ctx->fds = malloc(2 * (size_t) cnt * sizeof(int));
+    if (ctx->loop == NULL || ctx->pfds == NULL || ctx->fds == NULL) {
+        destroy_evloop_ctx(ctx);
+        return NULL;
+    }
+    memset(ctx->fds, -1, 2 * (size_t) cnt * sizeof(int));
+    raise_fd_limit();
+
+    for (int i = 0; i < cnt; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &ctx->fds[2 * i]) ||
+                evloop_add(ctx->loop, ctx->fds[2 * i], EPOLLIN, count_ready, NULL)) {
+            fprintf(stderr, "Unable to create %d socket pairs: %s\n", cnt, strerror(errno));
+            destroy_evloop_ctx(ctx);
+            return NULL;
+        }
+        ctx->pfds[i] = (struct pollfd) {
+            .fd = ctx->fds[2 * i], .events = POLLIN,
+        };
+    }
+
+    // the last descriptor stays readable, as nobody reads from it...
+    if (write(ctx->fds[2 * cnt - 1], "x", 1) != 1) {
+        destroy_evloop_ctx(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Receiving from many GPSD stand-ins on the loopback interface, through epoll or io_uring...
+
+// the length of the line that each source sends per round, like a TPV report...
+#define INGEST_LINE 300
+
+typedef struct ingest_ctx {
+    evloop_t *loop;
+    uring_t *ring;
+    // our ends (writing) and the receiving ends of the connections...
+    int *fds;
+    int *peers;
+    int cnt;
+    char line[INGEST_LINE];
+    uint64_t received;
+    uint32_t submits;
+} ingest_ctx_t;
+
+// Reads a single line per wakeup, like libgps does for a source...
+static void ingest_epoll_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)events;
+    ingest_ctx_t *ctx = context;
+    char buf[4096];
+
+    ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    bench_syscalls++;
+    if (len > 0) {
+        ctx->received += (uint64_t) len;
+    }
+}
+
+static void ingest_recv_callback(uring_t *ring, char *data, int result, void *context) {
+    (void)ring;
+    (void)data;
+    ingest_ctx_t *ctx = context;
+    if (result > 0) {
+        ctx->received += (uint64_t) result;
+    }
+}
+
+static void ingest_uring_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    ingest_ctx_t *ctx = context;
+
+    // reads the eventfd, and (re)submits multishot receives if needed...
+    uring_process(ctx->ring);
+    uring_stats_t stats = uring_dump_stats(ctx->ring);
+    bench_syscalls += 1 + stats.submits - ctx->submits;
+    ctx->submits = stats.submits;
+}
+
+// Each iteration is a single line, sent in rounds over all sources, of which all lines are received before the next round...
+static void bench_ingest(void *context, uint64_t iterations) {
+    ingest_ctx_t *ctx = context;
+
+    for (uint64_t sent = 0; sent < iterations;) {
+        int round = (iterations - sent < (uint64_t) ctx->cnt) ? (int)(iterations - sent) : ctx->cnt;
+        for (int i = 0; i < round; i++) {
+            if (write(ctx->fds[i], ctx->line, INGEST_LINE) != INGEST_LINE) {
+                fprintf(stderr, "Unable to write to GPSD stand-in: %s\n", strerror(errno));
+                return;
+            }
+        }
+        sent += (uint64_t) round;
+
+        uint64_t expected = ctx->received + (uint64_t) round * INGEST_LINE;
+        while (ctx->received < expected) {
+            bench_syscalls++;
+            if (evloop_dispatch(ctx->loop, 1000) <= 0) {
+                // Lines got lost, do not wait for them forever...
+                fprintf(stderr, "Receiving stalled, %" PRIu64 " bytes missing!\n", expected - ctx->received);
+                ctx->received = expected;
+            }
+        }
+    }
+}
+
+static void destroy_ingest_ctx(ingest_ctx_t *ctx) {
+    if (ctx) {
+        for (int i = 0; i < ctx->cnt; i++) {
+            if (ctx->peers[i] >= 0) {
+                if (ctx->ring) {
+                    uring_recv_stop(ctx->ring, ctx->peers[i]);
+                } else {
+                    evloop_remove(ctx->loop, ctx->peers[i]);
+                }
+                close(ctx->peers[i]);
+            }
+            if (ctx->fds[i] >= 0) {
+                close(ctx->fds[i]);
+            }
+        }
+        if (ctx->ring) {
+            evloop_remove(ctx->loop, uring_fd(ctx->ring));
+            uring_destroy(ctx->ring);
+        }
+        evloop_destroy(ctx->loop);
+        free(ctx->fds);
+        free(ctx->peers);
+        free(ctx);
+    }
+}
+
+static ingest_ctx_t *create_ingest_ctx(int cnt, bool use_uring) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+
+    ingest_ctx_t *ctx = calloc(1, sizeof(ingest_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->cnt = cnt;
+    ctx->loop = evloop_init();
+    ctx->fds = malloc((size_t) cnt * sizeof(int));
+    ctx->peers = malloc((size_t) cnt * sizeof(int));
+    if (ctx->loop == NULL || ctx->fds == NULL || ctx->peers == NULL) {
+        ctx->cnt = 0;
+        destroy_ingest_ctx(ctx);
+        return NULL;
+    }
+    memset(ctx->fds, -1, (size_t) cnt * sizeof(int));
+    memset(ctx->peers, -1, (size_t) cnt * sizeof(int));
+    memset(ctx->line, 'x', INGEST_LINE - 1);
+    ctx->line[INGEST_LINE - 1] = '\n';
+
+    if (use_uring) {
+        ctx->ring = uring_init();
+        if (ctx->ring == NULL || evloop_add(ctx->loop, uring_fd(ctx->ring), EPOLLIN, ingest_uring_callback, ctx)) {
+            // uring_init tells why...
+            destroy_ingest_ctx(ctx);
+            return NULL;
+        }
+    }
+    raise_fd_limit();
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+            bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(listen_fd, cnt) ||
+            getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "Unable to start GPSD stand-in: %s\n", strerror(errno));
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        destroy_ingest_ctx(ctx);
+        return NULL;
+    }
+
+    for (int i = 0; i < cnt; i++) {
+        int one = 1;
+        if ((ctx->peers[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                connect(ctx->peers[i], (struct sockaddr *) &addr, sizeof(addr)) ||
+                (ctx->fds[i] = accept(listen_fd, NULL, NULL)) < 0 ||
+                // like GPSD does...
+                setsockopt(ctx->fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ||
+                (ctx->ring ? uring_recv_start(ctx->ring, ctx->peers[i], ingest_recv_callback, ctx) :
+                 evloop_add(ctx->loop, ctx->peers[i], EPOLLIN, ingest_epoll_callback, ctx))) {
+            fprintf(stderr, "Unable to connect %d GPSD stand-ins: %s\n", cnt, strerror(errno));
+            close(listen_fd);
+            destroy_ingest_ctx(ctx);
+            return NULL;
+        }
+    }
+    close(listen_fd);
+
+    return ctx;
+}
+
+// Timing wheel, with as many pending timers as a very large number of sources would have...
+
+#define WHEEL_TIMERS 100000
+// the resolution of the wheel of gpsstats, and the period over which the timers are spread, in milliseconds...
+#define WHEEL_TICK 10
+#define WHEEL_SPREAD 5000
+#define WHEEL_SPARES 1024
+
+typedef struct wheel_ctx {
+    wheel_t *wheel;
+    wheel_timer_t *timers;
+    // timers that are not pending, for scheduling and cancelling...
+    wheel_timer_t spares[WHEEL_SPARES];
+    // timers for a single round of the expiry benchmark...
+    wheel_timer_t *round;
+    uint32_t seed;
+} wheel_ctx_t;
+
+// Returns a pseudo-random delay within the spread, cheap enough not to dominate the benchmarks...
+static uint64_t next_delay(wheel_ctx_t *ctx) {
+    ctx->seed = ctx->seed * 1103515245u + 12345u;
+    return (ctx->seed >> 8) % WHEEL_SPREAD;
+}
+
+// Keeps the number of pending timers constant...
+static void reschedule_timer(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    wheel_schedule(wheel, timer, next_delay(context));
+}
+
+static void count_expired(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+    (void)context;
+    bench_sink++;
+}
+
+static void bench_wheel_schedule(void *context, uint64_t iterations) {
+    wheel_ctx_t *ctx = context;
+    wheel_process(ctx->wheel);
+    for (uint64_t i = 0; i < iterations; i++) {
+        wheel_timer_t *timer = &ctx->spares[i % WHEEL_SPARES];
+        wheel_schedule(ctx->wheel, timer, next_delay(ctx));
+        wheel_cancel(ctx->wheel, timer);
+    }
+}
+
+static void bench_wheel_reschedule(void *context, uint64_t iterations) {
+    wheel_ctx_t *ctx = context;
+    wheel_process(ctx->wheel);
+    for (uint64_t i = 0; i < iterations; i++) {
+        wheel_timer_t *timer = &ctx->timers[ctx->seed % WHEEL_TIMERS];
+        wheel_schedule(ctx->wheel, timer, next_delay(ctx));
+    }
+}
+
+// Each iteration schedules all timers on a new wheel, and lets them expire at once...
+static void bench_wheel_expire(void *context, uint64_t iterations) {
+    wheel_ctx_t *ctx = context;
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        wheel_t *wheel = wheel_init(WHEEL_TICK);
+        if (wheel == NULL) {
+            return;
+        }
+        for (int j = 0; j < WHEEL_TIMERS; j++) {
+            wheel_timer_init(&ctx->round[j], count_expired, ctx);
+            wheel_schedule(wheel, &ctx->round[j], next_delay(ctx));
+        }
+
+        uint64_t now = (now_ns() - start) / 1000000 + WHEEL_SPREAD + 2 * WHEEL_TICK;
+        int expired = wheel_advance(wheel, now);
+        if (expired != WHEEL_TIMERS) {
+            fprintf(stderr, "Timing wheel expired %d out of %d timers!\n", expired, WHEEL_TIMERS);
+        }
+        wheel_destroy(wheel);
+    }
+}
+
+static void destroy_wheel_ctx(wheel_ctx_t *ctx) {
+    if (ctx) {
+        wheel_destroy(ctx->wheel);
+        free(ctx->timers);
+        free(ctx->round);
+        free(ctx);
+    }
+}
+
+static wheel_ctx_t *create_wheel_ctx(void) {
+    wheel_ctx_t *ctx = calloc(1, sizeof(wheel_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->seed = 1;
+    ctx->wheel = wheel_init(WHEEL_TICK);
+    ctx->timers = calloc(WHEEL_TIMERS, sizeof(wheel_timer_t));
+    ctx->round = calloc(WHEEL_TIMERS, sizeof(wheel_timer_t));
+    if (ctx->wheel == NULL || ctx->timers == NULL || ctx->round == NULL) {
+        destroy_wheel_ctx(ctx);
+        return NULL;
+    }
+
+    for (int i = 0; i < WHEEL_TIMERS; i++) {
+        wheel_timer_init(&ctx->timers[i], reschedule_timer, ctx);
+        wheel_schedule(ctx->wheel, &ctx->timers[i], next_delay(ctx));
+    }
+    for (int i = 0; i < WHEEL_SPARES; i++) {
+        wheel_timer_init(&ctx->spares[i], reschedule_timer, ctx);
+    }
+    return ctx;
+}
+
+// Harness...
+
+static bench_result_t run_bench(const bench_t *bench, int runs) {
+    bench_result_t result = { 0 };
+    double samples[MAX_RUNS];
+    double deviations[MAX_RUNS];
+
+    // Warm up caches, branch predictors and CPU frequency, and find the number
+    // of iterations that takes at least SAMPLE_NS...
+    uint64_t iterations = 1;
+    uint64_t start = now_ns();
+    for (;;) {
+        uint64_t t = now_ns();
+        bench_measured_ns = 0;
+        bench->fn(bench->context, iterations);
+        uint64_t elapsed = bench_measured_ns ? bench_measured_ns : now_ns() - t;
+
+        if (elapsed < SAMPLE_NS) {
+            iterations *= 2;
+        } else if (now_ns() - start >= WARMUP_NS) {
+            break;
+        }
+    }
+
+    bench_syscalls = 0;
+    for (int i = 0; i < runs; i++) {
+        uint64_t t = now_ns();
+        bench_measured_ns = 0;
+        bench->fn(bench->context, iterations);
+        samples[i] = (double)(bench_measured_ns ? bench_measured_ns : now_ns() - t) / (double) iterations;
+    }
+    result.syscalls = (double) bench_syscalls / (double)(iterations * (uint64_t) runs);
+
+    // Median and median absolute deviation are insensitive to outliers...
+    qsort(samples, (size_t) runs, sizeof(double), cmp_double);
+    result.iterations = iterations;
+    result.median = samples[runs / 2];
+    result.min = samples[0];
+    result.max = samples[runs - 1];
+
+    for (int i = 0; i < runs; i++) {
+        deviations[i] = fabs(samples[i] - result.median);
+    }
+    qsort(deviations, (size_t) runs, sizeof(double), cmp_double);
+    result.mad = deviations[runs / 2];
+
+    return result;
+}
+
+// Reads the medians of a previous JSON output of us...
+static int read_baseline(const char *file, baseline_t *baseline) {
+    FILE *fh = fopen(file, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "Unable to read baseline %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    char line[512];
+    int cnt = 0;
+    while (cnt < MAX_BASELINE && fgets(line, sizeof(line), fh)) {
+        const char *name = strstr(line, "\"name\": \"");
+        const char *median = strstr(line, "\"median_ns\": ");
+        if (!name || !median) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        size_t len = strcspn(name, "\"");
+        if (len >= sizeof(baseline[cnt].name)) {
+            continue;
+        }
+        memcpy(baseline[cnt].name, name, len);
+        baseline[cnt].name[len] = 0;
+        baseline[cnt].median = strtod(median + strlen("\"median_ns\": "), NULL);
+        cnt++;
+    }
+
+    fclose(fh);
+    return cnt;
+}
+
+static const baseline_t *find_baseline(const baseline_t *baseline, int cnt, const char *name) {
+    for (int i = 0; i < cnt; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+// Adds a benchmark, unless its setup failed...
+static int add_bench(bench_t *benches, int cnt, const char *name, bench_fn_t fn, void *context) {
+    if (context == NULL) {
+        fprintf(stderr, "SKIPPED    %s: setup failed\n", name);
+        return cnt;
+    }
+    benches[cnt] = (bench_t) {
+        name, fn, context
+    };
+    return cnt + 1;
+}
+
+// Returns whether the name of a benchmark starts with any of the filters, if any...
+static bool matches(const char *name, const char **filters, int filter_cnt) {
+    for (int i = 0; i < filter_cnt; i++) {
+        if (strncmp(name, filters[i], strlen(filters[i])) == 0) {
+            return true;
+        }
+    }
+    return filter_cnt == 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-b baseline.json] [-t tolerance] [-f filter] [-r runs] [-o output.json]\n", name);
+    fprintf(stderr, "  -b  compare the results to the given baseline, fail on regressions and missing benchmarks;\n");
+    fprintf(stderr, "  -t  the allowed slowdown compared to the baseline, in percent (default: %.0f);\n", DEFAULT_TOLERANCE);
+    fprintf(stderr, "  -f  only run the benchmarks whose name starts with the given text, can be repeated;\n");
+    fprintf(stderr, "  -r  the number of runs per benchmark (default: %d);\n", DEFAULT_RUNS);
+    fprintf(stderr, "  -o  write the results to the given file instead of stdout.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline_file = NULL;
+    const char *filters[MAX_BENCH_FILTERS];
+    int filter_cnt = 0;
+    const char *output = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+    int runs = DEFAULT_RUNS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:f:ho:r:t:")) != -1) {
+        switch (opt) {
+        case 'b':
+            baseline_file = optarg;
+            break;
+        case 'f':
+            if (filter_cnt >= MAX_BENCH_FILTERS) {
+                fprintf(stderr, "Too many filters: use at most %d filters!\n", MAX_BENCH_FILTERS);
+                return 2;
+            }
+            filters[filter_cnt++] = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS) {
+                fprintf(stderr, "Invalid number of runs: use a value between 1 and %d!\n", MAX_RUNS);
+                return 2;
+            }
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // The harness itself only logs problems...
+    log_async_set_debug(false);
+
+    static const int sky_sizes[] = { 0, 1, 8, 16, 32, 64, 128 };
+    static const int parse_sizes[] = { 0, 32, 128 };
+    static char names[64][64];
+    bench_t benches[64];
+    int cnt = 0;
+
+    for (size_t i = 0; i < sizeof(sky_sizes) / sizeof(sky_sizes[0]); i++) {
+        snprintf(names[i], sizeof(names[i]), "create_event_payload/sats=%d", sky_sizes[i]);
+        cnt = add_bench(benches, cnt, names[i], bench_create_event, create_handle(sky_sizes[i]));
+    }
+
+    for (size_t i = 0; i < sizeof(parse_sizes) / sizeof(parse_sizes[0]); i++) {
+        char *name = names[8 + i];
+        snprintf(name, sizeof(names[0]), "track_cn0/sats=%d", parse_sizes[i]);
+        cnt = add_bench(benches, cnt, name, bench_track_cn0, create_cn0_handle(parse_sizes[i]));
+    }
+
+    cnt = add_bench(benches, cnt, "gpsd_parse/tpv", bench_parse, create_parse_ctx(strdup(TPV_MSG), false));
+    for (size_t i = 0; i < sizeof(parse_sizes) / sizeof(parse_sizes[0]); i++) {
+        char *name = names[16 + i];
+        snprintf(name, sizeof(names[0]), "gpsd_parse/sky_sats=%d", parse_sizes[i]);
+        cnt = add_bench(benches, cnt, name, bench_parse, create_parse_ctx(create_sky_msg(parse_sizes[i]), false));
+    }
+    cnt = add_bench(benches, cnt, "gpsd_parse/nmea_cycle", bench_parse, create_parse_ctx(create_nmea_msg(), true));
+
+    cnt = add_bench(benches, cnt, "timespec/ts_sub", bench_ts_sub, timestamps);
+    cnt = add_bench(benches, cnt, "timespec/tstons", bench_tstons, &timestamps[2]);
+
+    static gps_event_t event;
+    fill_event(&event, 12);
+    cnt = add_bench(benches, cnt, "payload/field_values", bench_field_values, &event);
+    cnt = add_bench(benches, cnt, "payload/json", bench_json, &event);
+    cnt = add_bench(benches, cnt, "payload/sparkplug_birth", bench_sparkplug_birth, &event);
+    cnt = add_bench(benches, cnt, "payload/sparkplug_data", bench_sparkplug_data, &event);
+
+    cnt = add_bench(benches, cnt, "expr/scalar", bench_expr, create_expr_ctx("sats_used >= 4 && tdop < 2.5", 12));
+    cnt = add_bench(benches, cnt, "expr/count,sats=40", bench_expr, create_expr_ctx("count(used && ss > 35)", 40));
+    cnt = add_bench(benches, cnt, "expr/count,sats=128", bench_expr, create_expr_ctx("count(used && ss > 35)", 128));
+
+    // only redirect stderr when needed...
+    static const bench_t log_benches[] = {
+        { "log/sync", bench_log_sync, NULL },
+        { "log/async,writer=running", bench_log_async, NULL },
+        { "log/async,writer=stalled", bench_log_stalled, NULL },
+        { "log/debug_disabled", bench_log_debug, NULL },
+        { "log/warning_suppressed", bench_log_suppressed, NULL },
+    };
+    log_ctx_t *log = NULL;
+    for (size_t i = 0; i < sizeof(log_benches) / sizeof(log_benches[0]); i++) {
+        if (matches(log_benches[i].name, filters, filter_cnt)) {
+            log = log ? log : create_log_ctx();
+            cnt = add_bench(benches, cnt, log_benches[i].name, log_benches[i].fn, log);
+        }
+    }
+
+    // only start our stand-in broker when needed...
+    mqtt_ctx_t *mqtt = NULL;
+    if (matches("mqtt/publish_qos0", filters, filter_cnt)) {
+        mqtt = create_mqtt_ctx();
+        cnt = add_bench(benches, cnt, "mqtt/publish_qos0", bench_mqtt, mqtt);
+    }
+
+    // only start our GPSD stand-ins when needed...
+    static const uint8_t worker_sizes[] = { 1, 2, 4, 8 };
+    worker_ctx_t *worker_ctxs[4] = { NULL };
+    for (size_t i = 0; i < sizeof(worker_sizes) / sizeof(worker_sizes[0]); i++) {
+        char *name = names[24 + i];
+        snprintf(name, sizeof(names[0]), "worker/sources=%d,workers=%d", WORKER_SOURCES, worker_sizes[i]);
+        if (matches(name, filters, filter_cnt)) {
+            worker_ctxs[i] = create_worker_ctx(worker_sizes[i]);
+            cnt = add_bench(benches, cnt, name, bench_workers, worker_ctxs[i]);
+        }
+    }
+
+    // only connect the GPSD stand-ins when needed...
+    static const int ingest_sizes[] = { 10, 100, 1000 };
+    ingest_ctx_t *ingest_ctxs[6] = { NULL };
+    for (size_t i = 0; i < 2 * sizeof(ingest_sizes) / sizeof(ingest_sizes[0]); i++) {
+        bool use_uring = (i % 2) != 0;
+        char *name = names[42 + i];
+        snprintf(name, sizeof(names[0]), "ingest/%s,sources=%d", use_uring ? "io_uring" : "epoll", ingest_sizes[i / 2]);
+        if (matches(name, filters, filter_cnt)) {
+            ingest_ctxs[i] = create_ingest_ctx(ingest_sizes[i / 2], use_uring);
+            cnt = add_bench(benches, cnt, name, bench_ingest, ingest_ctxs[i]);
+        }
+    }
+
+    // only fill a timing wheel when needed, all its benchmarks share it...
+    static const bench_t wheel_benches[] = {
+        { "wheel/schedule+cancel,timers=100000", bench_wheel_schedule, NULL },
+        { "wheel/reschedule,timers=100000", bench_wheel_reschedule, NULL },
+        { "wheel/schedule+expire,timers=100000", bench_wheel_expire, NULL },
+    };
+    wheel_ctx_t *wheel = NULL;
+    for (size_t i = 0; i < sizeof(wheel_benches) / sizeof(wheel_benches[0]); i++) {
+        if (matches(wheel_benches[i].name, filters, filter_cnt)) {
+            wheel = wheel ? wheel : create_wheel_ctx();
+            cnt = add_bench(benches, cnt, wheel_benches[i].name, wheel_benches[i].fn, wheel);
+        }
+    }
+
+    // only create the socket pairs when needed, both backends share them...
+    static const int evloop_sizes[] = { 2, 10, 100, 500, 1000 };
+    evloop_ctx_t *evloop_ctxs[5] = { NULL };
+    for (size_t i = 0; i < sizeof(evloop_sizes) / sizeof(evloop_sizes[0]); i++) {
+        char *poll_name = names[32 + 2 * i];
+        char *epoll_name = names[33 + 2 * i];
+        snprintf(poll_name, sizeof(names[0]), "evloop/poll,fds=%d", evloop_sizes[i]);
+        snprintf(epoll_name, sizeof(names[0]), "evloop/epoll,fds=%d", evloop_sizes[i]);
+        if (matches(poll_name, filters, filter_cnt) || matches(epoll_name, filters, filter_cnt)) {
+            evloop_ctxs[i] = create_evloop_ctx(evloop_sizes[i]);
+            cnt = add_bench(benches, cnt, poll_name, bench_poll, evloop_ctxs[i]);
+            cnt = add_bench(benches, cnt, epoll_name, bench_epoll, evloop_ctxs[i]);
+        }
+    }
+
+    baseline_t baseline[MAX_BASELINE];
+    int baseline_cnt = 0;
+    if (baseline_file && (baseline_cnt = read_baseline(baseline_file, baseline)) < 0) {
+        return 2;
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Unable to write %s: %s\n", output, strerror(errno));
+        return 2;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    fprintf(out, "{\n  \"host\": \"%s %s\",\n  \"runs\": %d,\n  \"benchmarks\": [\n", uts.machine, uts.release, runs);
+
+    int regressions = 0;
+    int missing = 0;
+    bool first = true;
+    for (int i = 0; i < cnt; i++) {
+        const bench_t *bench = &benches[i];
+        if (!matches(bench->name, filters, filter_cnt)) {
+            continue;
+        }
+
+        bench_result_t result = run_bench(bench, runs);
+
+        fprintf(out, "%s    {\"name\": \"%s\", \"iterations\": %" PRIu64 ", \"median_ns\": %.2f, \"mad_ns\": %.2f, \"min_ns\": %.2f, \"max_ns\": %.2f",
+                first ? "" : ",\n", bench->name, result.iterations, result.median, result.mad, result.min, result.max);
+        if (result.syscalls > 0) {
+            fprintf(out, ", \"syscalls\": %.3f", result.syscalls);
+        }
+        fprintf(out, "}");
+        fflush(out);
+        first = false;
+
+        const baseline_t *base = find_baseline(baseline, baseline_cnt, bench->name);
+        if (!baseline_file) {
+            continue;
+        } else if (!base) {
+            fprintf(stderr, "MISSING    %-32s %10.2f ns, not in baseline\n", bench->name, result.median);
+            missing++;
+        } else if (result.median > base->median * (1.0 + tolerance / 100.0)) {
+            fprintf(stderr, "REGRESSION %-32s %10.2f ns, baseline %10.2f ns (%+.1f%%)\n",
+                    bench->name, result.median, base->median, (result.median / base->median - 1.0) * 100.0);
+            regressions++;
+        } else {
+            fprintf(stderr, "ok         %-32s %10.2f ns, baseline %10.2f ns (%+.1f%%)\n",
+                    bench->name, result.median, base->median, (result.median / base->median - 1.0) * 100.0);
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (output) {
+        fclose(out);
+    }
+
+    destroy_mqtt_ctx(mqtt);
+    for (size_t i = 0; i < sizeof(worker_ctxs) / sizeof(worker_ctxs[0]); i++) {
+        destroy_worker_ctx(worker_ctxs[i]);
+    }
+    for (size_t i = 0; i < sizeof(evloop_ctxs) / sizeof(evloop_ctxs[0]); i++) {
+        destroy_evloop_ctx(evloop_ctxs[i]);
+    }
+    destroy_wheel_ctx(wheel);
+    destroy_log_ctx(log);
+    for (size_t i = 0; i < sizeof(ingest_ctxs) / sizeof(ingest_ctxs[0]); i++) {
+        destroy_ingest_ctx(ingest_ctxs[i]);
+    }
+
+    if (regressions) {
+        fprintf(stderr, "%d benchmark(s) regressed more than %.0f%% compared to %s!\n", regressions, tolerance, baseline_file);
+    }
+    if (missing) {
+        // an incomplete baseline would let regressions of new benchmarks pass unnoticed...
+        fprintf(stderr, "%d benchmark(s) missing from %s, record a new baseline!\n", missing, baseline_file);
+    }
+    return (regressions || missing) ? 1 : 0;
+}
+
+// EOF
@@ -0,0 +1,181 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "rt.h"
+
+// Measures the wake-up lateness of a periodic timer, with the real-time
+// settings of gpsstats applied and optionally with hogs competing for the
+// same CPUs, see "Real-time scheduling" in the README...
+
+#define DEFAULT_SAMPLES 5000
+#define DEFAULT_PERIOD_US 1000
+#define MAX_HOGS 16
+// the memory each hog keeps dirtying, so it also competes for the caches...
+#define HOG_SIZE (64 * 1024 * 1024)
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Keeps a CPU (and the memory bus) busy until killed...
+static void hog_main(const char *cpus) {
+    if (cpus) {
+        rt_apply(pthread_self(), "hog", cpus, 0);
+    }
+
+    volatile char *buf = malloc(HOG_SIZE);
+    if (buf == NULL) {
+        for (;;) {
+        }
+    }
+    for (size_t i = 0;; i = (i + 4096) % HOG_SIZE) {
+        buf[i]++;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n samples] [-p period] [-c cpus] [-f priority] [-m] [-g hogs]\n", name);
+    fprintf(stderr, "  -n  the number of samples (default: %d);\n", DEFAULT_SAMPLES);
+    fprintf(stderr, "  -p  the period of the timer, in microseconds (default: %d);\n", DEFAULT_PERIOD_US);
+    fprintf(stderr, "  -c  pin the timer (and the hogs) to the given CPUs, such as \"0,2-3\";\n");
+    fprintf(stderr, "  -f  run the timer with SCHED_FIFO at the given priority (1..99);\n");
+    fprintf(stderr, "  -m  lock all memory;\n");
+    fprintf(stderr, "  -g  the number of CPU and memory hogs to start (default: 0).\n");
+}
+
+int main(int argc, char *argv[]) {
+    int samples = DEFAULT_SAMPLES;
+    long period = DEFAULT_PERIOD_US;
+    const char *cpus = NULL;
+    int priority = 0;
+    bool lock = false;
+    int hogs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:f:g:hmn:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (rt_check_cpus(optarg)) {
+                fprintf(stderr, "Invalid CPU list: %s!\n", optarg);
+                return 2;
+            }
+            cpus = optarg;
+            break;
+        case 'f':
+            priority = atoi(optarg);
+            if (priority < 1 || priority > 99) {
+                fprintf(stderr, "Invalid priority: use a value between 1 and 99!\n");
+                return 2;
+            }
+            break;
+        case 'g':
+            hogs = atoi(optarg);
+            if (hogs < 0 || hogs > MAX_HOGS) {
+                fprintf(stderr, "Invalid number of hogs: use a value between 0 and %d!\n", MAX_HOGS);
+                return 2;
+            }
+            break;
+        case 'm':
+            lock = true;
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            if (samples < 1) {
+                fprintf(stderr, "Invalid number of samples!\n");
+                return 2;
+            }
+            break;
+        case 'p':
+            period = atol(optarg);
+            if (period < 1) {
+                fprintf(stderr, "Invalid period!\n");
+                return 2;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    long *lateness = malloc((size_t) samples * sizeof(long));
+    if (lateness == NULL) {
+        fprintf(stderr, "Unable to allocate %d samples!\n", samples);
+        return 2;
+    }
+
+    pid_t hog_pids[MAX_HOGS];
+    for (int i = 0; i < hogs; i++) {
+        hog_pids[i] = fork();
+        if (hog_pids[i] == 0) {
+            hog_main(cpus);
+        } else if (hog_pids[i] < 0) {
+            fprintf(stderr, "Unable to start hog: %s\n", strerror(errno));
+            hogs = i;
+            break;
+        }
+    }
+
+    // The same settings as gpsstats applies to its ingest path, failures are logged...
+    if ((cpus || priority) && rt_apply(pthread_self(), "timer", cpus, (uint8_t) priority)) {
+        fprintf(stderr, "Unable to apply the real-time settings, continuing without them!\n");
+    }
+    if (lock && rt_lock_memory()) {
+        fprintf(stderr, "Unable to lock memory, continuing without!\n");
+    }
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < samples; i++) {
+        next.tv_nsec += period * 1000;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        lateness[i] = (now.tv_sec - next.tv_sec) * 1000000000L + (now.tv_nsec - next.tv_nsec);
+    }
+
+    for (int i = 0; i < hogs; i++) {
+        kill(hog_pids[i], SIGKILL);
+        waitpid(hog_pids[i], NULL, 0);
+    }
+
+    qsort(lateness, (size_t) samples, sizeof(long), cmp_long);
+    printf("samples: %d, period: %ld us, hogs: %d, cpus: %s, priority: %d, mlock: %s\n",
+           samples, period, hogs, cpus ? cpus : "-", priority, lock ? "yes" : "no");
+    printf("lateness p50: %.1f us, p99: %.1f us, p99.9: %.1f us, max: %.1f us\n",
+           (double) lateness[samples / 2] / 1000.0,
+           (double) lateness[(size_t) samples * 99 / 100] / 1000.0,
+           (double) lateness[(size_t) samples * 999 / 1000] / 1000.0,
+           (double) lateness[samples - 1] / 1000.0);
+
+    free(lateness);
+    return 0;
+}
+
+// EOF
@@ -0,0 +1,105 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "gpsd.h"
+
+/**
+ * Defines the handle that is to be used to talk to the checkpoint routines.
+ */
+typedef struct checkpoint checkpoint_t;
+
+/**
+ * Represents statistics about the checkpoint.
+ */
+typedef struct checkpoint_stats {
+    uint64_t generation;
+    uint32_t writes;
+    time_t last_write;
+    // of the checkpoint restored at startup, if any...
+    uint64_t restored_generation;
+    time_t restored_age;
+    uint32_t restore_usec;
+} checkpoint_stats_t;
+
+/**
+ * Fills the state of the GPS devices to keep in a checkpoint, for example by
+ * calling #gpsd_save_devices for each source.
+ *
+ * @param devices the device states to fill, cannot be NULL;
+ * @param max the maximum number of devices to fill;
+ * @param context the context as given to #checkpoint_write.
+ * @return the number of filled devices.
+ */
+typedef size_t (*checkpoint_save_t)(gpsd_saved_device_t *devices, size_t max, void *context);
+
+/**
+ * Opens (or creates) a checkpoint file and maps it into memory.
+ *
+ * @param file the name of the checkpoint file, cannot be NULL.
+ * @return a new #checkpoint_t instance, or NULL in case of errors.
+ */
+checkpoint_t *checkpoint_open(const char *file);
+
+/**
+ * Unmaps and closes a checkpoint file, without writing it first.
+ *
+ * @param cp the checkpoint, may be NULL.
+ */
+void checkpoint_close(checkpoint_t *cp);
+
+/**
+ * Returns the name of the file of a checkpoint.
+ *
+ * @param cp the checkpoint, cannot be NULL.
+ * @return the file name.
+ */
+const char *checkpoint_file(const checkpoint_t *cp);
+
+/**
+ * Restores the metrics and the state of the GPS devices of the most recent
+ * valid generation in the checkpoint file, @see #metrics_restore and
+ * #gpsd_restore_devices. Should be called once, before the metrics are
+ * updated by other threads and before any data is read from GPSD.
+ *
+ * @param cp the checkpoint, cannot be NULL;
+ * @param max_age the maximum age of the checkpoint, in seconds, or 0 to
+ *        restore checkpoints of any age.
+ * @return 0 upon success, -ENOENT if the file has no valid checkpoint,
+ *         -ESTALE if the checkpoint is too old, or another negative value in
+ *         case of errors.
+ */
+int checkpoint_restore(checkpoint_t *cp, uint32_t max_age);
+
+/**
+ * Writes a snapshot of the metrics and the state of the GPS devices as a new
+ * generation. The previous generation is left untouched, so it remains
+ * available in case gpsstats or the system crashes while writing.
+ *
+ * @param cp the checkpoint, cannot be NULL;
+ * @param save the callback that fills the state of the GPS devices, or NULL
+ *        to keep no device state;
+ * @param context the context to pass to the callback.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int checkpoint_write(checkpoint_t *cp, checkpoint_save_t save, void *context);
+
+/**
+ * Dumps statistics about the checkpoint.
+ *
+ * @param cp the checkpoint, may be NULL.
+ * @return the checkpoint statistics.
+ */
+checkpoint_stats_t checkpoint_dump_stats(checkpoint_t *cp);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _CHRONY_H
+#define _CHRONY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evloop.h"
+#include "wheel.h"
+
+/**
+ * The time after which an unanswered request to chronyd is given up, in
+ * milliseconds.
+ */
+#define CHRONY_TIMEOUT 1000
+
+/**
+ * Defines the handle that is to be used to talk to the chrony routines.
+ */
+typedef struct chrony chrony_t;
+
+/**
+ * Represents the view of chronyd on the system clock, as obtained by a
+ * single poll.
+ */
+typedef struct chrony_reading {
+    bool valid;
+    // the reference ID of the selected source, like "PPS" or an IPv4 address...
+    uint32_t ref_id;
+    uint16_t stratum;
+    uint16_t leap_status;
+    // the offset of the system clock to the selected source, positive if the
+    // clock is ahead, and its standard deviation, in seconds...
+    double offset;
+    double sd;
+    // the frequency error of the system clock, in ppm...
+    double freq;
+} chrony_reading_t;
+
+/**
+ * Represents statistics about the polls of chronyd.
+ */
+typedef struct chrony_stats {
+    uint32_t polls;
+    uint32_t polls_failed;
+    uint32_t timeouts;
+    uint32_t requests;
+} chrony_stats_t;
+
+/**
+ * Allocates and initializes a new chrony handle, but does not poll chronyd
+ * yet, @see #chrony_start.
+ *
+ * @param loop the event loop to watch the command socket with;
+ * @param wheel the timing wheel to schedule the polls with.
+ * @returns a new #chrony_t instance, or NULL in case no memory was available.
+ */
+chrony_t *chrony_init(evloop_t *loop, wheel_t *wheel);
+
+/**
+ * Stops polling, and frees all previously allocated resources.
+ *
+ * @param chrony the chrony handle, may be NULL.
+ */
+void chrony_destroy(chrony_t *chrony);
+
+/**
+ * Starts polling the tracking and source statistics of chronyd through its
+ * command socket. Each poll is a short exchange of datagrams that is driven
+ * by the event loop, so it never blocks. Polling that is already started is
+ * restarted with the new settings.
+ *
+ * @param chrony the chrony handle, cannot be NULL;
+ * @param path the path to the command socket of chronyd, or NULL to stop
+ *        polling;
+ * @param interval the interval between two polls, in seconds.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int chrony_start(chrony_t *chrony, const char *path, uint16_t interval);
+
+/**
+ * Stops polling chronyd.
+ *
+ * @param chrony the chrony handle, cannot be NULL.
+ */
+void chrony_stop(chrony_t *chrony);
+
+/**
+ * Returns the reading of the last poll. Never blocks, and can be called by
+ * any thread.
+ *
+ * @param reading the reading to fill, cannot be NULL.
+ * @return true if the last poll succeeded, false otherwise.
+ */
+bool chrony_latest(chrony_reading_t *reading);
+
+/**
+ * Formats the reference ID of a reading, like chronyc does.
+ *
+ * @param ref_id the reference ID;
+ * @param buffer the buffer to write to, cannot be NULL;
+ * @param size the size of the buffer, in bytes.
+ * @return the buffer.
+ */
+const char *chrony_ref_name(uint32_t ref_id, char *buffer, size_t size);
+
+/**
+ * Dumps statistics about the polls of chronyd.
+ *
+ * @param chrony the chrony handle, may be NULL.
+ * @return the chrony statistics.
+ */
+chrony_stats_t chrony_dump_stats(const chrony_t *chrony);
+
+#endif
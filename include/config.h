@@ -12,16 +12,95 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "expr.h"
+#include "topic.h"
+
+/**
+ * The maximum number of derived fields and filters that can be configured.
+ */
+#define MAX_DERIVED 16
+#define MAX_FILTERS 16
+
+/**
+ * The maximum number of GPSD sources and worker threads that can be configured.
+ */
+#define MAX_SOURCES 256
+#define MAX_WORKERS 64
+
+/**
+ * The maximum number of MQTT brokers that can be configured.
+ */
+#define MAX_BROKERS 8
+
+typedef enum payload_format {
+    FORMAT_JSON = 0,
+    FORMAT_SPARKPLUG,
+    FORMAT_FIELDS,
+} payload_format_t;
+
+typedef struct gpsd_source {
+    // the index of the source, used to keep its metrics...
+    uint16_t index;
+    char *name;
+    char *host;
+    char *port;
+    char *device;
+    bool nmea;
+    bool kernel;
+    bool chrony;
+    uint32_t osc_window;
+    uint16_t cn0_window;
+    uint32_t device_idle;
+} gpsd_source_t;
+
+typedef struct mqtt_broker {
+    char *name;
+    char *host;
+    uint16_t port;
+} mqtt_broker_t;
+
 typedef struct config {
     char *gpsd_host;
     char *gpsd_port;
     char *gpsd_device;
+    bool gpsd_io_uring;
+    uint8_t gpsd_workers;
+    bool gpsd_nmea;
+    bool gpsd_kernel;
+    uint32_t gpsd_device_idle;
+    uint32_t gpsd_osc_window;
+    uint16_t gpsd_cn0_window;
+
+    uint16_t source_cnt;
+    gpsd_source_t sources[MAX_SOURCES];
+
+    char *rt_ingest_cpus;
+    uint8_t rt_ingest_priority;
+    char *rt_sink_cpus;
+    bool rt_lock_memory;
+
+    char *checkpoint_file;
+    uint16_t checkpoint_interval;
+    uint32_t checkpoint_max_age;
+
+    uint32_t resolver_ttl;
+
+    char *chrony_socket;
+    uint16_t chrony_interval;
 
     char *client_id;
     char *mqtt_host;
     uint16_t mqtt_port;
+    // in order of preference, the first one is the primary...
+    uint8_t broker_cnt;
+    mqtt_broker_t brokers[MAX_BROKERS];
+    uint16_t mqtt_stagger;
+    uint16_t mqtt_failback;
     uint8_t qos;
     bool retain;
+    payload_format_t format;
+    char *group_id;
+    topic_template_t *topic;
 
     bool use_tls;
     bool use_auth;
@@ -36,6 +115,20 @@ typedef struct config {
     char *tls_version;
     char *ciphers;
     bool verify_peer;
+
+    bool use_http;
+    char *http_host;
+    char *http_port;
+    uint16_t http_max_clients;
+    uint16_t http_queue_size;
+
+    uint8_t derived_cnt;
+    char *derived_names[MAX_DERIVED];
+    expr_t *derived[MAX_DERIVED];
+
+    uint8_t filter_cnt;
+    char *filter_names[MAX_FILTERS];
+    expr_t *filters[MAX_FILTERS];
 } config_t;
 
 /**
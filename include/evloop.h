@@ -0,0 +1,115 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include <stdint.h>
+
+#include <sys/epoll.h>
+
+/**
+ * Defines the handle that is to be used to talk to the event loop routines.
+ */
+typedef struct evloop evloop_t;
+
+/**
+ * Called for each file descriptor that has pending events.
+ *
+ * @param loop the event loop;
+ * @param fd the file descriptor with pending events;
+ * @param events the pending events, as EPOLL* flags;
+ * @param context the context as given to #evloop_add.
+ */
+typedef void (*evloop_callback_t)(evloop_t *loop, int fd, uint32_t events, void *context);
+
+/**
+ * Represents statistics about the event loop.
+ */
+typedef struct evloop_stats {
+    uint32_t fds;
+    uint32_t wakeups;
+    uint64_t events;
+} evloop_stats_t;
+
+/**
+ * Allocates and initializes a new event loop, backed by epoll.
+ *
+ * @returns a new #evloop_t instance, or NULL in case of errors.
+ */
+evloop_t *evloop_init(void);
+
+/**
+ * Destroys and frees all previously allocated resources. File descriptors
+ * that are still registered are not closed.
+ *
+ * @param loop the event loop, may be NULL.
+ */
+void evloop_destroy(evloop_t *loop);
+
+/**
+ * Returns the file descriptor that becomes readable as soon as any of the
+ * registered file descriptors has pending events. This allows the event loop
+ * to be driven by the poll loop of udaemon.
+ *
+ * @param loop the event loop, cannot be NULL.
+ * @return a file descriptor, or -1 in case of errors.
+ */
+int evloop_fd(evloop_t *loop);
+
+/**
+ * Registers a file descriptor with the event loop.
+ *
+ * @param loop the event loop, cannot be NULL;
+ * @param fd the file descriptor to register;
+ * @param events the events to wait for, as EPOLL* flags. Use EPOLLET only
+ *        if the callback always reads/writes until EAGAIN;
+ * @param callback the callback to call for pending events, cannot be NULL;
+ * @param context the context to pass to the callback.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int evloop_add(evloop_t *loop, int fd, uint32_t events, evloop_callback_t callback, void *context);
+
+/**
+ * Changes the events to wait for of a registered file descriptor.
+ *
+ * @param loop the event loop, cannot be NULL;
+ * @param fd the (registered) file descriptor;
+ * @param events the events to wait for, as EPOLL* flags.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int evloop_modify(evloop_t *loop, int fd, uint32_t events);
+
+/**
+ * Removes a file descriptor from the event loop. Should be called before the
+ * file descriptor is closed. Can be called from any callback.
+ *
+ * @param loop the event loop, may be NULL;
+ * @param fd the file descriptor to remove.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int evloop_remove(evloop_t *loop, int fd);
+
+/**
+ * Calls the callbacks of all file descriptors with pending events.
+ *
+ * @param loop the event loop, cannot be NULL;
+ * @param timeout the maximum time to wait for events, in milliseconds. Use 0
+ *        to never block, or -1 to wait indefinitely.
+ * @return the number of handled events, or a negative value in case of errors.
+ */
+int evloop_dispatch(evloop_t *loop, int timeout);
+
+/**
+ * Dumps statistics about the event loop.
+ *
+ * @param loop the event loop, may be NULL.
+ * @return the event loop statistics.
+ */
+evloop_stats_t evloop_dump_stats(evloop_t *loop);
+
+#endif
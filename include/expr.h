@@ -0,0 +1,61 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _EXPR_H
+#define _EXPR_H
+
+#include <stddef.h>
+
+struct gps_event;
+
+/**
+ * Represents a compiled expression.
+ */
+typedef struct expr expr_t;
+
+/**
+ * Compiles an expression into bytecode. Expressions can use the fields of
+ * an event (like "sats_used" or "sats.gps"), numbers, the arithmetic
+ * operators + - * / %, the comparison operators < <= > >= == != and the
+ * logical operators && || !. The aggregates count(), sum(), avg(), min()
+ * and max() evaluate their argument for each visible satellite, which can
+ * use the satellite fields "ss", "used", "elevation", "azimuth", "gnssid"
+ * and "svid", for example "count(used && ss > 35)".
+ *
+ * @param src the expression to compile, cannot be NULL;
+ * @param error the buffer to write a description of errors to, cannot be NULL;
+ * @param error_size the size of the error buffer, in bytes.
+ * @return the compiled expression, or NULL in case of errors.
+ */
+expr_t *expr_compile(const char *src, char *error, size_t error_size);
+
+/**
+ * Frees all resources taken up by a compiled expression.
+ *
+ * @param expr the expression to free, may be NULL.
+ */
+void expr_free(expr_t *expr);
+
+/**
+ * Returns the source of a compiled expression.
+ *
+ * @param expr the expression, cannot be NULL.
+ * @return the expression as given to #expr_compile.
+ */
+const char *expr_str(const expr_t *expr);
+
+/**
+ * Evaluates a compiled expression. Does not allocate any memory.
+ *
+ * @param expr the expression to evaluate, cannot be NULL;
+ * @param event the event to evaluate the expression on, cannot be NULL.
+ * @return the result of the expression, where 0 denotes false and any other
+ *         value true for predicates.
+ */
+double expr_eval(const expr_t *expr, const struct gps_event *event);
+
+#endif
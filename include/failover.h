@@ -0,0 +1,118 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _FAILOVER_H
+#define _FAILOVER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+#include "evloop.h"
+#include "mqtt.h"
+#include "wheel.h"
+
+/**
+ * The maximum number of connection attempts of a single race.
+ */
+#define FAILOVER_MAX_ATTEMPTS 16
+
+/**
+ * The time after which a race is given up, in milliseconds.
+ */
+#define FAILOVER_TIMEOUT 10000
+
+/**
+ * Defines the handle that is to be used to talk to the failover routines.
+ */
+typedef struct failover failover_t;
+
+/**
+ * Called when a race has ended.
+ *
+ * @param fo the failover handle;
+ * @param mqtt the connected MQTT handle of the winning attempt, whose
+ *        ownership is passed to the callback, or NULL if all attempts failed;
+ * @param broker the index of the winning broker, or -1 if all attempts failed;
+ * @param msec the time since the start given to #failover_race, in
+ *        milliseconds;
+ * @param context the context as given to #failover_init.
+ */
+typedef void (*failover_callback_t)(failover_t *fo, mqtt_handle_t *mqtt, int broker, uint32_t msec, void *context);
+
+/**
+ * Represents statistics about the connection races.
+ */
+typedef struct failover_stats {
+    uint32_t races;
+    uint32_t races_lost;
+    uint32_t attempts;
+    uint32_t attempts_failed;
+    // of the last race that was won...
+    int last_broker;
+    uint32_t last_msec;
+} failover_stats_t;
+
+/**
+ * Allocates and initializes a new failover handle.
+ *
+ * @param loop the event loop to watch the connection attempts with;
+ * @param wheel the timing wheel to stagger the connection attempts with;
+ * @param callback the callback to call when a race has ended, cannot be NULL;
+ * @param context the context to pass to the callback.
+ * @returns a new #failover_t instance, or NULL in case no memory was available.
+ */
+failover_t *failover_init(evloop_t *loop, wheel_t *wheel, failover_callback_t callback, void *context);
+
+/**
+ * Cancels a pending race, and frees all previously allocated resources.
+ *
+ * @param fo the failover handle, may be NULL.
+ */
+void failover_destroy(failover_t *fo);
+
+/**
+ * Starts a race between the first brokers of the configuration. The addresses
+ * of each broker are resolved once its turn comes, and tried alternating
+ * between IPv6 and IPv4. Each attempt starts the configured stagger delay after
+ * the previous one, or right away once the previous one failed. The first
+ * attempt that receives a CONNACK wins, all others are abandoned. A pending
+ * race is cancelled first.
+ *
+ * @param fo the failover handle, cannot be NULL;
+ * @param cfg the configuration, which should remain valid during the race;
+ * @param brokers the number of brokers to race, in order of preference;
+ * @param since the moment the connection was lost, as CLOCK_MONOTONIC time,
+ *        or NULL to measure from the start of this race.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int failover_race(failover_t *fo, const config_t *cfg, uint8_t brokers, const struct timespec *since);
+
+/**
+ * Cancels a pending race, without calling the callback.
+ *
+ * @param fo the failover handle, cannot be NULL.
+ */
+void failover_cancel(failover_t *fo);
+
+/**
+ * Returns whether a race is pending.
+ *
+ * @param fo the failover handle, cannot be NULL.
+ * @return true if a race is pending, false otherwise.
+ */
+bool failover_racing(const failover_t *fo);
+
+/**
+ * Dumps statistics about the connection races.
+ *
+ * @param fo the failover handle, may be NULL.
+ * @return the failover statistics.
+ */
+failover_stats_t failover_dump_stats(failover_t *fo);
+
+#endif
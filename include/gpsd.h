@@ -8,9 +8,29 @@
 #ifndef _GPSD_H
 #define _GPSD_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "chrony.h"
 #include "config.h"
+#include "kclock.h"
+#include "nmea.h"
+#include "osc.h"
+#include "rolling.h"
+
+#ifndef GNSSID_CNT
+/* copied from gpsd-3.17: defines for u-blox gnssId, as used in satellite_t */
+#define GNSSID_GPS 0
+#define GNSSID_SBAS 1
+#define GNSSID_GAL 2
+#define GNSSID_BD 3
+#define GNSSID_IMES 4
+#define GNSSID_QZSS 5
+#define GNSSID_GLO 6
+#define GNSSID_IRNSS 7            /* Not defined by u-blox */
+#define GNSSID_CNT 8              /* count for array size */
+#endif
 
 /**
  * Defines the handle that is to be used to talk to the GPSD routines.
@@ -18,24 +38,255 @@
 typedef struct gpsd_handle gpsd_handle_t;
 
 /**
- * Represents statistics about our connection to GPSD.
+ * The maximum size of a device path, including the terminating NUL-character.
+ */
+#define GPS_DEVICE_SIZE 128
+
+/**
+ * The maximum size of the name of a GPSD source, including the terminating
+ * NUL-character.
+ */
+#define GPS_SOURCE_SIZE 64
+
+/**
+ * The maximum number of messages that is read from GPSD per wakeup, so a busy
+ * source cannot starve the others, @see #gpsd_data_waiting.
+ */
+#define GPS_READ_BURST 32
+
+/**
+ * The maximum number of satellites that is kept per event.
+ */
+#define GPS_MAX_SATS 128
+
+/**
+ * The maximum size of the name of a GPSD driver, including the terminating
+ * NUL-character.
+ */
+#define GPS_DRIVER_SIZE 64
+
+/**
+ * The maximum number of devices that is tracked per GPSD source.
+ */
+#define GPS_MAX_DEVICES 16
+
+/**
+ * The number of 1 dB-Hz bins of a C/N0 histogram, the last bin also holds all
+ * stronger signals.
+ */
+#define GPS_CN0_BINS 64
+
+/**
+ * Denotes the kind of an event.
+ */
+typedef enum gps_event_type {
+    // the fix and satellites of a device...
+    GPS_EVENT_FIX = 0,
+    // a device that appeared, disappeared or changed its settings...
+    GPS_EVENT_DEVICE,
+    // the oscillator of a device that changed its state...
+    GPS_EVENT_OSC_STATE,
+    // the oscillator of a device over the last window...
+    GPS_EVENT_OSC_SUMMARY,
+    // the C/N0 distribution of a single constellation over the last window...
+    GPS_EVENT_CN0,
+} gps_event_type_t;
+
+/**
+ * Denotes how a device changed.
+ */
+typedef enum gps_device_change {
+    GPS_DEVICE_ADDED = 0,
+    GPS_DEVICE_CHANGED,
+    GPS_DEVICE_REMOVED,
+} gps_device_change_t;
+
+/**
+ * Represents the settings of a device, as reported by GPSD.
+ */
+typedef struct gps_device_info {
+    gps_device_change_t change;
+    char driver[GPS_DRIVER_SIZE];
+    unsigned int bps;
+    // the cycle time, in seconds...
+    double cycle;
+} gps_device_info_t;
+
+/**
+ * Represents the oscillator of a device, as tracked by gpsstats.
+ */
+typedef struct gps_osc_info {
+    osc_state_t state;
+    // only for GPS_EVENT_OSC_STATE events...
+    osc_state_t previous;
+    // only for GPS_EVENT_OSC_SUMMARY events...
+    osc_summary_t summary;
+} gps_osc_info_t;
+
+/**
+ * Represents the distribution of the C/N0 of the satellites of a single
+ * constellation over a window. Satellites that are not tracked (without
+ * C/N0) are not counted.
+ */
+typedef struct gps_cn0_info {
+    uint8_t gnssid;
+    // the length of the window, in milliseconds, and the number of skyviews in it...
+    uint64_t window;
+    uint32_t skyviews;
+    // the total number of satellites counted in all bins...
+    uint32_t visible_cnt;
+    uint32_t used_cnt;
+    // the number of satellites per 1 dB-Hz bin, saturating at UINT16_MAX...
+    uint16_t visible[GPS_CN0_BINS];
+    uint16_t used[GPS_CN0_BINS];
+} gps_cn0_info_t;
+
+/**
+ * Represents a single (visible) satellite.
+ */
+typedef struct gps_sat {
+    uint8_t gnssid;
+    uint8_t svid;
+    bool used;
+    float ss;
+    float elevation;
+    float azimuth;
+} gps_sat_t;
+
+/**
+ * Represents the (typed) event data as derived from the data of GPSD.
  */
-typedef struct gpsd_stats {
-    uint32_t events_recv;
-    uint32_t events_send;
-    time_t last_event;
-} gpsd_stats_t;
+typedef struct gps_event {
+    gps_event_type_t type;
+    // the name of the GPSD source the event originates from...
+    char source[GPS_SOURCE_SIZE];
+    char device[GPS_DEVICE_SIZE];
+    struct timespec time;
+    // only for GPS_EVENT_DEVICE events, all other fields are unset...
+    gps_device_info_t dev;
+    // only for GPS_EVENT_OSC_* events, all other fields are unset...
+    gps_osc_info_t osc;
+    // only for GPS_EVENT_CN0 events, all other fields are unset...
+    gps_cn0_info_t cn0;
+
+    int sats_used;
+    int sats_visible;
+    double tdop;
+    double avg_snr;
+    long qErr;
+    double toff;
+    double pps;
+    // the PPS offset corrected by its qErr, only if both are reported...
+    bool pps_corrected_valid;
+    double pps_corrected;
+    // the last OSC message, only used by expressions...
+    bool osc_running;
+    bool osc_reference;
+    bool osc_disciplined;
+    int osc_delta;
+    uint8_t sats_seen[GNSSID_CNT];
+
+    // the kernel clock, sampled along with the last PPS (or TOFF) offset...
+    bool kernel_sampled;
+    kclock_sample_t kernel;
+
+    // the view of chronyd on the system clock, only if chronyd is polled...
+    bool chrony_valid;
+    chrony_reading_t chrony;
+    // the offset of GPSD (pps, or toff for sources without PPS) minus the one of chronyd...
+    double chrony_diff;
+
+    // the NMEA counters since the previous event, only if NMEA is watched...
+    bool nmea_watched;
+    nmea_counts_t nmea;
+
+    int sats_cnt;
+    gps_sat_t sats[GPS_MAX_SATS];
+
+    // the names of the derived fields are owned by the configuration...
+    int derived_cnt;
+    const char *const *derived_names;
+    double derived[MAX_DERIVED];
+} gps_event_t;
+
+/**
+ * Represents the statistics of the most recent offsets of a source, in
+ * seconds.
+ */
+typedef struct gpsd_offset_stats {
+    rolling_stats_t toff;
+    rolling_stats_t pps;
+    // only for receivers that report qErr...
+    rolling_stats_t pps_corrected;
+    // only if the kernel clock is sampled...
+    rolling_stats_t kernel;
+} gpsd_offset_stats_t;
+
+/**
+ * Represents the statistics of a single device of a source.
+ */
+typedef struct gpsd_device_stats {
+    char path[GPS_DEVICE_SIZE];
+    // the last #ROLLING_WINDOW offsets...
+    gpsd_offset_stats_t offsets;
+    // the time it took until the offsets covered a full window, and their
+    // statistics became meaningful, in milliseconds, or 0 while filling...
+    uint64_t warmup_msec;
+    // the oscillator totals, @see #osc_dump_stats...
+    osc_stats_t osc;
+    // the number of NMEA sentences per type, only if NMEA is watched.
+    // Sentences carry no device, so they count for the device that
+    // reported last...
+    size_t nmea_type_cnt;
+    nmea_type_stats_t nmea_types[NMEA_MAX_TYPES + 1];
+} gpsd_device_stats_t;
+
+/**
+ * The maximum number of devices of all sources whose state is kept across
+ * runs, @see #gpsd_save_devices.
+ */
+#define GPS_SAVED_DEVICES 64
+
+/**
+ * Represents the state of a single device that is kept across runs, that is,
+ * the state that takes a while to become meaningful again.
+ */
+typedef struct gpsd_saved_device {
+    char source[GPS_SOURCE_SIZE];
+    char path[GPS_DEVICE_SIZE];
+    rolling_t toff;
+    rolling_t pps;
+    rolling_t pps_corrected;
+    rolling_t kernel;
+    osc_saved_t osc;
+    // the current C/N0 window, the part of it that has passed (in milliseconds), and its histograms so far...
+    bool cn0_started;
+    uint64_t cn0_elapsed;
+    uint32_t cn0_skyviews;
+    gps_cn0_info_t cn0[GNSSID_CNT];
+} gpsd_saved_device_t;
+
+/**
+ * Returns the name of a GNSS constellation.
+ *
+ * @param gnssid the GNSS identifier, as used by GPSD.
+ * @return the name of the GNSS constellation, never NULL.
+ */
+const char *gpsd_gnss_name(uint8_t gnssid);
 
 /**
  * Allocates and initializes a new GPSD handle, but does not connect to GPSD yet, @see #connect_gpsd.
+ * The handle does not filter its events, @see #gpsd_filter_event.
  *
- * @param config the configuration options.
+ * @param source the GPSD source to connect to, cannot be NULL.
  * @returns a new #gpsd_handle_t instance, or NULL in case no memory was available.
  */
-gpsd_handle_t *gpsd_init(const config_t *config);
+gpsd_handle_t *gpsd_init(const gpsd_source_t *source);
 
 /**
- * Destroys and frees all previously allocated resources.
+ * Destroys and frees all previously allocated resources. Keeps the state of
+ * the devices of the source, so they continue with it once a new handle for
+ * the source reads from them, @see #gpsd_restore_devices.
  *
  * @param handle the GPSD handle, cannot be NULL.
  */
@@ -66,23 +317,105 @@ int gpsd_disconnect(gpsd_handle_t *handle);
 int gpsd_fd(gpsd_handle_t *handle);
 
 /**
- * Reads data from GPSD, and, if present, returns it as event payload.
- *
- * NOTE: in case of a returned event payload, the caller of this method is
- * responsible for freeing the memory.
+ * Reads data from GPSD, and, if present, returns it as event.
  *
  * @param handle the GPSD handle, cannot be NULL;
- * @param result the pointer to a char-buffer to put the event payload in.
- * @return 0 if no data was returned, a negative value in case of errors.
+ * @param event the event to fill with the data of GPSD, cannot be NULL.
+ * @return 0 if no data was returned, 1 if the event is filled, or a
+ *         negative value in case of errors.
  */
-int gpsd_read_data(gpsd_handle_t *handle, char **result);
+int gpsd_read_data(gpsd_handle_t *handle, gps_event_t *event);
 
 /**
- * Dumps statistics about the GPSD connection at info logging level.
- * 
+ * Returns whether #gpsd_read_data has more to return right away: libgps reads
+ * whole bursts into a buffer of its own, so the remaining messages no longer
+ * make the file descriptor readable.
+ *
  * @param handle the GPSD handle, cannot be NULL.
- * @return the GPSD statistics.
+ * @return true if messages or events are waiting, false otherwise.
+ */
+bool gpsd_data_waiting(gpsd_handle_t *handle);
+
+/**
+ * Called for each event that is parsed by #gpsd_feed_data.
+ *
+ * @param event the parsed event;
+ * @param context the context as given to #gpsd_feed_data.
+ */
+typedef void (*gpsd_event_callback_t)(gps_event_t *event, void *context);
+
+/**
+ * Parses data that is received from GPSD by other means than #gpsd_read_data,
+ * such as io_uring. Data can be split at arbitrary positions, partial lines
+ * are kept until the remainder of the line is fed.
+ *
+ * @param handle the GPSD handle, cannot be NULL;
+ * @param data the received data, is modified in place, cannot be NULL;
+ * @param len the length of the received data, in bytes;
+ * @param callback the callback to call for each event, cannot be NULL;
+ * @param context the context to pass to the callback.
+ * @return the number of events passed to the callback, or a negative value
+ *         in case of errors.
+ */
+int gpsd_feed_data(gpsd_handle_t *handle, char *data, size_t len, gpsd_event_callback_t callback, void *context);
+
+/**
+ * Dumps the statistics of the devices of a source that currently have a
+ * pipeline, that is, the devices that sent data and were not removed or idle
+ * since. Can be called by another thread than the one reading from GPSD.
+ *
+ * @param handle the GPSD handle, cannot be NULL;
+ * @param devices the device statistics to fill, cannot be NULL;
+ * @param max the maximum number of devices to fill.
+ * @return the number of filled devices.
+ */
+size_t gpsd_dump_devices(gpsd_handle_t *handle, gpsd_device_stats_t *devices, size_t max);
+
+/**
+ * Saves the state of the devices of a source that currently have a pipeline,
+ * so another run can continue with it, @see #gpsd_restore_devices. Can be
+ * called by another thread than the one reading from GPSD.
+ *
+ * @param handle the GPSD handle, may be NULL;
+ * @param devices the device states to fill, cannot be NULL;
+ * @param max the maximum number of devices to fill.
+ * @return the number of filled devices.
+ */
+size_t gpsd_save_devices(gpsd_handle_t *handle, gpsd_saved_device_t *devices, size_t max);
+
+/**
+ * Saves the kept state of the devices that have no pipeline yet, that is,
+ * of devices of a previous run that did not send data since, and of devices
+ * of sources that reconnect, @see #gpsd_destroy. Thread-safe.
+ *
+ * @param devices the device states to fill, may be NULL;
+ * @param max the maximum number of devices to fill.
+ * @return the number of filled devices.
+ */
+size_t gpsd_save_kept_devices(gpsd_saved_device_t *devices, size_t max);
+
+/**
+ * Keeps the state of the devices of a previous run, each device continues
+ * with its state once its pipeline is created, that is, once it sends data.
+ * Replaces the state of an earlier call, including the state kept by
+ * #gpsd_destroy, so a cnt of 0 drops all kept state. Should be called before
+ * any data is read from GPSD.
+ *
+ * @param devices the device states, cannot be NULL if cnt > 0;
+ * @param cnt the number of device states.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int gpsd_restore_devices(const gpsd_saved_device_t *devices, size_t cnt);
+
+/**
+ * Applies the configured filters to an event, and, if it passes all filters,
+ * adds the configured derived fields to it. Events that are not derived from
+ * a fix (device, oscillator and C/N0 events) always pass.
+ *
+ * @param config the configuration options, cannot be NULL;
+ * @param event the event to filter, cannot be NULL.
+ * @return true if the event passes all filters, false otherwise.
  */
-gpsd_stats_t gpsd_dump_stats(gpsd_handle_t *handle);
+bool gpsd_filter_event(const config_t *config, gps_event_t *event);
 
 #endif
@@ -0,0 +1,59 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "config.h"
+#include "evloop.h"
+#include "gpsd.h"
+#include "wheel.h"
+
+/**
+ * Defines the handle that is to be used to talk to the HTTP routines.
+ */
+typedef struct http_handle http_handle_t;
+
+/**
+ * Allocates and initializes a new HTTP handle, but does not start listening yet, @see #http_listen.
+ *
+ * @param config the configuration options;
+ * @param loop the event loop to register the listener and its clients with;
+ * @param wheel the timing wheel for the request deadlines of clients.
+ * @returns a new #http_handle_t instance, or NULL in case no memory was available.
+ */
+http_handle_t *http_init(const config_t *config, evloop_t *loop, wheel_t *wheel);
+
+/**
+ * Destroys and frees all previously allocated resources, including all connected clients.
+ *
+ * @param handle the HTTP handle, may be NULL.
+ */
+void http_destroy(http_handle_t *handle);
+
+/**
+ * Starts listening for incoming HTTP connections.
+ *
+ * @param handle the HTTP handle, cannot be NULL;
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int http_listen(http_handle_t *handle);
+
+/**
+ * Streams an event as JSON to all clients connected to the "/events"
+ * endpoint. The event is serialized once and shared by all clients.
+ *
+ * @param handle the HTTP handle, may be NULL;
+ * @param event the event to send, cannot be NULL.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int http_send_event(http_handle_t *handle, const gps_event_t *event);
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _KCLOCK_H
+#define _KCLOCK_H
+
+#include <stdbool.h>
+
+/**
+ * Represents the state of the kernel clock discipline at a single moment, as
+ * reported by adjtimex(2).
+ */
+typedef struct kclock_sample {
+    // the remaining offset of the kernel PLL/FLL, in seconds...
+    double offset;
+    // the frequency offset, in ppm...
+    double freq;
+    // the maximum and estimated error, in seconds...
+    double maxerror;
+    double esterror;
+    // the STA_* bits of the clock status...
+    int status;
+    // the clock state, like TIME_OK or TIME_ERROR...
+    int state;
+} kclock_sample_t;
+
+/**
+ * Samples the state of the kernel clock discipline, without changing it.
+ * Costs a single system call.
+ *
+ * @param sample the sample to fill, cannot be NULL.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int kclock_sample(kclock_sample_t *sample);
+
+/**
+ * Returns whether the kernel considers its clock synchronized.
+ *
+ * @param sample the sample to check, cannot be NULL.
+ * @return true if the clock is synchronized, false otherwise.
+ */
+bool kclock_synced(const kclock_sample_t *sample);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <udaemon/ud_logging.h>
+
+/**
+ * The maximum number of warnings and errors logged per call site in a single
+ * interval.
+ */
+#define LOG_RATE_BURST 10
+/**
+ * The interval over which messages are rate limited, in seconds.
+ */
+#define LOG_RATE_INTERVAL 10
+
+typedef enum log_prio {
+    PRIO_DEBUG = 0,
+    PRIO_INFO,
+    PRIO_WARNING,
+    PRIO_ERROR,
+} log_prio_t;
+
+/**
+ * Represents the rate limiting state of a single call site. Its fields are
+ * private to the logging routines.
+ */
+typedef struct log_site {
+    _Atomic uint64_t window;
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+} log_site_t;
+
+/**
+ * Represents statistics about the logging.
+ */
+typedef struct log_stats {
+    uint64_t queued;
+    uint64_t dropped;
+    uint64_t suppressed;
+} log_stats_t;
+
+/**
+ * Whether or not debug messages are logged, @see #log_async_set_debug.
+ */
+extern bool log_debug_enabled;
+
+/**
+ * Enables or disables debug messages. When disabled, the arguments of
+ * #log_debug are not even evaluated.
+ *
+ * @param debug true to log debug messages, false otherwise.
+ */
+void log_async_set_debug(bool debug);
+
+/**
+ * Starts the background writer. From now on, messages are queued and written
+ * by the background writer. Until then, messages are written directly.
+ *
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int log_async_start(void);
+
+/**
+ * Writes all queued messages and stops the background writer. From now on,
+ * messages are written directly again.
+ */
+void log_async_stop(void);
+
+/**
+ * Logs a message, never blocks once the background writer is started. Use
+ * the log_* macros instead of calling this directly.
+ *
+ * @param prio the priority of the message;
+ * @param site the call site to rate limit, or NULL to not rate limit;
+ * @param fmt the printf-style format of the message, followed by its arguments.
+ */
+void log_async(log_prio_t prio, log_site_t *site, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * Dumps statistics about the logging.
+ *
+ * @return the logging statistics.
+ */
+log_stats_t log_async_dump_stats(void);
+
+// Replace the (synchronous) logging of udaemon...
+#define log_debug(...) \
+    do { \
+        if (log_debug_enabled) { \
+            log_async(PRIO_DEBUG, NULL, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_RATE_LIMITED(prio, ...) \
+    do { \
+        static log_site_t log_site_; \
+        log_async((prio), &log_site_, __VA_ARGS__); \
+    } while (0)
+
+// informational messages, such as the statistics, are never rate limited...
+#define log_info(...) log_async(PRIO_INFO, NULL, __VA_ARGS__)
+#define log_warning(...) LOG_RATE_LIMITED(PRIO_WARNING, __VA_ARGS__)
+#define log_error(...) LOG_RATE_LIMITED(PRIO_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _MEM_H
+#define _MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The interval at which the memory usage is sampled, in seconds.
+ */
+#define MEM_SAMPLE_INTERVAL 10
+
+/**
+ * The subsystems memory is accounted to.
+ */
+typedef enum mem_subsys {
+    MEM_GPSD = 0,
+    MEM_MQTT,
+    MEM_HTTP,
+    MEM_CONFIG,
+    MEM_QUEUES,
+    MEM_SUBSYS_CNT,
+} mem_subsys_t;
+
+/**
+ * Represents statistics about the memory of a single subsystem.
+ */
+typedef struct mem_subsys_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    // over the last sample interval...
+    uint32_t allocs_per_sec;
+} mem_subsys_stats_t;
+
+/**
+ * Represents statistics about the memory usage.
+ */
+typedef struct mem_stats {
+    mem_subsys_stats_t subsys[MEM_SUBSYS_CNT];
+    // over the last sample interval...
+    uint32_t allocs_per_sec;
+    // as seen by the kernel...
+    uint64_t rss;
+    uint64_t peak_rss;
+    // as seen by the allocator, including allocations of libraries...
+    uint64_t heap_size;
+    uint64_t heap_used;
+    uint64_t peak_heap_used;
+} mem_stats_t;
+
+/**
+ * Allocates memory accounted to a subsystem, like malloc(3).
+ *
+ * @param subsys the subsystem to account the memory to;
+ * @param size the number of bytes to allocate.
+ * @return the allocated memory, or NULL if out of memory.
+ */
+void *mem_malloc(mem_subsys_t subsys, size_t size);
+
+/**
+ * Allocates zeroed memory accounted to a subsystem, like calloc(3).
+ *
+ * @param subsys the subsystem to account the memory to;
+ * @param nmemb the number of elements;
+ * @param size the size of each element.
+ * @return the allocated memory, or NULL if out of memory.
+ */
+void *mem_calloc(mem_subsys_t subsys, size_t nmemb, size_t size);
+
+/**
+ * Resizes memory accounted to a subsystem, like realloc(3).
+ *
+ * @param subsys the subsystem the memory is accounted to;
+ * @param ptr the memory to resize, may be NULL;
+ * @param size the new number of bytes.
+ * @return the resized memory, or NULL if out of memory, in which case ptr is
+ *         left untouched.
+ */
+void *mem_realloc(mem_subsys_t subsys, void *ptr, size_t size);
+
+/**
+ * Allocates aligned memory accounted to a subsystem, like aligned_alloc(3).
+ *
+ * @param subsys the subsystem to account the memory to;
+ * @param alignment the alignment, a power of two;
+ * @param size the number of bytes to allocate, a multiple of alignment.
+ * @return the allocated memory, or NULL if out of memory.
+ */
+void *mem_aligned_alloc(mem_subsys_t subsys, size_t alignment, size_t size);
+
+/**
+ * Duplicates a string into memory accounted to a subsystem, like strdup(3).
+ *
+ * @param subsys the subsystem to account the memory to;
+ * @param str the string to duplicate, cannot be NULL.
+ * @return the duplicated string, or NULL if out of memory.
+ */
+char *mem_strdup(mem_subsys_t subsys, const char *str);
+
+/**
+ * Duplicates at most n characters of a string into memory accounted to a
+ * subsystem, like strndup(3).
+ *
+ * @param subsys the subsystem to account the memory to;
+ * @param str the string to duplicate, cannot be NULL;
+ * @param n the maximum number of characters to duplicate.
+ * @return the duplicated string, or NULL if out of memory.
+ */
+char *mem_strndup(mem_subsys_t subsys, const char *str, size_t n);
+
+/**
+ * Frees memory allocated by any of the mem_* routines.
+ *
+ * @param subsys the subsystem the memory is accounted to;
+ * @param ptr the memory to free, may be NULL.
+ */
+void mem_free(mem_subsys_t subsys, void *ptr);
+
+/**
+ * Samples the resident set size and heap usage, and the allocation rates
+ * since the previous sample. Should be called periodically, at most once a
+ * second, @see MEM_SAMPLE_INTERVAL.
+ */
+void mem_sample(void);
+
+/**
+ * Returns the name of a subsystem.
+ *
+ * @param subsys the subsystem.
+ * @return the name of the subsystem, never NULL.
+ */
+const char *mem_subsys_name(mem_subsys_t subsys);
+
+/**
+ * Dumps statistics about the memory usage, as of the last sample.
+ *
+ * @return the memory statistics.
+ */
+mem_stats_t mem_dump_stats(void);
+
+#endif
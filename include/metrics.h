@@ -0,0 +1,223 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/**
+ * All counters, as (id, number of elements). Counters with multiple elements
+ * are indexed by the index of the source.
+ */
+#define METRICS_COUNTERS(X) \
+    X(GPSD_CONNECTS, MAX_SOURCES) \
+    X(GPSD_DISCONNECTS, MAX_SOURCES) \
+    X(GPSD_EVENTS_RECV, MAX_SOURCES) \
+    X(GPSD_EVENTS_SEND, MAX_SOURCES) \
+    X(GPSD_EVENTS_FILTERED, MAX_SOURCES) \
+    X(GPSD_DEVICE_EVENTS, MAX_SOURCES) \
+    X(GPSD_DEVICE_DROPS, MAX_SOURCES) \
+    X(NMEA_SENTENCES, MAX_SOURCES) \
+    X(NMEA_CHECKSUM_ERRORS, MAX_SOURCES) \
+    X(NMEA_TRUNCATED, MAX_SOURCES) \
+    X(MQTT_CONNECTS, 1) \
+    X(MQTT_DISCONNECTS, 1) \
+    X(MQTT_EVENTS_SEND, 1) \
+    X(MQTT_BYTES_SEND, 1) \
+    X(MQTT_FAILOVERS, 1) \
+    X(MQTT_FAILBACKS, 1) \
+    X(MQTT_DEVICES_RECLAIMED, 1) \
+    X(MQTT_SPARKPLUG_SESSIONS, 1) \
+    X(HTTP_CLIENTS_ACCEPTED, 1) \
+    X(HTTP_CLIENTS_DROPPED, 1) \
+    X(HTTP_CLIENTS_TIMED_OUT, 1) \
+    X(HTTP_EVENTS_SEND, 1)
+
+/**
+ * All gauges, as (id, number of elements).
+ */
+#define METRICS_GAUGES(X) \
+    X(GPSD_LAST_EVENT, MAX_SOURCES) \
+    X(MQTT_LAST_EVENT, 1) \
+    X(MQTT_BROKER, 1) \
+    X(MQTT_DEVICES, 1) \
+    X(HTTP_CLIENTS, 1) \
+    X(HTTP_LAST_EVENT, 1)
+
+/**
+ * All histograms, as (id, upper bounds of the buckets). The last bucket counts
+ * all values above the highest bound.
+ */
+#define METRICS_HISTOGRAMS(X) \
+    X(MQTT_PAYLOAD_BYTES, { 64, 128, 256, 512, 1024, 2048, 4096 }) \
+    X(MQTT_FAILOVER_MSEC, { 100, 250, 500, 1000, 2500, 10000, 60000 }) \
+    X(NMEA_GAP_MSEC, { 10, 25, 50, 100, 250, 500, 1000 })
+
+/**
+ * The number of buckets of each histogram, including the one for values above
+ * the highest bound.
+ */
+#define METRICS_BUCKETS 8
+
+// Each metric gets the index of its first element...
+#define METRICS_ENUM(id, cnt) METRIC_##id, METRIC_##id##_END_ = METRIC_##id + (cnt) - 1,
+
+typedef enum metric_counter {
+    METRICS_COUNTERS(METRICS_ENUM)
+    METRIC_COUNTER_SLOTS,
+} metric_counter_t;
+
+typedef enum metric_gauge {
+    METRICS_GAUGES(METRICS_ENUM)
+    METRIC_GAUGE_SLOTS,
+} metric_gauge_t;
+
+#undef METRICS_ENUM
+
+#define METRICS_HISTOGRAM_ENUM(id, ...) METRIC_##id,
+
+typedef enum metric_histogram {
+    METRICS_HISTOGRAMS(METRICS_HISTOGRAM_ENUM)
+    METRIC_HISTOGRAM_CNT,
+} metric_histogram_t;
+
+#undef METRICS_HISTOGRAM_ENUM
+
+// Each histogram takes its buckets and the sum of all observed values...
+#define METRICS_HISTOGRAM_SLOTS (METRICS_BUCKETS + 1)
+#define METRICS_SHARD_SLOTS (METRIC_COUNTER_SLOTS + METRIC_HISTOGRAM_CNT * METRICS_HISTOGRAM_SLOTS)
+
+/**
+ * Holds the counters and histograms updated by a single thread. Its fields
+ * are private to the metrics routines.
+ */
+typedef struct metrics_shard {
+    // odd while the owning thread is updating the values...
+    _Alignas(64) _Atomic uint32_t seq;
+    _Atomic bool in_use;
+    _Alignas(64) _Atomic uint64_t values[METRICS_SHARD_SLOTS];
+} metrics_shard_t;
+
+/**
+ * Represents the state of all metrics at a single moment.
+ */
+typedef struct metrics_snapshot {
+    uint64_t counters[METRIC_COUNTER_SLOTS];
+    int64_t gauges[METRIC_GAUGE_SLOTS];
+    struct {
+        uint64_t buckets[METRICS_BUCKETS];
+        uint64_t sum;
+        uint64_t count;
+    } histograms[METRIC_HISTOGRAM_CNT];
+} metrics_snapshot_t;
+
+/**
+ * The shard of the current thread, @see #metrics_add.
+ */
+extern _Thread_local metrics_shard_t *metrics_local_shard;
+
+/**
+ * The gauges, which are shared by all threads.
+ */
+extern _Atomic int64_t metrics_gauges[METRIC_GAUGE_SLOTS];
+
+/**
+ * Returns the shard of the current thread, claiming one on first use. The
+ * shard is released once the thread exits, and reused (including its values)
+ * by the next thread that needs one.
+ *
+ * @return the shard of the current thread, never NULL.
+ */
+metrics_shard_t *metrics_attach(void);
+
+/**
+ * Adds a value to a counter. Never blocks, nor uses atomic read-modify-write
+ * operations, as only the current thread writes to its shard.
+ *
+ * @param counter the counter;
+ * @param index the element of the counter, < the number of its elements;
+ * @param value the value to add.
+ */
+static inline void metrics_add(metric_counter_t counter, uint16_t index, uint64_t value) {
+    metrics_shard_t *shard = metrics_local_shard ? metrics_local_shard : metrics_attach();
+    _Atomic uint64_t *slot = &shard->values[counter + index];
+
+    uint32_t seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + value, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Increments a counter by one, @see #metrics_add.
+ */
+#define metrics_inc(counter, index) metrics_add((counter), (index), 1)
+
+/**
+ * Sets a gauge.
+ *
+ * @param gauge the gauge;
+ * @param index the element of the gauge, < the number of its elements;
+ * @param value the new value.
+ */
+static inline void metrics_set(metric_gauge_t gauge, uint16_t index, int64_t value) {
+    atomic_store_explicit(&metrics_gauges[gauge + index], value, memory_order_relaxed);
+}
+
+/**
+ * Adds a (possibly negative) value to a gauge.
+ *
+ * @param gauge the gauge;
+ * @param index the element of the gauge, < the number of its elements;
+ * @param value the value to add.
+ */
+static inline void metrics_adjust(metric_gauge_t gauge, uint16_t index, int64_t value) {
+    atomic_fetch_add_explicit(&metrics_gauges[gauge + index], value, memory_order_relaxed);
+}
+
+/**
+ * Adds a value to a histogram. Never blocks, @see #metrics_add.
+ *
+ * @param histogram the histogram;
+ * @param value the value to add.
+ */
+void metrics_observe(metric_histogram_t histogram, uint64_t value);
+
+/**
+ * Takes a snapshot of all metrics, by summing the shards of all threads. Never
+ * blocks the threads that update the metrics. The values of each shard are
+ * consistent with each other, those of different shards might be taken a few
+ * updates apart.
+ *
+ * @param snapshot the snapshot to fill, cannot be NULL.
+ */
+void metrics_snapshot(metrics_snapshot_t *snapshot);
+
+/**
+ * Adds the counters and histograms of a snapshot to those of the current
+ * thread, for example to continue where a previous run left off. Gauges are
+ * not restored, as they describe the present.
+ *
+ * @param snapshot the snapshot to restore, cannot be NULL.
+ */
+void metrics_restore(const metrics_snapshot_t *snapshot);
+
+/**
+ * Returns the upper bounds of the buckets of a histogram, @see METRICS_BUCKETS.
+ *
+ * @param histogram the histogram.
+ * @return the METRICS_BUCKETS - 1 upper bounds.
+ */
+const uint64_t *metrics_histogram_bounds(metric_histogram_t histogram);
+
+#endif
@@ -9,27 +9,22 @@
 #define _MQTT_H
 
 #include "config.h"
+#include "gpsd.h"
 
 /**
  * Defines the handle that is to be used to talk to the MQTT routines.
  */
 typedef struct mqtt_handle mqtt_handle_t;
 
-/**
- * Represents statistics about our connection to MQTT.
- */
-typedef struct mqtt_stats {
-    uint32_t events_send;
-    time_t last_event;
-} mqtt_stats_t;
-
 /**
  * Allocates and initializes a new MQTT handle, but does not connect to MQTT yet, @see #connect_mqtt.
  *
- * @param config the configuration options.
+ * @param config the configuration options;
+ * @param host the host name or address of the broker to connect to;
+ * @param port the port of the broker to connect to.
  * @returns a new #mqtt_handle_t instance, or NULL in case no memory was available.
  */
-mqtt_handle_t *mqtt_init(const config_t *config);
+mqtt_handle_t *mqtt_init(const config_t *config, const char *host, uint16_t port);
 
 /**
  * Destroys and frees all previously allocated resources.
@@ -46,6 +41,33 @@ void mqtt_destroy(mqtt_handle_t *handle);
  */
 int mqtt_connect(mqtt_handle_t *handle);
 
+/**
+ * Starts connecting to MQTT without waiting for the connection to be
+ * established, @see #mqtt_connect_status.
+ *
+ * @param handle the MQTT handle;
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int mqtt_connect_async(mqtt_handle_t *handle);
+
+/**
+ * Returns whether the broker has accepted the connection.
+ *
+ * @param handle the MQTT handle.
+ * @return 0 if the broker accepted the connection, -EINPROGRESS if no CONNACK
+ *         is received yet, or -ECONNREFUSED if the broker refused it.
+ */
+int mqtt_connect_status(mqtt_handle_t *handle);
+
+/**
+ * Announces that we're ready to publish events, for the payload formats that
+ * require so. Should be called once the connection is accepted.
+ *
+ * @param handle the MQTT handle.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int mqtt_announce(mqtt_handle_t *handle);
+
 /**
  * Disconnects from a MQTT server.
  *
@@ -80,6 +102,18 @@ int mqtt_write_data(mqtt_handle_t *handle);
  */
 int mqtt_misc_loop(mqtt_handle_t *handle);
 
+/**
+ * Reclaims the topics and last published values of the devices that sent no
+ * events for a while. Their retained values are removed as well.
+ *
+ * @param handle the MQTT handle;
+ * @param idle the time after which a device is considered idle, in seconds,
+ *        or 0 to never reclaim devices.
+ * @return the number of reclaimed devices, or a negative value in case of
+ *         errors.
+ */
+int mqtt_reclaim_sources(mqtt_handle_t *handle, uint32_t idle);
+
 /**
  * Returns the file descriptor to the MQTT server.
  *
@@ -89,20 +123,14 @@ int mqtt_misc_loop(mqtt_handle_t *handle);
 int mqtt_fd(mqtt_handle_t *handle);
 
 /**
- * Sends an event with data to the MQTT server.
+ * Sends an event with data to the MQTT server, encoded in the configured
+ * payload format. Device events are published as JSON object to the "device"
+ * subtopic of the device instead, and tear down the topics of removed devices.
  *
  * @param handle the MQTT handle;
- * @param event_data the event data to send, cannot be NULL.
+ * @param event the event to send, cannot be NULL.
  * @return 0 upon success, or a non-zero value in case of errors.
  */
-int mqtt_send_event(mqtt_handle_t *handle, const char *event_data);
-
-/**
- * Dumps statistics about the MQTT connection at info logging level.
- * 
- * @param handle the MQTT handle, cannot be NULL.
- * @return the MQTT statistics.
- */
-mqtt_stats_t mqtt_dump_stats(mqtt_handle_t *handle);
+int mqtt_send_event(mqtt_handle_t *handle, const gps_event_t *event);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _NMEA_H
+#define _NMEA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The maximum number of distinct sentence types (talker and type) that are
+ * counted per source, sentences of any other type are counted as "other".
+ */
+#define NMEA_MAX_TYPES 32
+
+/**
+ * The maximum size of a sentence address (talker and type), including the
+ * terminating NUL-character.
+ */
+#define NMEA_ADDRESS_SIZE 8
+
+/**
+ * Defines the handle that is to be used to talk to the NMEA routines.
+ */
+typedef struct nmea nmea_t;
+
+/**
+ * Denotes the outcome of tokenizing a single sentence.
+ */
+typedef enum nmea_status {
+    NMEA_OK = 0,
+    NMEA_CHECKSUM_ERROR,
+    NMEA_TRUNCATED,
+} nmea_status_t;
+
+/**
+ * Represents the counters of a single interval, @see #nmea_take_counts.
+ */
+typedef struct nmea_counts {
+    uint32_t sentences;
+    uint32_t checksum_errors;
+    uint32_t truncated;
+    // the largest gap between two sentences of the same cycle, in milliseconds...
+    uint32_t max_gap;
+} nmea_counts_t;
+
+/**
+ * Represents the number of (valid) sentences of a single type.
+ */
+typedef struct nmea_type_stats {
+    char address[NMEA_ADDRESS_SIZE];
+    uint64_t count;
+} nmea_type_stats_t;
+
+/**
+ * Returns whether a line of GPSD holds an NMEA sentence (or AIS message)
+ * rather than a JSON object.
+ *
+ * @param line the line to check, cannot be NULL.
+ * @return true if the line holds an NMEA sentence, false otherwise.
+ */
+static inline bool nmea_is_sentence(const char *line) {
+    return *line == '$' || *line == '!';
+}
+
+/**
+ * Allocates and initializes a new NMEA tokenizer.
+ *
+ * @param index the index of the source, for its metrics.
+ * @returns a new #nmea_t instance, or NULL in case no memory was available.
+ */
+nmea_t *nmea_init(uint16_t index);
+
+/**
+ * Destroys and frees all previously allocated resources.
+ *
+ * @param nmea the NMEA tokenizer, may be NULL.
+ */
+void nmea_destroy(nmea_t *nmea);
+
+/**
+ * Tokenizes a single line holding one or more NMEA sentences. A sentence that
+ * is interrupted by the start of another one (as happens on serial overruns)
+ * is counted as truncated, after which the next sentence is tokenized. A new
+ * cycle starts once the UTC time of the sentences changes.
+ *
+ * @param nmea the NMEA tokenizer, cannot be NULL;
+ * @param line the line to tokenize, without its line ending, cannot be NULL;
+ * @param len the length of the line, in bytes;
+ * @param now the moment the line was received, in milliseconds of
+ *        CLOCK_MONOTONIC.
+ * @return the status of the last sentence of the line.
+ */
+nmea_status_t nmea_feed(nmea_t *nmea, const char *line, size_t len, uint64_t now);
+
+/**
+ * Returns the counters of the current interval, and starts a new one.
+ *
+ * @param nmea the NMEA tokenizer, cannot be NULL.
+ * @return the counters since the previous call.
+ */
+nmea_counts_t nmea_take_counts(nmea_t *nmea);
+
+/**
+ * Dumps the number of sentences per type. Can be called by another thread
+ * than the one feeding the tokenizer.
+ *
+ * @param nmea the NMEA tokenizer, cannot be NULL;
+ * @param types the types to fill, cannot be NULL;
+ * @param max the maximum number of types to fill.
+ * @return the number of filled types.
+ */
+size_t nmea_dump_types(const nmea_t *nmea, nmea_type_stats_t *types, size_t max);
+
+#endif
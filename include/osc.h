@@ -0,0 +1,204 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _OSC_H
+#define _OSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The time after which an oscillator that is no longer reported is considered
+ * to be absent, in milliseconds.
+ */
+#define OSC_TIMEOUT 5000
+
+/**
+ * The number of buckets of the histogram of the oscillator delta, the last
+ * bucket holds all deltas beyond the last bound, @see #osc_delta_bounds.
+ */
+#define OSC_DELTA_BUCKETS 8
+
+/**
+ * Defines the handle that is to be used to talk to the oscillator routines.
+ */
+typedef struct osc osc_t;
+
+/**
+ * Denotes the state of a GPS disciplined oscillator, as derived from the OSC
+ * messages of GPSD.
+ */
+typedef enum osc_state {
+    // no oscillator is reported (anymore)...
+    OSC_ABSENT = 0,
+    // running without PPS reference, and not disciplined...
+    OSC_FREERUN,
+    // disciplined, but the PPS reference is lost...
+    OSC_HOLDOVER,
+    // the PPS reference is present, but not (yet) disciplined...
+    OSC_ACQUIRING,
+    // disciplined to the PPS reference...
+    OSC_LOCKED,
+    OSC_STATE_CNT,
+} osc_state_t;
+
+/**
+ * Represents the summary of a single window, @see #osc_take_summary.
+ */
+typedef struct osc_summary {
+    // the length of the window, and the time spent in each state, in milliseconds...
+    uint64_t window;
+    uint64_t time[OSC_STATE_CNT];
+    osc_state_t state;
+    uint32_t transitions;
+    // the number of times the PPS reference was lost...
+    uint32_t reference_losses;
+    // the deltas reported while the PPS reference was present, in nanoseconds...
+    uint32_t delta_cnt;
+    int delta_min;
+    int delta_max;
+    double delta_mean;
+    uint32_t delta_buckets[OSC_DELTA_BUCKETS];
+} osc_summary_t;
+
+/**
+ * Represents the totals since the oscillator was first reported.
+ */
+typedef struct osc_stats {
+    osc_state_t state;
+    // the time spent in each state, in milliseconds...
+    uint64_t time[OSC_STATE_CNT];
+    uint64_t transitions;
+    uint64_t reference_losses;
+} osc_stats_t;
+
+/**
+ * Represents the state of an oscillator tracker that is kept across runs,
+ * @see #osc_save.
+ */
+typedef struct osc_saved {
+    osc_state_t state;
+    osc_stats_t totals;
+    // the current window, the part of it that has passed (in milliseconds), and its summary so far...
+    bool started;
+    uint64_t window_elapsed;
+    osc_summary_t summary;
+    int64_t delta_sum;
+} osc_saved_t;
+
+/**
+ * The upper bounds (inclusive) of the buckets of the absolute oscillator
+ * delta, in nanoseconds.
+ */
+extern const int osc_delta_bounds[OSC_DELTA_BUCKETS - 1];
+
+/**
+ * Returns the name of an oscillator state.
+ *
+ * @param state the oscillator state.
+ * @return the name of the state, never NULL.
+ */
+const char *osc_state_name(osc_state_t state);
+
+/**
+ * Allocates and initializes a new oscillator tracker.
+ *
+ * @param window the length of a summary window, in seconds, or 0 to not
+ *        summarize at all.
+ * @returns a new #osc_t instance, or NULL in case no memory was available.
+ */
+osc_t *osc_init(uint32_t window);
+
+/**
+ * Destroys and frees all previously allocated resources.
+ *
+ * @param osc the oscillator tracker, may be NULL.
+ */
+void osc_destroy(osc_t *osc);
+
+/**
+ * Feeds the data of a single OSC message of GPSD.
+ *
+ * @param osc the oscillator tracker, cannot be NULL;
+ * @param running whether the oscillator is running;
+ * @param reference whether the PPS reference is present;
+ * @param disciplined whether the oscillator is disciplined;
+ * @param delta the difference between the PPS output of the oscillator and
+ *        the PPS reference, in nanoseconds;
+ * @param now the moment the message was received, in milliseconds of
+ *        CLOCK_MONOTONIC;
+ * @param previous the state before this message, only set if the state
+ *        changed, cannot be NULL.
+ * @return true if the state changed, false otherwise.
+ */
+bool osc_feed(osc_t *osc, bool running, bool reference, bool disciplined, int delta, uint64_t now, osc_state_t *previous);
+
+/**
+ * Checks whether the oscillator is still reported, and if not, moves it to
+ * #OSC_ABSENT after #OSC_TIMEOUT milliseconds.
+ *
+ * @param osc the oscillator tracker, cannot be NULL;
+ * @param now the current time, in milliseconds of CLOCK_MONOTONIC;
+ * @param previous the state before the timeout, only set if the state
+ *        changed, cannot be NULL.
+ * @return true if the state changed, false otherwise.
+ */
+bool osc_tick(osc_t *osc, uint64_t now, osc_state_t *previous);
+
+/**
+ * Returns the summary of the current window once it is complete, and starts
+ * a new one. Windows start once the oscillator is first reported.
+ *
+ * @param osc the oscillator tracker, cannot be NULL;
+ * @param now the current time, in milliseconds of CLOCK_MONOTONIC;
+ * @param summary the summary to fill, cannot be NULL.
+ * @return true if the summary is filled, false if the window is not complete.
+ */
+bool osc_take_summary(osc_t *osc, uint64_t now, osc_summary_t *summary);
+
+/**
+ * Returns the current state of the oscillator.
+ *
+ * @param osc the oscillator tracker, cannot be NULL.
+ * @return the oscillator state.
+ */
+osc_state_t osc_state(const osc_t *osc);
+
+/**
+ * Dumps the totals of the oscillator. Can be called by another thread than
+ * the one feeding the tracker. The time of the current state is only
+ * accounted up to the last message.
+ *
+ * @param osc the oscillator tracker, cannot be NULL.
+ * @return the oscillator totals.
+ */
+osc_stats_t osc_dump_stats(const osc_t *osc);
+
+/**
+ * Saves the state of the oscillator tracker, so another run can continue
+ * with it, @see #osc_restore. Another thread than the one feeding the tracker
+ * should only call this under a lock or sequence lock of its own.
+ *
+ * @param osc the oscillator tracker, cannot be NULL;
+ * @param now the current time, in milliseconds of CLOCK_MONOTONIC;
+ * @param saved the state to fill, cannot be NULL.
+ */
+void osc_save(const osc_t *osc, uint64_t now, osc_saved_t *saved);
+
+/**
+ * Continues with the state of a previous run, adding its totals to the ones
+ * of the tracker. The oscillator is considered to be reported right now, so
+ * it times out if it is no longer reported. Should be called before the
+ * tracker is fed.
+ *
+ * @param osc the oscillator tracker, cannot be NULL;
+ * @param saved the state to continue with, cannot be NULL;
+ * @param now the current time, in milliseconds of CLOCK_MONOTONIC.
+ */
+void osc_restore(osc_t *osc, const osc_saved_t *saved, uint64_t now);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _PAYLOAD_H
+#define _PAYLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpsd.h"
+
+/**
+ * The maximum size of an encoded event payload, in bytes.
+ */
+#define PAYLOAD_MAX_SIZE 1024
+
+/**
+ * The number of distinct fields an event can have, @see #payload_field_values.
+ */
+#define PAYLOAD_FIELD_CNT (21 + GNSSID_CNT)
+
+/**
+ * Denotes the type of a field.
+ */
+typedef enum payload_type {
+    TYPE_UINT = 0,
+    TYPE_INT,
+    TYPE_LONG,
+    TYPE_DOUBLE,
+    TYPE_BOOL,
+} payload_type_t;
+
+/**
+ * Represents the value of a single field of an event. The value is stored
+ * as raw bits to allow for cheap comparisons.
+ */
+typedef struct payload_value {
+    bool present;
+    uint64_t bits;
+} payload_value_t;
+
+/**
+ * Returns the name of a field.
+ *
+ * @param id the field identifier, should be less than #PAYLOAD_FIELD_CNT.
+ * @return the name of the field, as used in the JSON object.
+ */
+const char *payload_field_name(size_t id);
+
+/**
+ * Returns the type of a field.
+ *
+ * @param id the field identifier, should be less than #PAYLOAD_FIELD_CNT.
+ * @return the type of the field.
+ */
+payload_type_t payload_field_type(size_t id);
+
+/**
+ * Returns the GNSS constellation a field belongs to.
+ *
+ * @param id the field identifier, should be less than #PAYLOAD_FIELD_CNT.
+ * @return the GNSS identifier, or -1 if the field is not specific to a
+ *         single constellation.
+ */
+int payload_field_gnssid(size_t id);
+
+/**
+ * Takes the values of all fields of an event.
+ *
+ * @param event the event to take the values from, cannot be NULL;
+ * @param values the array of #PAYLOAD_FIELD_CNT values to fill, cannot be NULL.
+ */
+void payload_field_values(const gps_event_t *event, payload_value_t *values);
+
+/**
+ * Formats the value of a field as text.
+ *
+ * @param id the field identifier, should be less than #PAYLOAD_FIELD_CNT;
+ * @param value the value to format, cannot be NULL;
+ * @param buffer the buffer to write the text to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the text, or a negative value if the buffer is too small.
+ */
+int payload_format_value(size_t id, const payload_value_t *value, char *buffer, size_t size);
+
+/**
+ * Encodes an event as JSON object. Device events only hold the device, how it
+ * changed and its settings.
+ *
+ * @param event the event to encode, cannot be NULL;
+ * @param buffer the buffer to write the JSON object to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the JSON object (excluding the terminating
+ *         NUL-character), or a negative value if the buffer is too small.
+ */
+int payload_encode_json(const gps_event_t *event, char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+/**
+ * The maximum number of addresses kept for a single host.
+ */
+#define RESOLVER_MAX_ADDRS 8
+
+/**
+ * Holds the addresses of a host, in the order returned by getaddrinfo(3).
+ */
+typedef struct resolver_result {
+    uint8_t cnt;
+    struct {
+        int family;
+        char host[INET6_ADDRSTRLEN];
+    } addrs[RESOLVER_MAX_ADDRS];
+} resolver_result_t;
+
+/**
+ * Represents statistics about the resolver cache.
+ */
+typedef struct resolver_stats {
+    uint32_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    // hits on entries that were past their TTL...
+    uint64_t stale_hits;
+    uint64_t refreshes;
+    uint64_t refresh_failures;
+} resolver_stats_t;
+
+/**
+ * Starts caching resolved addresses, and refreshing them in the background.
+ * Can be called again to change the TTL.
+ *
+ * @param ttl the time after which an address is resolved again, in seconds,
+ *        or 0 to not cache addresses at all.
+ * @return 0 upon success, or a negative value in case of errors.
+ */
+int resolver_start(uint32_t ttl);
+
+/**
+ * Stops the background refresh, and clears the cache.
+ */
+void resolver_stop(void);
+
+/**
+ * Resolves a host name to its addresses. Cached addresses are returned right
+ * away, even when past their TTL, in which case they are refreshed in the
+ * background. If refreshing fails, the last known addresses remain in use.
+ * Only hosts that are not cached yet are resolved synchronously.
+ *
+ * @param host the host name or numeric address to resolve, cannot be NULL;
+ * @param result the result to fill, cannot be NULL.
+ * @return 0 upon success, -ENOENT if the host cannot be resolved, or another
+ *         negative value in case of errors.
+ */
+int resolver_lookup(const char *host, resolver_result_t *result);
+
+/**
+ * Drops the cached addresses of all hosts but the given ones, for example
+ * once the configuration is reloaded. Cached addresses are never dropped
+ * otherwise, so hosts that are only looked up on reconnect keep their last
+ * known addresses.
+ *
+ * @param hosts the host names to keep, cannot be NULL if cnt > 0;
+ * @param cnt the number of host names.
+ */
+void resolver_retain(const char *const *hosts, size_t cnt);
+
+/**
+ * Dumps statistics about the resolver cache.
+ *
+ * @return the resolver statistics.
+ */
+resolver_stats_t resolver_dump_stats(void);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _ROLLING_H
+#define _ROLLING_H
+
+#include <stdint.h>
+
+/**
+ * The number of most recent values kept by a rolling window.
+ */
+#define ROLLING_WINDOW 64
+
+/**
+ * Keeps the most recent values of a series. Its fields are private to the
+ * rolling routines.
+ */
+typedef struct rolling {
+    double values[ROLLING_WINDOW];
+    uint32_t cnt;
+    uint32_t next;
+} rolling_t;
+
+/**
+ * Represents the statistics of the values in a rolling window.
+ */
+typedef struct rolling_stats {
+    uint32_t cnt;
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} rolling_stats_t;
+
+/**
+ * Adds a value to a rolling window, replacing its oldest value once the
+ * window is full.
+ *
+ * @param rolling the rolling window, cannot be NULL;
+ * @param value the value to add.
+ */
+static inline void rolling_add(rolling_t *rolling, double value) {
+    rolling->values[rolling->next] = value;
+    rolling->next = (rolling->next + 1) % ROLLING_WINDOW;
+    if (rolling->cnt < ROLLING_WINDOW) {
+        rolling->cnt++;
+    }
+}
+
+/**
+ * Calculates the statistics of the values in a rolling window. Adding values
+ * is cheap, so all work is done here.
+ *
+ * @param rolling the rolling window, cannot be NULL.
+ * @return the statistics, all zero if the window is empty.
+ */
+rolling_stats_t rolling_stats(const rolling_t *rolling);
+
+#endif
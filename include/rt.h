@@ -0,0 +1,42 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _RT_H
+#define _RT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Validates a list of CPUs, such as "0,2-3".
+ *
+ * @param cpus the list of CPUs to validate, cannot be NULL.
+ * @return 0 if the list is valid, or a non-zero value otherwise.
+ */
+int rt_check_cpus(const char *cpus);
+
+/**
+ * Pins a thread to a set of CPUs and/or runs it with the SCHED_FIFO policy.
+ * Requires CAP_SYS_NICE or a sufficient RLIMIT_RTPRIO for the latter.
+ *
+ * @param thread the thread to apply the settings to;
+ * @param name the name of the thread, for logging, cannot be NULL;
+ * @param cpus the list of CPUs to run the thread on, or NULL to leave it as is;
+ * @param priority the SCHED_FIFO priority (1..99), or 0 to leave it as is.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int rt_apply(pthread_t thread, const char *name, const char *cpus, uint8_t priority);
+
+/**
+ * Locks all current and future memory of the process, so the hot path never
+ * incurs page faults. Requires CAP_IPC_LOCK or a sufficient RLIMIT_MEMLOCK.
+ *
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int rt_lock_memory(void);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _SPARKPLUG_H
+#define _SPARKPLUG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpsd.h"
+#include "payload.h"
+
+/**
+ * The topic namespace as used by Sparkplug B.
+ */
+#define SPARKPLUG_NAMESPACE "spBv1.0"
+
+/**
+ * The name of the metric of the edge node through which a host application
+ * requests all metrics to be announced again.
+ */
+#define SPARKPLUG_REBIRTH "Node Control/Rebirth"
+
+/**
+ * The number of metrics we announce in the birth certificate of a device.
+ */
+#define SPARKPLUG_METRIC_CNT PAYLOAD_FIELD_CNT
+
+/**
+ * Represents the state of a Sparkplug B session (edge node).
+ */
+typedef struct sparkplug_state {
+    uint64_t bd_seq;
+    // shared by all messages of the edge node and its devices...
+    uint8_t seq;
+    bool need_birth;
+    // the aliases of the next device start right after this one...
+    uint64_t next_alias;
+} sparkplug_state_t;
+
+/**
+ * Represents the state of a single device of the edge node, that is, a GPS
+ * device of one of the sources.
+ */
+typedef struct sparkplug_device {
+    // the aliases of the metrics of the device start right after this one...
+    uint64_t alias_base;
+    // the last published value of each metric...
+    payload_value_t last[SPARKPLUG_METRIC_CNT];
+} sparkplug_device_t;
+
+/**
+ * Holds the changes to the session (and device) state that an encoded
+ * message implies. These are only to be committed once the message is
+ * actually published, @see #sparkplug_commit.
+ */
+typedef struct sparkplug_update {
+    uint8_t seq;
+    // only set for device births and data...
+    bool has_values;
+    payload_value_t values[SPARKPLUG_METRIC_CNT];
+} sparkplug_update_t;
+
+/**
+ * Initializes a new Sparkplug B session.
+ *
+ * @param state the session state to initialize, cannot be NULL;
+ * @param bd_seq the birth/death sequence number of this session.
+ */
+void sparkplug_init(sparkplug_state_t *state, uint64_t bd_seq);
+
+/**
+ * Initializes a new device of the edge node, giving it its own range of
+ * metric aliases.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param device the device state to initialize, cannot be NULL.
+ */
+void sparkplug_device_init(sparkplug_state_t *state, sparkplug_device_t *device);
+
+/**
+ * Encodes a NBIRTH message, announcing the edge node itself along with its
+ * #SPARKPLUG_REBIRTH metric. The metrics of the GPS devices are announced by
+ * the birth certificates of the devices.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param update the changes to commit once the message is published, cannot
+ *        be NULL;
+ * @param buffer the buffer to write the encoded message to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the encoded message, or a negative value if the
+ *         buffer is too small.
+ */
+int sparkplug_encode_birth(const sparkplug_state_t *state, sparkplug_update_t *update, uint8_t *buffer, size_t size);
+
+/**
+ * Encodes a DBIRTH message, announcing all metrics of a device (including
+ * their aliases) along with their current values.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param device the device state, cannot be NULL;
+ * @param event the event to take the current values from, cannot be NULL;
+ * @param update the changes to commit once the message is published, cannot
+ *        be NULL;
+ * @param buffer the buffer to write the encoded message to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the encoded message, or a negative value if the
+ *         buffer is too small.
+ */
+int sparkplug_encode_device_birth(const sparkplug_state_t *state, const sparkplug_device_t *device, const gps_event_t *event,
+                                  sparkplug_update_t *update, uint8_t *buffer, size_t size);
+
+/**
+ * Encodes a DDATA message, containing only the aliases and values of the
+ * metrics of a device that changed since its last message.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param device the device state, cannot be NULL;
+ * @param event the event to take the current values from, cannot be NULL;
+ * @param update the changes to commit once the message is published, cannot
+ *        be NULL;
+ * @param buffer the buffer to write the encoded message to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the encoded message, 0 if no metric changed, or a
+ *         negative value if the buffer is too small.
+ */
+int sparkplug_encode_device_data(const sparkplug_state_t *state, const sparkplug_device_t *device, const gps_event_t *event,
+                                 sparkplug_update_t *update, uint8_t *buffer, size_t size);
+
+/**
+ * Encodes a DDEATH message, for a device that is gone.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param update the changes to commit once the message is published, cannot
+ *        be NULL;
+ * @param buffer the buffer to write the encoded message to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the encoded message, or a negative value if the
+ *         buffer is too small.
+ */
+int sparkplug_encode_device_death(const sparkplug_state_t *state, sparkplug_update_t *update, uint8_t *buffer, size_t size);
+
+/**
+ * Commits the changes of a published message to the session state.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param device the state of the device the message was for, can only be
+ *        NULL for messages of the edge node itself;
+ * @param update the changes of the message, as returned by its encoding.
+ */
+void sparkplug_commit(sparkplug_state_t *state, sparkplug_device_t *device, const sparkplug_update_t *update);
+
+/**
+ * Encodes a NDEATH message, to be used as MQTT will.
+ *
+ * @param state the session state, cannot be NULL;
+ * @param buffer the buffer to write the encoded message to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the encoded message, or a negative value if the
+ *         buffer is too small.
+ */
+int sparkplug_encode_death(const sparkplug_state_t *state, uint8_t *buffer, size_t size);
+
+/**
+ * Decodes a NCMD message, and returns whether it requests a rebirth, that is,
+ * whether it sets the #SPARKPLUG_REBIRTH metric to true.
+ *
+ * @param buffer the received message, cannot be NULL;
+ * @param size the length of the received message, in bytes.
+ * @return true if a rebirth is requested, false otherwise or if the message
+ *         is malformed.
+ */
+bool sparkplug_decode_rebirth(const uint8_t *buffer, size_t size);
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _TOPIC_H
+#define _TOPIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Represents a parsed topic template, like "site1/{host}/{device}".
+ */
+typedef struct topic_template topic_template_t;
+
+/**
+ * Denotes the placeholders that can be used in a topic template.
+ */
+typedef enum topic_var {
+    VAR_CLIENT_ID = 0,
+    VAR_HOST,
+    VAR_SOURCE,
+    VAR_DEVICE,
+    VAR_CONSTELLATION,
+    VAR_CNT,
+} topic_var_t;
+
+/**
+ * Parses a topic template into a list of literal and placeholder segments.
+ *
+ * @param template the template to parse, cannot be NULL.
+ * @return the parsed template, or NULL in case of invalid templates or if
+ *         no memory was available.
+ */
+topic_template_t *topic_parse(const char *template);
+
+/**
+ * Frees all resources taken up by the given template.
+ *
+ * @param tmpl the template to free, may be NULL.
+ */
+void topic_free(topic_template_t *tmpl);
+
+/**
+ * Returns the original string of a template.
+ *
+ * @param tmpl the template, cannot be NULL.
+ * @return the template string, never NULL.
+ */
+const char *topic_str(const topic_template_t *tmpl);
+
+/**
+ * Returns whether a template uses a particular placeholder.
+ *
+ * @param tmpl the template, cannot be NULL;
+ * @param var the placeholder to look for.
+ * @return true if the placeholder is used, false otherwise.
+ */
+bool topic_uses(const topic_template_t *tmpl, topic_var_t var);
+
+/**
+ * Expands a template into a topic. Characters that are not allowed in
+ * topic levels ('/', '+' and '#') are replaced in the placeholder values.
+ *
+ * @param tmpl the template to expand, cannot be NULL;
+ * @param vars the values of all #VAR_CNT placeholders, values may be NULL;
+ * @param buffer the buffer to write the topic to, cannot be NULL;
+ * @param size the size of the given buffer, in bytes.
+ * @return the length of the topic, or a negative value if the buffer is too small.
+ */
+int topic_expand(const topic_template_t *tmpl, const char *vars[VAR_CNT], char *buffer, size_t size);
+
+#endif
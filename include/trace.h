@@ -0,0 +1,68 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/**
+ * Statically defined (USDT) tracing probes, for use with bpftrace, perf or
+ * SystemTap. Each probe compiles to a single NOP, and becomes active only
+ * once a tracer attaches to it. Without sys/sdt.h, probes compile to nothing.
+ *
+ * Probes of the "gpsstats" provider:
+ * - gpsd_recv(char *host, char *class, size_t bytes): a message of GPSD was received;
+ * - payload_built(char *topic, int len): a payload was built for an event;
+ * - publish_queued(int mid, char *topic, int len): a message was handed to mosquitto;
+ * - publish_written(int mid): mosquitto has sent (QoS 0) or delivered (QoS 1/2) a message;
+ * - reconnect_start(char *kind, int id): a (re)connect of GPSD or MQTT starts;
+ * - reconnect_end(char *kind, int id, int status): a (re)connect has ended,
+ *   status is 0 upon success, > 0 if retried after status seconds, < 0 on errors.
+ *   For MQTT, id is the index of the broker that was connected to;
+ * - drop(char *kind, int id): an event (worker, mqtt), client (http) or log message (log) was dropped.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+// Use semaphores, so arguments that are costly to compute can be skipped when no tracer is attached...
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_PROBES(X) \
+    X(gpsd_recv) \
+    X(payload_built) \
+    X(publish_queued) \
+    X(publish_written) \
+    X(reconnect_start) \
+    X(reconnect_end) \
+    X(drop)
+
+#define TRACE_SEMAPHORE(name) gpsstats_##name##_semaphore
+#define TRACE_DECLARE(name) extern volatile unsigned short TRACE_SEMAPHORE(name);
+
+TRACE_PROBES(TRACE_DECLARE)
+
+/**
+ * Returns whether a tracer is attached to a probe.
+ */
+#define TRACE_ENABLED(name) __builtin_expect(TRACE_SEMAPHORE(name) != 0, 0)
+
+#define TRACE1(name, a) STAP_PROBE1(gpsstats, name, a)
+#define TRACE2(name, a, b) STAP_PROBE2(gpsstats, name, a, b)
+#define TRACE3(name, a, b, c) STAP_PROBE3(gpsstats, name, a, b, c)
+
+#else /* !HAVE_SYS_SDT_H */
+
+#define TRACE_ENABLED(name) 0
+
+// Arguments are never evaluated, but still count as used...
+#define TRACE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define TRACE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define TRACE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Defines the handle that is to be used to talk to the io_uring routines.
+ */
+typedef struct uring uring_t;
+
+/**
+ * Called for each completed receive.
+ *
+ * @param ring the io_uring handle;
+ * @param data the received data, which lives in a kernel-filled buffer that
+ *        is reused after the callback returns. Can be modified in place;
+ * @param result the number of bytes received, 0 if the remote end closed the
+ *        connection, or a negative errno value in case of errors;
+ * @param context the context as given to #uring_recv_start.
+ */
+typedef void (*uring_recv_callback_t)(uring_t *ring, char *data, int result, void *context);
+
+/**
+ * Represents statistics about the io_uring reader.
+ */
+typedef struct uring_stats {
+    uint32_t sources;
+    uint32_t submits;
+    uint32_t buffers_exhausted;
+    uint64_t completions;
+    uint64_t bytes_recv;
+} uring_stats_t;
+
+/**
+ * Allocates and initializes a new io_uring instance with a ring of provided
+ * buffers. Fails if gpsstats is compiled without io_uring support, or if the
+ * kernel does not support io_uring, in which case the epoll/poll path should
+ * be used instead.
+ *
+ * @returns a new #uring_t instance, or NULL in case io_uring is not available.
+ */
+uring_t *uring_init(void);
+
+/**
+ * Destroys and frees all previously allocated resources.
+ *
+ * @param ring the io_uring handle, may be NULL.
+ */
+void uring_destroy(uring_t *ring);
+
+/**
+ * Returns the (event) file descriptor that becomes readable as soon as
+ * completions are pending, @see #uring_process.
+ *
+ * @param ring the io_uring handle, cannot be NULL.
+ * @return a file descriptor, or -1 in case of errors.
+ */
+int uring_fd(uring_t *ring);
+
+/**
+ * Starts receiving data from a socket using a multishot receive: a single
+ * submission keeps delivering completions until #uring_recv_stop is called,
+ * the remote end closes the connection or an error occurs.
+ *
+ * @param ring the io_uring handle, cannot be NULL;
+ * @param fd the socket to receive data from;
+ * @param callback the callback to call for each completion, cannot be NULL;
+ * @param context the context to pass to the callback.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int uring_recv_start(uring_t *ring, int fd, uring_recv_callback_t callback, void *context);
+
+/**
+ * Stops receiving data from a socket. The callback is no longer called once
+ * this function returns. Can be called from the callback.
+ *
+ * @param ring the io_uring handle, may be NULL;
+ * @param fd the socket to stop receiving data from.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int uring_recv_stop(uring_t *ring, int fd);
+
+/**
+ * Handles all pending completions. Never blocks.
+ *
+ * @param ring the io_uring handle, cannot be NULL.
+ * @return the number of handled completions, or a negative value in case of errors.
+ */
+int uring_process(uring_t *ring);
+
+/**
+ * Dumps statistics about the io_uring reader.
+ *
+ * @param ring the io_uring handle, may be NULL.
+ * @return the io_uring statistics.
+ */
+uring_stats_t uring_dump_stats(uring_t *ring);
+
+#endif
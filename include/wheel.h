@@ -0,0 +1,141 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _WHEEL_H
+#define _WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Defines the handle that is to be used to talk to the timing wheel routines.
+ */
+typedef struct wheel wheel_t;
+
+typedef struct wheel_timer wheel_timer_t;
+
+/**
+ * Called when a timer expires. The timer can be rescheduled from the callback.
+ *
+ * @param wheel the timing wheel;
+ * @param timer the expired timer;
+ * @param context the context as given to #wheel_timer_init.
+ */
+typedef void (*wheel_callback_t)(wheel_t *wheel, wheel_timer_t *timer, void *context);
+
+/**
+ * Represents a single timer. Timers are embedded in the structure they belong
+ * to, so (re)scheduling them never allocates. Its fields are private to the
+ * timing wheel.
+ */
+struct wheel_timer {
+    wheel_timer_t *next;
+    wheel_timer_t *prev;
+    uint64_t expires;
+    uint32_t slot;
+    wheel_callback_t callback;
+    void *context;
+};
+
+/**
+ * Represents statistics about the timing wheel.
+ */
+typedef struct wheel_stats {
+    uint32_t timers;
+    uint64_t scheduled;
+    uint64_t cancelled;
+    uint64_t expired;
+    uint64_t cascaded;
+} wheel_stats_t;
+
+/**
+ * Allocates and initializes a new timing wheel.
+ *
+ * @param tick the resolution of the timing wheel, in milliseconds, > 0.
+ * @returns a new #wheel_t instance, or NULL in case of errors.
+ */
+wheel_t *wheel_init(uint32_t tick);
+
+/**
+ * Destroys and frees all previously allocated resources. Timers that are still
+ * scheduled are not called.
+ *
+ * @param wheel the timing wheel, may be NULL.
+ */
+void wheel_destroy(wheel_t *wheel);
+
+/**
+ * Returns the (timer) file descriptor that becomes readable as soon as timers
+ * are due, @see #wheel_process.
+ *
+ * @param wheel the timing wheel, cannot be NULL.
+ * @return a file descriptor, or -1 in case of errors.
+ */
+int wheel_fd(wheel_t *wheel);
+
+/**
+ * Initializes a timer, should be called once before scheduling it.
+ *
+ * @param timer the timer to initialize, cannot be NULL;
+ * @param callback the callback to call when the timer expires, cannot be NULL;
+ * @param context the context to pass to the callback.
+ */
+void wheel_timer_init(wheel_timer_t *timer, wheel_callback_t callback, void *context);
+
+/**
+ * Schedules a timer, or reschedules it in case it is already scheduled.
+ *
+ * @param wheel the timing wheel, cannot be NULL;
+ * @param timer the (initialized) timer to schedule, cannot be NULL;
+ * @param delay the delay after which the timer expires, in milliseconds.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int wheel_schedule(wheel_t *wheel, wheel_timer_t *timer, uint64_t delay);
+
+/**
+ * Cancels a timer. Does nothing in case the timer is not scheduled.
+ *
+ * @param wheel the timing wheel, cannot be NULL;
+ * @param timer the timer to cancel, cannot be NULL.
+ */
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+
+/**
+ * Returns whether a timer is scheduled.
+ *
+ * @param timer the timer, cannot be NULL.
+ * @return true if the timer is scheduled, false otherwise.
+ */
+bool wheel_pending(const wheel_timer_t *timer);
+
+/**
+ * Calls the callbacks of all timers that are due. Never blocks.
+ *
+ * @param wheel the timing wheel, cannot be NULL.
+ * @return the number of expired timers, or a negative value in case of errors.
+ */
+int wheel_process(wheel_t *wheel);
+
+/**
+ * Calls the callbacks of all timers that are due at a given time, without
+ * (re)arming the timer file descriptor.
+ *
+ * @param wheel the timing wheel, cannot be NULL;
+ * @param now the current time, in milliseconds since the wheel was created.
+ * @return the number of expired timers, or a negative value in case of errors.
+ */
+int wheel_advance(wheel_t *wheel, uint64_t now);
+
+/**
+ * Dumps statistics about the timing wheel.
+ *
+ * @param wheel the timing wheel, may be NULL.
+ * @return the timing wheel statistics.
+ */
+wheel_stats_t wheel_dump_stats(wheel_t *wheel);
+
+#endif
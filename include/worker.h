@@ -0,0 +1,140 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gpsd.h"
+
+/**
+ * Defines the handle that is to be used to talk to the worker pool routines.
+ */
+typedef struct worker_pool worker_pool_t;
+
+/**
+ * Called by #worker_pool_process for each event read by a worker.
+ *
+ * @param event the event, which can be modified in place, and is only valid
+ *        until the callback returns;
+ * @param source the source as given to #worker_pool_assign;
+ * @param context the context as given to #worker_pool_init.
+ */
+typedef void (*worker_event_callback_t)(gps_event_t *event, void *source, void *context);
+
+/**
+ * Called by #worker_pool_process once a worker no longer reads from a source,
+ * after which its GPSD handle can be used (or destroyed) again.
+ *
+ * @param source the source as given to #worker_pool_assign;
+ * @param lost true if the connection to GPSD was lost, false if the source
+ *        was released by #worker_pool_release;
+ * @param context the context as given to #worker_pool_init.
+ */
+typedef void (*worker_detach_callback_t)(void *source, bool lost, void *context);
+
+/**
+ * Represents statistics about a single worker.
+ */
+typedef struct worker_stats {
+    uint32_t sources;
+    uint64_t events;
+    uint64_t events_dropped;
+    uint32_t wakeups;
+} worker_stats_t;
+
+/**
+ * Allocates and starts a pool of worker threads, each with its own event loop.
+ *
+ * @param workers the number of worker threads, > 0;
+ * @param event_callback the callback for events, cannot be NULL;
+ * @param detach_callback the callback for detached sources, cannot be NULL;
+ * @param context the context to pass to the callbacks.
+ * @returns a new #worker_pool_t instance, or NULL in case of errors.
+ */
+worker_pool_t *worker_pool_init(uint8_t workers, worker_event_callback_t event_callback,
+                                worker_detach_callback_t detach_callback, void *context);
+
+/**
+ * Stops all worker threads, and destroys and frees all previously allocated
+ * resources. GPSD handles that are still assigned are not destroyed.
+ *
+ * @param pool the worker pool, may be NULL.
+ */
+void worker_pool_destroy(worker_pool_t *pool);
+
+/**
+ * Returns the file descriptor that becomes readable as soon as workers have
+ * queued events, @see #worker_pool_process.
+ *
+ * @param pool the worker pool, cannot be NULL.
+ * @return a file descriptor, or -1 in case of errors.
+ */
+int worker_pool_fd(worker_pool_t *pool);
+
+/**
+ * Hands a connected GPSD handle over to the least loaded worker. From now on,
+ * only that worker uses the handle, until the source is detached.
+ *
+ * @param pool the worker pool, cannot be NULL;
+ * @param gpsd the connected GPSD handle, cannot be NULL;
+ * @param source the source to pass to the callbacks, cannot be NULL.
+ * @return the index of the worker, or a negative value in case of errors.
+ */
+int worker_pool_assign(worker_pool_t *pool, gpsd_handle_t *gpsd, void *source);
+
+/**
+ * Asks a worker to stop reading from a source. The detach callback is called
+ * once the worker has done so.
+ *
+ * @param pool the worker pool, cannot be NULL;
+ * @param worker the index of the worker, as returned by #worker_pool_assign;
+ * @param source the source as given to #worker_pool_assign.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int worker_pool_release(worker_pool_t *pool, int worker, void *source);
+
+/**
+ * Calls the callbacks for all events and detached sources queued by the
+ * workers. Never blocks.
+ *
+ * @param pool the worker pool, cannot be NULL.
+ * @return the number of handled events, or a negative value in case of errors.
+ */
+int worker_pool_process(worker_pool_t *pool);
+
+/**
+ * Pins all worker threads to a set of CPUs and/or runs them with the
+ * SCHED_FIFO policy, @see #rt_apply.
+ *
+ * @param pool the worker pool, cannot be NULL;
+ * @param cpus the list of CPUs to run the workers on, or NULL to leave it as is;
+ * @param priority the SCHED_FIFO priority (1..99), or 0 to leave it as is.
+ * @return 0 upon success, or a non-zero value in case of errors.
+ */
+int worker_pool_set_rt(worker_pool_t *pool, const char *cpus, uint8_t priority);
+
+/**
+ * Returns the number of workers in a pool.
+ *
+ * @param pool the worker pool, may be NULL.
+ * @return the number of workers.
+ */
+uint8_t worker_pool_size(worker_pool_t *pool);
+
+/**
+ * Dumps statistics about a single worker.
+ *
+ * @param pool the worker pool, may be NULL;
+ * @param worker the index of the worker.
+ * @return the worker statistics.
+ */
+worker_stats_t worker_pool_dump_stats(worker_pool_t *pool, int worker);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "gpsd.h"
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+
+// "GPSSCKPT" when read as little endian...
+#define CHECKPOINT_MAGIC 0x54504b4353535047ULL
+// bump whenever the layout of checkpoint_slot_t changes...
+#define CHECKPOINT_VERSION 2
+// two generations are kept, the oldest one is overwritten...
+#define CHECKPOINT_SLOTS 2
+
+typedef struct checkpoint_slot {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t checksum;
+    uint64_t generation;
+    int64_t time;
+    // the layout of the metrics, which depends on the configured maximums...
+    uint32_t counter_slots;
+    uint32_t histogram_cnt;
+    uint32_t bucket_cnt;
+    uint32_t device_cnt;
+
+    metrics_snapshot_t metrics;
+    // the rolling windows, oscillator and C/N0 windows of the GPS devices...
+    gpsd_saved_device_t devices[GPS_SAVED_DEVICES];
+} checkpoint_slot_t;
+
+struct checkpoint {
+    char *file;
+    int fd;
+    checkpoint_slot_t *slots;
+
+    uint64_t generation;
+
+    uint32_t writes;
+    time_t last_write;
+    uint64_t restored_generation;
+    time_t restored_age;
+    uint32_t restore_usec;
+};
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 of a slot, excluding everything up to and including its checksum...
+static uint32_t slot_checksum(const checkpoint_slot_t *slot) {
+    const uint8_t *p = (const uint8_t *) slot + offsetof(checkpoint_slot_t, generation);
+    size_t len = sizeof(checkpoint_slot_t) - offsetof(checkpoint_slot_t, generation);
+    uint32_t c = 0xFFFFFFFFU;
+
+    if (crc_table[1] == 0) {
+        crc_init();
+    }
+
+    while (len--) {
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFU;
+}
+
+static bool slot_valid(const checkpoint_slot_t *slot) {
+    return slot->magic == CHECKPOINT_MAGIC &&
+           slot->version == CHECKPOINT_VERSION &&
+           slot->counter_slots == METRIC_COUNTER_SLOTS &&
+           slot->histogram_cnt == METRIC_HISTOGRAM_CNT &&
+           slot->bucket_cnt == METRICS_BUCKETS &&
+           slot->device_cnt <= GPS_SAVED_DEVICES &&
+           slot->checksum == slot_checksum(slot);
+}
+
+// Returns the valid slot with the highest generation, if any...
+static const checkpoint_slot_t *latest_slot(const checkpoint_t *cp) {
+    const checkpoint_slot_t *latest = NULL;
+
+    for (int i = 0; i < CHECKPOINT_SLOTS; i++) {
+        const checkpoint_slot_t *slot = &cp->slots[i];
+        if (slot_valid(slot) && (!latest || slot->generation > latest->generation)) {
+            latest = slot;
+        }
+    }
+    return latest;
+}
+
+checkpoint_t *checkpoint_open(const char *file) {
+    if (file == NULL) {
+        return NULL;
+    }
+
+    checkpoint_t *cp = mem_malloc(MEM_CONFIG, sizeof(checkpoint_t));
+    if (cp == NULL) {
+        log_error("failed to create checkpoint: out of memory!");
+        return NULL;
+    }
+    bzero(cp, sizeof(checkpoint_t));
+
+    size_t size = CHECKPOINT_SLOTS * sizeof(checkpoint_slot_t);
+    struct stat st;
+
+    cp->file = mem_strdup(MEM_CONFIG, file);
+    cp->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cp->file == NULL || cp->fd < 0) {
+        log_error("failed to open checkpoint %s: %s", file, strerror(cp->file ? errno : ENOMEM));
+        goto error;
+    }
+
+    // A file of a different size is from another version, and is reinitialized...
+    if (fstat(cp->fd, &st) || ((size_t) st.st_size != size && ftruncate(cp->fd, (off_t) size))) {
+        log_error("failed to resize checkpoint %s: %s", file, strerror(errno));
+        goto error;
+    }
+
+    cp->slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+    if (cp->slots == MAP_FAILED) {
+        cp->slots = NULL;
+        log_error("failed to map checkpoint %s: %s", file, strerror(errno));
+        goto error;
+    }
+
+    const checkpoint_slot_t *latest = latest_slot(cp);
+    cp->generation = latest ? latest->generation : 0;
+
+    return cp;
+
+error:
+    checkpoint_close(cp);
+    return NULL;
+}
+
+void checkpoint_close(checkpoint_t *cp) {
+    if (cp) {
+        if (cp->slots) {
+            munmap(cp->slots, CHECKPOINT_SLOTS * sizeof(checkpoint_slot_t));
+        }
+        if (cp->fd >= 0) {
+            close(cp->fd);
+        }
+        mem_free(MEM_CONFIG, cp->file);
+        mem_free(MEM_CONFIG, cp);
+    }
+}
+
+const char *checkpoint_file(const checkpoint_t *cp) {
+    return cp->file;
+}
+
+int checkpoint_restore(checkpoint_t *cp, uint32_t max_age) {
+    if (cp == NULL) {
+        return -EINVAL;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const checkpoint_slot_t *slot = latest_slot(cp);
+    if (slot == NULL) {
+        log_info("No valid checkpoint in %s, starting afresh...", cp->file);
+        return -ENOENT;
+    }
+
+    time_t age = time(NULL) - (time_t) slot->time;
+    if (max_age && (age < 0 || age > (time_t) max_age)) {
+        log_info("Not restoring checkpoint %s: it is %ld seconds old!", cp->file, (long) age);
+        return -ESTALE;
+    }
+
+    metrics_restore(&slot->metrics);
+    gpsd_restore_devices(slot->devices, slot->device_cnt);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    cp->restored_generation = slot->generation;
+    cp->restored_age = age;
+    cp->restore_usec = (uint32_t) ((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    log_info("Restored checkpoint %s (generation %" PRIu64 ", %ld seconds old, %u devices) in %u us",
+             cp->file, slot->generation, (long) age, slot->device_cnt, cp->restore_usec);
+
+    return 0;
+}
+
+int checkpoint_write(checkpoint_t *cp, checkpoint_save_t save, void *context) {
+    if (cp == NULL) {
+        return -EINVAL;
+    }
+
+    // Overwrite the oldest generation, the latest one stays intact...
+    uint64_t generation = cp->generation + 1;
+    checkpoint_slot_t *slot = &cp->slots[generation % CHECKPOINT_SLOTS];
+
+    // Invalidate the slot first, so a partial write is never mistaken for a valid one...
+    slot->magic = 0;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    metrics_snapshot(&slot->metrics);
+    size_t device_cnt = save ? save(slot->devices, GPS_SAVED_DEVICES, context) : 0;
+    slot->version = CHECKPOINT_VERSION;
+    slot->generation = generation;
+    slot->time = (int64_t) time(NULL);
+    slot->counter_slots = METRIC_COUNTER_SLOTS;
+    slot->histogram_cnt = METRIC_HISTOGRAM_CNT;
+    slot->bucket_cnt = METRICS_BUCKETS;
+    slot->device_cnt = (uint32_t) device_cnt;
+    slot->checksum = slot_checksum(slot);
+    atomic_signal_fence(memory_order_seq_cst);
+    slot->magic = CHECKPOINT_MAGIC;
+
+    // Let the kernel write it back in the background, our event loop should not block...
+    if (msync(cp->slots, CHECKPOINT_SLOTS * sizeof(checkpoint_slot_t), MS_ASYNC)) {
+        int err = errno;
+        log_warning("Failed to write checkpoint %s: %s", cp->file, strerror(err));
+        return -err;
+    }
+
+    cp->generation = generation;
+
+    // Update stats...
+    cp->writes++;
+    cp->last_write = (time_t) slot->time;
+
+    return 0;
+}
+
+checkpoint_stats_t checkpoint_dump_stats(checkpoint_t *cp) {
+    if (cp == NULL) {
+        return (checkpoint_stats_t) {
+            0
+        };
+    }
+
+    return (checkpoint_stats_t) {
+        .generation = cp->generation,
+        .writes = cp->writes,
+        .last_write = cp->last_write,
+        .restored_generation = cp->restored_generation,
+        .restored_age = cp->restored_age,
+        .restore_usec = cp->restore_usec,
+    };
+}
+
+// EOF
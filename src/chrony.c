@@ -0,0 +1,550 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "chrony.h"
+#include "log.h"
+#include "mem.h"
+
+// The command protocol of chronyd, see candm.h of chrony...
+#define PROTO_VERSION 6
+#define PKT_TYPE_CMD_REQUEST 1
+#define PKT_TYPE_CMD_REPLY 2
+
+#define REQ_N_SOURCES 14
+#define REQ_SOURCE_DATA 15
+#define REQ_TRACKING 33
+#define REQ_SOURCESTATS 34
+
+#define RPY_N_SOURCES 2
+#define RPY_SOURCE_DATA 3
+#define RPY_TRACKING 5
+#define RPY_SOURCESTATS 6
+
+#define STT_SUCCESS 0
+#define RPY_SD_ST_SELECTED 0
+
+#define REQUEST_HEADER_SIZE 20
+#define REPLY_HEADER_SIZE 28
+
+// the sizes of the request and reply data of the commands we use...
+#define INDEX_SIZE 4
+#define N_SOURCES_SIZE 4
+#define SOURCE_DATA_SIZE 48
+#define TRACKING_SIZE 76
+#define SOURCESTATS_SIZE 56
+
+#define MAX_PACKET_SIZE (REPLY_HEADER_SIZE + TRACKING_SIZE)
+
+typedef enum chrony_step {
+    STEP_IDLE = 0,
+    STEP_TRACKING,
+    STEP_N_SOURCES,
+    STEP_SOURCE_DATA,
+    STEP_SOURCESTATS,
+} chrony_step_t;
+
+struct chrony {
+    evloop_t *loop;
+    wheel_t *wheel;
+
+    char *path;
+    uint16_t interval;
+    int fd;
+    // chronyd replies to the address of its client, so we need one as well...
+    char local_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+    // the state of the current poll...
+    chrony_step_t step;
+    uint16_t command;
+    uint32_t sequence;
+    uint32_t n_sources;
+    uint32_t source;
+    uint32_t scanned;
+    // the index of the source that was selected by the last poll...
+    uint32_t selected;
+    chrony_reading_t reading;
+
+    wheel_timer_t poll_timer;
+    wheel_timer_t timeout_timer;
+
+    uint32_t ch_polls;
+    uint32_t ch_polls_failed;
+    uint32_t ch_timeouts;
+    uint32_t ch_requests;
+};
+
+// The reading of the last poll, read by other threads under a sequence lock...
+static _Atomic uint32_t chrony_seq;
+static chrony_reading_t chrony_reading;
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) (v >> 8);
+    p[1] = (uint8_t) v;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+// Decodes the 32-bit floating point format of chrony: a 7-bit exponent and a 25-bit coefficient...
+static double get_float(const uint8_t *p) {
+    uint32_t x = get_u32(p);
+
+    int32_t exp = (int32_t) (x >> 25);
+    if (exp >= 64) {
+        exp -= 128;
+    }
+    int32_t coef = (int32_t) (x & 0x1ffffff);
+    if (coef >= 0x1000000) {
+        coef -= 0x2000000;
+    }
+    return ldexp(coef, exp - 25);
+}
+
+static void publish_reading(const chrony_reading_t *reading) {
+    uint32_t seq = atomic_load_explicit(&chrony_seq, memory_order_relaxed);
+    atomic_store_explicit(&chrony_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    chrony_reading = *reading;
+
+    atomic_store_explicit(&chrony_seq, seq + 2, memory_order_release);
+}
+
+static void close_socket(chrony_t *chrony) {
+    if (chrony->fd >= 0) {
+        evloop_remove(chrony->loop, chrony->fd);
+        close(chrony->fd);
+        chrony->fd = -1;
+    }
+    if (chrony->local_path[0]) {
+        unlink(chrony->local_path);
+        chrony->local_path[0] = 0;
+    }
+}
+
+static void end_poll(chrony_t *chrony, bool success) {
+    wheel_cancel(chrony->wheel, &chrony->timeout_timer);
+    chrony->step = STEP_IDLE;
+
+    if (success) {
+        chrony->reading.valid = true;
+        publish_reading(&chrony->reading);
+        return;
+    }
+
+    // A stale reading is worse than none...
+    chrony_reading_t none;
+    bzero(&none, sizeof(none));
+    publish_reading(&none);
+
+    // Update stats...
+    chrony->ch_polls_failed++;
+}
+
+static void fail_poll(chrony_t *chrony, const char *reason) {
+    log_debug("Failed to poll chronyd: %s", reason);
+
+    end_poll(chrony, false);
+}
+
+static int send_request(chrony_t *chrony, uint16_t command, size_t req_size, size_t reply_size, int32_t index) {
+    uint8_t buf[MAX_PACKET_SIZE];
+    // Requests are padded to the size of their reply, so chronyd cannot be used to amplify traffic...
+    size_t len = REQUEST_HEADER_SIZE + req_size;
+    if (len < REPLY_HEADER_SIZE + reply_size) {
+        len = REPLY_HEADER_SIZE + reply_size;
+    }
+
+    bzero(buf, len);
+    buf[0] = PROTO_VERSION;
+    buf[1] = PKT_TYPE_CMD_REQUEST;
+    put_u16(buf + 4, command);
+    put_u32(buf + 8, ++chrony->sequence);
+    if (req_size) {
+        put_u32(buf + REQUEST_HEADER_SIZE, (uint32_t) index);
+    }
+
+    chrony->command = command;
+
+    if (send(chrony->fd, buf, len, MSG_DONTWAIT) != (ssize_t) len) {
+        log_debug("Failed to send request to chronyd: %s", strerror(errno));
+        // chronyd might have been restarted, reconnect on the next poll...
+        close_socket(chrony);
+        return -ENOTCONN;
+    }
+
+    // Update stats...
+    chrony->ch_requests++;
+
+    return 0;
+}
+
+static int request_source(chrony_t *chrony, chrony_step_t step) {
+    chrony->step = step;
+    if (step == STEP_SOURCE_DATA) {
+        return send_request(chrony, REQ_SOURCE_DATA, INDEX_SIZE, SOURCE_DATA_SIZE, (int32_t) chrony->source);
+    }
+    return send_request(chrony, REQ_SOURCESTATS, INDEX_SIZE, SOURCESTATS_SIZE, (int32_t) chrony->source);
+}
+
+// Handles a single reply, and sends the next request of the poll, if any...
+static void handle_reply(chrony_t *chrony, const uint8_t *data, size_t len) {
+    chrony_reading_t *reading = &chrony->reading;
+    int status = 0;
+
+    switch (chrony->step) {
+    case STEP_TRACKING:
+        if (len < TRACKING_SIZE) {
+            fail_poll(chrony, "tracking reply too short");
+            return;
+        }
+        reading->ref_id = get_u32(data);
+        reading->stratum = get_u16(data + 24);
+        reading->leap_status = get_u16(data + 26);
+        reading->freq = get_float(data + 52);
+
+        chrony->step = STEP_N_SOURCES;
+        status = send_request(chrony, REQ_N_SOURCES, 0, N_SOURCES_SIZE, 0);
+        break;
+
+    case STEP_N_SOURCES:
+        if (len < N_SOURCES_SIZE) {
+            fail_poll(chrony, "sources reply too short");
+            return;
+        }
+        chrony->n_sources = get_u32(data);
+        if (chrony->n_sources == 0) {
+            fail_poll(chrony, "no sources");
+            return;
+        }
+
+        // The selected source rarely changes, so start looking where it was last time...
+        chrony->source = (chrony->selected < chrony->n_sources) ? chrony->selected : 0;
+        chrony->scanned = 0;
+        status = request_source(chrony, STEP_SOURCE_DATA);
+        break;
+
+    case STEP_SOURCE_DATA:
+        if (len < SOURCE_DATA_SIZE) {
+            fail_poll(chrony, "source data reply too short");
+            return;
+        }
+        if (get_u16(data + 24) == RPY_SD_ST_SELECTED) {
+            chrony->selected = chrony->source;
+            status = request_source(chrony, STEP_SOURCESTATS);
+        } else if (++chrony->scanned < chrony->n_sources) {
+            chrony->source = (chrony->source + 1) % chrony->n_sources;
+            status = request_source(chrony, STEP_SOURCE_DATA);
+        } else {
+            fail_poll(chrony, "no source selected");
+            return;
+        }
+        break;
+
+    case STEP_SOURCESTATS:
+        if (len < SOURCESTATS_SIZE) {
+            fail_poll(chrony, "source statistics reply too short");
+            return;
+        }
+        reading->sd = get_float(data + 36);
+        reading->offset = get_float(data + 48);
+
+        end_poll(chrony, true);
+        return;
+
+    default:
+        // A late reply of a poll that was given up...
+        return;
+    }
+
+    if (status) {
+        fail_poll(chrony, "unable to send request");
+    }
+}
+
+static void socket_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    chrony_t *chrony = context;
+    uint8_t buf[MAX_PACKET_SIZE];
+
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+        close_socket(chrony);
+        if (chrony->step != STEP_IDLE) {
+            fail_poll(chrony, "connection lost");
+        }
+        return;
+    }
+
+    for (;;) {
+        ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_socket(chrony);
+                if (chrony->step != STEP_IDLE) {
+                    fail_poll(chrony, strerror(errno));
+                }
+            }
+            return;
+        }
+
+        // Ignore anything that is not the reply to our last request...
+        if (len < REPLY_HEADER_SIZE || buf[0] != PROTO_VERSION || buf[1] != PKT_TYPE_CMD_REPLY ||
+                get_u16(buf + 4) != chrony->command || get_u32(buf + 16) != chrony->sequence ||
+                chrony->step == STEP_IDLE) {
+            continue;
+        }
+
+        uint16_t status = get_u16(buf + 8);
+        if (status != STT_SUCCESS) {
+            char reason[32];
+            snprintf(reason, sizeof(reason), "status %u", status);
+            fail_poll(chrony, reason);
+            continue;
+        }
+
+        handle_reply(chrony, buf + REPLY_HEADER_SIZE, (size_t) len - REPLY_HEADER_SIZE);
+
+        // The socket might be closed when a request failed...
+        if (chrony->fd < 0) {
+            return;
+        }
+    }
+}
+
+static int open_socket(chrony_t *chrony) {
+    struct sockaddr_un remote = { .sun_family = AF_UNIX };
+    struct sockaddr_un local = { .sun_family = AF_UNIX };
+
+    if (strlen(chrony->path) >= sizeof(remote.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(remote.sun_path, chrony->path);
+
+    // Like chronyc, use a socket next to the one of chronyd...
+    const char *slash = strrchr(chrony->path, '/');
+    int dir_len = slash ? (int) (slash - chrony->path) : 1;
+    const char *dir = slash ? chrony->path : ".";
+    int len = snprintf(local.sun_path, sizeof(local.sun_path), "%.*s/gpsstats.%d.sock", dir_len, dir, (int) getpid());
+    if (len < 0 || (size_t) len >= sizeof(local.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    unlink(local.sun_path);
+    if (bind(fd, (struct sockaddr *) &local, sizeof(local)) < 0) {
+        int status = -errno;
+        close(fd);
+        return status;
+    }
+    strcpy(chrony->local_path, local.sun_path);
+    chrony->fd = fd;
+
+    // chronyd might no longer run as root when it replies...
+    chmod(local.sun_path, 0666);
+
+    if (connect(fd, (struct sockaddr *) &remote, sizeof(remote)) < 0) {
+        int status = -errno;
+        close_socket(chrony);
+        return status;
+    }
+
+    if (evloop_add(chrony->loop, fd, EPOLLIN, socket_callback, chrony)) {
+        log_warning("Unable to add chrony event handler!");
+        close(fd);
+        chrony->fd = -1;
+        close_socket(chrony);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void poll_callback(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    chrony_t *chrony = context;
+
+    wheel_schedule(wheel, timer, (uint64_t) chrony->interval * 1000);
+
+    if (chrony->step != STEP_IDLE) {
+        // Still waiting for the previous poll...
+        return;
+    }
+
+    // Update stats...
+    chrony->ch_polls++;
+
+    if (chrony->fd < 0) {
+        int status = open_socket(chrony);
+        if (status) {
+            log_debug("Unable to connect to chronyd at %s: %s", chrony->path, strerror(-status));
+            end_poll(chrony, false);
+            return;
+        }
+    }
+
+    bzero(&chrony->reading, sizeof(chrony->reading));
+
+    chrony->step = STEP_TRACKING;
+    if (send_request(chrony, REQ_TRACKING, 0, TRACKING_SIZE, 0)) {
+        end_poll(chrony, false);
+        return;
+    }
+
+    wheel_schedule(wheel, &chrony->timeout_timer, CHRONY_TIMEOUT);
+}
+
+static void timeout_callback(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+    chrony_t *chrony = context;
+
+    // Update stats...
+    chrony->ch_timeouts++;
+
+    fail_poll(chrony, "timed out");
+}
+
+chrony_t *chrony_init(evloop_t *loop, wheel_t *wheel) {
+    chrony_t *chrony = mem_malloc(MEM_GPSD, sizeof(chrony_t));
+    if (chrony == NULL) {
+        log_error("failed to create chrony handle: out of memory!");
+        return NULL;
+    }
+    bzero(chrony, sizeof(chrony_t));
+
+    chrony->loop = loop;
+    chrony->wheel = wheel;
+    chrony->fd = -1;
+
+    wheel_timer_init(&chrony->poll_timer, poll_callback, chrony);
+    wheel_timer_init(&chrony->timeout_timer, timeout_callback, chrony);
+
+    return chrony;
+}
+
+void chrony_destroy(chrony_t *chrony) {
+    if (chrony) {
+        chrony_stop(chrony);
+
+        mem_free(MEM_GPSD, chrony);
+    }
+}
+
+int chrony_start(chrony_t *chrony, const char *path, uint16_t interval) {
+    if (chrony == NULL || (path && interval == 0)) {
+        return -EINVAL;
+    }
+
+    chrony_stop(chrony);
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    chrony->path = mem_strdup(MEM_GPSD, path);
+    if (chrony->path == NULL) {
+        return -ENOMEM;
+    }
+    chrony->interval = interval;
+
+    // The first poll is right away...
+    if (wheel_schedule(chrony->wheel, &chrony->poll_timer, 0)) {
+        log_warning("Failed to register poll timer for chrony?!");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void chrony_stop(chrony_t *chrony) {
+    wheel_cancel(chrony->wheel, &chrony->poll_timer);
+    wheel_cancel(chrony->wheel, &chrony->timeout_timer);
+
+    close_socket(chrony);
+
+    mem_free(MEM_GPSD, chrony->path);
+    chrony->path = NULL;
+    chrony->step = STEP_IDLE;
+}
+
+bool chrony_latest(chrony_reading_t *reading) {
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&chrony_seq, memory_order_acquire);
+
+        *reading = chrony_reading;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&chrony_seq, memory_order_relaxed));
+
+    return reading->valid;
+}
+
+const char *chrony_ref_name(uint32_t ref_id, char *buffer, size_t size) {
+    char name[5];
+    bool printable = true;
+
+    for (int i = 0; i < 4; i++) {
+        char c = (char) (ref_id >> (24 - 8 * i));
+        name[i] = c;
+        if (c && (c < 0x20 || c > 0x7e)) {
+            printable = false;
+        }
+    }
+    name[4] = 0;
+
+    // Reference clocks use up to four characters, other sources their IPv4 address or a hash...
+    if (printable && name[0]) {
+        snprintf(buffer, size, "%s", name);
+    } else {
+        snprintf(buffer, size, "%u.%u.%u.%u", ref_id >> 24, (ref_id >> 16) & 0xff, (ref_id >> 8) & 0xff, ref_id & 0xff);
+    }
+    return buffer;
+}
+
+chrony_stats_t chrony_dump_stats(const chrony_t *chrony) {
+    if (chrony == NULL) {
+        return (chrony_stats_t) { 0 };
+    }
+
+    return (chrony_stats_t) {
+        .polls = chrony->ch_polls,
+        .polls_failed = chrony->ch_polls_failed,
+        .timeouts = chrony->ch_timeouts,
+        .requests = chrony->ch_requests,
+    };
+}
+
+// EOF
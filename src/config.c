@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <pwd.h>
 #include <grp.h>
@@ -16,9 +17,12 @@
 #include <sys/types.h>
 
 #include <yaml.h>
-#include <udaemon/ud_logging.h>
 
 #include "config.h"
+#include "gpsd.h"
+#include "log.h"
+#include "mem.h"
+#include "rt.h"
 
 typedef enum config_block {
     ROOT = 0,
@@ -26,6 +30,15 @@ typedef enum config_block {
     MQTT,
     MQTT_AUTH,
     MQTT_TLS,
+    HTTP,
+    DERIVED,
+    FILTER,
+    SOURCES,
+    REALTIME,
+    CHECKPOINT,
+    BROKERS,
+    RESOLVER,
+    CHRONY,
 } config_block_t;
 
 static inline char *safe_strdup(const char *val) {
@@ -35,7 +48,7 @@ static inline char *safe_strdup(const char *val) {
     if (strlen(val) == 0) {
         return NULL;
     }
-    return strdup(val);
+    return mem_strdup(MEM_CONFIG, val);
 }
 
 static inline int32_t safe_atoi(const char *val) {
@@ -58,16 +71,130 @@ static inline bool safe_atob(const char *val) {
     return strncasecmp(val, "true", 4) == 0 || strncasecmp(val, "yes", 3) == 0;
 }
 
+static bool valid_port(const char *val, size_t len) {
+    if (len == 0 || len > 5 || strspn(val, "0123456789") < len) {
+        return false;
+    }
+    int32_t n = safe_atoi(val);
+    return n >= 1 && n <= 65535;
+}
+
+// Splits host[:port] up to end, IPv6 addresses should be enclosed in brackets...
+static int split_host_port(const char *val, const char *end, const char **host_start, const char **host_stop, const char **port_start) {
+    const char *host = val;
+    const char *host_end;
+    const char *port = NULL;
+
+    if (*host == '[') {
+        host++;
+        host_end = memchr(host, ']', (size_t)(end - host));
+        if (!host_end || (host_end + 1 < end && host_end[1] != ':')) {
+            return -EINVAL;
+        }
+        if (host_end + 1 < end) {
+            port = host_end + 2;
+        }
+    } else {
+        host_end = memchr(host, ':', (size_t)(end - host));
+        if (host_end) {
+            port = host_end + 1;
+        } else {
+            host_end = end;
+        }
+    }
+    if (host_end == host || (port && !valid_port(port, (size_t)(end - port)))) {
+        return -EINVAL;
+    }
+
+    *host_start = host;
+    *host_stop = host_end;
+    *port_start = port;
+    return 0;
+}
+
+// Parses a source as host[:port][/device]...
+static int parse_source(const char *name, const char *val, gpsd_source_t *src) {
+    bzero(src, sizeof(gpsd_source_t));
+
+    const char *device = strchr(val, '/');
+    const char *end = device ? device : val + strlen(val);
+    const char *host, *host_end, *port;
+
+    if (split_host_port(val, end, &host, &host_end, &port)) {
+        return -EINVAL;
+    }
+
+    src->name = mem_strdup(MEM_CONFIG, name);
+    src->host = mem_strndup(MEM_CONFIG, host, (size_t)(host_end - host));
+    src->port = port ? mem_strndup(MEM_CONFIG, port, (size_t)(end - port)) : NULL;
+    src->device = device ? mem_strdup(MEM_CONFIG, device) : NULL;
+    if (!src->name || !src->host || (port && !src->port) || (device && !src->device)) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// Parses a broker as host[:port]...
+static int parse_broker(const char *name, const char *val, mqtt_broker_t *broker) {
+    bzero(broker, sizeof(mqtt_broker_t));
+
+    const char *end = val + strlen(val);
+    const char *host, *host_end, *port;
+
+    if (split_host_port(val, end, &host, &host_end, &port)) {
+        return -EINVAL;
+    }
+
+    broker->name = mem_strdup(MEM_CONFIG, name);
+    broker->host = mem_strndup(MEM_CONFIG, host, (size_t)(host_end - host));
+    broker->port = port ? (uint16_t) safe_atoi(port) : 0;
+    if (!broker->name || !broker->host) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
 static int init_config(config_t *cfg) {
     cfg->gpsd_host = NULL;
     cfg->gpsd_port = 0;
     cfg->gpsd_device = NULL;
+    cfg->gpsd_io_uring = false;
+    cfg->gpsd_workers = 0;
+    cfg->gpsd_nmea = false;
+    cfg->gpsd_kernel = false;
+    cfg->gpsd_device_idle = 300;
+    cfg->gpsd_osc_window = 60;
+    cfg->gpsd_cn0_window = 0;
+
+    cfg->source_cnt = 0;
+
+    cfg->rt_ingest_cpus = NULL;
+    cfg->rt_ingest_priority = 0;
+    cfg->rt_sink_cpus = NULL;
+    cfg->rt_lock_memory = false;
+
+    cfg->checkpoint_file = NULL;
+    cfg->checkpoint_interval = 60;
+    cfg->checkpoint_max_age = 3600;
+
+    cfg->resolver_ttl = 300;
+
+    cfg->chrony_socket = NULL;
+    cfg->chrony_interval = 10;
 
     cfg->client_id = NULL;
     cfg->mqtt_host = NULL;
     cfg->mqtt_port = 0;
+    cfg->mqtt_stagger = 250;
+    cfg->mqtt_failback = 60;
+    cfg->broker_cnt = 0;
     cfg->qos = 1;
     cfg->retain = false;
+    cfg->format = FORMAT_JSON;
+    cfg->group_id = NULL;
+    cfg->topic = NULL;
 
     cfg->use_auth = false;
     cfg->use_tls = false;
@@ -83,6 +210,15 @@ static int init_config(config_t *cfg) {
     cfg->ciphers = NULL;
     cfg->verify_peer = true;
 
+    cfg->use_http = false;
+    cfg->http_host = NULL;
+    cfg->http_port = NULL;
+    cfg->http_max_clients = 1000;
+    cfg->http_queue_size = 16;
+
+    cfg->derived_cnt = 0;
+    cfg->filter_cnt = 0;
+
     return 0;
 }
 
@@ -93,14 +229,78 @@ void dump_config(const void *config) {
     }
 
     log_debug("Using configuration:");
-    log_debug("- GPSD server: %s:%s", cfg->gpsd_host, cfg->gpsd_port);
-    if (cfg->gpsd_device) {
-        log_debug("  - device: %s", cfg->gpsd_device);
+    for (uint16_t i = 0; i < cfg->source_cnt; i++) {
+        const gpsd_source_t *src = &cfg->sources[i];
+        log_debug("- GPSD source %s: %s:%s", src->name, src->host, src->port);
+        if (src->device) {
+            log_debug("  - device: %s", src->device);
+        }
+    }
+    if (cfg->gpsd_workers) {
+        log_debug("  - using %d worker threads", cfg->gpsd_workers);
+    }
+    if (cfg->gpsd_io_uring) {
+        log_debug("  - using io_uring");
+    }
+    if (cfg->gpsd_nmea) {
+        log_debug("  - watching NMEA sentences");
+    }
+    if (cfg->gpsd_kernel) {
+        log_debug("  - sampling the kernel clock");
+    }
+    if (cfg->gpsd_device_idle) {
+        log_debug("  - reclaiming devices after %d idle seconds", cfg->gpsd_device_idle);
+    }
+    if (cfg->gpsd_osc_window) {
+        log_debug("  - summarizing oscillators every %d seconds", cfg->gpsd_osc_window);
+    }
+    if (cfg->gpsd_cn0_window) {
+        log_debug("  - publishing C/N0 histograms every %d seconds", cfg->gpsd_cn0_window);
+    }
+    if (cfg->rt_ingest_cpus || cfg->rt_ingest_priority || cfg->rt_sink_cpus || cfg->rt_lock_memory) {
+        log_debug("- real-time options:");
+        if (cfg->rt_ingest_cpus) {
+            log_debug("  - ingest CPUs: %s", cfg->rt_ingest_cpus);
+        }
+        if (cfg->rt_ingest_priority) {
+            log_debug("  - ingest priority: SCHED_FIFO %d", cfg->rt_ingest_priority);
+        }
+        if (cfg->rt_sink_cpus) {
+            log_debug("  - sink CPUs: %s", cfg->rt_sink_cpus);
+        }
+        log_debug("  - lock memory: %s", cfg->rt_lock_memory ? "yes" : "no");
+    }
+    if (cfg->checkpoint_file) {
+        log_debug("- checkpoint: %s", cfg->checkpoint_file);
+        log_debug("  - interval: %d s", cfg->checkpoint_interval);
+        log_debug("  - max. age: %u s", cfg->checkpoint_max_age);
+    }
+    if (cfg->resolver_ttl) {
+        log_debug("- cache resolved addresses for: %u s", cfg->resolver_ttl);
+    }
+    if (cfg->chrony_socket) {
+        log_debug("- chrony: %s", cfg->chrony_socket);
+        log_debug("  - interval: %d s", cfg->chrony_interval);
+    }
+    for (uint8_t i = 0; i < cfg->broker_cnt; i++) {
+        const mqtt_broker_t *broker = &cfg->brokers[i];
+        log_debug("- MQTT broker %s: %s:%d", broker->name, broker->host, broker->port);
+    }
+    if (cfg->broker_cnt > 1) {
+        log_debug("  - stagger attempts by: %d ms", cfg->mqtt_stagger);
+        log_debug("  - fail back after: %d s", cfg->mqtt_failback);
     }
-    log_debug("- MQTT server: %s:%d", cfg->mqtt_host, cfg->mqtt_port);
     log_debug("  - client ID: %s", cfg->client_id);
     log_debug("  - MQTT QoS: %d", cfg->qos);
     log_debug("  - retain messages: %s", cfg->retain ? "yes" : "no");
+    log_debug("  - topic: %s", topic_str(cfg->topic));
+    if (cfg->format == FORMAT_SPARKPLUG) {
+        log_debug("  - payload format: Sparkplug B (group ID: %s)", cfg->group_id);
+    } else if (cfg->format == FORMAT_FIELDS) {
+        log_debug("  - payload format: retained topic per field");
+    } else {
+        log_debug("  - payload format: JSON");
+    }
     if (cfg->use_auth) {
         log_debug("  - using client credentials");
     }
@@ -121,6 +321,17 @@ void dump_config(const void *config) {
             log_debug("  - cipher suite: %s", cfg->ciphers);
         }
     }
+    if (cfg->use_http) {
+        log_debug("- HTTP listener: %s:%s", cfg->http_host, cfg->http_port);
+        log_debug("  - max. clients: %d", cfg->http_max_clients);
+        log_debug("  - client queue size: %d", cfg->http_queue_size);
+    }
+    for (uint8_t i = 0; i < cfg->derived_cnt; i++) {
+        log_debug("- derived field %s = %s", cfg->derived_names[i], expr_str(cfg->derived[i]));
+    }
+    for (uint8_t i = 0; i < cfg->filter_cnt; i++) {
+        log_debug("- filter %s: %s", cfg->filter_names[i], expr_str(cfg->filters[i]));
+    }
 }
 
 void *read_config(const char *file, const void *current_config) {
@@ -136,6 +347,7 @@ void *read_config(const char *file, const void *current_config) {
     int done = 0;
     bool error = false;
     char key[64] = {};
+    char expr_error[128] = {};
 
 #define IN_CONTEXT(b) (cblock == (b))
 #define KEY_IN_CONTEXT(n, b) ((strcmp(key, (n)) == 0) && IN_CONTEXT(b))
@@ -144,7 +356,7 @@ void *read_config(const char *file, const void *current_config) {
     do { \
         log_error(__VA_ARGS__); \
         if (event.type != 0) { \
-            log_error("  at line %d, column %d", event.start_mark.line+1, event.start_mark.column+1); \
+            log_error("  at line %zu, column %zu", event.start_mark.line+1, event.start_mark.column+1); \
         } \
         error = true; \
         goto cleanup; \
@@ -169,7 +381,7 @@ void *read_config(const char *file, const void *current_config) {
 
         switch (event.type) {
         case YAML_STREAM_START_EVENT: {
-            cfg = malloc(sizeof(config_t));
+            cfg = mem_malloc(MEM_CONFIG, sizeof(config_t));
             if (cfg == NULL) {
                 PARSE_ERROR("failed to allocate memory for configuration");
             }
@@ -210,6 +422,25 @@ void *read_config(const char *file, const void *current_config) {
                 cblock = GPSD;
             } else if (VALUE_IN_CONTEXT("mqtt", ROOT)) {
                 cblock = MQTT;
+            } else if (VALUE_IN_CONTEXT("http", ROOT)) {
+                cblock = HTTP;
+                cfg->use_http = true;
+            } else if (VALUE_IN_CONTEXT("derived", ROOT)) {
+                cblock = DERIVED;
+            } else if (VALUE_IN_CONTEXT("filter", ROOT)) {
+                cblock = FILTER;
+            } else if (VALUE_IN_CONTEXT("sources", ROOT)) {
+                cblock = SOURCES;
+            } else if (VALUE_IN_CONTEXT("realtime", ROOT)) {
+                cblock = REALTIME;
+            } else if (VALUE_IN_CONTEXT("checkpoint", ROOT)) {
+                cblock = CHECKPOINT;
+            } else if (VALUE_IN_CONTEXT("brokers", ROOT)) {
+                cblock = BROKERS;
+            } else if (VALUE_IN_CONTEXT("resolver", ROOT)) {
+                cblock = RESOLVER;
+            } else if (VALUE_IN_CONTEXT("chrony", ROOT)) {
+                cblock = CHRONY;
             } else if (VALUE_IN_CONTEXT("auth", MQTT)) {
                 cblock = MQTT_AUTH;
             } else if (VALUE_IN_CONTEXT("tls", MQTT)) {
@@ -229,6 +460,82 @@ void *read_config(const char *file, const void *current_config) {
                     cfg->gpsd_port = safe_strdup(val);
                 } else if (KEY_IN_CONTEXT("device", GPSD)) {
                     cfg->gpsd_device = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("io_uring", GPSD)) {
+                    cfg->gpsd_io_uring = safe_atob(val);
+                } else if (KEY_IN_CONTEXT("workers", GPSD)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > MAX_WORKERS) {
+                        PARSE_ERROR("invalid number of workers: %s. Use a value between 0 and %d!", val, MAX_WORKERS);
+                    }
+                    cfg->gpsd_workers = (uint8_t) n;
+                } else if (KEY_IN_CONTEXT("nmea", GPSD)) {
+                    cfg->gpsd_nmea = safe_atob(val);
+                } else if (KEY_IN_CONTEXT("kernel", GPSD)) {
+                    cfg->gpsd_kernel = safe_atob(val);
+                } else if (KEY_IN_CONTEXT("device_idle", GPSD)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 86400) {
+                        PARSE_ERROR("invalid device idle time: %s. Use a value between 0 and 86400 seconds!", val);
+                    }
+                    cfg->gpsd_device_idle = (uint32_t) n;
+                } else if (KEY_IN_CONTEXT("osc_window", GPSD)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 86400) {
+                        PARSE_ERROR("invalid oscillator window: %s. Use a value between 0 and 86400 seconds!", val);
+                    }
+                    cfg->gpsd_osc_window = (uint32_t) n;
+                } else if (KEY_IN_CONTEXT("cn0_window", GPSD)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 3600) {
+                        PARSE_ERROR("invalid C/N0 window: %s. Use a value between 0 and 3600 seconds!", val);
+                    }
+                    cfg->gpsd_cn0_window = (uint16_t) n;
+                } else if (KEY_IN_CONTEXT("ingest_cpus", REALTIME)) {
+                    if (rt_check_cpus(val)) {
+                        PARSE_ERROR("invalid list of ingest CPUs: %s. Use a list like 0,2-3 as value!", val);
+                    }
+                    cfg->rt_ingest_cpus = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("ingest_priority", REALTIME)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 99) {
+                        PARSE_ERROR("invalid ingest priority: %s. Use a value between 0 and 99!", val);
+                    }
+                    cfg->rt_ingest_priority = (uint8_t) n;
+                } else if (KEY_IN_CONTEXT("sink_cpus", REALTIME)) {
+                    if (rt_check_cpus(val)) {
+                        PARSE_ERROR("invalid list of sink CPUs: %s. Use a list like 0,2-3 as value!", val);
+                    }
+                    cfg->rt_sink_cpus = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("lock_memory", REALTIME)) {
+                    cfg->rt_lock_memory = safe_atob(val);
+                } else if (KEY_IN_CONTEXT("file", CHECKPOINT)) {
+                    cfg->checkpoint_file = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("interval", CHECKPOINT)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 1 || n > 3600) {
+                        PARSE_ERROR("invalid checkpoint interval: %s. Use a value between 1 and 3600!", val);
+                    }
+                    cfg->checkpoint_interval = (uint16_t) n;
+                } else if (KEY_IN_CONTEXT("max_age", CHECKPOINT)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0) {
+                        PARSE_ERROR("invalid maximum checkpoint age: %s. Use a value of 0 or more!", val);
+                    }
+                    cfg->checkpoint_max_age = (uint32_t) n;
+                } else if (KEY_IN_CONTEXT("ttl", RESOLVER)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 86400) {
+                        PARSE_ERROR("invalid resolver TTL: %s. Use a value between 0 and 86400!", val);
+                    }
+                    cfg->resolver_ttl = (uint32_t) n;
+                } else if (KEY_IN_CONTEXT("socket", CHRONY)) {
+                    cfg->chrony_socket = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("interval", CHRONY)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 1 || n > 3600) {
+                        PARSE_ERROR("invalid chrony poll interval: %s. Use a value between 1 and 3600!", val);
+                    }
+                    cfg->chrony_interval = (uint16_t) n;
                 } else if (KEY_IN_CONTEXT("client_id", MQTT)) {
                     cfg->client_id = safe_strdup(val);
                 } else if (KEY_IN_CONTEXT("host", MQTT)) {
@@ -239,6 +546,18 @@ void *read_config(const char *file, const void *current_config) {
                         PARSE_ERROR("invalid MQTT server port: %s. Use a port between 1 and 65535!", val);
                     }
                     cfg->mqtt_port = (uint16_t) n;
+                } else if (KEY_IN_CONTEXT("stagger", MQTT)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 10 || n > 2000) {
+                        PARSE_ERROR("invalid stagger delay: %s. Use a value between 10 and 2000!", val);
+                    }
+                    cfg->mqtt_stagger = (uint16_t) n;
+                } else if (KEY_IN_CONTEXT("failback", MQTT)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 0 || n > 3600) {
+                        PARSE_ERROR("invalid failback interval: %s. Use a value between 0 and 3600!", val);
+                    }
+                    cfg->mqtt_failback = (uint16_t) n;
                 } else if (KEY_IN_CONTEXT("qos", MQTT)) {
                     int32_t n = safe_atoi(val);
                     if (n < 0 || n > 2) {
@@ -247,6 +566,24 @@ void *read_config(const char *file, const void *current_config) {
                     cfg->qos = (uint8_t) n;
                 } else if (KEY_IN_CONTEXT("retain", MQTT)) {
                     cfg->retain = safe_atob(val);
+                } else if (KEY_IN_CONTEXT("format", MQTT)) {
+                    if (strcasecmp(val, "json") == 0) {
+                        cfg->format = FORMAT_JSON;
+                    } else if (strcasecmp(val, "sparkplug") == 0) {
+                        cfg->format = FORMAT_SPARKPLUG;
+                    } else if (strcasecmp(val, "fields") == 0) {
+                        cfg->format = FORMAT_FIELDS;
+                    } else {
+                        PARSE_ERROR("invalid payload format: %s. Use json, sparkplug or fields as value!", val);
+                    }
+                } else if (KEY_IN_CONTEXT("topic", MQTT)) {
+                    topic_free(cfg->topic);
+                    cfg->topic = topic_parse(val);
+                    if (!cfg->topic) {
+                        PARSE_ERROR("invalid topic template: %s", val);
+                    }
+                } else if (KEY_IN_CONTEXT("group_id", MQTT)) {
+                    cfg->group_id = safe_strdup(val);
                 } else if (KEY_IN_CONTEXT("username", MQTT_AUTH)) {
                     cfg->username = safe_strdup(val);
                     cfg->use_auth = true;
@@ -274,6 +611,79 @@ void *read_config(const char *file, const void *current_config) {
                 } else if (KEY_IN_CONTEXT("ciphers", MQTT_TLS)) {
                     cfg->ciphers = safe_strdup(val);
                     cfg->use_tls = true;
+                } else if (KEY_IN_CONTEXT("listen", HTTP)) {
+                    cfg->http_host = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("port", HTTP)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 1 || n > 65535) {
+                        PARSE_ERROR("invalid HTTP port: %s. Use a port between 1 and 65535!", val);
+                    }
+                    cfg->http_port = safe_strdup(val);
+                } else if (KEY_IN_CONTEXT("max_clients", HTTP)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 1 || n > 65535) {
+                        PARSE_ERROR("invalid maximum number of HTTP clients: %s. Use a value between 1 and 65535!", val);
+                    }
+                    cfg->http_max_clients = (uint16_t) n;
+                } else if (KEY_IN_CONTEXT("queue_size", HTTP)) {
+                    int32_t n = safe_atoi(val);
+                    if (n < 1 || n > 1024) {
+                        PARSE_ERROR("invalid HTTP client queue size: %s. Use a value between 1 and 1024!", val);
+                    }
+                    cfg->http_queue_size = (uint16_t) n;
+                } else if (IN_CONTEXT(DERIVED)) {
+                    // any key denotes the name of a derived field...
+                    if (cfg->derived_cnt >= MAX_DERIVED) {
+                        PARSE_ERROR("too many derived fields: %s. Use at most %d derived fields!", key, MAX_DERIVED);
+                    }
+                    expr_t *expr = expr_compile(val, expr_error, sizeof(expr_error));
+                    if (!expr) {
+                        PARSE_ERROR("invalid expression for derived field %s: %s", key, expr_error);
+                    }
+                    cfg->derived[cfg->derived_cnt] = expr;
+                    cfg->derived_names[cfg->derived_cnt++] = mem_strdup(MEM_CONFIG, key);
+                    if (!cfg->derived_names[cfg->derived_cnt - 1]) {
+                        PARSE_ERROR("failed to allocate memory for derived field");
+                    }
+                } else if (IN_CONTEXT(FILTER)) {
+                    // any key denotes the name of a filter...
+                    if (cfg->filter_cnt >= MAX_FILTERS) {
+                        PARSE_ERROR("too many filters: %s. Use at most %d filters!", key, MAX_FILTERS);
+                    }
+                    expr_t *expr = expr_compile(val, expr_error, sizeof(expr_error));
+                    if (!expr) {
+                        PARSE_ERROR("invalid expression for filter %s: %s", key, expr_error);
+                    }
+                    cfg->filters[cfg->filter_cnt] = expr;
+                    cfg->filter_names[cfg->filter_cnt++] = mem_strdup(MEM_CONFIG, key);
+                    if (!cfg->filter_names[cfg->filter_cnt - 1]) {
+                        PARSE_ERROR("failed to allocate memory for filter");
+                    }
+                } else if (IN_CONTEXT(SOURCES)) {
+                    // any key denotes the name of a source...
+                    if (cfg->source_cnt >= MAX_SOURCES) {
+                        PARSE_ERROR("too many sources: %s. Use at most %d sources!", key, MAX_SOURCES);
+                    }
+                    if (strlen(key) >= GPS_SOURCE_SIZE) {
+                        PARSE_ERROR("invalid source name: %s. Use at most %d characters!", key, GPS_SOURCE_SIZE - 1);
+                    }
+                    int status = parse_source(key, val, &cfg->sources[cfg->source_cnt++]);
+                    if (status == -ENOMEM) {
+                        PARSE_ERROR("failed to allocate memory for source");
+                    } else if (status) {
+                        PARSE_ERROR("invalid source %s: %s. Use host[:port][/device] as value!", key, val);
+                    }
+                } else if (IN_CONTEXT(BROKERS)) {
+                    // any key denotes the name of a broker...
+                    if (cfg->broker_cnt >= MAX_BROKERS) {
+                        PARSE_ERROR("too many brokers: %s. Use at most %d brokers!", key, MAX_BROKERS);
+                    }
+                    int status = parse_broker(key, val, &cfg->brokers[cfg->broker_cnt++]);
+                    if (status == -ENOMEM) {
+                        PARSE_ERROR("failed to allocate memory for broker");
+                    } else if (status) {
+                        PARSE_ERROR("invalid broker %s: %s. Use host[:port] as value!", key, val);
+                    }
                 } else {
                     PARSE_ERROR("unexpected key/value %s => %s", key, val);
                 }
@@ -292,20 +702,75 @@ void *read_config(const char *file, const void *current_config) {
     } while (!done);
 
     if (!cfg->client_id) {
-        cfg->client_id = strdup("gpsstats");
+        cfg->client_id = mem_strdup(MEM_CONFIG, "gpsstats");
     }
     if (!cfg->gpsd_host) {
-        cfg->gpsd_host = strdup("localhost");
+        cfg->gpsd_host = mem_strdup(MEM_CONFIG, "localhost");
     }
     if (!cfg->gpsd_port) {
-        cfg->gpsd_port = strdup("2947");
+        cfg->gpsd_port = mem_strdup(MEM_CONFIG, "2947");
+    }
+    if (cfg->source_cnt == 0) {
+        // Use the GPSD server as only source, named after its host...
+        cfg->sources[cfg->source_cnt++] = (gpsd_source_t) {
+            .name = mem_strndup(MEM_CONFIG, cfg->gpsd_host, GPS_SOURCE_SIZE - 1),
+            .host = mem_strdup(MEM_CONFIG, cfg->gpsd_host),
+            .device = safe_strdup(cfg->gpsd_device),
+        };
+    }
+    for (uint16_t i = 0; i < cfg->source_cnt; i++) {
+        cfg->sources[i].index = i;
+        cfg->sources[i].nmea = cfg->gpsd_nmea;
+        cfg->sources[i].kernel = cfg->gpsd_kernel;
+        cfg->sources[i].chrony = (cfg->chrony_socket != NULL);
+        cfg->sources[i].osc_window = cfg->gpsd_osc_window;
+        cfg->sources[i].cn0_window = cfg->gpsd_cn0_window;
+        cfg->sources[i].device_idle = cfg->gpsd_device_idle;
+        if (!cfg->sources[i].port) {
+            cfg->sources[i].port = mem_strdup(MEM_CONFIG, cfg->gpsd_port);
+        }
+        if (!cfg->sources[i].name || !cfg->sources[i].host || !cfg->sources[i].port) {
+            PARSE_ERROR("failed to allocate memory for source");
+        }
     }
     if (!cfg->mqtt_host) {
-        cfg->mqtt_host = strdup("localhost");
+        cfg->mqtt_host = mem_strdup(MEM_CONFIG, "localhost");
     }
     if (!cfg->mqtt_port) {
         cfg->mqtt_port = (cfg->use_tls) ? 8883 : 1883;
     }
+    if (cfg->broker_cnt == 0) {
+        // Use the MQTT server as only broker...
+        cfg->brokers[cfg->broker_cnt++] = (mqtt_broker_t) {
+            .name = mem_strdup(MEM_CONFIG, "mqtt"),
+            .host = mem_strdup(MEM_CONFIG, cfg->mqtt_host),
+        };
+    }
+    for (uint8_t i = 0; i < cfg->broker_cnt; i++) {
+        if (!cfg->brokers[i].port) {
+            cfg->brokers[i].port = cfg->mqtt_port;
+        }
+        if (!cfg->brokers[i].name || !cfg->brokers[i].host) {
+            PARSE_ERROR("failed to allocate memory for broker");
+        }
+    }
+    if (!cfg->group_id) {
+        cfg->group_id = mem_strdup(MEM_CONFIG, "gpsstats");
+    }
+    if (!cfg->topic) {
+        cfg->topic = topic_parse((cfg->format == FORMAT_FIELDS) ? "gpsstats/{device}" : "gpsstats");
+        if (!cfg->topic) {
+            PARSE_ERROR("failed to allocate memory for topic template");
+        }
+    }
+    if (cfg->use_http) {
+        if (!cfg->http_host) {
+            cfg->http_host = mem_strdup(MEM_CONFIG, "localhost");
+        }
+        if (!cfg->http_port) {
+            cfg->http_port = mem_strdup(MEM_CONFIG, "8080");
+        }
+    }
 
     // Do some additional validations...
     if (cfg->use_auth) {
@@ -316,7 +781,7 @@ void *read_config(const char *file, const void *current_config) {
 
     if (cfg->use_tls) {
         if (!cfg->tls_version) {
-            cfg->tls_version = strdup("tlsv1.2");
+            cfg->tls_version = mem_strdup(MEM_CONFIG, "tlsv1.2");
         }
 
         if (!cfg->cacertpath && !cfg->cacertfile) {
@@ -329,8 +794,10 @@ void *read_config(const char *file, const void *current_config) {
         if (!cfg->verify_peer) {
             log_warning("insecure TLS operation used: verify_peer = false! Potential MITM vulnerability!");
         }
-        if (cfg->mqtt_port == 1883) {
-            log_warning("connecting to non-TLS port of MQTT while TLS settings were configured!");
+        for (uint8_t i = 0; i < cfg->broker_cnt; i++) {
+            if (cfg->brokers[i].port == 1883) {
+                log_warning("connecting to non-TLS port of MQTT broker %s while TLS settings were configured!", cfg->brokers[i].name);
+            }
         }
     }
 
@@ -357,22 +824,53 @@ void free_config(void *config) {
 
     config_t *cfg = config;
 
-    free(cfg->gpsd_host);
-    free(cfg->gpsd_port);
-    free(cfg->gpsd_device);
+    mem_free(MEM_CONFIG, cfg->gpsd_host);
+    mem_free(MEM_CONFIG, cfg->gpsd_port);
+    mem_free(MEM_CONFIG, cfg->gpsd_device);
+
+    for (uint16_t i = 0; i < cfg->source_cnt; i++) {
+        mem_free(MEM_CONFIG, cfg->sources[i].name);
+        mem_free(MEM_CONFIG, cfg->sources[i].host);
+        mem_free(MEM_CONFIG, cfg->sources[i].port);
+        mem_free(MEM_CONFIG, cfg->sources[i].device);
+    }
+
+    mem_free(MEM_CONFIG, cfg->rt_ingest_cpus);
+    mem_free(MEM_CONFIG, cfg->rt_sink_cpus);
+
+    mem_free(MEM_CONFIG, cfg->checkpoint_file);
+    mem_free(MEM_CONFIG, cfg->chrony_socket);
+
+    mem_free(MEM_CONFIG, cfg->client_id);
+    mem_free(MEM_CONFIG, cfg->mqtt_host);
+    for (uint8_t i = 0; i < cfg->broker_cnt; i++) {
+        mem_free(MEM_CONFIG, cfg->brokers[i].name);
+        mem_free(MEM_CONFIG, cfg->brokers[i].host);
+    }
+    mem_free(MEM_CONFIG, cfg->group_id);
+    topic_free(cfg->topic);
+
+    mem_free(MEM_CONFIG, cfg->username);
+    mem_free(MEM_CONFIG, cfg->password);
 
-    free(cfg->client_id);
-    free(cfg->mqtt_host);
+    mem_free(MEM_CONFIG, cfg->cacertfile);
+    mem_free(MEM_CONFIG, cfg->cacertpath);
+    mem_free(MEM_CONFIG, cfg->certfile);
+    mem_free(MEM_CONFIG, cfg->keyfile);
+    mem_free(MEM_CONFIG, cfg->tls_version);
+    mem_free(MEM_CONFIG, cfg->ciphers);
 
-    free(cfg->username);
-    free(cfg->password);
+    mem_free(MEM_CONFIG, cfg->http_host);
+    mem_free(MEM_CONFIG, cfg->http_port);
 
-    free(cfg->cacertfile);
-    free(cfg->cacertpath);
-    free(cfg->certfile);
-    free(cfg->keyfile);
-    free(cfg->tls_version);
-    free(cfg->ciphers);
+    for (uint8_t i = 0; i < cfg->derived_cnt; i++) {
+        mem_free(MEM_CONFIG, cfg->derived_names[i]);
+        expr_free(cfg->derived[i]);
+    }
+    for (uint8_t i = 0; i < cfg->filter_cnt; i++) {
+        mem_free(MEM_CONFIG, cfg->filter_names[i]);
+        expr_free(cfg->filters[i]);
+    }
 
-    free(cfg);
+    mem_free(MEM_CONFIG, cfg);
 }
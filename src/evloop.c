@@ -0,0 +1,242 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "log.h"
+#include "mem.h"
+
+#define MAX_EPOLL_EVENTS 64
+#define MIN_HANDLERS 16
+
+typedef struct ev_handler {
+    struct ev_handler *next_released;
+
+    int fd;
+    evloop_callback_t callback;
+    void *context;
+} ev_handler_t;
+
+struct evloop {
+    int epoll_fd;
+
+    // handlers are looked up by their file descriptor...
+    ev_handler_t **handlers;
+    int handlers_size;
+
+    // handlers removed while dispatching, freed once dispatching is done...
+    ev_handler_t *released;
+    bool dispatching;
+
+    uint32_t evloop_fds;
+    uint32_t evloop_wakeups;
+    uint64_t evloop_events;
+};
+
+static int ensure_capacity(evloop_t *loop, int fd) {
+    if (fd < loop->handlers_size) {
+        return 0;
+    }
+
+    int size = loop->handlers_size ? loop->handlers_size : MIN_HANDLERS;
+    while (size <= fd) {
+        size *= 2;
+    }
+
+    ev_handler_t **handlers = mem_realloc(MEM_QUEUES, loop->handlers, (size_t) size * sizeof(ev_handler_t *));
+    if (handlers == NULL) {
+        return -ENOMEM;
+    }
+    bzero(handlers + loop->handlers_size, (size_t)(size - loop->handlers_size) * sizeof(ev_handler_t *));
+
+    loop->handlers = handlers;
+    loop->handlers_size = size;
+
+    return 0;
+}
+
+evloop_t *evloop_init(void) {
+    evloop_t *loop = mem_malloc(MEM_QUEUES, sizeof(evloop_t));
+    if (loop == NULL) {
+        log_error("failed to create event loop: out of memory!");
+        return NULL;
+    }
+    bzero(loop, sizeof(evloop_t));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        log_error("failed to create epoll instance: %s", strerror(errno));
+        mem_free(MEM_QUEUES, loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void evloop_destroy(evloop_t *loop) {
+    if (loop) {
+        for (int fd = 0; fd < loop->handlers_size; fd++) {
+            mem_free(MEM_QUEUES, loop->handlers[fd]);
+        }
+        mem_free(MEM_QUEUES, loop->handlers);
+
+        close(loop->epoll_fd);
+
+        mem_free(MEM_QUEUES, loop);
+    }
+}
+
+int evloop_fd(evloop_t *loop) {
+    if (loop == NULL) {
+        return -EINVAL;
+    }
+    return loop->epoll_fd;
+}
+
+int evloop_add(evloop_t *loop, int fd, uint32_t events, evloop_callback_t callback, void *context) {
+    if (loop == NULL || fd < 0 || callback == NULL) {
+        return -EINVAL;
+    }
+    if (ensure_capacity(loop, fd)) {
+        log_warning("failed to register fd %d: out of memory!", fd);
+        return -ENOMEM;
+    }
+    if (loop->handlers[fd]) {
+        return -EEXIST;
+    }
+
+    ev_handler_t *handler = mem_malloc(MEM_QUEUES, sizeof(ev_handler_t));
+    if (handler == NULL) {
+        log_warning("failed to register fd %d: out of memory!", fd);
+        return -ENOMEM;
+    }
+    bzero(handler, sizeof(ev_handler_t));
+
+    handler->fd = fd;
+    handler->callback = callback;
+    handler->context = context;
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = handler,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        int err = errno;
+        log_warning("failed to register fd %d: %s", fd, strerror(err));
+        mem_free(MEM_QUEUES, handler);
+        return -err;
+    }
+
+    loop->handlers[fd] = handler;
+    loop->evloop_fds++;
+
+    return 0;
+}
+
+int evloop_modify(evloop_t *loop, int fd, uint32_t events) {
+    if (loop == NULL || fd < 0 || fd >= loop->handlers_size || !loop->handlers[fd]) {
+        return -EINVAL;
+    }
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = loop->handlers[fd],
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int evloop_remove(evloop_t *loop, int fd) {
+    if (loop == NULL || fd < 0 || fd >= loop->handlers_size || !loop->handlers[fd]) {
+        return -EINVAL;
+    }
+
+    ev_handler_t *handler = loop->handlers[fd];
+
+    // Best effort: the fd might already be closed...
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    loop->handlers[fd] = NULL;
+    loop->evloop_fds--;
+
+    if (loop->dispatching) {
+        // events of this batch can still refer to this handler...
+        handler->callback = NULL;
+        handler->next_released = loop->released;
+        loop->released = handler;
+    } else {
+        mem_free(MEM_QUEUES, handler);
+    }
+
+    return 0;
+}
+
+int evloop_dispatch(evloop_t *loop, int timeout) {
+    if (loop == NULL) {
+        return -EINVAL;
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        log_warning("Failed to wait for events: %s", strerror(errno));
+        return -EIO;
+    }
+
+    // Update stats...
+    loop->evloop_wakeups++;
+    loop->evloop_events += (uint64_t) n;
+
+    loop->dispatching = true;
+
+    for (int i = 0; i < n; i++) {
+        ev_handler_t *handler = events[i].data.ptr;
+
+        if (handler->callback) {
+            handler->callback(loop, handler->fd, events[i].events, handler->context);
+        }
+    }
+
+    loop->dispatching = false;
+
+    while (loop->released) {
+        ev_handler_t *handler = loop->released;
+        loop->released = handler->next_released;
+        mem_free(MEM_QUEUES, handler);
+    }
+
+    return n;
+}
+
+evloop_stats_t evloop_dump_stats(evloop_t *loop) {
+    if (loop == NULL) {
+        return (evloop_stats_t) {
+            0
+        };
+    }
+
+    return (evloop_stats_t) {
+        .fds = loop->evloop_fds,
+        .wakeups = loop->evloop_wakeups,
+        .events = loop->evloop_events,
+    };
+}
+
+// EOF
@@ -0,0 +1,760 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "gpsd.h"
+#include "mem.h"
+
+#define MAX_STACK 32
+#define MAX_CODE 256
+#define MAX_CONSTS 64
+// aggregates are evaluated for all satellites at once, one column per stack entry...
+#define MAX_AGG_STACK 8
+
+typedef enum opcode {
+    OP_CONST = 0,
+    OP_FIELD,
+    OP_SAT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_NEG,
+    OP_NOT,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_AGG, // arg = kind | (length of its body << AGG_SHIFT)
+} opcode_t;
+
+#define AGG_SHIFT 3
+#define AGG_KIND_MASK ((1 << AGG_SHIFT) - 1)
+
+typedef enum agg_kind {
+    AGG_COUNT = 0,
+    AGG_SUM,
+    AGG_AVG,
+    AGG_MIN,
+    AGG_MAX,
+} agg_kind_t;
+
+typedef enum event_field {
+    E_TIME = 0,
+    E_SATS_USED,
+    E_SATS_VISIBLE,
+    E_TDOP,
+    E_AVG_SNR,
+    E_QERR,
+    E_TOFF,
+    E_PPS,
+    E_PPS_CORRECTED,
+    E_OSC_RUNNING,
+    E_OSC_PPS,
+    E_OSC_GPS,
+    E_OSC_DELTA,
+    E_KERNEL_OFFSET,
+    E_KERNEL_FREQ,
+    E_KERNEL_MAXERROR,
+    E_KERNEL_ESTERROR,
+    E_KERNEL_STATUS,
+    E_CHRONY_OFFSET,
+    E_CHRONY_SD,
+    E_CHRONY_DIFF,
+    E_CHRONY_STRATUM,
+    E_SATS, // first of GNSSID_CNT fields
+} event_field_t;
+
+typedef enum sat_field {
+    S_SS = 0,
+    S_USED,
+    S_ELEVATION,
+    S_AZIMUTH,
+    S_GNSSID,
+    S_SVID,
+} sat_field_t;
+
+typedef struct insn {
+    uint8_t op;
+    uint16_t arg;
+} insn_t;
+
+struct expr {
+    char *src;
+    uint16_t len;
+    insn_t code[MAX_CODE];
+    double consts[MAX_CONSTS];
+};
+
+typedef struct name_def {
+    const char *name;
+    int id;
+} name_def_t;
+
+static const name_def_t event_fields[] = {
+    { "time", E_TIME },
+    { "sats_used", E_SATS_USED },
+    { "sats_visible", E_SATS_VISIBLE },
+    { "tdop", E_TDOP },
+    { "avg_snr", E_AVG_SNR },
+    { "qErr", E_QERR },
+    { "toff", E_TOFF },
+    { "pps", E_PPS },
+    { "pps_corrected", E_PPS_CORRECTED },
+    { "osc.running", E_OSC_RUNNING },
+    { "osc.pps", E_OSC_PPS },
+    { "osc.gps", E_OSC_GPS },
+    { "osc.delta", E_OSC_DELTA },
+    { "kernel.offset", E_KERNEL_OFFSET },
+    { "kernel.freq", E_KERNEL_FREQ },
+    { "kernel.maxerror", E_KERNEL_MAXERROR },
+    { "kernel.esterror", E_KERNEL_ESTERROR },
+    { "kernel.status", E_KERNEL_STATUS },
+    { "chrony.offset", E_CHRONY_OFFSET },
+    { "chrony.sd", E_CHRONY_SD },
+    { "chrony.diff", E_CHRONY_DIFF },
+    { "chrony.stratum", E_CHRONY_STRATUM },
+    { "sats.gps", E_SATS + GNSSID_GPS },
+    { "sats.sbas", E_SATS + GNSSID_SBAS },
+    { "sats.galileo", E_SATS + GNSSID_GAL },
+    { "sats.beidou", E_SATS + GNSSID_BD },
+    { "sats.imes", E_SATS + GNSSID_IMES },
+    { "sats.qzss", E_SATS + GNSSID_QZSS },
+    { "sats.glonass", E_SATS + GNSSID_GLO },
+    { "sats.irnss", E_SATS + GNSSID_IRNSS },
+    { NULL, 0 },
+};
+
+static const name_def_t sat_fields[] = {
+    { "ss", S_SS },
+    { "used", S_USED },
+    { "elevation", S_ELEVATION },
+    { "azimuth", S_AZIMUTH },
+    { "gnssid", S_GNSSID },
+    { "svid", S_SVID },
+    { NULL, 0 },
+};
+
+static const name_def_t constants[] = {
+    { "GPS", GNSSID_GPS },
+    { "SBAS", GNSSID_SBAS },
+    { "GALILEO", GNSSID_GAL },
+    { "BEIDOU", GNSSID_BD },
+    { "IMES", GNSSID_IMES },
+    { "QZSS", GNSSID_QZSS },
+    { "GLONASS", GNSSID_GLO },
+    { "IRNSS", GNSSID_IRNSS },
+    { "true", 1 },
+    { "false", 0 },
+    { NULL, 0 },
+};
+
+static const name_def_t aggregates[] = {
+    { "count", AGG_COUNT },
+    { "sum", AGG_SUM },
+    { "avg", AGG_AVG },
+    { "min", AGG_MIN },
+    { "max", AGG_MAX },
+    { NULL, 0 },
+};
+
+/* Compiler */
+
+typedef struct parser {
+    const char *p;
+    expr_t *expr;
+    uint16_t nconsts;
+    int depth;      // current stack depth
+    int agg_base;   // stack depth at the start of the current aggregate
+    bool in_agg;    // whether satellite fields can be used
+    bool failed;
+    char *error;
+    size_t error_size;
+} parser_t;
+
+static void parse_error(parser_t *ps, const char *fmt, ...) {
+    if (ps->failed) {
+        return;
+    }
+    ps->failed = true;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(ps->error, ps->error_size, fmt, args);
+    va_end(args);
+}
+
+static void emit(parser_t *ps, opcode_t op, uint16_t arg, int stack_effect) {
+    if (ps->expr->len >= MAX_CODE) {
+        parse_error(ps, "expression too complex");
+        return;
+    }
+    ps->expr->code[ps->expr->len++] = (insn_t) {
+        (uint8_t) op, arg
+    };
+
+    ps->depth += stack_effect;
+    if (ps->depth > MAX_STACK) {
+        parse_error(ps, "expression nested too deeply");
+    } else if (ps->in_agg && ps->depth - ps->agg_base > MAX_AGG_STACK) {
+        parse_error(ps, "aggregate nested too deeply");
+    }
+}
+
+static void emit_const(parser_t *ps, double value) {
+    if (ps->nconsts >= MAX_CONSTS) {
+        parse_error(ps, "too many constants");
+        return;
+    }
+    ps->expr->consts[ps->nconsts] = value;
+    emit(ps, OP_CONST, ps->nconsts++, +1);
+}
+
+static const char *where(const parser_t *ps) {
+    return *ps->p ? ps->p : "end of expression";
+}
+
+static void skip_ws(parser_t *ps) {
+    while (isspace((unsigned char) *ps->p)) {
+        ps->p++;
+    }
+}
+
+static bool accept(parser_t *ps, const char *token) {
+    skip_ws(ps);
+    size_t n = strlen(token);
+    if (strncmp(ps->p, token, n) == 0) {
+        ps->p += n;
+        return true;
+    }
+    return false;
+}
+
+static int lookup(const name_def_t *defs, const char *name, size_t len) {
+    for (; defs->name; defs++) {
+        if (strlen(defs->name) == len && strncmp(defs->name, name, len) == 0) {
+            return defs->id;
+        }
+    }
+    return -1;
+}
+
+static void parse_expr(parser_t *ps);
+
+static void parse_primary(parser_t *ps) {
+    skip_ws(ps);
+
+    if (accept(ps, "(")) {
+        parse_expr(ps);
+        if (!accept(ps, ")")) {
+            parse_error(ps, "expected ')' at: %s", where(ps));
+        }
+        return;
+    }
+
+    if (isdigit((unsigned char) *ps->p) || *ps->p == '.') {
+        char *end;
+        double value = strtod(ps->p, &end);
+        if (end == ps->p) {
+            parse_error(ps, "invalid number at: %s", where(ps));
+            return;
+        }
+        ps->p = end;
+        emit_const(ps, value);
+        return;
+    }
+
+    if (!isalpha((unsigned char) *ps->p) && *ps->p != '_') {
+        parse_error(ps, "unexpected input at: %s", where(ps));
+        return;
+    }
+
+    const char *name = ps->p;
+    while (isalnum((unsigned char) *ps->p) || *ps->p == '_' || *ps->p == '.') {
+        ps->p++;
+    }
+    size_t len = (size_t)(ps->p - name);
+    int id;
+
+    if (accept(ps, "(")) {
+        id = lookup(aggregates, name, len);
+        if (id < 0) {
+            parse_error(ps, "unknown function: %.*s", (int) len, name);
+            return;
+        }
+        if (ps->in_agg) {
+            parse_error(ps, "aggregates cannot be nested: %.*s", (int) len, name);
+            return;
+        }
+
+        uint16_t start = ps->expr->len;
+        emit(ps, OP_AGG, 0, 0);
+
+        ps->in_agg = true;
+        ps->agg_base = ps->depth;
+        parse_expr(ps);
+        ps->in_agg = false;
+
+        // the body leaves one value on the stack of the aggregate, which is
+        // replaced by the aggregated result on our stack, so its net effect is +1...
+        if (!ps->failed) {
+            uint16_t body_len = (uint16_t)(ps->expr->len - start - 1);
+            ps->expr->code[start].arg = (uint16_t)(id | (body_len << AGG_SHIFT));
+        }
+
+        if (!accept(ps, ")")) {
+            parse_error(ps, "expected ')' at: %s", where(ps));
+        }
+    } else if ((id = lookup(event_fields, name, len)) >= 0) {
+        emit(ps, OP_FIELD, (uint16_t) id, +1);
+    } else if ((id = lookup(sat_fields, name, len)) >= 0) {
+        if (!ps->in_agg) {
+            parse_error(ps, "satellite field %.*s can only be used in aggregates", (int) len, name);
+            return;
+        }
+        emit(ps, OP_SAT, (uint16_t) id, +1);
+    } else if ((id = lookup(constants, name, len)) >= 0) {
+        emit_const(ps, id);
+    } else {
+        parse_error(ps, "unknown field: %.*s", (int) len, name);
+    }
+}
+
+static void parse_unary(parser_t *ps) {
+    if (accept(ps, "-")) {
+        parse_unary(ps);
+        emit(ps, OP_NEG, 0, 0);
+    } else if (accept(ps, "!")) {
+        if (*ps->p == '=') {
+            parse_error(ps, "unexpected input at: %s", where(ps));
+            return;
+        }
+        parse_unary(ps);
+        emit(ps, OP_NOT, 0, 0);
+    } else {
+        parse_primary(ps);
+    }
+}
+
+static void parse_mul(parser_t *ps) {
+    parse_unary(ps);
+    while (!ps->failed) {
+        opcode_t op;
+        if (accept(ps, "*")) {
+            op = OP_MUL;
+        } else if (accept(ps, "/")) {
+            op = OP_DIV;
+        } else if (accept(ps, "%")) {
+            op = OP_MOD;
+        } else {
+            break;
+        }
+        parse_unary(ps);
+        emit(ps, op, 0, -1);
+    }
+}
+
+static void parse_add(parser_t *ps) {
+    parse_mul(ps);
+    while (!ps->failed) {
+        opcode_t op;
+        if (accept(ps, "+")) {
+            op = OP_ADD;
+        } else if (accept(ps, "-")) {
+            op = OP_SUB;
+        } else {
+            break;
+        }
+        parse_mul(ps);
+        emit(ps, op, 0, -1);
+    }
+}
+
+static void parse_cmp(parser_t *ps) {
+    parse_add(ps);
+
+    opcode_t op;
+    // order matters: match the two-character operators first...
+    if (accept(ps, "<=")) {
+        op = OP_LE;
+    } else if (accept(ps, ">=")) {
+        op = OP_GE;
+    } else if (accept(ps, "==")) {
+        op = OP_EQ;
+    } else if (accept(ps, "!=")) {
+        op = OP_NE;
+    } else if (accept(ps, "<")) {
+        op = OP_LT;
+    } else if (accept(ps, ">")) {
+        op = OP_GT;
+    } else {
+        return;
+    }
+    parse_add(ps);
+    emit(ps, op, 0, -1);
+}
+
+static void parse_and(parser_t *ps) {
+    parse_cmp(ps);
+    while (!ps->failed && accept(ps, "&&")) {
+        parse_cmp(ps);
+        emit(ps, OP_AND, 0, -1);
+    }
+}
+
+static void parse_expr(parser_t *ps) {
+    parse_and(ps);
+    while (!ps->failed && accept(ps, "||")) {
+        parse_and(ps);
+        emit(ps, OP_OR, 0, -1);
+    }
+}
+
+expr_t *expr_compile(const char *src, char *error, size_t error_size) {
+    expr_t *expr = mem_malloc(MEM_CONFIG, sizeof(expr_t));
+    if (!expr) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    expr->len = 0;
+    expr->src = mem_strdup(MEM_CONFIG, src);
+
+    parser_t ps = {
+        .p = src,
+        .expr = expr,
+        .error = error,
+        .error_size = error_size,
+    };
+
+    if (!expr->src) {
+        parse_error(&ps, "out of memory");
+    }
+
+    parse_expr(&ps);
+
+    skip_ws(&ps);
+    if (*ps.p) {
+        parse_error(&ps, "unexpected input at: %s", where(&ps));
+    }
+
+    if (ps.failed) {
+        expr_free(expr);
+        return NULL;
+    }
+
+    return expr;
+}
+
+void expr_free(expr_t *expr) {
+    if (expr) {
+        mem_free(MEM_CONFIG, expr->src);
+        mem_free(MEM_CONFIG, expr);
+    }
+}
+
+const char *expr_str(const expr_t *expr) {
+    return expr->src;
+}
+
+/* Evaluator */
+
+static double event_field(const gps_event_t *event, uint16_t id) {
+    switch (id) {
+    case E_TIME:
+        return (double) event->time.tv_sec + (double) event->time.tv_nsec / 1e9;
+    case E_SATS_USED:
+        return event->sats_used;
+    case E_SATS_VISIBLE:
+        return event->sats_visible;
+    case E_TDOP:
+        return event->tdop;
+    case E_AVG_SNR:
+        return event->avg_snr;
+    case E_QERR:
+        return (double) event->qErr;
+    case E_TOFF:
+        return event->toff;
+    case E_PPS:
+        return event->pps;
+    case E_PPS_CORRECTED:
+        return event->pps_corrected;
+    case E_OSC_RUNNING:
+        return event->osc_running;
+    case E_OSC_PPS:
+        return event->osc_reference;
+    case E_OSC_GPS:
+        return event->osc_disciplined;
+    case E_OSC_DELTA:
+        return event->osc_delta;
+    case E_KERNEL_OFFSET:
+        return event->kernel.offset;
+    case E_KERNEL_FREQ:
+        return event->kernel.freq;
+    case E_KERNEL_MAXERROR:
+        return event->kernel.maxerror;
+    case E_KERNEL_ESTERROR:
+        return event->kernel.esterror;
+    case E_KERNEL_STATUS:
+        return event->kernel.status;
+    case E_CHRONY_OFFSET:
+        return event->chrony.offset;
+    case E_CHRONY_SD:
+        return event->chrony.sd;
+    case E_CHRONY_DIFF:
+        return event->chrony_diff;
+    case E_CHRONY_STRATUM:
+        return event->chrony.stratum;
+    default:
+        return (id - E_SATS < GNSSID_CNT) ? event->sats_seen[id - E_SATS] : 0;
+    }
+}
+
+// Loads a field of all satellites at once...
+static void sat_column(const gps_event_t *event, uint16_t id, double *col) {
+    const gps_sat_t *sats = event->sats;
+    int n = event->sats_cnt;
+
+#define LOAD(f) for (int i = 0; i < n; i++) col[i] = sats[i].f
+
+    switch (id) {
+    case S_SS:
+        LOAD(ss);
+        break;
+    case S_USED:
+        LOAD(used);
+        break;
+    case S_ELEVATION:
+        LOAD(elevation);
+        break;
+    case S_AZIMUTH:
+        LOAD(azimuth);
+        break;
+    case S_GNSSID:
+        LOAD(gnssid);
+        break;
+    case S_SVID:
+        LOAD(svid);
+        break;
+    default:
+        LOAD(svid * 0);
+        break;
+    }
+
+#undef LOAD
+}
+
+// Evaluates the body of an aggregate column-wise, that is, each instruction
+// is dispatched once and applied to all satellites in a tight loop...
+static double eval_agg(const expr_t *expr, uint16_t pc, uint16_t end, agg_kind_t kind, const gps_event_t *event) {
+    double stack[MAX_AGG_STACK][GPS_MAX_SATS];
+    int sp = 0;
+    int n = event->sats_cnt;
+
+#define FILL(v) do { double _v = (v); for (int i = 0; i < n; i++) stack[sp][i] = _v; sp++; } while (0)
+#define BINOP(expr) \
+    do { \
+        sp--; \
+        double *a = stack[sp - 1]; \
+        const double *b = stack[sp]; \
+        for (int i = 0; i < n; i++) a[i] = (expr); \
+    } while (0)
+
+    while (pc < end) {
+        const insn_t *insn = &expr->code[pc++];
+
+        switch (insn->op) {
+        case OP_CONST:
+            FILL(expr->consts[insn->arg]);
+            break;
+        case OP_FIELD:
+            FILL(event_field(event, insn->arg));
+            break;
+        case OP_SAT:
+            sat_column(event, insn->arg, stack[sp++]);
+            break;
+        case OP_ADD:
+            BINOP(a[i] + b[i]);
+            break;
+        case OP_SUB:
+            BINOP(a[i] - b[i]);
+            break;
+        case OP_MUL:
+            BINOP(a[i] * b[i]);
+            break;
+        case OP_DIV:
+            BINOP(a[i] / b[i]);
+            break;
+        case OP_MOD:
+            BINOP(fmod(a[i], b[i]));
+            break;
+        case OP_NEG:
+            for (int i = 0; i < n; i++) stack[sp - 1][i] = -stack[sp - 1][i];
+            break;
+        case OP_NOT:
+            for (int i = 0; i < n; i++) stack[sp - 1][i] = (stack[sp - 1][i] == 0);
+            break;
+        case OP_LT:
+            BINOP(a[i] < b[i]);
+            break;
+        case OP_LE:
+            BINOP(a[i] <= b[i]);
+            break;
+        case OP_GT:
+            BINOP(a[i] > b[i]);
+            break;
+        case OP_GE:
+            BINOP(a[i] >= b[i]);
+            break;
+        case OP_EQ:
+            BINOP(a[i] == b[i]);
+            break;
+        case OP_NE:
+            BINOP(a[i] != b[i]);
+            break;
+        case OP_AND:
+            BINOP((a[i] != 0) & (b[i] != 0));
+            break;
+        case OP_OR:
+            BINOP((a[i] != 0) | (b[i] != 0));
+            break;
+        default:
+            return NAN;
+        }
+    }
+
+#undef BINOP
+#undef FILL
+
+    const double *v = stack[0];
+    double acc = 0;
+
+    if (n == 0) {
+        // the average, minimum or maximum of nothing is undefined...
+        return (kind == AGG_COUNT || kind == AGG_SUM) ? 0 : NAN;
+    }
+
+    switch (kind) {
+    case AGG_COUNT:
+        for (int i = 0; i < n; i++) acc += (v[i] != 0);
+        break;
+    case AGG_MIN:
+        acc = v[0];
+        for (int i = 1; i < n; i++) acc = (v[i] < acc) ? v[i] : acc;
+        break;
+    case AGG_MAX:
+        acc = v[0];
+        for (int i = 1; i < n; i++) acc = (v[i] > acc) ? v[i] : acc;
+        break;
+    case AGG_AVG:
+    case AGG_SUM:
+        for (int i = 0; i < n; i++) acc += v[i];
+        if (kind == AGG_AVG) {
+            acc /= n;
+        }
+        break;
+    }
+    return acc;
+}
+
+double expr_eval(const expr_t *expr, const gps_event_t *event) {
+    double stack[MAX_STACK];
+    int sp = 0;
+    uint16_t pc = 0;
+
+#define POP2() double b = stack[--sp]; double a = stack[sp - 1]
+#define BINOP(expr) do { POP2(); stack[sp - 1] = (expr); } while (0)
+
+    while (pc < expr->len) {
+        const insn_t *insn = &expr->code[pc++];
+
+        switch (insn->op) {
+        case OP_CONST:
+            stack[sp++] = expr->consts[insn->arg];
+            break;
+        case OP_FIELD:
+            stack[sp++] = event_field(event, insn->arg);
+            break;
+        case OP_ADD:
+            BINOP(a + b);
+            break;
+        case OP_SUB:
+            BINOP(a - b);
+            break;
+        case OP_MUL:
+            BINOP(a * b);
+            break;
+        case OP_DIV:
+            BINOP(a / b);
+            break;
+        case OP_MOD:
+            BINOP(fmod(a, b));
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        case OP_NOT:
+            stack[sp - 1] = (stack[sp - 1] == 0);
+            break;
+        case OP_LT:
+            BINOP(a < b);
+            break;
+        case OP_LE:
+            BINOP(a <= b);
+            break;
+        case OP_GT:
+            BINOP(a > b);
+            break;
+        case OP_GE:
+            BINOP(a >= b);
+            break;
+        case OP_EQ:
+            BINOP(a == b);
+            break;
+        case OP_NE:
+            BINOP(a != b);
+            break;
+        case OP_AND:
+            BINOP((a != 0) && (b != 0));
+            break;
+        case OP_OR:
+            BINOP((a != 0) || (b != 0));
+            break;
+        case OP_AGG: {
+            uint16_t body_end = (uint16_t)(pc + (insn->arg >> AGG_SHIFT));
+
+            stack[sp++] = eval_agg(expr, pc, body_end, (agg_kind_t)(insn->arg & AGG_KIND_MASK), event);
+            pc = body_end;
+            break;
+        }
+        default:
+            // satellite fields are only valid inside aggregates...
+            return NAN;
+        }
+    }
+
+#undef BINOP
+#undef POP2
+
+    return (sp > 0) ? stack[sp - 1] : NAN;
+}
+
+// EOF
@@ -0,0 +1,407 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "failover.h"
+#include "log.h"
+#include "mem.h"
+#include "resolver.h"
+#include "timespec.h"
+
+#define MAX_NAME_SIZE 256
+
+typedef struct attempt {
+    failover_t *fo;
+    uint8_t broker;
+    // a numeric address, or the name of the broker when using TLS...
+    char host[MAX_NAME_SIZE];
+    uint16_t port;
+
+    mqtt_handle_t *mqtt;
+    int fd;
+    uint32_t events;
+} attempt_t;
+
+struct failover {
+    evloop_t *loop;
+    wheel_t *wheel;
+    failover_callback_t callback;
+    void *context;
+
+    // only valid during a race...
+    const config_t *cfg;
+    uint8_t brokers;
+    uint8_t next_broker;
+    struct timespec since;
+
+    attempt_t attempts[FAILOVER_MAX_ATTEMPTS];
+    uint8_t attempt_cnt;
+    uint8_t next_attempt;
+    uint8_t pending;
+
+    wheel_timer_t stagger_timer;
+    wheel_timer_t timeout_timer;
+
+    uint32_t fo_races;
+    uint32_t fo_races_lost;
+    uint32_t fo_attempts;
+    uint32_t fo_attempts_failed;
+    int fo_last_broker;
+    uint32_t fo_last_msec;
+};
+
+static void start_next(failover_t *fo);
+
+// Returns the time since the start of the race, in milliseconds...
+static uint32_t elapsed_msec(const failover_t *fo) {
+    struct timespec now, diff;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TS_SUB(&diff, &now, &fo->since);
+    return (uint32_t) (diff.tv_sec * 1000 + diff.tv_nsec / 1000000);
+}
+
+static void abandon_attempt(attempt_t *attempt) {
+    failover_t *fo = attempt->fo;
+
+    if (attempt->fd >= 0) {
+        evloop_remove(fo->loop, attempt->fd);
+        attempt->fd = -1;
+    }
+    if (attempt->mqtt) {
+        mqtt_disconnect(attempt->mqtt);
+        mqtt_destroy(attempt->mqtt);
+        attempt->mqtt = NULL;
+
+        fo->pending--;
+    }
+}
+
+// Stops all attempts and timers, leaving the statistics untouched...
+static void stop_race(failover_t *fo) {
+    wheel_cancel(fo->wheel, &fo->stagger_timer);
+    wheel_cancel(fo->wheel, &fo->timeout_timer);
+
+    for (uint8_t i = 0; i < fo->attempt_cnt; i++) {
+        abandon_attempt(&fo->attempts[i]);
+    }
+
+    fo->cfg = NULL;
+    fo->attempt_cnt = 0;
+    fo->next_attempt = 0;
+}
+
+static void lose_race(failover_t *fo) {
+    uint32_t msec = elapsed_msec(fo);
+
+    log_warning("Unable to connect to any MQTT broker!");
+
+    stop_race(fo);
+
+    // Update stats...
+    fo->fo_races_lost++;
+
+    fo->callback(fo, NULL, -1, msec, fo->context);
+}
+
+static void win_race(failover_t *fo, attempt_t *winner) {
+    mqtt_handle_t *mqtt = winner->mqtt;
+    int broker = winner->broker;
+    uint32_t msec = elapsed_msec(fo);
+
+    log_info("Connected to MQTT broker %s (%s:%d) after %u ms",
+             fo->cfg->brokers[broker].name, winner->host, winner->port, msec);
+
+    // The caller watches the connection from now on...
+    evloop_remove(fo->loop, winner->fd);
+    winner->fd = -1;
+    winner->mqtt = NULL;
+    fo->pending--;
+
+    stop_race(fo);
+
+    // Update stats...
+    fo->fo_last_broker = broker;
+    fo->fo_last_msec = msec;
+
+    fo->callback(fo, mqtt, broker, msec, fo->context);
+}
+
+static void fail_attempt(attempt_t *attempt) {
+    failover_t *fo = attempt->fo;
+
+    log_debug("Connection attempt to MQTT broker %s:%d failed", attempt->host, attempt->port);
+
+    abandon_attempt(attempt);
+
+    // Update stats...
+    fo->fo_attempts_failed++;
+
+    // No need to wait for the stagger delay, the next attempt can start right away...
+    wheel_cancel(fo->wheel, &fo->stagger_timer);
+    start_next(fo);
+}
+
+// Called when the connection of an attempt has pending events...
+static void attempt_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    attempt_t *attempt = context;
+
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+        fail_attempt(attempt);
+        return;
+    }
+    if ((events & EPOLLOUT) && mqtt_write_data(attempt->mqtt)) {
+        fail_attempt(attempt);
+        return;
+    }
+    if ((events & EPOLLIN) && mqtt_read_data(attempt->mqtt)) {
+        fail_attempt(attempt);
+        return;
+    }
+
+    int status = mqtt_connect_status(attempt->mqtt);
+    if (status == 0) {
+        win_race(attempt->fo, attempt);
+        return;
+    } else if (status != -EINPROGRESS) {
+        fail_attempt(attempt);
+        return;
+    }
+
+    uint32_t wanted = EPOLLIN;
+    if (mqtt_want_write(attempt->mqtt)) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted != attempt->events && evloop_modify(loop, fd, wanted) == 0) {
+        attempt->events = wanted;
+    }
+}
+
+static void add_attempt(failover_t *fo, uint8_t broker, const char *host) {
+    if (fo->attempt_cnt >= FAILOVER_MAX_ATTEMPTS) {
+        return;
+    }
+
+    attempt_t *attempt = &fo->attempts[fo->attempt_cnt++];
+    bzero(attempt, sizeof(attempt_t));
+
+    attempt->fo = fo;
+    attempt->broker = broker;
+    attempt->port = fo->cfg->brokers[broker].port;
+    attempt->fd = -1;
+    strncpy(attempt->host, host, sizeof(attempt->host) - 1);
+}
+
+// Adds an attempt for each address of a broker, alternating between address families...
+static void add_attempts(failover_t *fo, uint8_t broker) {
+    const mqtt_broker_t *b = &fo->cfg->brokers[broker];
+
+    // The certificate of the broker is verified against the name we connect to...
+    if (fo->cfg->use_tls) {
+        add_attempt(fo, broker, b->host);
+        return;
+    }
+
+    resolver_result_t result;
+    if (resolver_lookup(b->host, &result)) {
+        log_warning("Unable to resolve MQTT broker %s (%s)", b->name, b->host);
+        return;
+    }
+
+    // RFC 8305: start with the family of the first address, and alternate from there...
+    int next[2] = { 0, -1 };
+    for (int i = 1; i < result.cnt && next[1] < 0; i++) {
+        if (result.addrs[i].family != result.addrs[0].family) {
+            next[1] = i;
+        }
+    }
+
+    for (int family = 0; next[0] >= 0 || next[1] >= 0; family ^= 1) {
+        int i = next[family];
+        if (i < 0) {
+            continue;
+        }
+
+        add_attempt(fo, broker, result.addrs[i].host);
+
+        // Advance to the next address of the same family...
+        int j = i + 1;
+        while (j < result.cnt && result.addrs[j].family != result.addrs[i].family) {
+            j++;
+        }
+        next[family] = (j < result.cnt) ? j : -1;
+    }
+}
+
+static int start_attempt(attempt_t *attempt) {
+    failover_t *fo = attempt->fo;
+
+    log_debug("Connecting to MQTT broker %s (%s:%d)...",
+              fo->cfg->brokers[attempt->broker].name, attempt->host, attempt->port);
+
+    // Update stats...
+    fo->fo_attempts++;
+
+    attempt->mqtt = mqtt_init(fo->cfg, attempt->host, attempt->port);
+    if (attempt->mqtt == NULL) {
+        return -ENOMEM;
+    }
+    fo->pending++;
+
+    if (mqtt_connect_async(attempt->mqtt)) {
+        return -ENOTCONN;
+    }
+
+    int fd = mqtt_fd(attempt->mqtt);
+    if (fd < 0) {
+        return -ENOTCONN;
+    }
+    // Level-triggered: the CONNECT packet is written once the connection is established...
+    if (evloop_add(fo->loop, fd, EPOLLIN | EPOLLOUT, attempt_callback, attempt)) {
+        log_warning("Unable to add MQTT event handler!");
+        return -EINVAL;
+    }
+    attempt->fd = fd;
+    attempt->events = EPOLLIN | EPOLLOUT;
+
+    return 0;
+}
+
+// Starts the next attempt, resolving the next broker once all addresses of the previous ones are tried...
+static void start_next(failover_t *fo) {
+    while (fo->next_attempt < FAILOVER_MAX_ATTEMPTS) {
+        while (fo->next_attempt == fo->attempt_cnt && fo->next_broker < fo->brokers) {
+            add_attempts(fo, fo->next_broker++);
+        }
+        if (fo->next_attempt == fo->attempt_cnt) {
+            break;
+        }
+
+        attempt_t *attempt = &fo->attempts[fo->next_attempt++];
+        if (start_attempt(attempt) == 0) {
+            // Give this attempt a head start before starting the next one...
+            if (fo->next_attempt < fo->attempt_cnt || fo->next_broker < fo->brokers) {
+                wheel_schedule(fo->wheel, &fo->stagger_timer, fo->cfg->mqtt_stagger);
+            }
+            return;
+        }
+
+        abandon_attempt(attempt);
+
+        // Update stats...
+        fo->fo_attempts_failed++;
+    }
+
+    if (fo->pending == 0) {
+        lose_race(fo);
+    }
+}
+
+static void stagger_callback(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+
+    start_next(context);
+}
+
+static void timeout_callback(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+
+    log_debug("Connection attempts to MQTT timed out...");
+
+    lose_race(context);
+}
+
+failover_t *failover_init(evloop_t *loop, wheel_t *wheel, failover_callback_t callback, void *context) {
+    failover_t *fo = mem_malloc(MEM_MQTT, sizeof(failover_t));
+    if (fo == NULL) {
+        log_error("failed to create failover handle: out of memory!");
+        return NULL;
+    }
+    bzero(fo, sizeof(failover_t));
+
+    fo->loop = loop;
+    fo->wheel = wheel;
+    fo->callback = callback;
+    fo->context = context;
+    fo->fo_last_broker = -1;
+
+    wheel_timer_init(&fo->stagger_timer, stagger_callback, fo);
+    wheel_timer_init(&fo->timeout_timer, timeout_callback, fo);
+
+    return fo;
+}
+
+void failover_destroy(failover_t *fo) {
+    if (fo) {
+        stop_race(fo);
+
+        mem_free(MEM_MQTT, fo);
+    }
+}
+
+int failover_race(failover_t *fo, const config_t *cfg, uint8_t brokers, const struct timespec *since) {
+    if (fo == NULL || cfg == NULL || brokers == 0 || brokers > cfg->broker_cnt) {
+        return -EINVAL;
+    }
+
+    stop_race(fo);
+
+    fo->cfg = cfg;
+    fo->brokers = brokers;
+    fo->next_broker = 0;
+    if (since) {
+        fo->since = *since;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &fo->since);
+    }
+
+    if (wheel_schedule(fo->wheel, &fo->timeout_timer, FAILOVER_TIMEOUT)) {
+        log_warning("Failed to register timeout timer for MQTT?!");
+        fo->cfg = NULL;
+        return -EINVAL;
+    }
+
+    // Update stats...
+    fo->fo_races++;
+
+    start_next(fo);
+
+    return 0;
+}
+
+void failover_cancel(failover_t *fo) {
+    stop_race(fo);
+}
+
+bool failover_racing(const failover_t *fo) {
+    return fo->cfg != NULL;
+}
+
+failover_stats_t failover_dump_stats(failover_t *fo) {
+    if (fo == NULL) {
+        return (failover_stats_t) {
+            .last_broker = -1,
+        };
+    }
+
+    return (failover_stats_t) {
+        .races = fo->fo_races,
+        .races_lost = fo->fo_races_lost,
+        .attempts = fo->fo_attempts,
+        .attempts_failed = fo->fo_attempts_failed,
+        .last_broker = fo->fo_last_broker,
+        .last_msec = fo->fo_last_msec,
+    };
+}
+
+// EOF
@@ -6,6 +6,11 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -15,23 +20,35 @@
 
 #include <gps.h>
 
+#include "chrony.h"
+#include "expr.h"
 #include "gpsd.h"
+#include "kclock.h"
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+#include "nmea.h"
+#include "osc.h"
+#include "resolver.h"
+#include "rolling.h"
 #include "timespec.h"
+#include "trace.h"
 
 #define GPSD_ERROR(s) \
     ((errno) ? strerror(errno) : gps_errstr(s))
 
-#ifndef GNSSID_CNT
-/* copied from gpsd-3.17: defines for u-blox gnssId, as used in satellite_t */
-#define GNSSID_GPS 0
-#define GNSSID_SBAS 1
-#define GNSSID_GAL 2
-#define GNSSID_BD 3
-#define GNSSID_IMES 4
-#define GNSSID_QZSS 5
-#define GNSSID_GLO 6
-#define GNSSID_IRNSS 7            /* Not defined by u-blox */
-#define GNSSID_CNT 8              /* count for array size */
+#if GPSD_API_MAJOR_VERSION >= 9
+#define DEV_ACTIVE(dev) ((dev)->activated.tv_sec != 0 || (dev)->activated.tv_nsec != 0)
+#define DEV_CYCLE(dev) TSTONS(&(dev)->cycle)
+#else
+#define DEV_ACTIVE(dev) ((dev)->activated != 0)
+#define DEV_CYCLE(dev) ((dev)->cycle)
+#endif
+
+#ifdef GPS_JSON_RESPONSE_MAX
+#define MAX_LINE_SIZE GPS_JSON_RESPONSE_MAX
+#else
+#define MAX_LINE_SIZE 4096
 #endif
 
 static const char* gnssid_name[GNSSID_CNT] = {
@@ -45,38 +62,185 @@ static const char* gnssid_name[GNSSID_CNT] = {
     "irnss"
 };
 
+// the number of seconds a PPS offset or qErr waits for its counterpart...
+#define QERR_RING_SIZE 8
+
+// the data that belongs to a single device, @see #find_track...
+#define TRACK_SET (TIME_SET | MODE_SET | SATELLITE_SET | TOFF_SET | PPS_SET | OSCILLATOR_SET)
+
+// Pairs the PPS offset and the quantization error of a single second...
+typedef struct qerr_slot {
+    time_t second;
+    bool has_pps;
+    bool has_qerr;
+    double pps;
+    long qErr;
+} qerr_slot_t;
+
+// Keeps the last reported settings of a device...
+typedef struct gpsd_device {
+    bool used;
+    // a change that is not reported yet...
+    bool pending;
+    char path[GPS_DEVICE_SIZE];
+    gps_device_info_t info;
+} gpsd_device_t;
+
+// The pipeline of a single device, as GPSD reports the data of all its devices over one connection...
+typedef struct gpsd_track {
+    char path[GPS_DEVICE_SIZE];
+    // the last time the device sent data, in milliseconds of CLOCK_MONOTONIC...
+    uint64_t last_seen;
+    // when the pipeline was created, and how long it took until its offsets covered a full window...
+    uint64_t created;
+    _Atomic uint64_t warmup;
+
+    struct timespec toff_diff;
+    struct timespec pps_diff;
+
+    // only if the kernel clock is sampled...
+    bool kernel_sampled;
+    bool pps_seen;
+    kclock_sample_t kernel_sample;
+
+    // the PPS offsets corrected by the qErr of their second...
+    qerr_slot_t qerr_ring[QERR_RING_SIZE];
+    long qErr;
+    time_t qerr_fix_second;
+    time_t last_pps_second;
+    time_t corrected_second;
+    double pps_corrected;
+
+    // the most recent offsets, the oscillator and the C/N0 window are read by
+    // other threads under a sequence lock, @see #begin_change...
+    _Atomic uint32_t state_seq;
+    rolling_t toff_window;
+    rolling_t pps_window;
+    rolling_t pps_corrected_window;
+    rolling_t kernel_window;
+
+    // only if the NMEA sentences are watched...
+    nmea_t *nmea;
+
+    // the oscillator as last reported, and its changes and summary that are not reported yet...
+    osc_t *osc;
+    bool osc_running;
+    bool osc_reference;
+    bool osc_disciplined;
+    int osc_delta;
+    bool osc_pending;
+    osc_state_t osc_previous;
+    bool osc_summary_pending;
+    osc_summary_t osc_summary;
+
+    // the C/N0 histograms of the current window, only if enabled...
+    uint64_t cn0_start;
+    uint32_t cn0_skyviews;
+    bool cn0_pending;
+    gps_cn0_info_t cn0[GNSSID_CNT];
+} gpsd_track_t;
+
 struct gpsd_handle {
     struct gps_data_t gpsd;
+    char *name;
     char *host;
     char *port;
     char *device;
+    // the index of the source, for its metrics...
+    uint16_t index;
 
-    struct timespec toff_diff;
-    struct timespec pps_diff;
+    // only if the kernel clock is sampled...
+    bool kernel;
+    // only if chronyd is polled...
+    bool chrony;
+    // only if the NMEA sentences are watched...
+    bool nmea;
+    uint32_t osc_window;
+    uint64_t cn0_window;
+    // in milliseconds, or 0 to only reclaim the pipelines of removed devices...
+    uint64_t device_idle;
+    uint64_t next_reclaim;
 
-    uint32_t gpsd_events_recv;
-    uint32_t gpsd_events_send;
-    time_t gpsd_last_event;
+    // the pipelines of the devices that sent data, NULL for unused slots. Only
+    // the reading thread changes them, and only it reads them without the lock...
+    pthread_mutex_t tracks_lock;
+    gpsd_track_t *tracks[GPS_MAX_DEVICES];
+
+    // the devices as reported by the DEVICE(S) messages of GPSD...
+    gpsd_device_t devices[GPS_MAX_DEVICES];
+
+    // partial line of data fed by #gpsd_feed_data...
+    size_t line_len;
+    bool line_overflow;
+    char line[MAX_LINE_SIZE + 1];
 };
 
-gpsd_handle_t *gpsd_init(const config_t *config) {
-    gpsd_handle_t *handle = malloc(sizeof(gpsd_handle_t));
+// The state of the devices of a previous run, or of a source that reconnects, each taken once by the
+// pipeline of its device, @see #restore_track. Taken entries have an empty source...
+static pthread_mutex_t restored_lock = PTHREAD_MUTEX_INITIALIZER;
+static gpsd_saved_device_t *restored;
+static size_t restored_cnt;
+static size_t restored_left;
+
+static inline uint64_t monotonic_msec(void);
+static void stash_track(const gpsd_handle_t *handle, const gpsd_track_t *track, uint64_t now);
+
+static void destroy_track(gpsd_track_t *track) {
+    if (track) {
+        nmea_destroy(track->nmea);
+        osc_destroy(track->osc);
+        mem_free(MEM_GPSD, track);
+    }
+}
+
+gpsd_handle_t *gpsd_init(const gpsd_source_t *source) {
+    gpsd_handle_t *handle = mem_malloc(MEM_GPSD, sizeof(gpsd_handle_t));
     if (handle == NULL) {
         log_error("failed to create GPSD handle: out of memory!");
         return NULL;
     }
     bzero(handle, sizeof(gpsd_handle_t));
 
-    handle->host = config->gpsd_host;
-    handle->port = config->gpsd_port;
-    handle->device = config->gpsd_device;
+    // the handle can outlive the configuration it was created with...
+    handle->name = mem_strdup(MEM_GPSD, source->name);
+    handle->host = mem_strdup(MEM_GPSD, source->host);
+    handle->port = mem_strdup(MEM_GPSD, source->port);
+    handle->device = source->device ? mem_strdup(MEM_GPSD, source->device) : NULL;
+    handle->index = source->index;
+    handle->nmea = source->nmea;
+    handle->osc_window = source->osc_window;
+    handle->cn0_window = (uint64_t) source->cn0_window * 1000;
+    handle->device_idle = (uint64_t) source->device_idle * 1000;
+    handle->kernel = source->kernel;
+    handle->chrony = source->chrony;
+    pthread_mutex_init(&handle->tracks_lock, NULL);
+
+    if (!handle->name || !handle->host || !handle->port || (source->device && !handle->device)) {
+        log_error("failed to create GPSD handle: out of memory!");
+        gpsd_destroy(handle);
+        return NULL;
+    }
 
     return handle;
 }
 
 void gpsd_destroy(gpsd_handle_t *handle) {
     if (handle) {
-        free(handle);
+        // Keep the state of the devices for when the source reconnects...
+        uint64_t now = monotonic_msec();
+        for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+            if (handle->tracks[i] && handle->name) {
+                stash_track(handle, handle->tracks[i], now);
+            }
+            destroy_track(handle->tracks[i]);
+        }
+
+        mem_free(MEM_GPSD, handle->name);
+        mem_free(MEM_GPSD, handle->host);
+        mem_free(MEM_GPSD, handle->port);
+        mem_free(MEM_GPSD, handle->device);
+        pthread_mutex_destroy(&handle->tracks_lock);
+        mem_free(MEM_GPSD, handle);
     }
 }
 
@@ -87,8 +251,21 @@ int gpsd_connect(gpsd_handle_t *handle) {
 
     unsigned int flags = WATCH_ENABLE | WATCH_NEWSTYLE | WATCH_JSON | WATCH_PPS | WATCH_TIMING;
 
-    int status;
-    if ((status = gps_open(handle->host, handle->port, &handle->gpsd)) < 0) {
+    // Use the cached addresses, so a slow resolver does not hold up our reconnects...
+    resolver_result_t addrs;
+    if (resolver_lookup(handle->host, &addrs)) {
+        log_error("unable to resolve GPSD host %s", handle->host);
+        return -ENOTCONN;
+    }
+
+    int status = -1;
+    for (uint8_t i = 0; i < addrs.cnt && status < 0; i++) {
+        errno = 0;
+        if ((status = gps_open(addrs.addrs[i].host, handle->port, &handle->gpsd)) < 0) {
+            log_debug("failed to connect to GPSD at %s: %s", addrs.addrs[i].host, GPSD_ERROR(status));
+        }
+    }
+    if (status < 0) {
         log_error("no GPSD running or network error: %s", GPSD_ERROR(status));
         return -ENOTCONN;
     }
@@ -96,13 +273,17 @@ int gpsd_connect(gpsd_handle_t *handle) {
     if (handle->device) {
         flags |= WATCH_DEVICE;
     }
+    if (handle->nmea) {
+        // Relays the sentences of the receiver as-is, rather than regenerating them...
+        flags |= WATCH_RAW;
+    }
 
     if ((status = gps_stream(&handle->gpsd, flags, handle->device)) < 0) {
         log_error("failed to set GPS stream options: %s", GPSD_ERROR(status));
         return -ENOTCONN;
     }
 
-    log_info("connected to GPSD...");
+    log_info("connected to GPSD at %s:%s...", handle->host, handle->port);
 
     return 0;
 }
@@ -126,7 +307,7 @@ int gpsd_disconnect(gpsd_handle_t *handle) {
         log_debug("Failed to close handle to GPSD: %s", GPSD_ERROR(status));
     }
 
-    log_info("disconnected from GPSD...");
+    log_info("disconnected from GPSD at %s:%s...", handle->host, handle->port);
 
     return 0;
 }
@@ -143,150 +324,944 @@ int gpsd_fd(gpsd_handle_t *handle) {
     return fd;
 }
 
-#define INITIAL_BUFFER_SIZE 256
+const char *gpsd_gnss_name(uint8_t gnssid) {
+    if (gnssid >= GNSSID_CNT) {
+        return "unknown";
+    }
+    return gnssid_name[gnssid];
+}
 
-#define BUFFER_ADD(...)                                                        \
-  do {                                                                         \
-    int status;                                                                \
-    status = snprintf(*buffer + offset, buffer_size - offset, __VA_ARGS__);     \
-    if (status < 1) {                                                          \
-      free(*buffer);                                                            \
-      return -ENOMEM;                                                             \
-    } else if (((size_t)status) >= (buffer_size - offset)) {                   \
-      free(*buffer);                                                            \
-      return -ENOMEM;                                                             \
-    } else                                                                     \
-      offset += ((size_t)status);                                              \
-  } while (0)
+static inline uint64_t monotonic_msec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-static int create_event_payload(gpsd_handle_t *handle, char **buffer) {
-    double snr_total = 0;
-    double snr_avg = 0;
-    uint8_t sats_seen[GNSSID_CNT] = { 0 };
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// Marks the start of a change of the state that other threads read, @see #dump_offsets and #save_track...
+static inline void begin_change(gpsd_track_t *track) {
+    uint32_t seq = atomic_load_explicit(&track->state_seq, memory_order_relaxed);
+    atomic_store_explicit(&track->state_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
 
-    for(int i = 0; i <= handle->gpsd.satellites_visible; i++) {
-        if (!handle->gpsd.skyview[i].used) {
+static inline void end_change(gpsd_track_t *track) {
+    uint32_t seq = atomic_load_explicit(&track->state_seq, memory_order_relaxed);
+    atomic_store_explicit(&track->state_seq, seq + 1, memory_order_release);
+}
+
+// Continues a new pipeline with the state of its device of the previous run, if any...
+static void restore_track(const gpsd_handle_t *handle, gpsd_track_t *track) {
+    pthread_mutex_lock(&restored_lock);
+
+    for (size_t i = 0; i < restored_cnt; i++) {
+        gpsd_saved_device_t *saved = &restored[i];
+        if (!saved->source[0] || strncmp(saved->source, handle->name, GPS_SOURCE_SIZE - 1) != 0 ||
+                strncmp(saved->path, track->path, GPS_DEVICE_SIZE - 1) != 0) {
             continue;
         }
 
-        if (handle->gpsd.skyview[i].ss >= 0) {
-            snr_total += handle->gpsd.skyview[i].ss;
+        uint64_t now = monotonic_msec();
+
+        track->toff_window = saved->toff;
+        track->pps_window = saved->pps;
+        track->pps_corrected_window = saved->pps_corrected;
+        track->kernel_window = saved->kernel;
+
+        osc_restore(track->osc, &saved->osc, now);
+
+        if (handle->cn0_window && saved->cn0_started) {
+            // a window cannot have started before the clock did...
+            track->cn0_start = now - ((saved->cn0_elapsed < now) ? saved->cn0_elapsed : now - 1);
+            track->cn0_skyviews = saved->cn0_skyviews;
+            memcpy(track->cn0, saved->cn0, sizeof(track->cn0));
         }
 
-#if GPSD_API_MAJOR_VERSION >= 8
-        if (handle->gpsd.skyview[i].svid != 0) {
-            uint8_t gnssid = handle->gpsd.skyview[i].gnssid;
-            if (gnssid < GNSSID_CNT) {
-                sats_seen[gnssid]++;
-            }
+        log_debug("Continuing with the state of GPS device %s of %s from the previous run...", track->path, handle->name);
+
+        // Each state is taken only once, and freed once all are taken...
+        saved->source[0] = 0;
+        if (--restored_left == 0) {
+            mem_free(MEM_GPSD, restored);
+            restored = NULL;
+            restored_cnt = 0;
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&restored_lock);
+}
+
+// Returns the pipeline of the device that sent the last message, or NULL if it cannot be tracked...
+static gpsd_track_t *find_track(gpsd_handle_t *handle) {
+    // gpsd reports the device for each message, fall back to the configured one...
+    const char *path = handle->gpsd.dev.path;
+    if (!path[0]) {
+        path = handle->device ? handle->device : "";
+    }
+
+    gpsd_track_t **unused = NULL;
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_track_t *track = handle->tracks[i];
+        if (track == NULL) {
+            unused = unused ? unused : &handle->tracks[i];
+        } else if (strncmp(track->path, path, GPS_DEVICE_SIZE - 1) == 0) {
+            track->last_seen = monotonic_msec();
+            return track;
+        }
+    }
+
+    if (unused == NULL) {
+        log_warning("Dropping data of GPS device %s: too many devices!", path);
+
+        // Update stats...
+        metrics_inc(METRIC_GPSD_DEVICE_DROPS, handle->index);
+        return NULL;
+    }
+
+    gpsd_track_t *track = mem_malloc(MEM_GPSD, sizeof(gpsd_track_t));
+    if (track == NULL) {
+        log_warning("Not tracking data of GPS device %s: out of memory!", path);
+        return NULL;
+    }
+    bzero(track, sizeof(gpsd_track_t));
+
+    strncpy(track->path, path, sizeof(track->path) - 1);
+    track->last_seen = track->created = monotonic_msec();
+    track->nmea = handle->nmea ? nmea_init(handle->index) : NULL;
+    track->osc = osc_init(handle->osc_window);
+
+    if ((handle->nmea && !track->nmea) || !track->osc) {
+        log_warning("Not tracking data of GPS device %s: out of memory!", path);
+        destroy_track(track);
+        return NULL;
+    }
+
+    restore_track(handle, track);
+
+    // Publish the pipeline only once it is complete, @see #gpsd_dump_devices...
+    pthread_mutex_lock(&handle->tracks_lock);
+    *unused = track;
+    pthread_mutex_unlock(&handle->tracks_lock);
+
+    return track;
+}
+
+// Frees the pipeline in a slot, once no other thread reads it anymore...
+static void reclaim_track(gpsd_handle_t *handle, size_t slot) {
+    gpsd_track_t *track = handle->tracks[slot];
+
+    pthread_mutex_lock(&handle->tracks_lock);
+    handle->tracks[slot] = NULL;
+    pthread_mutex_unlock(&handle->tracks_lock);
+
+    destroy_track(track);
+}
+
+// Reclaims the pipeline of a removed device, if any...
+static void reclaim_device(gpsd_handle_t *handle, const char *path) {
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        if (handle->tracks[i] && strncmp(handle->tracks[i]->path, path, GPS_DEVICE_SIZE - 1) == 0) {
+            reclaim_track(handle, i);
+            return;
+        }
+    }
+}
+
+// Reclaims the pipelines of devices that sent no data for a while, at most once a second...
+static void reclaim_idle(gpsd_handle_t *handle) {
+    uint64_t now = monotonic_msec();
+    if (handle->device_idle == 0 || now < handle->next_reclaim) {
+        return;
+    }
+    handle->next_reclaim = now + 1000;
+
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_track_t *track = handle->tracks[i];
+        // Pipelines with unreported events are reclaimed once these are reported...
+        if (track == NULL || now - track->last_seen < handle->device_idle ||
+                track->osc_pending || track->osc_summary_pending || track->cn0_pending) {
+            continue;
         }
+
+        log_info("GPS device %s idle for %" PRIu64 " seconds, reclaiming its pipeline...",
+                 track->path, handle->device_idle / 1000);
+        reclaim_track(handle, i);
+    }
+}
+
+static void set_event_device(const gpsd_handle_t *handle, const gpsd_track_t *track, gps_event_t *event) {
+    strncpy(event->source, handle->name, sizeof(event->source) - 1);
+    strncpy(event->device, track->path, sizeof(event->device) - 1);
+}
+
+// Returns the constellation of a satellite, or -1 if unknown...
+static int sat_gnssid(const struct satellite_t *skyview, int *svid) {
+#if GPSD_API_MAJOR_VERSION >= 8
+    *svid = skyview->svid;
+    return (skyview->svid != 0) ? skyview->gnssid : -1;
 #else
-        int gnssid = -1;
-        short prn = handle->gpsd.skyview[i].PRN;
-
-        if (GPS_PRN(prn)) {
-            gnssid = GNSSID_GPS;
-        } else if (GBAS_PRN(prn)) {
-            gnssid = GNSSID_GLO;
-        } else if (SBAS_PRN(prn)) {
-            gnssid = GNSSID_SBAS;
-        } else if (GNSS_PRN(prn)) {
-            gnssid = GNSSID_BD;
+    short prn = skyview->PRN;
+
+    *svid = prn;
+    if (GPS_PRN(prn)) {
+        return GNSSID_GPS;
+    } else if (GBAS_PRN(prn)) {
+        return GNSSID_GLO;
+    } else if (SBAS_PRN(prn)) {
+        return GNSSID_SBAS;
+    } else if (GNSS_PRN(prn)) {
+        return GNSSID_BD;
+    }
+    return -1;
+#endif
+}
+
+static void create_event_payload(gpsd_handle_t *handle, gpsd_track_t *track, gps_event_t *event) {
+    double snr_total = 0;
+
+    bzero(event, sizeof(gps_event_t));
+
+    set_event_device(handle, track, event);
+
+    for(int i = 0; i < handle->gpsd.satellites_visible && i < MAXCHANNELS; i++) {
+        const struct satellite_t *skyview = &handle->gpsd.skyview[i];
+
+        int svid;
+        int gnssid = sat_gnssid(skyview, &svid);
+
+        // keep all visible satellites for the aggregates of derived fields...
+        if (event->sats_cnt < GPS_MAX_SATS) {
+            event->sats[event->sats_cnt++] = (gps_sat_t) {
+                .gnssid = (uint8_t) ((gnssid >= 0) ? gnssid : GNSSID_CNT),
+                .svid = (uint8_t) svid,
+                .used = skyview->used,
+                .ss = (float) skyview->ss,
+                .elevation = (float) skyview->elevation,
+                .azimuth = (float) skyview->azimuth,
+            };
+        }
+
+        if (!skyview->used) {
+            continue;
         }
+
+        if (skyview->ss >= 0) {
+            snr_total += skyview->ss;
+        }
+
         if (gnssid >= 0 && gnssid < GNSSID_CNT) {
-            sats_seen[gnssid]++;
+            event->sats_seen[gnssid]++;
         }
-#endif
     }
     if (handle->gpsd.satellites_used > 0) {
-        snr_avg = snr_total / handle->gpsd.satellites_used;
+        event->avg_snr = snr_total / handle->gpsd.satellites_used;
+    }
+
+#if GPSD_API_MAJOR_VERSION >= 9
+    event->time = handle->gpsd.fix.time;
+#elif GPSD_API_MAJOR_VERSION >= 8
+    event->time.tv_sec = (time_t) handle->gpsd.fix.time;
+    event->time.tv_nsec = (long) ((handle->gpsd.fix.time - (double) event->time.tv_sec) * 1e9);
+#endif
+
+    event->sats_used = handle->gpsd.satellites_used;
+    event->sats_visible = handle->gpsd.satellites_visible;
+    event->tdop = handle->gpsd.dop.tdop;
+
+    event->qErr = track->qErr;
+
+    event->toff = TSTONS(&track->toff_diff);
+    event->pps = TSTONS(&track->pps_diff);
+
+    event->osc_running = track->osc_running;
+    event->osc_reference = track->osc_reference;
+    event->osc_disciplined = track->osc_disciplined;
+    event->osc_delta = track->osc_delta;
+
+    // Only while the pairs keep up with the pulses...
+    if (track->corrected_second && track->last_pps_second - track->corrected_second < QERR_RING_SIZE) {
+        event->pps_corrected_valid = true;
+        event->pps_corrected = track->pps_corrected;
     }
 
-    size_t offset = 0;
-    size_t buffer_size = INITIAL_BUFFER_SIZE;
+    if (track->kernel_sampled) {
+        event->kernel_sampled = true;
+        event->kernel = track->kernel_sample;
+    }
 
-    *buffer = malloc(buffer_size * sizeof(char));
+    if (handle->chrony && chrony_latest(&event->chrony)) {
+        event->chrony_valid = true;
+        event->chrony_diff = (track->pps_seen ? event->pps : event->toff) - event->chrony.offset;
+    }
 
-    BUFFER_ADD("{");
+    if (track->nmea) {
+        event->nmea_watched = true;
+        event->nmea = nmea_take_counts(track->nmea);
+    }
+}
 
+// Adds the PPS offset or qErr of a second, returns true once both are known...
+static bool pair_qerr(gpsd_track_t *track, time_t second, const double *pps, const long *qErr) {
+    qerr_slot_t *slot = &track->qerr_ring[second % QERR_RING_SIZE];
+
+    if (slot->second != second) {
+        // Evict whatever waited for a counterpart that never came...
+        bzero(slot, sizeof(qerr_slot_t));
+        slot->second = second;
+    }
+    if (pps) {
+        slot->has_pps = true;
+        slot->pps = *pps;
+    }
+    if (qErr) {
+        slot->has_qerr = true;
+        slot->qErr = *qErr;
+    }
+    if (!slot->has_pps || !slot->has_qerr) {
+        return false;
+    }
+
+    // The pulse came qErr (in ps) after the second that GPSD timestamped it with...
+    track->pps_corrected = slot->pps - (double) slot->qErr / 1e12;
+    track->corrected_second = second;
+    slot->second = 0;
+
+    return true;
+}
+
+// Returns the qErr of a new fix, if any...
+static bool take_qerr(gpsd_handle_t *handle, gpsd_track_t *track, time_t *second, long *qErr) {
 #if GPSD_API_MAJOR_VERSION >= 9
-    BUFFER_ADD("\"time\":%ld.%.9ld", handle->gpsd.fix.time.tv_sec, handle->gpsd.fix.time.tv_nsec);
+    long q = handle->gpsd.qErr;
+    time_t t = handle->gpsd.fix.time.tv_sec;
 #elif GPSD_API_MAJOR_VERSION >= 8
-    BUFFER_ADD("\"time\":%.9f", handle->gpsd.fix.time);
+    long q = handle->gpsd.fix.qErr;
+    time_t t = (time_t) handle->gpsd.fix.time;
+#else
+    long q = 0;
+    time_t t = 0;
 #endif
 
-    BUFFER_ADD(",\"sats_used\":%d,\"sats_visible\":%d,\"tdop\":%f,\"avg_snr\":%f",
-               handle->gpsd.satellites_used,
-               handle->gpsd.satellites_visible,
-               handle->gpsd.dop.tdop,
-               snr_avg);
-
-    long qErr = 0;
+    if (q == 0) {
+        return false;
+    }
+    // libgps keeps a single qErr for all devices, so a fix of another device must not take it as well...
 #if GPSD_API_MAJOR_VERSION >= 9
-    qErr = handle->gpsd.qErr;
+    handle->gpsd.qErr = 0;
 #elif GPSD_API_MAJOR_VERSION >= 8
-    qErr = data->fix.qErr;
+    handle->gpsd.fix.qErr = 0;
 #endif
+    track->qErr = q;
 
-    if (qErr != 0) {
-        BUFFER_ADD(",\"qErr\":%ld", qErr);
+    if (t == 0 || t == track->qerr_fix_second) {
+        return false;
     }
+    track->qerr_fix_second = t;
+
+    // Receivers report the quantization error of the next pulse...
+    *second = t + 1;
+    *qErr = q;
+    return true;
+}
 
-    BUFFER_ADD(",\"toff\":%f", TSTONS(&handle->toff_diff));
-    BUFFER_ADD(",\"pps\":%f", TSTONS(&handle->pps_diff));
+// Keeps the most recent offsets, and samples the kernel clock once per cycle...
+static void track_offsets(gpsd_handle_t *handle, gpsd_track_t *track, gps_mask_t set) {
+    bool toff = (set & TOFF_SET) != 0;
+    bool pps = (set & PPS_SET) != 0;
+    bool corrected = false;
+
+    // Either the PPS offset or the qErr of a second can arrive first...
+    if (pps) {
+        double offset = TSTONS(&track->pps_diff);
+        track->last_pps_second = handle->gpsd.pps.real.tv_sec;
+        corrected = pair_qerr(track, track->last_pps_second, &offset, NULL);
+    }
+    time_t second;
+    long qErr;
+    if (take_qerr(handle, track, &second, &qErr)) {
+        corrected |= pair_qerr(track, second, NULL, &qErr);
+    }
 
-    if (handle->gpsd.osc.running) {
-        if (handle->gpsd.osc.reference) {
-            BUFFER_ADD(",\"osc.pps\":true");
+    if (!toff && !pps && !corrected) {
+        return;
+    }
+    track->pps_seen |= pps;
+
+    // Sample at the PPS offset, or at the TOFF offset for sources without PPS...
+    bool sampled = false;
+    if (handle->kernel && (pps || !track->pps_seen)) {
+        int status = kclock_sample(&track->kernel_sample);
+        if (status) {
+            log_debug("Failed to sample kernel clock: %s", strerror(-status));
+        }
+        track->kernel_sampled = sampled = (status == 0);
+    }
+
+    begin_change(track);
+
+    if (toff) {
+        rolling_add(&track->toff_window, TSTONS(&track->toff_diff));
+    }
+    if (pps) {
+        rolling_add(&track->pps_window, TSTONS(&track->pps_diff));
+    }
+    if (corrected) {
+        rolling_add(&track->pps_corrected_window, track->pps_corrected);
+    }
+    if (sampled) {
+        rolling_add(&track->kernel_window, track->kernel_sample.offset);
+    }
+
+    end_change(track);
+
+    if (atomic_load_explicit(&track->warmup, memory_order_relaxed) == 0 &&
+            (track->toff_window.cnt == ROLLING_WINDOW || track->pps_window.cnt == ROLLING_WINDOW)) {
+        uint64_t now = monotonic_msec();
+        // 0 denotes a window that is still filling...
+        atomic_store_explicit(&track->warmup, (now > track->created) ? now - track->created : 1, memory_order_relaxed);
+    }
+}
+
+// Tracks the state of the oscillators, and completes their summary windows...
+static void track_osc(gpsd_handle_t *handle, gpsd_track_t *current, gps_mask_t set) {
+    uint64_t now = monotonic_msec();
+
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_track_t *track = handle->tracks[i];
+        osc_state_t previous = OSC_ABSENT;
+        bool changed;
+
+        if (track == NULL) {
+            continue;
+        }
+
+        begin_change(track);
+
+        if (track == current && (set & OSCILLATOR_SET)) {
+            // libgps keeps a single oscillator state for all devices...
+            track->osc_running = handle->gpsd.osc.running;
+            track->osc_reference = handle->gpsd.osc.reference;
+            track->osc_disciplined = handle->gpsd.osc.disciplined;
+            track->osc_delta = handle->gpsd.osc.delta;
+
+            changed = osc_feed(track->osc,
+                               track->osc_running,
+                               track->osc_reference,
+                               track->osc_disciplined,
+                               track->osc_delta,
+                               now, &previous);
         } else {
-            BUFFER_ADD(",\"osc.pps\":false");
+            // Silent devices time out as well...
+            changed = osc_tick(track->osc, now, &previous);
+        }
+        bool summarized = osc_take_summary(track->osc, now, &track->osc_summary);
+
+        end_change(track);
+
+        if (changed) {
+            log_info("GPS oscillator of %s:%s %s changed from %s to %s", handle->host, handle->port, track->path,
+                     osc_state_name(previous), osc_state_name(osc_state(track->osc)));
+
+            // A change that is not reported yet keeps its original state...
+            if (!track->osc_pending) {
+                track->osc_previous = previous;
+            }
+            track->osc_pending = true;
+        }
+
+        if (summarized) {
+            track->osc_summary_pending = true;
+        }
+    }
+}
+
+static inline void cn0_inc(uint16_t *bin) {
+    if (*bin < UINT16_MAX) {
+        (*bin)++;
+    }
+}
+
+// Adds each skyview to the C/N0 histograms of its device, and completes their windows...
+static void track_cn0(gpsd_handle_t *handle, gpsd_track_t *current, gps_mask_t set) {
+    if (handle->cn0_window == 0) {
+        return;
+    }
+
+    uint64_t now = monotonic_msec();
+    if (current) {
+        begin_change(current);
+    }
+    if (current && current->cn0_start == 0) {
+        current->cn0_start = now;
+    }
+
+    if (current && (set & SATELLITE_SET)) {
+        current->cn0_skyviews++;
+
+        for (int i = 0; i < handle->gpsd.satellites_visible && i < MAXCHANNELS; i++) {
+            const struct satellite_t *skyview = &handle->gpsd.skyview[i];
+
+            int svid;
+            int gnssid = sat_gnssid(skyview, &svid);
+            // Satellites that are not tracked have no C/N0 (which also rules out NaN)...
+            if (gnssid < 0 || gnssid >= GNSSID_CNT || !(skyview->ss > 0)) {
+                continue;
+            }
+
+            gps_cn0_info_t *cn0 = &current->cn0[gnssid];
+            size_t bin = (skyview->ss < GPS_CN0_BINS - 1) ? (size_t) skyview->ss : GPS_CN0_BINS - 1;
+
+            cn0_inc(&cn0->visible[bin]);
+            cn0->visible_cnt++;
+            if (skyview->used) {
+                cn0_inc(&cn0->used[bin]);
+                cn0->used_cnt++;
+            }
+        }
+    }
+    if (current) {
+        end_change(current);
+    }
+
+    for (size_t t = 0; t < GPS_MAX_DEVICES; t++) {
+        gpsd_track_t *track = handle->tracks[t];
+        // A window that is not reported yet is not to be touched, @see #next_cn0_event...
+        if (track == NULL || track->cn0_start == 0 || track->cn0_pending || now < track->cn0_start + handle->cn0_window) {
+            continue;
+        }
+
+        begin_change(track);
+        for (uint8_t i = 0; i < GNSSID_CNT; i++) {
+            track->cn0[i].gnssid = i;
+            track->cn0[i].window = now - track->cn0_start;
+            track->cn0[i].skyviews = track->cn0_skyviews;
+        }
+        // Reported before any new skyview is added, @see #next_cn0_event...
+        track->cn0_pending = true;
+        track->cn0_skyviews = 0;
+        track->cn0_start = now;
+        end_change(track);
+    }
+}
+
+static gpsd_offset_stats_t dump_offsets(const gpsd_track_t *track) {
+    gpsd_offset_stats_t stats;
+
+    rolling_t toff, pps, pps_corrected, kernel;
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&track->state_seq, memory_order_acquire);
+
+        toff = track->toff_window;
+        pps = track->pps_window;
+        pps_corrected = track->pps_corrected_window;
+        kernel = track->kernel_window;
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&track->state_seq, memory_order_relaxed));
+
+    stats.toff = rolling_stats(&toff);
+    stats.pps = rolling_stats(&pps);
+    stats.pps_corrected = rolling_stats(&pps_corrected);
+    stats.kernel = rolling_stats(&kernel);
+
+    return stats;
+}
+
+size_t gpsd_dump_devices(gpsd_handle_t *handle, gpsd_device_stats_t *devices, size_t max) {
+    if (handle == NULL || devices == NULL) {
+        return 0;
+    }
+
+    size_t cnt = 0;
+
+    // Keeps the pipelines from being reclaimed while we read them...
+    pthread_mutex_lock(&handle->tracks_lock);
+
+    for (size_t i = 0; i < GPS_MAX_DEVICES && cnt < max; i++) {
+        const gpsd_track_t *track = handle->tracks[i];
+        if (track == NULL) {
+            continue;
         }
-        if (handle->gpsd.osc.disciplined) {
-            BUFFER_ADD(",\"osc.gps\":true");
+
+        gpsd_device_stats_t *stats = &devices[cnt++];
+        strncpy(stats->path, track->path, sizeof(stats->path) - 1);
+        stats->path[sizeof(stats->path) - 1] = 0;
+        stats->offsets = dump_offsets(track);
+        stats->warmup_msec = atomic_load_explicit(&track->warmup, memory_order_relaxed);
+        stats->osc = osc_dump_stats(track->osc);
+        stats->nmea_type_cnt = track->nmea ? nmea_dump_types(track->nmea, stats->nmea_types, NMEA_MAX_TYPES + 1) : 0;
+    }
+
+    pthread_mutex_unlock(&handle->tracks_lock);
+
+    return cnt;
+}
+
+// Saves the state of a pipeline, which its reading thread might change meanwhile...
+static void save_track(const gpsd_handle_t *handle, const gpsd_track_t *track, uint64_t now, gpsd_saved_device_t *saved) {
+    bzero(saved, sizeof(gpsd_saved_device_t));
+    strncpy(saved->source, handle->name, sizeof(saved->source) - 1);
+    strncpy(saved->path, track->path, sizeof(saved->path) - 1);
+
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&track->state_seq, memory_order_acquire);
+
+        saved->toff = track->toff_window;
+        saved->pps = track->pps_window;
+        saved->pps_corrected = track->pps_corrected_window;
+        saved->kernel = track->kernel_window;
+
+        osc_save(track->osc, now, &saved->osc);
+
+        saved->cn0_started = (track->cn0_start != 0);
+        saved->cn0_elapsed = (now > track->cn0_start) ? now - track->cn0_start : 0;
+        saved->cn0_skyviews = track->cn0_skyviews;
+        if (track->cn0_pending) {
+            // These are the histograms of the window that is being reported, the current one just started...
+            bzero(saved->cn0, sizeof(saved->cn0));
         } else {
-            BUFFER_ADD(",\"osc.gps\":false");
+            memcpy(saved->cn0, track->cn0, sizeof(saved->cn0));
         }
-        BUFFER_ADD(",\"osc.delta\":%d", handle->gpsd.osc.delta);
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&track->state_seq, memory_order_relaxed));
+}
+
+size_t gpsd_save_devices(gpsd_handle_t *handle, gpsd_saved_device_t *devices, size_t max) {
+    if (handle == NULL || devices == NULL) {
+        return 0;
     }
 
-    for (int i = 0; i < GNSSID_CNT; i++) {
-        uint8_t seen = sats_seen[i];
-        if (seen > 0) {
-            BUFFER_ADD(",\"sats.%s\":%d", gnssid_name[i], sats_seen[i]);
+    size_t cnt = 0;
+    uint64_t now = monotonic_msec();
+
+    // Keeps the pipelines from being reclaimed while we read them...
+    pthread_mutex_lock(&handle->tracks_lock);
+
+    for (size_t i = 0; i < GPS_MAX_DEVICES && cnt < max; i++) {
+        const gpsd_track_t *track = handle->tracks[i];
+        if (track) {
+            save_track(handle, track, now, &devices[cnt++]);
         }
     }
 
-    BUFFER_ADD("}");
+    pthread_mutex_unlock(&handle->tracks_lock);
 
-    return (int) offset;
+    return cnt;
 }
 
-int gpsd_read_data(gpsd_handle_t *handle, char **result) {
-    if (handle == NULL) {
-        return -EINVAL;
+// Keeps the state of a pipeline that is destroyed, for the pipeline of its device once its source reconnects...
+static void stash_track(const gpsd_handle_t *handle, const gpsd_track_t *track, uint64_t now) {
+    gpsd_saved_device_t saved;
+    save_track(handle, track, now, &saved);
+
+    pthread_mutex_lock(&restored_lock);
+
+    // Replaces an older state of the same device, or takes the first free entry...
+    gpsd_saved_device_t *entry = NULL;
+    gpsd_saved_device_t *free_entry = NULL;
+    for (size_t i = 0; i < restored_cnt && !entry; i++) {
+        if (!restored[i].source[0]) {
+            free_entry = free_entry ? free_entry : &restored[i];
+        } else if (strcmp(restored[i].source, saved.source) == 0 && strcmp(restored[i].path, saved.path) == 0) {
+            entry = &restored[i];
+        }
+    }
+    if (!entry && free_entry) {
+        entry = free_entry;
+        restored_left++;
+    } else if (!entry && restored_cnt < GPS_SAVED_DEVICES) {
+        gpsd_saved_device_t *grown = mem_realloc(MEM_GPSD, restored, (restored_cnt + 1) * sizeof(gpsd_saved_device_t));
+        if (grown) {
+            restored = grown;
+            entry = &restored[restored_cnt++];
+            restored_left++;
+        }
     }
 
-#if GPSD_API_MAJOR_VERSION >= 8
-    int status = gps_read(&handle->gpsd, NULL, 0);
-#else
-    int status = gps_read(&handle->gpsd);
-#endif
-    if (status < 0) {
-        log_warning("Failed to read from GPSD: %s", GPSD_ERROR(status));
-        return -ENOTCONN;
-    } else if (status == 0) {
-        // No data was available...
+    if (entry) {
+        *entry = saved;
+    } else {
+        log_debug("Not keeping the state of GPS device %s of %s: too many devices!", track->path, handle->name);
+    }
+
+    pthread_mutex_unlock(&restored_lock);
+}
+
+size_t gpsd_save_kept_devices(gpsd_saved_device_t *devices, size_t max) {
+    if (devices == NULL) {
         return 0;
     }
 
+    size_t cnt = 0;
+
+    pthread_mutex_lock(&restored_lock);
+    for (size_t i = 0; i < restored_cnt && cnt < max; i++) {
+        if (restored[i].source[0]) {
+            devices[cnt++] = restored[i];
+        }
+    }
+    pthread_mutex_unlock(&restored_lock);
+
+    return cnt;
+}
+
+int gpsd_restore_devices(const gpsd_saved_device_t *devices, size_t cnt) {
+    if (devices == NULL && cnt > 0) {
+        return -EINVAL;
+    }
+
+    gpsd_saved_device_t *copy = NULL;
+    if (cnt > 0) {
+        copy = mem_malloc(MEM_GPSD, cnt * sizeof(gpsd_saved_device_t));
+        if (copy == NULL) {
+            log_error("failed to restore GPS devices: out of memory!");
+            return -ENOMEM;
+        }
+        memcpy(copy, devices, cnt * sizeof(gpsd_saved_device_t));
+    }
+
+    pthread_mutex_lock(&restored_lock);
+    mem_free(MEM_GPSD, restored);
+    restored = copy;
+    restored_cnt = cnt;
+    restored_left = cnt;
+    pthread_mutex_unlock(&restored_lock);
+
+    return 0;
+}
+
+bool gpsd_filter_event(const config_t *config, gps_event_t *event) {
+    if (event->type != GPS_EVENT_FIX) {
+        return true;
+    }
+
+    for (uint8_t i = 0; i < config->filter_cnt; i++) {
+        if (expr_eval(config->filters[i], event) == 0) {
+            return false;
+        }
+    }
+
+    for (uint8_t i = 0; i < config->derived_cnt; i++) {
+        event->derived[i] = expr_eval(config->derived[i], event);
+    }
+    event->derived_cnt = config->derived_cnt;
+    event->derived_names = (const char *const *) config->derived_names;
+
+    return true;
+}
+
+static gpsd_device_t *find_device(gpsd_handle_t *handle, const char *path) {
+    gpsd_device_t *unused = NULL;
+
+    for (int i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_device_t *device = &handle->devices[i];
+        if (!device->used) {
+            unused = unused ? unused : device;
+        } else if (strcmp(device->path, path) == 0) {
+            return device;
+        }
+    }
+    return unused;
+}
+
+static void mark_device(gpsd_device_t *device, gps_device_change_t change) {
+    // A device that is not reported yet remains added...
+    if (!device->pending || device->info.change != GPS_DEVICE_ADDED || change == GPS_DEVICE_REMOVED) {
+        device->info.change = change;
+    }
+    device->pending = true;
+}
+
+// Compares the settings of a device with the ones reported before, marking any change...
+static void track_device(gpsd_handle_t *handle, const struct devconfig_t *dev) {
+    gpsd_device_t *device = find_device(handle, dev->path);
+
+    if (!DEV_ACTIVE(dev)) {
+        if (device && device->used) {
+            log_info("GPS device %s removed", device->path);
+            mark_device(device, GPS_DEVICE_REMOVED);
+        }
+        reclaim_device(handle, dev->path);
+        return;
+    }
+
+    if (device == NULL) {
+        log_debug("Not tracking GPS device %s: too many devices!", dev->path);
+        return;
+    }
+
+    unsigned int bps = dev->baudrate;
+    double cycle = DEV_CYCLE(dev);
+
+    if (!device->used) {
+        log_info("GPS device %s added (driver: %s, %u bps, cycle %.2f s)", dev->path, dev->driver, bps, cycle);
+
+        bzero(device, sizeof(gpsd_device_t));
+        device->used = true;
+        strncpy(device->path, dev->path, sizeof(device->path) - 1);
+        mark_device(device, GPS_DEVICE_ADDED);
+    } else if (device->info.bps != bps || fabs(device->info.cycle - cycle) > 1e-6) {
+        log_info("GPS device %s changed from %u bps, cycle %.2f s to %u bps, cycle %.2f s",
+                 dev->path, device->info.bps, device->info.cycle, bps, cycle);
+
+        mark_device(device, GPS_DEVICE_CHANGED);
+    } else if (device->info.change == GPS_DEVICE_REMOVED) {
+        // Reappeared before its removal was reported...
+        mark_device(device, GPS_DEVICE_CHANGED);
+    }
+
+    strncpy(device->info.driver, dev->driver, sizeof(device->info.driver) - 1);
+    device->info.bps = bps;
+    device->info.cycle = cycle;
+}
+
+// Marks all devices that are no longer listed by GPSD as removed...
+static void track_device_list(gpsd_handle_t *handle) {
+    for (int i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_device_t *device = &handle->devices[i];
+        bool listed = false;
+
+        for (int j = 0; device->used && j < handle->gpsd.devices.ndevices && !listed; j++) {
+            listed = strcmp(device->path, handle->gpsd.devices.list[j].path) == 0;
+        }
+        if (device->used && !listed && device->info.change != GPS_DEVICE_REMOVED) {
+            log_info("GPS device %s removed", device->path);
+            mark_device(device, GPS_DEVICE_REMOVED);
+            reclaim_device(handle, device->path);
+        }
+    }
+
+    for (int j = 0; j < handle->gpsd.devices.ndevices; j++) {
+        track_device(handle, &handle->gpsd.devices.list[j]);
+    }
+}
+
+// Fills the event with the next unreported change of a device, returns true if there was one...
+static bool next_device_event(gpsd_handle_t *handle, gps_event_t *event) {
+    for (int i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_device_t *device = &handle->devices[i];
+        if (!device->pending) {
+            continue;
+        }
+
+        bzero(event, offsetof(gps_event_t, sats));
+        event->type = GPS_EVENT_DEVICE;
+        strncpy(event->source, handle->name, sizeof(event->source) - 1);
+        strncpy(event->device, device->path, sizeof(event->device) - 1);
+        clock_gettime(CLOCK_REALTIME, &event->time);
+        event->dev = device->info;
+        event->derived_cnt = 0;
+
+        device->pending = false;
+        if (device->info.change == GPS_DEVICE_REMOVED) {
+            bzero(device, sizeof(gpsd_device_t));
+        }
+
+        // Update stats...
+        metrics_inc(METRIC_GPSD_DEVICE_EVENTS, handle->index);
+
+        return true;
+    }
+    return false;
+}
+
+// Fills the event with the next unreported change or summary of the oscillator of a device, returns true if there was one...
+static bool next_osc_event(gpsd_handle_t *handle, gpsd_track_t *track, gps_event_t *event) {
+    if (!track->osc_pending && !track->osc_summary_pending) {
+        return false;
+    }
+
+    bzero(event, offsetof(gps_event_t, sats));
+    set_event_device(handle, track, event);
+    clock_gettime(CLOCK_REALTIME, &event->time);
+    event->derived_cnt = 0;
+
+    if (track->osc_pending) {
+        event->type = GPS_EVENT_OSC_STATE;
+        event->osc.state = osc_state(track->osc);
+        event->osc.previous = track->osc_previous;
+        track->osc_pending = false;
+    } else {
+        event->type = GPS_EVENT_OSC_SUMMARY;
+        event->osc.state = track->osc_summary.state;
+        event->osc.summary = track->osc_summary;
+        track->osc_summary_pending = false;
+    }
+
+    return true;
+}
+
+// Fills the event with the C/N0 histograms of the next constellation of the last window of a device, returns true if there was one...
+static bool next_cn0_event(gpsd_handle_t *handle, gpsd_track_t *track, gps_event_t *event) {
+    if (!track->cn0_pending) {
+        return false;
+    }
+
+    for (int i = 0; i < GNSSID_CNT; i++) {
+        gps_cn0_info_t *cn0 = &track->cn0[i];
+        if (cn0->visible_cnt == 0) {
+            continue;
+        }
+
+        bzero(event, offsetof(gps_event_t, sats));
+        event->type = GPS_EVENT_CN0;
+        set_event_device(handle, track, event);
+        clock_gettime(CLOCK_REALTIME, &event->time);
+        event->cn0 = *cn0;
+        event->derived_cnt = 0;
+
+        bzero(cn0, sizeof(gps_cn0_info_t));
+        return true;
+    }
+
+    // All constellations are reported, the next window can be filled...
+    begin_change(track);
+    track->cn0_pending = false;
+    end_change(track);
+    return false;
+}
+
+// Fills the event with the next event that is not derived from the fix, returns true if there was one...
+static bool next_pending_event(gpsd_handle_t *handle, gps_event_t *event) {
+    if (next_device_event(handle, event)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        gpsd_track_t *track = handle->tracks[i];
+        if (track && (next_osc_event(handle, track, event) || next_cn0_event(handle, track, event))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns whether any change is left to report, without taking it...
+static bool has_pending_event(const gpsd_handle_t *handle) {
+    for (size_t i = 0; i < GPS_MAX_DEVICES; i++) {
+        const gpsd_track_t *track = handle->tracks[i];
+        if (handle->devices[i].pending ||
+                (track && (track->osc_pending || track->osc_summary_pending || track->cn0_pending))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Processes the data of GPSD once it is unpacked, returns 1 if the event is filled...
+static int process_data(gpsd_handle_t *handle, gps_event_t *event) {
     if (handle->gpsd.set & ERROR_SET) {
         log_warning("GPSD returned error: %s", handle->gpsd.error);
         return -EIO;
     }
 
     // Update stats...
-    handle->gpsd_events_recv++;
-    handle->gpsd_last_event = time(NULL);
+    metrics_inc(METRIC_GPSD_EVENTS_RECV, handle->index);
+    metrics_set(METRIC_GPSD_LAST_EVENT, handle->index, time(NULL));
 
     if (handle->gpsd.set & VERSION_SET) {
         log_info("Connected to GPSD with protocol v%d.%d (release: %s)",
@@ -300,44 +1275,215 @@ int gpsd_read_data(gpsd_handle_t *handle, char **result) {
         return 0;
     }
 
+    if (handle->gpsd.set & (DEVICE_SET | DEVICELIST_SET)) {
+        if (handle->gpsd.set & DEVICELIST_SET) {
+            track_device_list(handle);
+        } else {
+            track_device(handle, &handle->gpsd.dev);
+        }
+        handle->gpsd.set = 0;
 
-#if GPSD_API_MAJOR_VERSION >= 9
-    TS_SUB(&handle->toff_diff, &handle->gpsd.toff.clock, &handle->gpsd.toff.real);
-    TS_SUB(&handle->pps_diff, &handle->gpsd.pps.clock, &handle->gpsd.pps.real);
-#else
+        // These carry no fix, any other changes are reported by subsequent calls...
+        return next_pending_event(handle, event) ? 1 : 0;
+    }
+
+    reclaim_idle(handle);
+
+    // Messages without a device of their own (such as VERSION) only complete windows...
+    gpsd_track_t *track = (handle->gpsd.set & TRACK_SET) ? find_track(handle) : NULL;
+
+    track_osc(handle, track, handle->gpsd.set);
+    track_cn0(handle, track, handle->gpsd.set);
+
+    if (handle->gpsd.set & OSCILLATOR_SET) {
+        handle->gpsd.set = 0;
+
+        // Neither does an OSC message, its state is reported by its own events...
+        return next_pending_event(handle, event) ? 1 : 0;
+    }
+
+    if (track == NULL) {
+        handle->gpsd.set = 0;
+        return 0;
+    }
+
+    // libgps keeps the offsets of all devices in one place, so only the ones just received are taken...
     if (handle->gpsd.set & TOFF_SET) {
-        TS_SUB(&handle->toff_diff, &handle->gpsd.toff.clock, &handle->gpsd.toff.real);
+        TS_SUB(&track->toff_diff, &handle->gpsd.toff.clock, &handle->gpsd.toff.real);
     }
 
     if (handle->gpsd.set & PPS_SET) {
-        TS_SUB(&handle->pps_diff, &handle->gpsd.pps.clock, &handle->gpsd.pps.real);
+        TS_SUB(&track->pps_diff, &handle->gpsd.pps.clock, &handle->gpsd.pps.real);
     }
-#endif
+
+    track_offsets(handle, track, handle->gpsd.set);
 
     handle->gpsd.set = 0;
 
     if ((handle->gpsd.fix.mode > MODE_NO_FIX) && (handle->gpsd.satellites_used > 0)) {
-        // Update stats...
-        handle->gpsd_events_send++;
-
-        return create_event_payload(handle, result);
+        // Filtering is left to the caller, as only it can follow configuration reloads...
+        create_event_payload(handle, track, event);
+        return 1;
     }
 
     return 0;
 }
 
-gpsd_stats_t gpsd_dump_stats(gpsd_handle_t *handle) {
+// Fires the gpsd_recv probe, the class of the message is only extracted when traced...
+static void trace_recv(const gpsd_handle_t *handle, const char *msg, size_t bytes) {
+    if (TRACE_ENABLED(gpsd_recv)) {
+        char class[16] = "";
+        const char *p = msg ? strstr(msg, "\"class\":\"") : NULL;
+        if (p) {
+            p += sizeof("\"class\":\"") - 1;
+            size_t n = strcspn(p, "\"");
+            if (n >= sizeof(class)) {
+                n = sizeof(class) - 1;
+            }
+            memcpy(class, p, n);
+            class[n] = 0;
+        }
+        TRACE3(gpsd_recv, handle->host, class, bytes);
+    }
+}
+
+// Sentences carry no device, so they count for the device that reported last...
+static void feed_nmea(gpsd_handle_t *handle, const char *line, size_t len) {
+    gpsd_track_t *track = find_track(handle);
+    if (track) {
+        nmea_feed(track->nmea, line, len, monotonic_msec());
+    }
+}
+
+int gpsd_read_data(gpsd_handle_t *handle, gps_event_t *event) {
+    if (handle == NULL || event == NULL) {
+        return -EINVAL;
+    }
+
+    // Report the remaining changes of a DEVICES message (or the oscillator) first...
+    if (next_pending_event(handle, event)) {
+        return 1;
+    }
+
+#if GPSD_API_MAJOR_VERSION >= 8
+    int status = gps_read(&handle->gpsd, NULL, 0);
+#else
+    int status = gps_read(&handle->gpsd);
+#endif
+    if (status < 0) {
+        log_warning("Failed to read from GPSD: %s", GPSD_ERROR(status));
+        return -ENOTCONN;
+    } else if (status == 0) {
+        // No data was available...
+        return 0;
+    }
+
+    const char *msg = gps_data(&handle->gpsd);
+    if (msg && nmea_is_sentence(msg)) {
+        if (handle->nmea) {
+            feed_nmea(handle, msg, strlen(msg));
+        }
+        // libgps does not unpack sentences, yet marks them as received...
+        handle->gpsd.set &= ~PACKET_SET;
+        return 0;
+    }
+
+    trace_recv(handle, msg, (size_t) status);
+
+    return process_data(handle, event);
+}
+
+bool gpsd_data_waiting(gpsd_handle_t *handle) {
     if (handle == NULL) {
-        return (gpsd_stats_t) {
-            0
-        };
+        return false;
+    }
+    return has_pending_event(handle) || gps_waiting(&handle->gpsd, 0);
+}
+
+// Unpacks a single (NUL-terminated) line of JSON, like gps_read does...
+static int unpack_line(gpsd_handle_t *handle, char *line, size_t len, gpsd_event_callback_t callback, void *context) {
+    gps_event_t event;
+
+    if (*line == 0 || *line == '\r') {
+        // Nothing to unpack...
+        return 0;
+    }
+    if (nmea_is_sentence(line)) {
+        if (handle->nmea) {
+            feed_nmea(handle, line, len);
+        }
+        return 0;
+    }
+
+    handle->gpsd.set &= ~PACKET_SET;
+    if (gps_unpack(line, &handle->gpsd) < 0) {
+        log_debug("Failed to unpack data of GPSD: %s", line);
+        return 0;
+    }
+    handle->gpsd.set |= PACKET_SET;
+
+    trace_recv(handle, line, len);
+
+    int status = process_data(handle, &event);
+    if (status > 0) {
+        callback(&event, context);
+    }
+    if (status >= 0) {
+        // A DEVICES message can change several devices at once, and a fix can complete a window of the oscillator...
+        while (next_pending_event(handle, &event)) {
+            callback(&event, context);
+            status++;
+        }
+    }
+    return status;
+}
+
+int gpsd_feed_data(gpsd_handle_t *handle, char *data, size_t len, gpsd_event_callback_t callback, void *context) {
+    if (handle == NULL || data == NULL || callback == NULL) {
+        return -EINVAL;
+    }
+
+    int events = 0;
+    char *end = data + len;
+
+    while (data < end) {
+        char *eol = memchr(data, '\n', (size_t)(end - data));
+        size_t n = (size_t)((eol ? eol : end) - data);
+
+        if (handle->line_overflow) {
+            // Skip the remainder of an oversized line...
+            handle->line_overflow = (eol == NULL);
+        } else if (handle->line_len == 0 && eol) {
+            // Common case: parse complete lines directly from the given buffer...
+            *eol = 0;
+            int status = unpack_line(handle, data, n, callback, context);
+            if (status > 0) {
+                events += status;
+            }
+        } else if (handle->line_len + n > MAX_LINE_SIZE) {
+            log_debug("Dropping oversized line of GPSD!");
+            handle->line_overflow = (eol == NULL);
+            handle->line_len = 0;
+        } else {
+            memcpy(handle->line + handle->line_len, data, n);
+            handle->line_len += n;
+
+            if (eol) {
+                size_t line_len = handle->line_len;
+                handle->line[line_len] = 0;
+                handle->line_len = 0;
+
+                int status = unpack_line(handle, handle->line, line_len, callback, context);
+                if (status > 0) {
+                    events += status;
+                }
+            }
+        }
+
+        data += n + (eol ? 1 : 0);
     }
 
-    return (gpsd_stats_t) {
-        .events_recv = handle->gpsd_events_recv,
-        .events_send = handle->gpsd_events_send,
-        .last_event = handle->gpsd_last_event,
-    };
+    return events;
 }
 
 // EOF
\ No newline at end of file
@@ -0,0 +1,570 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "evloop.h"
+#include "http.h"
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+#include "payload.h"
+#include "trace.h"
+#include "wheel.h"
+
+#define EVENTS_PATH "/events"
+
+#define LISTEN_BACKLOG 128
+#define MAX_REQUEST_SIZE 512
+#define MAX_IOV 16
+// the time a client has to send its request, in milliseconds...
+#define REQUEST_TIMEOUT 10000
+// the file descriptors we need besides those of our clients (GPSD, MQTT, logging, ...)...
+#define RESERVED_FDS 64
+
+static const char sse_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char not_found_response[] =
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char bad_request_response[] =
+    "HTTP/1.1 400 Bad Request\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/**
+ * A serialized SSE message, shared by all clients it is queued for.
+ */
+typedef struct http_msg {
+    uint32_t refcnt;
+    size_t len;
+    char data[];
+} http_msg_t;
+
+typedef enum client_state {
+    CLIENT_REQUEST = 0,
+    CLIENT_STREAMING,
+    CLIENT_CLOSING,
+} client_state_t;
+
+typedef struct http_client {
+    struct http_client *prev;
+    struct http_client *next;
+
+    struct http_handle *handle;
+
+    int fd;
+    client_state_t state;
+    // closes the client if it does not subscribe in time...
+    wheel_timer_t request_timer;
+
+    // the (static) response that is being written, if any...
+    const char *response;
+    size_t response_len;
+    size_t response_off;
+
+    // bounded ring of queued messages...
+    uint16_t q_head;
+    uint16_t q_len;
+    size_t q_off; // offset in the message at the head of the queue
+    http_msg_t **queue;
+
+    size_t req_len;
+    char req[MAX_REQUEST_SIZE];
+} http_client_t;
+
+struct http_handle {
+    char *host;
+    char *port;
+    uint16_t max_clients;
+    uint16_t queue_size;
+
+    evloop_t *loop;
+    wheel_t *wheel;
+    int listen_fd;
+
+    http_client_t *clients;
+
+    uint32_t http_clients;
+};
+
+static inline http_msg_t *msg_ref(http_msg_t *msg) {
+    msg->refcnt++;
+    return msg;
+}
+
+static inline void msg_unref(http_msg_t *msg) {
+    if (msg && --msg->refcnt == 0) {
+        mem_free(MEM_HTTP, msg);
+    }
+}
+
+static void client_close(http_handle_t *handle, http_client_t *client) {
+    wheel_cancel(handle->wheel, &client->request_timer);
+    evloop_remove(handle->loop, client->fd);
+    close(client->fd);
+
+    while (client->q_len > 0) {
+        msg_unref(client->queue[client->q_head]);
+        client->q_head = (uint16_t)((client->q_head + 1) % handle->queue_size);
+        client->q_len--;
+    }
+
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        handle->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+
+    handle->http_clients--;
+    metrics_adjust(METRIC_HTTP_CLIENTS, 0, -1);
+
+    mem_free(MEM_HTTP, client->queue);
+    mem_free(MEM_HTTP, client);
+}
+
+// Writes as much pending data as possible, returns -1 if the client should be closed...
+static int client_flush(http_handle_t *handle, http_client_t *client) {
+    while (client->response) {
+        ssize_t n = send(client->fd, client->response + client->response_off,
+                         client->response_len - client->response_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        client->response_off += (size_t) n;
+        if (client->response_off >= client->response_len) {
+            client->response = NULL;
+        }
+    }
+
+    if (client->state == CLIENT_CLOSING) {
+        return -1;
+    }
+
+    while (client->q_len > 0) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+
+        for (uint16_t i = 0; i < client->q_len && iovcnt < MAX_IOV; i++) {
+            http_msg_t *msg = client->queue[(client->q_head + i) % handle->queue_size];
+            size_t off = (i == 0) ? client->q_off : 0;
+
+            iov[iovcnt].iov_base = msg->data + off;
+            iov[iovcnt].iov_len = msg->len - off;
+            iovcnt++;
+        }
+
+        struct msghdr hdr = {
+            .msg_iov = iov,
+            .msg_iovlen = (size_t) iovcnt,
+        };
+
+        ssize_t n = sendmsg(client->fd, &hdr, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        // Release all messages that are written completely...
+        size_t written = (size_t) n;
+        while (written > 0 && client->q_len > 0) {
+            http_msg_t *msg = client->queue[client->q_head];
+            size_t remaining = msg->len - client->q_off;
+
+            if (written < remaining) {
+                client->q_off += written;
+                break;
+            }
+
+            written -= remaining;
+            msg_unref(msg);
+            client->q_head = (uint16_t)((client->q_head + 1) % handle->queue_size);
+            client->q_len--;
+            client->q_off = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void client_respond(http_client_t *client, const char *response, size_t len, client_state_t state) {
+    client->response = response;
+    client->response_len = len;
+    client->response_off = 0;
+    client->state = state;
+}
+
+static void client_request_timeout(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+    http_client_t *client = context;
+
+    log_debug("Closing HTTP client: no request received in time!");
+
+    // Update stats...
+    metrics_inc(METRIC_HTTP_CLIENTS_TIMED_OUT, 0);
+
+    client_close(client->handle, client);
+}
+
+// Parses the request line once all request headers are received...
+static void client_handle_request(http_client_t *client) {
+    char *eol = strstr(client->req, "\r\n");
+    if (!eol) {
+        client_respond(client, bad_request_response, sizeof(bad_request_response) - 1, CLIENT_CLOSING);
+        return;
+    }
+    *eol = 0;
+
+    char *method = client->req;
+    char *path = strchr(method, ' ');
+    if (!path) {
+        client_respond(client, bad_request_response, sizeof(bad_request_response) - 1, CLIENT_CLOSING);
+        return;
+    }
+    *path++ = 0;
+
+    char *version = strchr(path, ' ');
+    if (version) {
+        *version = 0;
+    }
+
+    if (strcmp(method, "GET") != 0) {
+        client_respond(client, bad_request_response, sizeof(bad_request_response) - 1, CLIENT_CLOSING);
+    } else if (strcmp(path, EVENTS_PATH) != 0) {
+        client_respond(client, not_found_response, sizeof(not_found_response) - 1, CLIENT_CLOSING);
+    } else {
+        log_debug("HTTP client subscribed to " EVENTS_PATH);
+        client_respond(client, sse_response, sizeof(sse_response) - 1, CLIENT_STREAMING);
+        // Streaming clients are only closed when lagging behind...
+        wheel_cancel(client->handle->wheel, &client->request_timer);
+    }
+}
+
+// Reads all pending data, returns -1 if the client should be closed...
+static int client_read(http_client_t *client) {
+    for (;;) {
+        char discard[256];
+        char *buf = discard;
+        size_t len = sizeof(discard);
+
+        if (client->state == CLIENT_REQUEST) {
+            buf = client->req + client->req_len;
+            len = sizeof(client->req) - client->req_len - 1;
+            if (len == 0) {
+                client_respond(client, bad_request_response, sizeof(bad_request_response) - 1, CLIENT_CLOSING);
+                return 0;
+            }
+        }
+
+        ssize_t n = recv(client->fd, buf, len, 0);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        } else if (n == 0) {
+            // Remote end closed...
+            return -1;
+        }
+
+        if (client->state == CLIENT_REQUEST) {
+            client->req_len += (size_t) n;
+            client->req[client->req_len] = 0;
+
+            if (strstr(client->req, "\r\n\r\n")) {
+                client_handle_request(client);
+            }
+        }
+    }
+}
+
+static void client_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    http_client_t *client = context;
+    bool close_client = (events & (EPOLLERR | EPOLLHUP)) != 0;
+
+    if (!close_client && (events & (EPOLLIN | EPOLLRDHUP))) {
+        close_client = client_read(client) < 0;
+    }
+    if (!close_client) {
+        close_client = client_flush(client->handle, client) < 0;
+    }
+
+    if (close_client) {
+        client_close(client->handle, client);
+    }
+}
+
+static void http_accept(evloop_t *loop, int listen_fd, uint32_t events, void *context) {
+    (void)events;
+    http_handle_t *handle = context;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_warning("Failed to accept HTTP client: %s", strerror(errno));
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        if (handle->http_clients >= handle->max_clients) {
+            log_debug("Rejecting HTTP client: too many clients connected!");
+            close(fd);
+            continue;
+        }
+
+        http_client_t *client = mem_malloc(MEM_HTTP, sizeof(http_client_t));
+        http_msg_t **queue = mem_calloc(MEM_HTTP, handle->queue_size, sizeof(http_msg_t *));
+        if (!client || !queue) {
+            log_warning("Failed to accept HTTP client: out of memory!");
+            mem_free(MEM_HTTP, client);
+            mem_free(MEM_HTTP, queue);
+            close(fd);
+            continue;
+        }
+        bzero(client, sizeof(http_client_t));
+
+        client->handle = handle;
+        client->fd = fd;
+        client->queue = queue;
+        wheel_timer_init(&client->request_timer, client_request_timeout, client);
+
+        // Edge-triggered: we always read and write until EAGAIN...
+        if (wheel_schedule(handle->wheel, &client->request_timer, REQUEST_TIMEOUT) ||
+                evloop_add(loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, client_callback, client)) {
+            wheel_cancel(handle->wheel, &client->request_timer);
+            log_warning("Failed to register HTTP client!");
+            mem_free(MEM_HTTP, queue);
+            mem_free(MEM_HTTP, client);
+            close(fd);
+            continue;
+        }
+
+        client->next = handle->clients;
+        if (handle->clients) {
+            handle->clients->prev = client;
+        }
+        handle->clients = client;
+
+        // Update stats...
+        handle->http_clients++;
+        metrics_adjust(METRIC_HTTP_CLIENTS, 0, 1);
+        metrics_inc(METRIC_HTTP_CLIENTS_ACCEPTED, 0);
+    }
+}
+
+// Makes sure we can open a descriptor for each of our clients, raising our soft limit if needed...
+static void check_fd_limit(const config_t *config) {
+    struct rlimit limit;
+    rlim_t needed = (rlim_t) config->http_max_clients + config->source_cnt + RESERVED_FDS;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        log_warning("Unable to determine limit on open files: %s", strerror(errno));
+        return;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed) {
+        return;
+    }
+
+    rlim_t current = limit.rlim_cur;
+    limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max >= needed) ? needed : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = current;
+    }
+
+    if (limit.rlim_cur < needed) {
+        log_warning("Limit on open files (%lu) is too low for %u HTTP clients, raise it to at least %lu!",
+                    (unsigned long) limit.rlim_cur, config->http_max_clients, (unsigned long) needed);
+    } else {
+        log_info("Raised limit on open files from %lu to %lu for %u HTTP clients",
+                 (unsigned long) current, (unsigned long) limit.rlim_cur, config->http_max_clients);
+    }
+}
+
+http_handle_t *http_init(const config_t *config, evloop_t *loop, wheel_t *wheel) {
+    http_handle_t *handle = mem_malloc(MEM_HTTP, sizeof(http_handle_t));
+    if (handle == NULL) {
+        log_error("failed to create HTTP handle: out of memory!");
+        return NULL;
+    }
+    bzero(handle, sizeof(http_handle_t));
+
+    handle->host = config->http_host;
+    handle->port = config->http_port;
+    handle->max_clients = config->http_max_clients;
+    handle->queue_size = config->http_queue_size;
+
+    handle->loop = loop;
+    handle->wheel = wheel;
+    handle->listen_fd = -1;
+
+    check_fd_limit(config);
+
+    return handle;
+}
+
+void http_destroy(http_handle_t *handle) {
+    if (handle) {
+        while (handle->clients) {
+            client_close(handle, handle->clients);
+        }
+
+        if (handle->listen_fd >= 0) {
+            evloop_remove(handle->loop, handle->listen_fd);
+            close(handle->listen_fd);
+        }
+
+        mem_free(MEM_HTTP, handle);
+    }
+}
+
+int http_listen(http_handle_t *handle) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *res = NULL;
+
+    int status = getaddrinfo(handle->host, handle->port, &hints, &res);
+    if (status) {
+        log_error("failed to resolve HTTP listen address: %s", gai_strerror(status));
+        return -EINVAL;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, LISTEN_BACKLOG) == 0) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        log_error("failed to listen on %s:%s: %s", handle->host ? handle->host : "*", handle->port, strerror(errno));
+        return -ENOTCONN;
+    }
+
+    // Edge-triggered: we always accept until EAGAIN...
+    if (evloop_add(handle->loop, fd, EPOLLIN | EPOLLET, http_accept, handle)) {
+        log_error("failed to register HTTP listener!");
+        close(fd);
+        return -EINVAL;
+    }
+
+    handle->listen_fd = fd;
+
+    log_info("listening for HTTP clients on %s:%s...", handle->host ? handle->host : "*", handle->port);
+
+    return 0;
+}
+
+int http_send_event(http_handle_t *handle, const gps_event_t *event) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+    if (handle->clients == NULL) {
+        // Nobody is listening...
+        return 0;
+    }
+
+    char payload[PAYLOAD_MAX_SIZE];
+    int len = payload_encode_json(event, payload, sizeof(payload));
+    if (len < 0) {
+        log_warning("Failed to encode HTTP event: payload too large!");
+        return -ENOMEM;
+    }
+
+    // Serialize the event once, all clients share the same buffer...
+    size_t msg_len = (size_t) len + sizeof("data: \n\n") - 1;
+    http_msg_t *msg = mem_malloc(MEM_HTTP, sizeof(http_msg_t) + msg_len + 1);
+    if (msg == NULL) {
+        log_warning("Failed to create HTTP event: out of memory!");
+        return -ENOMEM;
+    }
+    msg->refcnt = 1;
+    msg->len = (size_t) snprintf(msg->data, msg_len + 1, "data: %s\n\n", payload);
+
+    http_client_t *client = handle->clients;
+    while (client) {
+        http_client_t *next = client->next;
+
+        if (client->state == CLIENT_STREAMING) {
+            if (client->q_len >= handle->queue_size) {
+                // Client is lagging behind too much...
+                log_debug("Dropping lagging HTTP client...");
+                TRACE2(drop, "http", client->fd);
+                metrics_inc(METRIC_HTTP_CLIENTS_DROPPED, 0);
+
+                client_close(handle, client);
+            } else {
+                uint16_t tail = (uint16_t)((client->q_head + client->q_len) % handle->queue_size);
+                client->queue[tail] = msg_ref(msg);
+                client->q_len++;
+
+                if (client_flush(handle, client) < 0) {
+                    client_close(handle, client);
+                }
+            }
+        }
+
+        client = next;
+    }
+
+    msg_unref(msg);
+
+    // Update stats...
+    metrics_inc(METRIC_HTTP_EVENTS_SEND, 0);
+    metrics_set(METRIC_HTTP_LAST_EVENT, 0, time(NULL));
+
+    return 0;
+}
+
+// EOF
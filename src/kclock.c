@@ -0,0 +1,45 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/timex.h>
+
+#include "kclock.h"
+
+int kclock_sample(kclock_sample_t *sample) {
+    if (sample == NULL) {
+        return -EINVAL;
+    }
+
+    // A zero mode only reads the state of the clock...
+    struct timex tx;
+    bzero(&tx, sizeof(tx));
+
+    int state = adjtimex(&tx);
+    if (state < 0) {
+        return -errno;
+    }
+
+    sample->offset = (double) tx.offset / ((tx.status & STA_NANO) ? 1e9 : 1e6);
+    // the frequency is in ppm with a 16-bit fraction...
+    sample->freq = (double) tx.freq / 65536.0;
+    sample->maxerror = (double) tx.maxerror / 1e6;
+    sample->esterror = (double) tx.esterror / 1e6;
+    sample->status = tx.status;
+    sample->state = state;
+
+    return 0;
+}
+
+bool kclock_synced(const kclock_sample_t *sample) {
+    return sample->state != TIME_ERROR && !(sample->status & STA_UNSYNC);
+}
+
+// EOF
@@ -0,0 +1,300 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "trace.h"
+
+// must be a power of two...
+#define LOG_QUEUE_SIZE 256
+#define LOG_QUEUE_MASK (LOG_QUEUE_SIZE - 1)
+#define LOG_MSG_SIZE 1024
+#define LOG_STACK_SIZE (128 * 1024)
+
+typedef struct log_entry {
+    // the position this entry can be written at (== position) or read at (== position + 1)...
+    _Atomic size_t seq;
+    log_prio_t prio;
+    char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+// Bounded multi-producer/single consumer queue, the workers log as well...
+static log_entry_t log_queue[LOG_QUEUE_SIZE];
+static _Alignas(64) _Atomic size_t log_head;
+static _Alignas(64) size_t log_tail;
+
+static _Atomic bool log_started;
+static _Atomic bool log_stopping;
+static _Atomic bool log_sleeping;
+static int log_event_fd = -1;
+static pthread_t log_thread;
+
+static _Atomic uint64_t log_queued;
+static _Atomic uint64_t log_dropped;
+static _Atomic uint64_t log_suppressed;
+
+bool log_debug_enabled = false;
+
+// Writes a message using the (synchronous) logging of udaemon...
+static void write_msg(log_prio_t prio, const char *msg) {
+    // the parentheses prevent our own macros from being expanded...
+    switch (prio) {
+    case PRIO_DEBUG:
+        (log_debug)("%s", msg);
+        break;
+    case PRIO_INFO:
+        (log_info)("%s", msg);
+        break;
+    case PRIO_WARNING:
+        (log_warning)("%s", msg);
+        break;
+    default:
+        (log_error)("%s", msg);
+        break;
+    }
+}
+
+// Returns whether a message of a call site can be logged, and how many were suppressed before it...
+static bool allow_msg(log_site_t *site, uint32_t *suppressed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    uint64_t window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    uint64_t current = (uint64_t) now.tv_sec + LOG_RATE_INTERVAL;
+
+    // starts at LOG_RATE_INTERVAL, so the first window always starts a new one...
+    if (current - window >= LOG_RATE_INTERVAL &&
+            atomic_compare_exchange_strong(&site->window, &window, current)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange(&site->suppressed, 0);
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) < LOG_RATE_BURST) {
+        return true;
+    }
+
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log_suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+// Formats a message, appending the number of suppressed messages, if any...
+static void format_msg(char *buf, uint32_t suppressed, const char *fmt, va_list args) {
+    int len = vsnprintf(buf, LOG_MSG_SIZE, fmt, args);
+    if (len >= LOG_MSG_SIZE) {
+        memcpy(buf + LOG_MSG_SIZE - 4, "...", 4);
+        len = LOG_MSG_SIZE - 1;
+    }
+    if (suppressed && len >= 0) {
+        snprintf(buf + len, LOG_MSG_SIZE - (size_t) len, " (suppressed %u similar messages)", suppressed);
+    }
+}
+
+// Writes all queued messages, returns false if the queue was empty...
+static bool drain_queue(void) {
+    bool drained = false;
+
+    for (;;) {
+        log_entry_t *entry = &log_queue[log_tail & LOG_QUEUE_MASK];
+        if (atomic_load_explicit(&entry->seq, memory_order_acquire) != log_tail + 1) {
+            break;
+        }
+
+        write_msg(entry->prio, entry->msg);
+
+        atomic_store_explicit(&entry->seq, log_tail + LOG_QUEUE_SIZE, memory_order_release);
+        log_tail++;
+        drained = true;
+    }
+
+    return drained;
+}
+
+// Tells how many messages were dropped since the last time...
+static void report_dropped(uint64_t *reported) {
+    uint64_t dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+    if (dropped != *reported) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Dropped %" PRIu64 " log messages, as the log writer could not keep up!", dropped - *reported);
+        write_msg(PRIO_WARNING, msg);
+        *reported = dropped;
+    }
+}
+
+static void *log_main(void *arg) {
+    (void)arg;
+    uint64_t reported = atomic_load(&log_dropped);
+
+    while (!atomic_load(&log_stopping)) {
+        if (drain_queue()) {
+            continue;
+        }
+
+        report_dropped(&reported);
+
+        // Announce we are going to sleep, and check once more to not miss a wakeup...
+        atomic_store(&log_sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&log_queue[log_tail & LOG_QUEUE_MASK].seq, memory_order_acquire) == log_tail + 1) {
+            atomic_store(&log_sleeping, false);
+            continue;
+        }
+
+        uint64_t cnt;
+        if (read(log_event_fd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+            (log_error)("Failed to wait for log messages: %s", strerror(errno));
+            break;
+        }
+    }
+
+    drain_queue();
+    report_dropped(&reported);
+
+    return NULL;
+}
+
+void log_async_set_debug(bool debug) {
+    log_debug_enabled = debug;
+}
+
+int log_async_start(void) {
+    if (atomic_load(&log_started)) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+        atomic_init(&log_queue[i].seq, i);
+    }
+    atomic_store(&log_head, 0);
+    log_tail = 0;
+
+    log_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (log_event_fd < 0) {
+        (log_error)("failed to create log event: %s", strerror(errno));
+        return -errno;
+    }
+
+    atomic_store(&log_stopping, false);
+    atomic_store(&log_sleeping, false);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOG_STACK_SIZE);
+
+    int status = pthread_create(&log_thread, &attr, log_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (status) {
+        (log_error)("failed to start log writer: %s", strerror(status));
+        close(log_event_fd);
+        log_event_fd = -1;
+        return -status;
+    }
+    pthread_setname_np(log_thread, "gpsstats-log");
+
+    atomic_store(&log_started, true);
+
+    return 0;
+}
+
+void log_async_stop(void) {
+    if (!atomic_exchange(&log_started, false)) {
+        return;
+    }
+
+    atomic_store(&log_stopping, true);
+
+    uint64_t one = 1;
+    if (write(log_event_fd, &one, sizeof(one)) < 0) {
+        (log_warning)("Failed to wake log writer: %s", strerror(errno));
+    }
+
+    pthread_join(log_thread, NULL);
+
+    close(log_event_fd);
+    log_event_fd = -1;
+}
+
+void log_async(log_prio_t prio, log_site_t *site, const char *fmt, ...) {
+    uint32_t suppressed = 0;
+    if (site && !allow_msg(site, &suppressed)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    if (!atomic_load_explicit(&log_started, memory_order_acquire)) {
+        char msg[LOG_MSG_SIZE];
+        format_msg(msg, suppressed, fmt, args);
+        va_end(args);
+
+        write_msg(prio, msg);
+        return;
+    }
+
+    // Claim an entry, or drop the message if the queue is full...
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_entry_t *entry;
+    for (;;) {
+        entry = &log_queue[pos & LOG_QUEUE_MASK];
+        size_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            va_end(args);
+            TRACE2(drop, "log", prio);
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    entry->prio = prio;
+    format_msg(entry->msg, suppressed, fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&log_queued, 1, memory_order_relaxed);
+
+    // Only wake the writer when it is (about to go) asleep...
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log_sleeping, memory_order_relaxed) && atomic_exchange(&log_sleeping, false)) {
+        uint64_t one = 1;
+        if (write(log_event_fd, &one, sizeof(one)) < 0) {
+            // let the next message try again...
+            atomic_store(&log_sleeping, true);
+        }
+    }
+}
+
+log_stats_t log_async_dump_stats(void) {
+    return (log_stats_t) {
+        .queued = atomic_load(&log_queued),
+        .dropped = atomic_load(&log_dropped),
+        .suppressed = atomic_load(&log_suppressed),
+    };
+}
+
+// EOF
@@ -7,6 +7,8 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -17,190 +19,581 @@
 #include <udaemon/udaemon.h>
 #include <udaemon/ud_utils.h>
 
+#include "checkpoint.h"
+#include "chrony.h"
 #include "config.h"
+#include "evloop.h"
+#include "failover.h"
 #include "gpsd.h"
 #include "gpsstats.h"
+#include "http.h"
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
 #include "mqtt.h"
+#include "resolver.h"
+#include "rt.h"
+#include "trace.h"
+#include "uring.h"
+#include "wheel.h"
+#include "worker.h"
+
+// the resolution of our timers, in milliseconds...
+#define TIMER_TICK 10
+// the maximum delay between reconnection attempts, in seconds...
+#define MAX_RETRY_INTERVAL 300
+
+typedef struct run_state run_state_t;
+
+typedef struct gpsd_conn {
+    run_state_t *run_state;
+    // the index of the source in the configuration...
+    uint16_t index;
 
-typedef struct {
-    mqtt_handle_t *mqtt;
     gpsd_handle_t *gpsd;
+    int fd;
+    bool uring;
 
-    eh_id_t gpsd_event_handler_id;
-    eh_id_t mqtt_event_handler_id;
+    // the worker reading from this source, if any...
+    int worker;
+    bool releasing;
 
-    uint32_t gpsd_disconnects;
-    uint32_t gpsd_connects;
+    wheel_timer_t reconnect_timer;
+    uint16_t retry_interval;
+    // picks up what is left of a burst that was not drained in one go...
+    wheel_timer_t drain_timer;
+} gpsd_conn_t;
 
-    uint32_t mqtt_disconnects;
-    uint32_t mqtt_connects;
-} run_state_t;
+struct run_state {
+    const ud_state_t *ud_state;
 
-static ud_result_t gpsstats_gps_callback(const ud_state_t *ud_state, struct pollfd *pollfd, void *context);
-static ud_result_t gpsstats_mqtt_callback(const ud_state_t *ud_state, struct pollfd *pollfd, void *context);
+    mqtt_handle_t *mqtt;
+    http_handle_t *http;
 
-// task that disconnects from GPSD and reconnects to it...
-static int gpsstats_reconnect_gpsd(const ud_state_t *ud_state, const uint16_t interval, void *context) {
-    const config_t *cfg = ud_get_app_config(ud_state);
-    run_state_t *run_state = context;
+    // all connections are multiplexed by our own event loop...
+    evloop_t *evloop;
+    eh_id_t evloop_event_handler_id;
+
+    // optionally, GPSD is read through io_uring...
+    uring_t *uring;
+    bool use_uring;
+
+    // optionally, GPSD is read by worker threads...
+    worker_pool_t *workers;
+
+    // holds the timers of all sources...
+    wheel_t *wheel;
+
+    // optionally, chronyd is polled to compare its offset with the one of GPSD...
+    chrony_t *chrony;
 
-    if (run_state->gpsd) {
+    // optionally, the metrics are kept in a checkpoint...
+    checkpoint_t *checkpoint;
+    bool checkpoint_scheduled;
+
+    gpsd_conn_t gpsd[MAX_SOURCES];
+    uint16_t gpsd_cnt;
+
+    int mqtt_fd;
+    uint32_t mqtt_events;
+
+    // races the brokers whenever the connection to MQTT is lost...
+    failover_t *failover;
+    int mqtt_broker;
+    uint16_t mqtt_retry_interval;
+    bool mqtt_lost;
+    struct timespec mqtt_lost_at;
+    wheel_timer_t failback_timer;
+};
+
+static void gpsstats_gps_callback(evloop_t *loop, int fd, uint32_t events, void *context);
+static void gpsstats_gps_recv_callback(uring_t *ring, char *data, int result, void *context);
+static void gpsstats_mqtt_callback(evloop_t *loop, int fd, uint32_t events, void *context);
+
+// Stops listening for data of GPSD...
+static void gpsstats_unwatch_gpsd(gpsd_conn_t *conn) {
+    if (conn->fd < 0) {
+        return;
+    }
+
+    int status;
+    if (conn->uring) {
+        status = uring_recv_stop(conn->run_state->uring, conn->fd);
+    } else {
+        status = evloop_remove(conn->run_state->evloop, conn->fd);
+    }
+    if (status) {
+        log_debug("Unable to remove GPSD event handler!");
+    }
+
+    wheel_cancel(conn->run_state->wheel, &conn->drain_timer);
+
+    conn->fd = -1;
+    conn->uring = false;
+}
+
+// disconnects from GPSD and reconnects to it, returns the delay before the next attempt, if any...
+static int gpsstats_reconnect_gpsd(gpsd_conn_t *conn, const uint16_t interval) {
+    run_state_t *run_state = conn->run_state;
+    const config_t *cfg = ud_get_app_config(run_state->ud_state);
+
+    if (conn->worker >= 0) {
+        // A worker still reads from this source, continue once it lets go of it...
+        if (conn->releasing || worker_pool_release(run_state->workers, conn->worker, conn) == 0) {
+            conn->releasing = true;
+            return 0;
+        }
+        return 1;
+    }
+
+    gpsstats_unwatch_gpsd(conn);
+
+    if (conn->gpsd) {
         log_debug("Closing connection to GPSD...");
 
-        gpsd_disconnect(run_state->gpsd);
-        gpsd_destroy(run_state->gpsd);
-        run_state->gpsd = NULL;
+        gpsd_disconnect(conn->gpsd);
+        gpsd_destroy(conn->gpsd);
+        conn->gpsd = NULL;
 
         // Update stats...
-        run_state->gpsd_disconnects++;
+        metrics_inc(METRIC_GPSD_DISCONNECTS, conn->index);
     }
 
-    if (ud_valid_event_handler_id(run_state->gpsd_event_handler_id)) {
-        if (ud_remove_event_handler(ud_state, run_state->gpsd_event_handler_id)) {
-            log_warning("Unable to remove GPSD event handler!");
-        }
-        run_state->gpsd_event_handler_id = UD_INVALID_ID;
+    if (conn->index >= cfg->source_cnt) {
+        // Source is no longer configured...
+        return 0;
     }
 
-    run_state->gpsd = gpsd_init(cfg);
-    if (run_state->gpsd == NULL) {
+    conn->gpsd = gpsd_init(&cfg->sources[conn->index]);
+    if (conn->gpsd == NULL) {
         log_warning("Unable to reinitialize GPSD! Out of memory?");
         return -ENOMEM;
     }
 
-    if (gpsd_connect(run_state->gpsd)) {
+    if (gpsd_connect(conn->gpsd)) {
         log_warning("Unable to connect to GPSD! Scheduling retry...");
         return interval * 2;
     }
 
-    int fd = gpsd_fd(run_state->gpsd);
-    if (fd) {
-        if (ud_add_event_handler(ud_state, fd, POLLIN,
-                                 gpsstats_gps_callback,
-                                 run_state,
-                                 &run_state->gpsd_event_handler_id)) {
-            log_warning("Unable to add GPSD event handler!");
-            return -EINVAL;
+    int fd = gpsd_fd(conn->gpsd);
+    if (fd >= 0) {
+        if (run_state->workers) {
+            int worker = worker_pool_assign(run_state->workers, conn->gpsd, conn);
+            if (worker < 0) {
+                log_warning("Unable to assign GPSD to a worker!");
+                return -EINVAL;
+            }
+            conn->worker = worker;
+        } else {
+            if (run_state->use_uring && uring_recv_start(run_state->uring, fd, gpsstats_gps_recv_callback, conn) == 0) {
+                conn->uring = true;
+            } else if (evloop_add(run_state->evloop, fd, EPOLLIN, gpsstats_gps_callback, conn)) {
+                // Level-triggered: libgps buffers data and returns one message per read...
+                log_warning("Unable to add GPSD event handler!");
+                return -EINVAL;
+            }
+            conn->fd = fd;
         }
     }
 
     // Update stats...
-    run_state->gpsd_connects++;
+    metrics_inc(METRIC_GPSD_CONNECTS, conn->index);
 
     return 0;
 }
 
-// Called when data of gpsd is received...
-static ud_result_t gpsstats_gps_callback(const ud_state_t *ud_state, struct pollfd *pollfd, void *context) {
+// Called when the reconnect timer of a source expires...
+static void gpsstats_reconnect_timer(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    gpsd_conn_t *conn = context;
+
+    TRACE2(reconnect_start, "gpsd", conn->index);
+    int delay = gpsstats_reconnect_gpsd(conn, conn->retry_interval);
+    TRACE3(reconnect_end, "gpsd", conn->index, delay);
+    if (delay > 0) {
+        conn->retry_interval = (uint16_t) ((delay < MAX_RETRY_INTERVAL) ? delay : MAX_RETRY_INTERVAL);
+        wheel_schedule(wheel, timer, (uint64_t) conn->retry_interval * 1000);
+    } else {
+        conn->retry_interval = 1;
+    }
+}
+
+static void gpsstats_schedule_reconnect_gpsd(gpsd_conn_t *conn, uint16_t interval) {
+    if (wheel_schedule(conn->run_state->wheel, &conn->reconnect_timer, (uint64_t) interval * 1000)) {
+        log_warning("Failed to register (re)connect timer for GPSD?!");
+    }
+}
+
+// Publishes an event to all our sinks...
+static void gpsstats_publish_event(const gps_event_t *event, void *context) {
     run_state_t *run_state = context;
 
-    int status;
-    bool need_reconnect = false;
+    mqtt_send_event(run_state->mqtt, event);
+    http_send_event(run_state->http, event);
+}
 
-    if ((pollfd->revents & (POLLHUP | POLLERR)) != 0) {
-        log_warning("GPSD closed unexpectedly! Remote end closed?");
-        need_reconnect = true;
-    } else if (pollfd->revents & POLLIN) {
-        char *event = { 0 };
+// Filters an event of a source with the current configuration, and publishes it if it passes...
+static void gpsstats_filter_event(run_state_t *run_state, uint16_t index, gps_event_t *event) {
+    // The configuration is only looked up here, as it is replaced on reloads...
+    if (!gpsd_filter_event(ud_get_app_config(run_state->ud_state), event)) {
+        // Update stats...
+        metrics_inc(METRIC_GPSD_EVENTS_FILTERED, index);
+        return;
+    }
 
-        status = gpsd_read_data(run_state->gpsd, &event);
+    if (event->type == GPS_EVENT_FIX) {
+        // Update stats...
+        metrics_inc(METRIC_GPSD_EVENTS_SEND, index);
+    }
+
+    gpsstats_publish_event(event, run_state);
+}
+
+// Called for each event that is parsed from the data of a source...
+static void gpsstats_gpsd_event(gps_event_t *event, void *context) {
+    gpsd_conn_t *conn = context;
+
+    gpsstats_filter_event(conn->run_state, conn->index, event);
+}
+
+// Reads what gpsd has sent, returns false if the connection is lost...
+static bool gpsstats_drain_gpsd(gpsd_conn_t *conn) {
+    gps_event_t event;
+    int status;
+
+    // Drain what libgps has buffered, yet leave the other sources their turn...
+    int reads = 0;
+    do {
+        status = gpsd_read_data(conn->gpsd, &event);
         if (status < 0) {
-            need_reconnect = (status == -ENOTCONN);
+            return status != -ENOTCONN;
         } else if (status > 0) {
-            mqtt_send_event(run_state->mqtt, event);
-            free(event);
+            gpsstats_filter_event(conn->run_state, conn->index, &event);
         }
+    } while (++reads < GPS_READ_BURST && gpsd_data_waiting(conn->gpsd));
+
+    // The remainder no longer makes the socket readable...
+    if (reads == GPS_READ_BURST && gpsd_data_waiting(conn->gpsd) &&
+            wheel_schedule(conn->run_state->wheel, &conn->drain_timer, 0)) {
+        log_warning("Failed to register drain timer for GPSD?!");
+    }
+    return true;
+}
+
+static void gpsstats_lost_gpsd(gpsd_conn_t *conn) {
+    // Stop listening until we're reconnected...
+    evloop_remove(conn->run_state->evloop, conn->fd);
+    wheel_cancel(conn->run_state->wheel, &conn->drain_timer);
+    conn->fd = -1;
+
+    gpsstats_schedule_reconnect_gpsd(conn, 1);
+}
+
+// Called when data of gpsd is received...
+static void gpsstats_gps_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    gpsd_conn_t *conn = context;
+
+    bool need_reconnect = false;
+
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+        log_warning("GPSD closed unexpectedly! Remote end closed?");
+        need_reconnect = true;
+    } else if (events & EPOLLIN) {
+        need_reconnect = !gpsstats_drain_gpsd(conn);
     }
 
     if (need_reconnect) {
-        if (ud_schedule_task(ud_state, 1, gpsstats_reconnect_gpsd, run_state)) {
-            log_warning("Failed to register (re)connect task for GPSD?!");
-        }
+        gpsstats_lost_gpsd(conn);
+    }
+}
+
+// Called when a burst of gpsd was not drained in one go...
+static void gpsstats_drain_timer(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+    gpsd_conn_t *conn = context;
 
-        return RES_ERROR;
+    if (conn->fd >= 0 && !conn->uring && !gpsstats_drain_gpsd(conn)) {
+        gpsstats_lost_gpsd(conn);
     }
+}
 
-    return RES_OK;
+// Called when data of gpsd is received through io_uring...
+static void gpsstats_gps_recv_callback(uring_t *ring, char *data, int result, void *context) {
+    gpsd_conn_t *conn = context;
+
+    if (result > 0) {
+        gpsd_feed_data(conn->gpsd, data, (size_t) result, gpsstats_gpsd_event, conn);
+        return;
+    }
+
+    if (result == 0) {
+        log_warning("GPSD closed unexpectedly! Remote end closed?");
+    } else if (result == -EINVAL || result == -EOPNOTSUPP) {
+        // Kernel does not support multishot receives...
+        log_warning("Unable to receive from GPSD through io_uring: %s! Falling back to epoll...", strerror(-result));
+        conn->run_state->use_uring = false;
+    } else {
+        log_warning("Failed to read from GPSD: %s", strerror(-result));
+    }
+
+    // Stop listening until we're reconnected...
+    uring_recv_stop(ring, conn->fd);
+    conn->fd = -1;
+    conn->uring = false;
+
+    gpsstats_schedule_reconnect_gpsd(conn, 1);
 }
 
-// task that disconnects from MQTT and reconnects to it...
-static int gpsstats_reconnect_mqtt(const ud_state_t *ud_state, const uint16_t interval, void *context) {
-    const config_t *cfg = ud_get_app_config(ud_state);
+// Called when completions of io_uring are pending...
+static void gpsstats_uring_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    (void)events;
     run_state_t *run_state = context;
 
+    uring_process(run_state->uring);
+}
+
+// Called for each event read by a worker...
+static void gpsstats_worker_event(gps_event_t *event, void *source, void *context) {
+    gpsd_conn_t *conn = source;
+
+    gpsstats_filter_event(context, conn->index, event);
+}
+
+// Called when a worker no longer reads from a source...
+static void gpsstats_worker_detach(void *source, bool lost, void *context) {
+    (void)context;
+    gpsd_conn_t *conn = source;
+
+    conn->worker = -1;
+
+    if (conn->releasing) {
+        // Continue the pending reconnect...
+        gpsstats_schedule_reconnect_gpsd(conn, 0);
+    } else if (lost) {
+        gpsstats_schedule_reconnect_gpsd(conn, 1);
+    }
+    conn->releasing = false;
+}
+
+// Called when workers have queued events...
+static void gpsstats_workers_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    run_state_t *run_state = context;
+
+    worker_pool_process(run_state->workers);
+}
+
+// Called when timers are due...
+static void gpsstats_wheel_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    run_state_t *run_state = context;
+
+    wheel_process(run_state->wheel);
+}
+
+// Schedules a (re)connect of all configured sources, and of those that are no longer configured...
+static void gpsstats_reconnect_sources(run_state_t *run_state, const config_t *cfg, uint16_t interval) {
+    for (uint16_t i = run_state->gpsd_cnt; i < cfg->source_cnt; i++) {
+        run_state->gpsd[i] = (gpsd_conn_t) {
+            .run_state = run_state,
+            .index = i,
+            .fd = -1,
+            .worker = -1,
+            .retry_interval = 1,
+        };
+        wheel_timer_init(&run_state->gpsd[i].reconnect_timer, gpsstats_reconnect_timer, &run_state->gpsd[i]);
+        wheel_timer_init(&run_state->gpsd[i].drain_timer, gpsstats_drain_timer, &run_state->gpsd[i]);
+    }
+    if (cfg->source_cnt > run_state->gpsd_cnt) {
+        run_state->gpsd_cnt = cfg->source_cnt;
+    }
+
+    for (uint16_t i = 0; i < run_state->gpsd_cnt; i++) {
+        gpsstats_schedule_reconnect_gpsd(&run_state->gpsd[i], interval);
+    }
+}
+
+// Stops listening for data of MQTT and closes the connection to it...
+static void gpsstats_close_mqtt(run_state_t *run_state) {
+    wheel_cancel(run_state->wheel, &run_state->failback_timer);
+
+    if (run_state->mqtt_fd >= 0) {
+        if (evloop_remove(run_state->evloop, run_state->mqtt_fd)) {
+            log_warning("Unable to remove MQTT event handler!");
+        }
+        run_state->mqtt_fd = -1;
+    }
+
     if (run_state->mqtt) {
         log_debug("Closing connection to MQTT...");
 
         mqtt_disconnect(run_state->mqtt);
         mqtt_destroy(run_state->mqtt);
         run_state->mqtt = NULL;
+        run_state->mqtt_broker = -1;
 
         // Update stats...
-        run_state->mqtt_disconnects++;
+        metrics_inc(METRIC_MQTT_DISCONNECTS, 0);
+        metrics_set(METRIC_MQTT_BROKER, 0, -1);
     }
+}
 
-    if (ud_valid_event_handler_id(run_state->mqtt_event_handler_id)) {
-        if (ud_remove_event_handler(ud_state, run_state->mqtt_event_handler_id)) {
-            log_warning("Unable to remove MQTT event handler!");
-        }
-        run_state->mqtt_event_handler_id = UD_INVALID_ID;
+// disconnects from MQTT and races all brokers to reconnect, returns the delay before the next attempt, if any...
+static int gpsstats_connect_mqtt(run_state_t *run_state, const config_t *cfg, const uint16_t interval) {
+    gpsstats_close_mqtt(run_state);
+
+    TRACE2(reconnect_start, "mqtt", 0);
+    // The outcome is reported to gpsstats_mqtt_raced...
+    if (failover_race(run_state->failover, cfg, cfg->broker_cnt, run_state->mqtt_lost ? &run_state->mqtt_lost_at : NULL)) {
+        log_warning("Unable to connect to MQTT! Scheduling retry...");
+        TRACE3(reconnect_end, "mqtt", 0, interval * 2);
+        return interval * 2;
     }
 
-    run_state->mqtt = mqtt_init(cfg);
-    if (run_state->mqtt == NULL) {
-        log_warning("Unable to reinitialize MQTT! Out of memory?");
-        return -ENOMEM;
+    return 0;
+}
+
+// task that disconnects from MQTT and reconnects to it...
+static int gpsstats_reconnect_mqtt(const ud_state_t *ud_state, const uint16_t interval, void *context) {
+    const config_t *cfg = ud_get_app_config(ud_state);
+    run_state_t *run_state = context;
+
+    return gpsstats_connect_mqtt(run_state, cfg, interval);
+}
+
+static void gpsstats_schedule_failback(run_state_t *run_state, const config_t *cfg) {
+    if (cfg->mqtt_failback == 0 || run_state->mqtt_broker <= 0) {
+        // Nothing to fail back to...
+        return;
+    }
+    if (wheel_schedule(run_state->wheel, &run_state->failback_timer, (uint64_t) cfg->mqtt_failback * 1000)) {
+        log_warning("Failed to register failback timer for MQTT?!");
+    }
+}
+
+// Called when it is time to see whether a more preferred broker is back...
+static void gpsstats_failback_timer(wheel_t *wheel, wheel_timer_t *timer, void *context) {
+    (void)wheel;
+    (void)timer;
+    run_state_t *run_state = context;
+    const config_t *cfg = ud_get_app_config(run_state->ud_state);
+
+    if (run_state->mqtt == NULL || run_state->mqtt_broker <= 0 || failover_racing(run_state->failover)) {
+        return;
     }
 
-    if (mqtt_connect(run_state->mqtt)) {
+    log_debug("Probing preferred MQTT brokers...");
+
+    // Only the brokers preferred over the current one take part, we stay connected meanwhile...
+    TRACE2(reconnect_start, "mqtt", 0);
+    if (failover_race(run_state->failover, cfg, (uint8_t) run_state->mqtt_broker, NULL)) {
+        gpsstats_schedule_failback(run_state, cfg);
+    }
+}
+
+// Called when a race between the brokers has ended...
+static void gpsstats_mqtt_raced(failover_t *fo, mqtt_handle_t *mqtt, int broker, uint32_t msec, void *context) {
+    (void)fo;
+    run_state_t *run_state = context;
+    const config_t *cfg = ud_get_app_config(run_state->ud_state);
+
+    if (mqtt == NULL) {
+        if (run_state->mqtt) {
+            // The preferred brokers are still unavailable...
+            TRACE3(reconnect_end, "mqtt", 0, cfg->mqtt_failback);
+            gpsstats_schedule_failback(run_state, cfg);
+            return;
+        }
+
+        run_state->mqtt_retry_interval = (uint16_t) ((run_state->mqtt_retry_interval * 2 < MAX_RETRY_INTERVAL) ? run_state->mqtt_retry_interval * 2 : MAX_RETRY_INTERVAL);
+        TRACE3(reconnect_end, "mqtt", 0, run_state->mqtt_retry_interval);
+
         log_warning("Unable to connect to MQTT! Scheduling retry...");
-        return interval * 2;
+        if (ud_schedule_task(run_state->ud_state, run_state->mqtt_retry_interval, gpsstats_reconnect_mqtt, run_state)) {
+            log_warning("Failed to register (re)connect task for MQTT?!");
+        }
+        return;
+    }
+
+    TRACE3(reconnect_end, "mqtt", broker, 0);
+
+    if (run_state->mqtt) {
+        log_info("Failing back to MQTT broker %s...", cfg->brokers[broker].name);
+        gpsstats_close_mqtt(run_state);
+
+        // Update stats...
+        metrics_inc(METRIC_MQTT_FAILBACKS, 0);
+    } else if (run_state->mqtt_lost) {
+        log_info("Failed over to MQTT broker %s in %u ms", cfg->brokers[broker].name, msec);
+        run_state->mqtt_lost = false;
+
+        // Update stats...
+        metrics_inc(METRIC_MQTT_FAILOVERS, 0);
+        metrics_observe(METRIC_MQTT_FAILOVER_MSEC, msec);
     }
 
-    int fd = mqtt_fd(run_state->mqtt);
-    if (fd) {
-        if (ud_add_event_handler(ud_state, fd, POLLIN,
-                                 gpsstats_mqtt_callback,
-                                 run_state,
-                                 &run_state->mqtt_event_handler_id)) {
+    run_state->mqtt = mqtt;
+    run_state->mqtt_broker = broker;
+    run_state->mqtt_retry_interval = 1;
+
+    mqtt_announce(mqtt);
+
+    // Level-triggered: mosquitto reads at most one packet at a time...
+    int fd = mqtt_fd(mqtt);
+    if (fd >= 0) {
+        uint32_t events = EPOLLIN | (mqtt_want_write(mqtt) ? EPOLLOUT : 0);
+        if (evloop_add(run_state->evloop, fd, events, gpsstats_mqtt_callback, run_state)) {
             log_warning("Unable to add MQTT event handler!");
-            return -EINVAL;
+        } else {
+            run_state->mqtt_fd = fd;
+            run_state->mqtt_events = events;
         }
     }
 
-    // Update stats...
-    run_state->mqtt_connects++;
+    gpsstats_schedule_failback(run_state, cfg);
 
-    return 0;
+    // Update stats...
+    metrics_inc(METRIC_MQTT_CONNECTS, 0);
+    metrics_set(METRIC_MQTT_BROKER, 0, broker);
 }
 
 // Called when data of mosquitto is received/to be transmitted...
-static ud_result_t gpsstats_mqtt_callback(const ud_state_t *ud_state, struct pollfd *pollfd, void *context) {
+static void gpsstats_mqtt_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
     run_state_t *run_state = context;
 
+    uint32_t wanted = EPOLLIN;
     if (mqtt_want_write(run_state->mqtt)) {
-        log_debug("Requesting to write MQTT data...");
-
-        pollfd->events |= POLLOUT;
-    } else if (pollfd->events & POLLOUT) {
-        log_debug("Clearing MQTT data request...");
+        wanted |= EPOLLOUT;
+    }
+    if (wanted != run_state->mqtt_events) {
+        log_debug("%s MQTT data request...", (wanted & EPOLLOUT) ? "Requesting to write" : "Clearing");
 
-        pollfd->events &= ~POLLOUT;
+        if (evloop_modify(loop, fd, wanted) == 0) {
+            run_state->mqtt_events = wanted;
+        }
     }
 
     int status;
     bool need_reconnect = false;
 
-    if ((pollfd->revents & (POLLHUP | POLLERR)) != 0) {
-        log_warning("GPSD closed unexpectedly! Remote end closed?");
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+        log_warning("MQTT closed unexpectedly! Remote end closed?");
         need_reconnect = true;
     } else {
-        if (pollfd->revents & POLLOUT) {
+        if (events & EPOLLOUT) {
             // We can write safely...
             status = mqtt_write_data(run_state->mqtt);
             need_reconnect |= (status == -ENOTCONN);
         }
-        if (pollfd->revents & POLLIN) {
+        if (events & EPOLLIN) {
             // We can read safely...
             status = mqtt_read_data(run_state->mqtt);
             need_reconnect |= (status == -ENOTCONN);
@@ -208,38 +601,256 @@ static ud_result_t gpsstats_mqtt_callback(const ud_state_t *ud_state, struct pol
     }
 
     if (need_reconnect) {
-        if (ud_schedule_task(ud_state, 1, gpsstats_reconnect_mqtt, run_state)) {
+        // The failover time includes all attempts until we're reconnected...
+        if (!run_state->mqtt_lost) {
+            clock_gettime(CLOCK_MONOTONIC, &run_state->mqtt_lost_at);
+            run_state->mqtt_lost = true;
+        }
+
+        // Start racing the brokers right away...
+        int delay = gpsstats_connect_mqtt(run_state, ud_get_app_config(run_state->ud_state), 1);
+        if (delay > 0 && ud_schedule_task(run_state->ud_state, (uint16_t) delay, gpsstats_reconnect_mqtt, run_state)) {
             log_warning("Failed to register (re)connect task for MQTT?!");
         }
+    }
+}
 
-        return RES_ERROR;
+// task that (re)starts the HTTP listener...
+static int gpsstats_restart_http(const ud_state_t *ud_state, const uint16_t interval, void *context) {
+    const config_t *cfg = ud_get_app_config(ud_state);
+    run_state_t *run_state = context;
+
+    if (run_state->http) {
+        log_debug("Closing HTTP listener...");
+
+        http_destroy(run_state->http);
+        run_state->http = NULL;
+    }
+
+    if (!cfg->use_http) {
+        // Nothing to do...
+        return 0;
+    }
+
+    run_state->http = http_init(cfg, run_state->evloop, run_state->wheel);
+    if (run_state->http == NULL) {
+        log_warning("Unable to reinitialize HTTP! Out of memory?");
+        return -ENOMEM;
+    }
+
+    if (http_listen(run_state->http)) {
+        log_warning("Unable to start HTTP listener! Scheduling retry...");
+        return interval * 2;
+    }
+
+    return 0;
+}
+
+// Called when any of the connections in our event loop has pending events...
+static ud_result_t gpsstats_evloop_callback(const ud_state_t *ud_state, struct pollfd *pollfd, void *context) {
+    (void)ud_state;
+    run_state_t *run_state = context;
+
+    if (pollfd->revents & POLLIN) {
+        if (evloop_dispatch(run_state->evloop, 0) < 0) {
+            return RES_ERROR;
+        }
     }
 
     return RES_OK;
 }
 
 static int gpsstats_mqtt_misc_loop(const ud_state_t *ud_state, const uint16_t interval, void *context) {
-    (void)ud_state;
+    const config_t *cfg = ud_get_app_config(ud_state);
     run_state_t *run_state = context;
 
     mqtt_misc_loop(run_state->mqtt);
+    mqtt_reclaim_sources(run_state->mqtt, cfg->gpsd_device_idle);
+    return interval;
+}
+
+// task that periodically samples the memory usage...
+static int gpsstats_sample_memory(const ud_state_t *ud_state, const uint16_t interval, void *context) {
+    (void)ud_state;
+    (void)context;
+
+    mem_sample();
     return interval;
 }
 
+// Saves the state of the devices of all sources for the checkpoint...
+static size_t gpsstats_save_devices(gpsd_saved_device_t *devices, size_t max, void *context) {
+    run_state_t *run_state = context;
+    size_t cnt = 0;
+
+    for (uint16_t i = 0; i < run_state->gpsd_cnt && cnt < max; i++) {
+        cnt += gpsd_save_devices(run_state->gpsd[i].gpsd, devices + cnt, max - cnt);
+    }
+
+    // Devices that did not send data since a restart or a reconnect keep their state, unless their source is gone...
+    const config_t *cfg = ud_get_app_config(run_state->ud_state);
+    size_t first = cnt;
+    size_t kept = gpsd_save_kept_devices(devices + first, max - first);
+    for (size_t k = first; k < first + kept; k++) {
+        for (uint16_t i = 0; i < cfg->source_cnt; i++) {
+            if (strncmp(devices[k].source, cfg->sources[i].name, GPS_SOURCE_SIZE - 1) == 0) {
+                devices[cnt++] = devices[k];
+                break;
+            }
+        }
+    }
+    return cnt;
+}
+
+// task that periodically writes the checkpoint...
+static int gpsstats_write_checkpoint(const ud_state_t *ud_state, const uint16_t interval, void *context) {
+    (void)interval;
+    const config_t *cfg = ud_get_app_config(ud_state);
+    run_state_t *run_state = context;
+
+    if (run_state->checkpoint == NULL) {
+        // No longer configured...
+        run_state->checkpoint_scheduled = false;
+        return 0;
+    }
+
+    checkpoint_write(run_state->checkpoint, gpsstats_save_devices, run_state);
+    return cfg->checkpoint_interval;
+}
+
+// Switches to another checkpoint file if its configuration changed, and keeps it up to date...
+static void gpsstats_reopen_checkpoint(run_state_t *run_state, const config_t *cfg) {
+    bool changed = !run_state->checkpoint || !cfg->checkpoint_file ||
+                   strcmp(checkpoint_file(run_state->checkpoint), cfg->checkpoint_file) != 0;
+
+    if (changed && run_state->checkpoint) {
+        checkpoint_write(run_state->checkpoint, gpsstats_save_devices, run_state);
+        checkpoint_close(run_state->checkpoint);
+        run_state->checkpoint = NULL;
+    }
+
+    if (changed && cfg->checkpoint_file) {
+        // the metrics are still in memory, so there is nothing to restore...
+        run_state->checkpoint = checkpoint_open(cfg->checkpoint_file);
+    }
+
+    if (run_state->checkpoint && !run_state->checkpoint_scheduled) {
+        if (ud_schedule_task(run_state->ud_state, cfg->checkpoint_interval, gpsstats_write_checkpoint, run_state)) {
+            log_warning("Failed to register periodic task for checkpoint?!");
+        } else {
+            run_state->checkpoint_scheduled = true;
+        }
+    }
+}
+
 // Initializes GPSStats
 static int gpsstats_init(const ud_state_t *ud_state) {
+    const config_t *cfg = ud_get_app_config(ud_state);
     run_state_t *run_state = ud_get_app_state(ud_state);
 
     // Dump the configuration when running in debug mode...
-    dump_config(ud_get_app_config(ud_state));
+    dump_config(cfg);
+
+    run_state->ud_state = ud_state;
+
+    // From now on, log messages are written in the background...
+    log_async_start();
+
+    // Reconnects use cached addresses from now on...
+    resolver_start(cfg->resolver_ttl);
+
+    // Lock everything first, so all allocations below are resident as well...
+    if (cfg->rt_lock_memory) {
+        rt_lock_memory();
+    }
+
+    // Continue where the previous run left off, before anything is counted...
+    if (cfg->checkpoint_file) {
+        run_state->checkpoint = checkpoint_open(cfg->checkpoint_file);
+        if (run_state->checkpoint) {
+            checkpoint_restore(run_state->checkpoint, cfg->checkpoint_max_age);
+        }
+    }
+    gpsstats_reopen_checkpoint(run_state, cfg);
+
+    // udaemon only needs to poll a single fd for all our connections...
+    run_state->evloop = evloop_init();
+    if (run_state->evloop == NULL) {
+        return -ENOMEM;
+    }
+    if (ud_add_event_handler(ud_state, evloop_fd(run_state->evloop), POLLIN,
+                             gpsstats_evloop_callback,
+                             run_state,
+                             &run_state->evloop_event_handler_id)) {
+        log_warning("Unable to add event loop handler!");
+        return -EINVAL;
+    }
+
+    run_state->wheel = wheel_init(TIMER_TICK);
+    if (run_state->wheel == NULL) {
+        return -ENOMEM;
+    }
+    if (evloop_add(run_state->evloop, wheel_fd(run_state->wheel), EPOLLIN, gpsstats_wheel_callback, run_state)) {
+        log_warning("Unable to add timer handler!");
+        return -EINVAL;
+    }
+
+    if (cfg->gpsd_workers) {
+        run_state->workers = worker_pool_init(cfg->gpsd_workers, gpsstats_worker_event, gpsstats_worker_detach, run_state);
+        if (run_state->workers == NULL ||
+                evloop_add(run_state->evloop, worker_pool_fd(run_state->workers), EPOLLIN, gpsstats_workers_callback, run_state)) {
+            log_warning("Unable to start workers for GPSD, reading GPSD from the main thread...");
+            worker_pool_destroy(run_state->workers);
+            run_state->workers = NULL;
+        } else if (cfg->gpsd_io_uring) {
+            log_warning("Not using io_uring for GPSD, as workers are used...");
+        }
+    }
+
+    // The ingest path is either our workers or the main thread...
+    if (run_state->workers) {
+        worker_pool_set_rt(run_state->workers, cfg->rt_ingest_cpus, cfg->rt_ingest_priority);
+        rt_apply(pthread_self(), "main thread", cfg->rt_sink_cpus, 0);
+    } else {
+        if (cfg->rt_sink_cpus) {
+            log_warning("Ignoring sink CPUs, as no workers are used...");
+        }
+        rt_apply(pthread_self(), "main thread", cfg->rt_ingest_cpus, cfg->rt_ingest_priority);
+    }
+
+    if (cfg->gpsd_io_uring && !run_state->workers) {
+        run_state->uring = uring_init();
+        if (run_state->uring == NULL ||
+                evloop_add(run_state->evloop, uring_fd(run_state->uring), EPOLLIN, gpsstats_uring_callback, run_state)) {
+            log_warning("Unable to use io_uring for GPSD, falling back to epoll...");
+        } else {
+            run_state->use_uring = true;
+        }
+    }
+
+    run_state->failover = failover_init(run_state->evloop, run_state->wheel, gpsstats_mqtt_raced, run_state);
+    if (run_state->failover == NULL) {
+        return -ENOMEM;
+    }
+    wheel_timer_init(&run_state->failback_timer, gpsstats_failback_timer, run_state);
+
+    run_state->chrony = chrony_init(run_state->evloop, run_state->wheel);
+    if (run_state->chrony == NULL) {
+        return -ENOMEM;
+    }
+    if (chrony_start(run_state->chrony, cfg->chrony_socket, cfg->chrony_interval)) {
+        log_warning("Failed to start polling chronyd?!");
+    }
 
     // Connect to both services...
     if (ud_schedule_task(ud_state, 1, gpsstats_reconnect_mqtt, run_state)) {
         log_warning("Failed to register connect task for MQTT?!");
     }
 
-    if (ud_schedule_task(ud_state, 1, gpsstats_reconnect_gpsd, run_state)) {
-        log_warning("Failed to register connect task for GPSD?!");
+    gpsstats_reconnect_sources(run_state, cfg, 1);
+
+    if (ud_schedule_task(ud_state, 1, gpsstats_restart_http, run_state)) {
+        log_warning("Failed to register start task for HTTP?!");
     }
 
     // MQTT needs to perform some tasks periodically...
@@ -247,39 +858,262 @@ static int gpsstats_init(const ud_state_t *ud_state) {
         log_warning("Failed to register periodic task for MQTT?!");
     }
 
+    // Start the first sample window right away...
+    mem_sample();
+    if (ud_schedule_task(ud_state, MEM_SAMPLE_INTERVAL, gpsstats_sample_memory, run_state)) {
+        log_warning("Failed to register periodic task for memory sampling?!");
+    }
+
     return 0;
 }
 
 static void gpsstats_dump_stats(const ud_state_t *ud_state, run_state_t *run_state) {
-    (void)ud_state;
+    const config_t *cfg = ud_get_app_config(ud_state);
+
+    // only called by the main thread...
+    static metrics_snapshot_t metrics;
+    metrics_snapshot(&metrics);
 
-    gpsd_stats_t gpsd_stats = gpsd_dump_stats(run_state->gpsd);
-    mqtt_stats_t mqtt_stats = mqtt_dump_stats(run_state->mqtt);
+    evloop_stats_t evloop_stats = evloop_dump_stats(run_state->evloop);
+    uring_stats_t uring_stats = uring_dump_stats(run_state->uring);
+    wheel_stats_t wheel_stats = wheel_dump_stats(run_state->wheel);
 
     log_info(PROGNAME " statistics:");
 
-    log_info("GPSD connects: %d, disconnects: %d, events rx: %d, tx: %d, last seen: %d",
-             run_state->gpsd_connects, run_state->gpsd_disconnects,
-             gpsd_stats.events_recv, gpsd_stats.events_send,
-             gpsd_stats.last_event);
+    for (uint16_t i = 0; i < run_state->gpsd_cnt; i++) {
+        log_info("GPSD #%d connects: %" PRIu64 ", disconnects: %" PRIu64 ", events rx: %" PRIu64 ", tx: %" PRIu64 ", filtered: %" PRIu64 ", device changes: %" PRIu64 ", last seen: %" PRId64,
+                 i, metrics.counters[METRIC_GPSD_CONNECTS + i],
+                 metrics.counters[METRIC_GPSD_DISCONNECTS + i],
+                 metrics.counters[METRIC_GPSD_EVENTS_RECV + i],
+                 metrics.counters[METRIC_GPSD_EVENTS_SEND + i],
+                 metrics.counters[METRIC_GPSD_EVENTS_FILTERED + i],
+                 metrics.counters[METRIC_GPSD_DEVICE_EVENTS + i],
+                 metrics.gauges[METRIC_GPSD_LAST_EVENT + i]);
+
+        if (cfg->gpsd_nmea) {
+            log_info("GPSD #%d NMEA sentences: %" PRIu64 ", checksum errors: %" PRIu64 ", truncated: %" PRIu64,
+                     i, metrics.counters[METRIC_NMEA_SENTENCES + i],
+                     metrics.counters[METRIC_NMEA_CHECKSUM_ERRORS + i],
+                     metrics.counters[METRIC_NMEA_TRUNCATED + i]);
+        }
+
+        // only called by the main thread...
+        static gpsd_device_stats_t devices[GPS_MAX_DEVICES];
+        size_t device_cnt = gpsd_dump_devices(run_state->gpsd[i].gpsd, devices, GPS_MAX_DEVICES);
+
+        log_info("GPSD #%d devices: %zu, dropped messages: %" PRIu64,
+                 i, device_cnt, metrics.counters[METRIC_GPSD_DEVICE_DROPS + i]);
+
+        for (size_t d = 0; d < device_cnt; d++) {
+            const gpsd_device_stats_t *dev = &devices[d];
+            const gpsd_offset_stats_t *offsets = &dev->offsets;
+
+            log_info("GPSD #%d %s last %u toff mean: %.9f, stddev: %.9f, last %u pps mean: %.9f, stddev: %.9f",
+                     i, dev->path, offsets->toff.cnt, offsets->toff.mean, offsets->toff.stddev,
+                     offsets->pps.cnt, offsets->pps.mean, offsets->pps.stddev);
+            if (dev->warmup_msec) {
+                log_info("GPSD #%d %s offsets covered a full window after %.3f s", i, dev->path, (double) dev->warmup_msec / 1000.0);
+            }
+            if (offsets->pps_corrected.cnt) {
+                log_info("GPSD #%d %s last %u qErr corrected pps mean: %.9f, stddev: %.9f, min: %.9f, max: %.9f",
+                         i, dev->path, offsets->pps_corrected.cnt, offsets->pps_corrected.mean, offsets->pps_corrected.stddev,
+                         offsets->pps_corrected.min, offsets->pps_corrected.max);
+            }
+            if (cfg->gpsd_kernel) {
+                log_info("GPSD #%d %s last %u kernel offset mean: %.9f, stddev: %.9f, min: %.9f, max: %.9f",
+                         i, dev->path, offsets->kernel.cnt, offsets->kernel.mean, offsets->kernel.stddev,
+                         offsets->kernel.min, offsets->kernel.max);
+            }
+
+            const osc_stats_t *osc = &dev->osc;
+            if (osc->transitions) {
+                log_info("GPSD #%d %s oscillator %s, transitions: %" PRIu64 ", reference losses: %" PRIu64
+                         ", seconds locked: %.1f, acquiring: %.1f, holdover: %.1f, freerun: %.1f, absent: %.1f",
+                         i, dev->path, osc_state_name(osc->state), osc->transitions, osc->reference_losses,
+                         (double) osc->time[OSC_LOCKED] / 1000.0,
+                         (double) osc->time[OSC_ACQUIRING] / 1000.0,
+                         (double) osc->time[OSC_HOLDOVER] / 1000.0,
+                         (double) osc->time[OSC_FREERUN] / 1000.0,
+                         (double) osc->time[OSC_ABSENT] / 1000.0);
+            }
+
+            if (cfg->gpsd_nmea) {
+                char buf[512] = "";
+                size_t len = 0;
+                for (size_t j = 0; j < dev->nmea_type_cnt && len < sizeof(buf); j++) {
+                    int n = snprintf(buf + len, sizeof(buf) - len, "%s%s: %" PRIu64, j ? ", " : "", dev->nmea_types[j].address, dev->nmea_types[j].count);
+                    if (n < 0) {
+                        break;
+                    }
+                    len += (size_t) n;
+                }
+
+                log_info("GPSD #%d %s NMEA sentences per type: %s", i, dev->path, buf);
+            }
+        }
+    }
+
+    if (cfg->gpsd_nmea) {
+        const uint64_t *bounds = metrics_histogram_bounds(METRIC_NMEA_GAP_MSEC);
+        const uint64_t *buckets = metrics.histograms[METRIC_NMEA_GAP_MSEC].buckets;
+        log_info("NMEA cycle gap ms <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64
+                 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", more: %" PRIu64,
+                 bounds[0], buckets[0], bounds[1], buckets[1], bounds[2], buckets[2], bounds[3], buckets[3],
+                 bounds[4], buckets[4], bounds[5], buckets[5], bounds[6], buckets[6], buckets[7]);
+    }
+
+    uint64_t mqtt_events = metrics.counters[METRIC_MQTT_EVENTS_SEND];
+    uint64_t mqtt_bytes = metrics.counters[METRIC_MQTT_BYTES_SEND];
+    log_info("MQTT connects: %" PRIu64 ", disconnects: %" PRIu64 ", events tx: %" PRIu64 ", bytes tx: %" PRIu64 " (avg. %" PRIu64 "), last: %" PRId64,
+             metrics.counters[METRIC_MQTT_CONNECTS],
+             metrics.counters[METRIC_MQTT_DISCONNECTS],
+             mqtt_events, mqtt_bytes,
+             mqtt_events ? mqtt_bytes / mqtt_events : 0,
+             metrics.gauges[METRIC_MQTT_LAST_EVENT]);
+
+    const uint64_t *bounds = metrics_histogram_bounds(METRIC_MQTT_PAYLOAD_BYTES);
+    const uint64_t *buckets = metrics.histograms[METRIC_MQTT_PAYLOAD_BYTES].buckets;
+    log_info("MQTT payload bytes <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64
+             ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", more: %" PRIu64,
+             bounds[0], buckets[0], bounds[1], buckets[1], bounds[2], buckets[2], bounds[3], buckets[3],
+             bounds[4], buckets[4], bounds[5], buckets[5], bounds[6], buckets[6], buckets[7]);
+
+    log_info("MQTT devices: %" PRId64 ", reclaimed: %" PRIu64,
+             metrics.gauges[METRIC_MQTT_DEVICES],
+             metrics.counters[METRIC_MQTT_DEVICES_RECLAIMED]);
+
+    failover_stats_t failover_stats = failover_dump_stats(run_state->failover);
+    int64_t broker = metrics.gauges[METRIC_MQTT_BROKER];
+    log_info("MQTT broker: %s, failovers: %" PRIu64 ", failbacks: %" PRIu64 ", races: %d (lost: %d), attempts: %d (failed: %d), last race: %d ms",
+             (broker >= 0 && broker < cfg->broker_cnt) ? cfg->brokers[broker].name : "none",
+             metrics.counters[METRIC_MQTT_FAILOVERS],
+             metrics.counters[METRIC_MQTT_FAILBACKS],
+             failover_stats.races, failover_stats.races_lost,
+             failover_stats.attempts, failover_stats.attempts_failed,
+             failover_stats.last_msec);
+
+    bounds = metrics_histogram_bounds(METRIC_MQTT_FAILOVER_MSEC);
+    buckets = metrics.histograms[METRIC_MQTT_FAILOVER_MSEC].buckets;
+    log_info("MQTT failover ms <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64
+             ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", <=%" PRIu64 ": %" PRIu64 ", more: %" PRIu64,
+             bounds[0], buckets[0], bounds[1], buckets[1], bounds[2], buckets[2], bounds[3], buckets[3],
+             bounds[4], buckets[4], bounds[5], buckets[5], bounds[6], buckets[6], buckets[7]);
+
+    if (cfg->chrony_socket) {
+        chrony_stats_t chrony_stats = chrony_dump_stats(run_state->chrony);
+        chrony_reading_t reading;
+        char ref_name[16] = "none";
+        if (chrony_latest(&reading)) {
+            chrony_ref_name(reading.ref_id, ref_name, sizeof(ref_name));
+        }
+        log_info("Chrony polls: %d (failed: %d, timeouts: %d), requests: %d, selected: %s, stratum: %d, offset: %.9f, sd: %.9f",
+                 chrony_stats.polls, chrony_stats.polls_failed, chrony_stats.timeouts, chrony_stats.requests,
+                 ref_name, reading.stratum, reading.offset, reading.sd);
+    }
+
+    resolver_stats_t resolver_stats = resolver_dump_stats();
+    log_info("Resolver entries: %d, hits: %" PRIu64 " (stale: %" PRIu64 "), misses: %" PRIu64 ", refreshes: %" PRIu64 " (failed: %" PRIu64 ")",
+             resolver_stats.entries, resolver_stats.hits, resolver_stats.stale_hits,
+             resolver_stats.misses, resolver_stats.refreshes, resolver_stats.refresh_failures);
 
-    log_info("MQTT connects: %d, disconnects: %d, events tx: %d, last: %d",
-             run_state->mqtt_connects, run_state->mqtt_disconnects,
-             mqtt_stats.events_send,
-             mqtt_stats.last_event);
+    log_info("Event loop fds: %d, wakeups: %d, events: %" PRIu64,
+             evloop_stats.fds, evloop_stats.wakeups, evloop_stats.events);
+
+    log_stats_t log_stats = log_async_dump_stats();
+    log_info("Log messages queued: %" PRIu64 ", dropped: %" PRIu64 ", suppressed: %" PRIu64,
+             log_stats.queued, log_stats.dropped, log_stats.suppressed);
+    log_info("Timers: %d, scheduled: %" PRIu64 ", cancelled: %" PRIu64 ", expired: %" PRIu64 ", cascaded: %" PRIu64,
+             wheel_stats.timers, wheel_stats.scheduled, wheel_stats.cancelled,
+             wheel_stats.expired, wheel_stats.cascaded);
+
+    for (int i = 0; i < worker_pool_size(run_state->workers); i++) {
+        worker_stats_t worker_stats = worker_pool_dump_stats(run_state->workers, i);
+
+        log_info("Worker #%d sources: %d, wakeups: %d, events: %" PRIu64 ", dropped: %" PRIu64,
+                 i, worker_stats.sources, worker_stats.wakeups,
+                 worker_stats.events, worker_stats.events_dropped);
+    }
+
+    if (run_state->use_uring) {
+        log_info("io_uring sources: %d, submits: %d, completions: %" PRIu64 ", bytes rx: %" PRIu64 ", buffers exhausted: %d",
+                 uring_stats.sources, uring_stats.submits, uring_stats.completions,
+                 uring_stats.bytes_recv, uring_stats.buffers_exhausted);
+    }
+
+    if (run_state->http) {
+        log_info("HTTP clients: %" PRId64 ", accepted: %" PRIu64 ", dropped: %" PRIu64 ", timed out: %" PRIu64 ", events tx: %" PRIu64 ", last: %" PRId64,
+                 metrics.gauges[METRIC_HTTP_CLIENTS],
+                 metrics.counters[METRIC_HTTP_CLIENTS_ACCEPTED],
+                 metrics.counters[METRIC_HTTP_CLIENTS_DROPPED],
+                 metrics.counters[METRIC_HTTP_CLIENTS_TIMED_OUT],
+                 metrics.counters[METRIC_HTTP_EVENTS_SEND],
+                 metrics.gauges[METRIC_HTTP_LAST_EVENT]);
+    }
+
+    if (run_state->checkpoint) {
+        checkpoint_stats_t checkpoint_stats = checkpoint_dump_stats(run_state->checkpoint);
+
+        log_info("Checkpoint generation: %" PRIu64 ", writes: %d, last: %ld, restored generation: %" PRIu64 " (age: %ld s, in %d us)",
+                 checkpoint_stats.generation, checkpoint_stats.writes, checkpoint_stats.last_write,
+                 checkpoint_stats.restored_generation, checkpoint_stats.restored_age,
+                 checkpoint_stats.restore_usec);
+    }
+
+    // rates are determined over the time since the previous sample...
+    mem_sample();
+    mem_stats_t mem_stats = mem_dump_stats();
+
+    log_info("Memory RSS: %" PRIu64 " kB (peak %" PRIu64 " kB), heap used: %" PRIu64 " kB (peak %" PRIu64 " kB) of %" PRIu64 " kB, allocations: %d/s",
+             mem_stats.rss / 1024, mem_stats.peak_rss / 1024,
+             mem_stats.heap_used / 1024, mem_stats.peak_heap_used / 1024,
+             mem_stats.heap_size / 1024, mem_stats.allocs_per_sec);
+
+    for (int i = 0; i < MEM_SUBSYS_CNT; i++) {
+        const mem_subsys_stats_t *stats = &mem_stats.subsys[i];
+
+        log_info("Memory %s live: %" PRIu64 " bytes (peak %" PRIu64 "), allocations: %" PRIu64 " (%d/s), frees: %" PRIu64,
+                 mem_subsys_name((mem_subsys_t) i), stats->live_bytes, stats->peak_bytes,
+                 stats->allocs, stats->allocs_per_sec, stats->frees);
+    }
+}
+
+// Drops the cached addresses of the GPSD servers and MQTT brokers that are no longer configured...
+static void gpsstats_retain_hosts(const config_t *cfg) {
+    // only called by the main thread...
+    static const char *hosts[MAX_SOURCES + MAX_BROKERS];
+    size_t cnt = 0;
+
+    for (uint16_t i = 0; i < cfg->source_cnt; i++) {
+        hosts[cnt++] = cfg->sources[i].host;
+    }
+    for (uint8_t i = 0; i < cfg->broker_cnt; i++) {
+        hosts[cnt++] = cfg->brokers[i].host;
+    }
+
+    resolver_retain(hosts, cnt);
 }
 
 static void gpsstats_signal_handler(const ud_state_t *ud_state, const ud_signal_t signal) {
     run_state_t *run_state = ud_get_app_state(ud_state);
 
     if (signal == SIG_HUP) {
-        // reconnect to both GPSD & MQTT...
-        if (ud_schedule_task(ud_state, 0, gpsstats_reconnect_gpsd, run_state)) {
-            log_warning("Failed to register (re)connect task for GPSD?!");
-        }
+        const config_t *cfg = ud_get_app_config(ud_state);
+
+        // reconnect to both GPSD & MQTT, a pending race still refers to the old configuration...
+        gpsstats_reconnect_sources(run_state, cfg, 0);
+        failover_cancel(run_state->failover);
         if (ud_schedule_task(ud_state, 0, gpsstats_reconnect_mqtt, run_state)) {
             log_warning("Failed to register (re)connect task for MQTT?!");
         }
+        if (ud_schedule_task(ud_state, 0, gpsstats_restart_http, run_state)) {
+            log_warning("Failed to register restart task for HTTP?!");
+        }
+        gpsstats_reopen_checkpoint(run_state, cfg);
+        resolver_start(cfg->resolver_ttl);
+        gpsstats_retain_hosts(cfg);
+        if (chrony_start(run_state->chrony, cfg->chrony_socket, cfg->chrony_interval)) {
+            log_warning("Failed to restart polling chronyd?!");
+        }
     } else if (signal == SIG_USR1) {
         gpsstats_dump_stats(ud_state, run_state);
     }
@@ -289,21 +1123,66 @@ static void gpsstats_signal_handler(const ud_state_t *ud_state, const ud_signal_
 static int gpsstats_cleanup(const ud_state_t *ud_state) {
     run_state_t *run_state = ud_get_app_state(ud_state);
 
+    // Stop the workers first, so we own all GPSD handles again...
+    if (run_state->workers) {
+        evloop_remove(run_state->evloop, worker_pool_fd(run_state->workers));
+        worker_pool_destroy(run_state->workers);
+    }
+
+    // Keep the final counters and the state of the devices for the next run...
+    if (run_state->checkpoint) {
+        checkpoint_write(run_state->checkpoint, gpsstats_save_devices, run_state);
+        checkpoint_close(run_state->checkpoint);
+    }
+
     log_debug("Closing connection to GPSD...");
-    gpsd_disconnect(run_state->gpsd);
-    gpsd_destroy(run_state->gpsd);
+    for (uint16_t i = 0; i < run_state->gpsd_cnt; i++) {
+        gpsstats_unwatch_gpsd(&run_state->gpsd[i]);
+        gpsd_disconnect(run_state->gpsd[i].gpsd);
+        gpsd_destroy(run_state->gpsd[i].gpsd);
+    }
+    // The final checkpoint holds the state the handles kept...
+    gpsd_restore_devices(NULL, 0);
+
+    if (run_state->uring) {
+        evloop_remove(run_state->evloop, uring_fd(run_state->uring));
+        uring_destroy(run_state->uring);
+    }
 
     log_debug("Closing connection to MQTT...");
+    failover_destroy(run_state->failover);
+    evloop_remove(run_state->evloop, run_state->mqtt_fd);
     mqtt_disconnect(run_state->mqtt);
     mqtt_destroy(run_state->mqtt);
 
+    log_debug("Closing HTTP listener...");
+    http_destroy(run_state->http);
+
+    chrony_destroy(run_state->chrony);
+
+    if (run_state->wheel) {
+        evloop_remove(run_state->evloop, wheel_fd(run_state->wheel));
+        wheel_destroy(run_state->wheel);
+    }
+
+    if (ud_valid_event_handler_id(run_state->evloop_event_handler_id)) {
+        ud_remove_event_handler(ud_state, run_state->evloop_event_handler_id);
+    }
+    evloop_destroy(run_state->evloop);
+
+    resolver_stop();
+
+    log_async_stop();
+
     return 0;
 }
 
 int main(int argc, char *argv[]) {
     run_state_t run_state = {
-        .gpsd_event_handler_id = UD_INVALID_ID,
-        .mqtt_event_handler_id = UD_INVALID_ID,
+        .evloop_event_handler_id = UD_INVALID_ID,
+        .mqtt_fd = -1,
+        .mqtt_broker = -1,
+        .mqtt_retry_interval = 1,
     };
 
     ud_config_t daemon_config = {
@@ -352,6 +1231,7 @@ int main(int argc, char *argv[]) {
     // setup our logging layer...
     setup_logging(daemon_config.foreground);
     set_loglevel(debug ? DEBUG : INFO);
+    log_async_set_debug(debug);
 
     // Use defaults if not set explicitly...
     if (daemon_config.conf_file == NULL) {
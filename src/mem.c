@@ -0,0 +1,218 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include "mem.h"
+
+#define CACHE_LINE 64
+
+typedef struct mem_counters {
+    // workers allocate as well, so keep each subsystem on its own cache line...
+    _Alignas(CACHE_LINE) _Atomic uint64_t allocs;
+    _Atomic uint64_t frees;
+    _Atomic uint64_t live_bytes;
+    _Atomic uint64_t peak_bytes;
+} mem_counters_t;
+
+static mem_counters_t mem_counters[MEM_SUBSYS_CNT];
+
+static const char *mem_subsys_names[MEM_SUBSYS_CNT] = {
+    [MEM_GPSD] = "gpsd",
+    [MEM_MQTT] = "mqtt",
+    [MEM_HTTP] = "http",
+    [MEM_CONFIG] = "config",
+    [MEM_QUEUES] = "queues",
+};
+
+// The last sample, only accessed by the main thread...
+static mem_stats_t mem_last;
+static uint64_t mem_last_allocs[MEM_SUBSYS_CNT];
+static struct timespec mem_last_time;
+
+// Accounts for a block of memory that was allocated...
+static void account_alloc(mem_subsys_t subsys, void *ptr) {
+    mem_counters_t *counters = &mem_counters[subsys];
+    uint64_t size = malloc_usable_size(ptr);
+
+    atomic_fetch_add_explicit(&counters->allocs, 1, memory_order_relaxed);
+    uint64_t live = atomic_fetch_add_explicit(&counters->live_bytes, size, memory_order_relaxed) + size;
+
+    uint64_t peak = atomic_load_explicit(&counters->peak_bytes, memory_order_relaxed);
+    while (live > peak &&
+            !atomic_compare_exchange_weak_explicit(&counters->peak_bytes, &peak, live,
+                    memory_order_relaxed, memory_order_relaxed)) {
+        // peak is updated by the failed exchange...
+    }
+}
+
+// Accounts for a block of memory that is about to be freed...
+static void account_free(mem_subsys_t subsys, void *ptr) {
+    mem_counters_t *counters = &mem_counters[subsys];
+
+    atomic_fetch_add_explicit(&counters->frees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&counters->live_bytes, malloc_usable_size(ptr), memory_order_relaxed);
+}
+
+void *mem_malloc(mem_subsys_t subsys, size_t size) {
+    void *ptr = malloc(size);
+    if (ptr) {
+        account_alloc(subsys, ptr);
+    }
+    return ptr;
+}
+
+void *mem_calloc(mem_subsys_t subsys, size_t nmemb, size_t size) {
+    void *ptr = calloc(nmemb, size);
+    if (ptr) {
+        account_alloc(subsys, ptr);
+    }
+    return ptr;
+}
+
+void *mem_realloc(mem_subsys_t subsys, void *ptr, size_t size) {
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+
+    void *new_ptr = realloc(ptr, size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    if (ptr) {
+        mem_counters_t *counters = &mem_counters[subsys];
+
+        atomic_fetch_add_explicit(&counters->frees, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&counters->live_bytes, old_size, memory_order_relaxed);
+    }
+    account_alloc(subsys, new_ptr);
+
+    return new_ptr;
+}
+
+void *mem_aligned_alloc(mem_subsys_t subsys, size_t alignment, size_t size) {
+    void *ptr = aligned_alloc(alignment, size);
+    if (ptr) {
+        account_alloc(subsys, ptr);
+    }
+    return ptr;
+}
+
+char *mem_strdup(mem_subsys_t subsys, const char *str) {
+    char *ptr = strdup(str);
+    if (ptr) {
+        account_alloc(subsys, ptr);
+    }
+    return ptr;
+}
+
+char *mem_strndup(mem_subsys_t subsys, const char *str, size_t n) {
+    char *ptr = strndup(str, n);
+    if (ptr) {
+        account_alloc(subsys, ptr);
+    }
+    return ptr;
+}
+
+void mem_free(mem_subsys_t subsys, void *ptr) {
+    if (ptr) {
+        account_free(subsys, ptr);
+        free(ptr);
+    }
+}
+
+// Returns the resident set size, in bytes...
+static uint64_t read_rss(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    unsigned long size, resident;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+
+    if (n != 2) {
+        return 0;
+    }
+    return (uint64_t) resident * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+void mem_sample(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    mem_last.rss = read_rss();
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        mem_last.peak_rss = (uint64_t) usage.ru_maxrss * 1024;
+    }
+
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    mem_last.heap_size = (uint64_t) info.arena + (uint64_t) info.hblkhd;
+    mem_last.heap_used = (uint64_t) info.uordblks + (uint64_t) info.hblkhd;
+    if (mem_last.heap_used > mem_last.peak_heap_used) {
+        mem_last.peak_heap_used = mem_last.heap_used;
+    }
+
+    // Only determine the rates over a sensible window...
+    int64_t elapsed = (now.tv_sec - mem_last_time.tv_sec) * 1000 + (now.tv_nsec - mem_last_time.tv_nsec) / 1000000;
+    bool first = mem_last_time.tv_sec == 0 && mem_last_time.tv_nsec == 0;
+    bool update_rates = first || elapsed >= 1000;
+    if (update_rates) {
+        mem_last.allocs_per_sec = 0;
+    }
+
+    for (int i = 0; i < MEM_SUBSYS_CNT; i++) {
+        mem_subsys_stats_t *stats = &mem_last.subsys[i];
+        const mem_counters_t *counters = &mem_counters[i];
+
+        stats->allocs = atomic_load_explicit(&counters->allocs, memory_order_relaxed);
+        stats->frees = atomic_load_explicit(&counters->frees, memory_order_relaxed);
+        stats->live_bytes = atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+        stats->peak_bytes = atomic_load_explicit(&counters->peak_bytes, memory_order_relaxed);
+
+        if (update_rates) {
+            // the first sample only starts the window...
+            stats->allocs_per_sec = first ? 0 : (uint32_t) ((stats->allocs - mem_last_allocs[i]) * 1000 / (uint64_t) elapsed);
+            mem_last.allocs_per_sec += stats->allocs_per_sec;
+            mem_last_allocs[i] = stats->allocs;
+        }
+    }
+
+    if (update_rates) {
+        mem_last_time = now;
+    }
+}
+
+const char *mem_subsys_name(mem_subsys_t subsys) {
+    if (subsys < 0 || subsys >= MEM_SUBSYS_CNT) {
+        return "unknown";
+    }
+    return mem_subsys_names[subsys];
+}
+
+mem_stats_t mem_dump_stats(void) {
+    return mem_last;
+}
+
+// EOF
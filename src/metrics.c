@@ -0,0 +1,202 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+
+// the main thread, the workers, and some spare...
+#define METRICS_MAX_SHARDS (MAX_WORKERS + 4)
+// the number of attempts to read a consistent shard before yielding...
+#define METRICS_SPIN_CNT 100
+
+#define METRICS_BOUNDS(id, ...) [METRIC_##id] = __VA_ARGS__,
+
+static const uint64_t metrics_bounds[METRIC_HISTOGRAM_CNT][METRICS_BUCKETS - 1] = {
+    METRICS_HISTOGRAMS(METRICS_BOUNDS)
+};
+
+#undef METRICS_BOUNDS
+
+static _Atomic(metrics_shard_t *) metrics_shards[METRICS_MAX_SHARDS];
+
+// used when all shards are taken, shared by all remaining threads...
+static metrics_shard_t metrics_overflow_shard;
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+
+_Thread_local metrics_shard_t *metrics_local_shard;
+
+_Atomic int64_t metrics_gauges[METRIC_GAUGE_SLOTS];
+
+// Releases the shard of a thread that exits, its values remain...
+static void release_shard(void *arg) {
+    metrics_shard_t *shard = arg;
+
+    if (shard != &metrics_overflow_shard) {
+        atomic_store_explicit(&shard->in_use, false, memory_order_release);
+    }
+}
+
+static void create_key(void) {
+    if (pthread_key_create(&metrics_key, release_shard)) {
+        log_warning("Failed to create metrics key, shards are not released!");
+    }
+}
+
+// Claims an unused shard, or allocates a new one...
+static metrics_shard_t *claim_shard(void) {
+    for (int i = 0; i < METRICS_MAX_SHARDS; i++) {
+        metrics_shard_t *shard = atomic_load_explicit(&metrics_shards[i], memory_order_acquire);
+
+        if (shard == NULL) {
+            metrics_shard_t *new_shard = mem_aligned_alloc(MEM_QUEUES, 64, sizeof(metrics_shard_t));
+            if (new_shard == NULL) {
+                return NULL;
+            }
+            bzero(new_shard, sizeof(metrics_shard_t));
+            atomic_init(&new_shard->in_use, true);
+
+            if (atomic_compare_exchange_strong(&metrics_shards[i], &shard, new_shard)) {
+                return new_shard;
+            }
+            // another thread took this slot in the meantime...
+            mem_free(MEM_QUEUES, new_shard);
+        }
+
+        bool expected = false;
+        if (atomic_compare_exchange_strong_explicit(&shard->in_use, &expected, true,
+                memory_order_acquire, memory_order_relaxed)) {
+            return shard;
+        }
+    }
+
+    return NULL;
+}
+
+metrics_shard_t *metrics_attach(void) {
+    pthread_once(&metrics_once, create_key);
+
+    metrics_shard_t *shard = claim_shard();
+    if (shard == NULL) {
+        log_warning("No metrics shard available, updates might get lost!");
+        shard = &metrics_overflow_shard;
+    }
+
+    pthread_setspecific(metrics_key, shard);
+    metrics_local_shard = shard;
+
+    return shard;
+}
+
+void metrics_observe(metric_histogram_t histogram, uint64_t value) {
+    metrics_shard_t *shard = metrics_local_shard ? metrics_local_shard : metrics_attach();
+    _Atomic uint64_t *slots = &shard->values[METRIC_COUNTER_SLOTS + histogram * METRICS_HISTOGRAM_SLOTS];
+    const uint64_t *bounds = metrics_bounds[histogram];
+
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && value > bounds[bucket]) {
+        bucket++;
+    }
+
+    uint32_t seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slots[bucket], atomic_load_explicit(&slots[bucket], memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&slots[METRICS_BUCKETS], atomic_load_explicit(&slots[METRICS_BUCKETS], memory_order_relaxed) + value, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 2, memory_order_release);
+}
+
+// Copies the values of a shard, retrying until no update happened in between...
+static void read_shard(metrics_shard_t *shard, uint64_t *values, bool consistent) {
+    for (int attempt = 1;; attempt++) {
+        uint32_t seq = atomic_load_explicit(&shard->seq, memory_order_acquire);
+
+        for (int i = 0; i < METRICS_SHARD_SLOTS; i++) {
+            values[i] = atomic_load_explicit(&shard->values[i], memory_order_relaxed);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (!consistent || ((seq & 1) == 0 && seq == atomic_load_explicit(&shard->seq, memory_order_relaxed))) {
+            return;
+        }
+
+        // the owner might have been preempted halfway an update...
+        if (attempt % METRICS_SPIN_CNT == 0) {
+            sched_yield();
+        }
+    }
+}
+
+void metrics_snapshot(metrics_snapshot_t *snapshot) {
+    uint64_t totals[METRICS_SHARD_SLOTS] = { 0 };
+    uint64_t values[METRICS_SHARD_SLOTS];
+
+    for (int i = 0; i <= METRICS_MAX_SHARDS; i++) {
+        metrics_shard_t *shard = (i < METRICS_MAX_SHARDS) ? atomic_load_explicit(&metrics_shards[i], memory_order_acquire) : &metrics_overflow_shard;
+        if (shard == NULL) {
+            continue;
+        }
+
+        // the overflow shard has multiple writers, so its sequence is meaningless...
+        read_shard(shard, values, shard != &metrics_overflow_shard);
+
+        for (int j = 0; j < METRICS_SHARD_SLOTS; j++) {
+            totals[j] += values[j];
+        }
+    }
+
+    memcpy(snapshot->counters, totals, sizeof(snapshot->counters));
+
+    for (int i = 0; i < METRIC_HISTOGRAM_CNT; i++) {
+        const uint64_t *slots = &totals[METRIC_COUNTER_SLOTS + i * METRICS_HISTOGRAM_SLOTS];
+
+        snapshot->histograms[i].count = 0;
+        for (int j = 0; j < METRICS_BUCKETS; j++) {
+            snapshot->histograms[i].buckets[j] = slots[j];
+            snapshot->histograms[i].count += slots[j];
+        }
+        snapshot->histograms[i].sum = slots[METRICS_BUCKETS];
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_SLOTS; i++) {
+        snapshot->gauges[i] = atomic_load_explicit(&metrics_gauges[i], memory_order_relaxed);
+    }
+}
+
+void metrics_restore(const metrics_snapshot_t *snapshot) {
+    metrics_shard_t *shard = metrics_local_shard ? metrics_local_shard : metrics_attach();
+    uint64_t values[METRICS_SHARD_SLOTS];
+
+    memcpy(values, snapshot->counters, sizeof(snapshot->counters));
+    for (int i = 0; i < METRIC_HISTOGRAM_CNT; i++) {
+        uint64_t *slots = &values[METRIC_COUNTER_SLOTS + i * METRICS_HISTOGRAM_SLOTS];
+
+        memcpy(slots, snapshot->histograms[i].buckets, sizeof(snapshot->histograms[i].buckets));
+        slots[METRICS_BUCKETS] = snapshot->histograms[i].sum;
+    }
+
+    uint32_t seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i = 0; i < METRICS_SHARD_SLOTS; i++) {
+        atomic_store_explicit(&shard->values[i], atomic_load_explicit(&shard->values[i], memory_order_relaxed) + values[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&shard->seq, seq + 2, memory_order_release);
+}
+
+const uint64_t *metrics_histogram_bounds(metric_histogram_t histogram) {
+    return metrics_bounds[histogram];
+}
+
+// EOF
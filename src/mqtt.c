@@ -7,18 +7,54 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <mosquitto.h>
-#include <udaemon/ud_logging.h>
 
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
 #include "mqtt.h"
+#include "payload.h"
+#include "sparkplug.h"
+#include "topic.h"
+#include "trace.h"
 
-#define TOPIC "gpsstats"
+#define MAX_TOPIC_SIZE 256
+#define MAX_HOST_SIZE 64
+
+#define STATE_READY "ready"
+#define STATE_LOST "lost"
+
+#define ALL_CONSTELLATIONS "all"
+
+/**
+ * Holds the precomputed topics and last published values of a single source
+ * (a GPS device of a GPSD source). The topics are expanded once when the
+ * source first appears, and the source is reclaimed once its device is
+ * removed or remains idle.
+ */
+typedef struct mqtt_source {
+    struct mqtt_source *next;
+    // all values are to be published again (as birth certificate, for Sparkplug B)...
+    bool refresh;
+    // in seconds of CLOCK_MONOTONIC, to reclaim sources of idle devices...
+    time_t last_seen;
+    char source[GPS_SOURCE_SIZE];
+    char device[GPS_DEVICE_SIZE];
+    // the topic of the JSON events, or the DDATA topic for Sparkplug B...
+    char topic[MAX_TOPIC_SIZE];
+    payload_value_t last[PAYLOAD_FIELD_CNT];
+    sparkplug_device_t sparkplug;
+    // only allocated when publishing each field to its own topic...
+    char field_topics[][MAX_TOPIC_SIZE];
+} mqtt_source_t;
 
 #define MOSQ_ERROR(s) \
 	((s) == MOSQ_ERR_ERRNO) ? strerror(errno) : mosquitto_strerror((s))
@@ -27,21 +63,79 @@ struct mqtt_handle {
     struct mosquitto *mosq;
     char *host;
     int port;
+    // the result of the CONNACK, or -1 while waiting for it...
+    int connack;
     bool retain;
     int qos;
-
-    uint32_t mqtt_events_send;
-    time_t mqtt_last_event;
+    payload_format_t format;
+
+    sparkplug_state_t sparkplug;
+    char birth_topic[MAX_TOPIC_SIZE];
+    char death_topic[MAX_TOPIC_SIZE];
+    char command_topic[MAX_TOPIC_SIZE];
+
+    // owned by the handle, as it can outlive the configuration it was created with...
+    topic_template_t *topic;
+    char *client_id;
+    char *group_id;
+    const char *topic_vars[VAR_CNT];
+    char hostname[MAX_HOST_SIZE];
+    char state_topic[MAX_TOPIC_SIZE];
+
+    mqtt_source_t *sources;
+    mqtt_source_t *last_source;
 };
 
+// multiple handles exist while racing brokers, the library is initialized only once...
+static int mqtt_lib_refs = 0;
+
 static void my_connect_cb(struct mosquitto *mosq, void *user_data, int result) {
     (void)mosq;
-    (void)user_data;
+    mqtt_handle_t *handle = user_data;
+
+    handle->connack = result;
 
     if (result) {
-        log_warning("unable to connect to MQTT broker. Reason: %s", MOSQ_ERROR(result));
+        log_warning("unable to connect to MQTT broker %s. Reason: %s", handle->host, MOSQ_ERROR(result));
     } else {
-        log_info("successfully connected to MQTT broker");
+        log_debug("successfully connected to MQTT broker %s", handle->host);
+
+        // (re)announce our metrics with the next event...
+        handle->sparkplug.need_birth = true;
+
+        // the broker might have lost our retained values...
+        for (mqtt_source_t *source = handle->sources; source; source = source->next) {
+            source->refresh = true;
+        }
+
+        // host applications can ask for a rebirth, the session is clean so subscribe each time...
+        if (handle->format == FORMAT_SPARKPLUG) {
+            int status = mosquitto_subscribe(handle->mosq, NULL, handle->command_topic, 1 /* qos */);
+            if (status != MOSQ_ERR_SUCCESS) {
+                log_warning("failed to subscribe to %s: %s", handle->command_topic, MOSQ_ERROR(status));
+            }
+        }
+    }
+}
+
+static void my_message_cb(struct mosquitto *mosq, void *user_data, const struct mosquitto_message *msg) {
+    (void)mosq;
+    mqtt_handle_t *handle = user_data;
+
+    if (handle->format != FORMAT_SPARKPLUG || strcmp(msg->topic, handle->command_topic) != 0) {
+        return;
+    }
+    if (msg->payloadlen <= 0 || !sparkplug_decode_rebirth(msg->payload, (size_t) msg->payloadlen)) {
+        log_debug("ignoring Sparkplug command without rebirth request");
+        return;
+    }
+
+    log_info("Sparkplug rebirth requested, announcing all metrics again...");
+
+    // the NBIRTH is published with the next event, followed by a DBIRTH of each device...
+    handle->sparkplug.need_birth = true;
+    for (mqtt_source_t *source = handle->sources; source; source = source->next) {
+        source->refresh = true;
     }
 }
 
@@ -56,6 +150,13 @@ static void my_disconnect_cb(struct mosquitto *mosq, void *user_data, int result
     }
 }
 
+static void my_publish_cb(struct mosquitto *mosq, void *user_data, int mid) {
+    (void)mosq;
+    (void)user_data;
+
+    TRACE1(publish_written, mid);
+}
+
 static void my_log_callback(struct mosquitto *mosq, void *user_data, int level, const char *msg) {
     (void)mosq;
     (void)user_data;
@@ -72,16 +173,259 @@ static bool mqtt_needs_to_reconnect(int status) {
            status == MOSQ_ERR_UNKNOWN;
 }
 
-mqtt_handle_t *mqtt_init(const config_t *cfg) {
-    mosquitto_lib_init();
+// Sparkplug B mandates that each new MQTT session uses a new bdSeq, which
+// survives restarts as the established sessions are checkpointed...
+static uint64_t sparkplug_next_bd_seq(void) {
+    metrics_snapshot_t metrics;
+    metrics_snapshot(&metrics);
+
+    return metrics.counters[METRIC_MQTT_SPARKPLUG_SESSIONS];
+}
+
+static time_t now_sec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Returns the name of a device, as used in topics...
+static const char *device_name(const char *device) {
+    const char *name = strrchr(device, '/');
+    return name ? name + 1 : device;
+}
+
+// Returns the name of the device of an event, as used in topics...
+static const char *event_device_name(const char *source, const char *device) {
+    // a source without (configured) device is named after the source itself...
+    return *device ? device_name(device) : source;
+}
+
+// Expands the topic template for a given source, device and constellation...
+static int expand_topic(mqtt_handle_t *handle, const char *source, const char *device, const char *constellation, char *buffer, size_t size) {
+    const char *vars[VAR_CNT];
+
+    memcpy(vars, handle->topic_vars, sizeof(vars));
+    vars[VAR_SOURCE] = source;
+    vars[VAR_DEVICE] = device;
+    vars[VAR_CONSTELLATION] = constellation;
+
+    int len = topic_expand(handle->topic, vars, buffer, size);
+    if (len < 0) {
+        log_warning("Failed to expand topic %s: topic too long!", topic_str(handle->topic));
+    }
+    return len;
+}
+
+// Creates a Sparkplug B topic for a device of our edge node...
+static int sparkplug_topic(const mqtt_handle_t *handle, const mqtt_source_t *source, const char *type, char *buffer, size_t size) {
+    // the device ID cannot contain any of the MQTT topic separators and wildcards...
+    int len = snprintf(buffer, size, SPARKPLUG_NAMESPACE "/%s/%s/%s/", handle->group_id, type, handle->client_id);
+    if (len < 0 || (size_t) len >= size) {
+        return -ENOMEM;
+    }
+    int id_start = len;
+    if (*source->device) {
+        len += snprintf(buffer + len, size - (size_t) len, "%s:%s", source->source, device_name(source->device));
+    } else {
+        len += snprintf(buffer + len, size - (size_t) len, "%s", source->source);
+    }
+    if ((size_t) len >= size) {
+        return -ENOMEM;
+    }
+    for (char *p = buffer + id_start; *p; p++) {
+        if (*p == '/' || *p == '+' || *p == '#') {
+            *p = '_';
+        }
+    }
+    return len;
+}
+
+static mqtt_source_t *create_source(mqtt_handle_t *handle, const gps_event_t *event) {
+    bool with_fields = (handle->format == FORMAT_FIELDS);
+    size_t size = sizeof(mqtt_source_t) + (with_fields ? PAYLOAD_FIELD_CNT * MAX_TOPIC_SIZE : 0);
+
+    mqtt_source_t *source = mem_malloc(MEM_MQTT, size);
+    if (!source) {
+        log_warning("Failed to create MQTT source: out of memory!");
+        return NULL;
+    }
+    bzero(source, size);
+
+    source->refresh = true;
+    source->last_seen = now_sec();
+    strncpy(source->source, event->source, sizeof(source->source) - 1);
+    strncpy(source->device, event->device, sizeof(source->device) - 1);
+
+    const char *name = event_device_name(source->source, source->device);
+
+    if (handle->format == FORMAT_SPARKPLUG) {
+        sparkplug_device_init(&handle->sparkplug, &source->sparkplug);
+
+        if (sparkplug_topic(handle, source, "DDATA", source->topic, MAX_TOPIC_SIZE) < 0) {
+            log_warning("Failed to create MQTT source: topic too long!");
+            goto err_cleanup;
+        }
+    } else if (expand_topic(handle, source->source, name, ALL_CONSTELLATIONS, source->topic, MAX_TOPIC_SIZE) < 0) {
+        goto err_cleanup;
+    }
+
+    bool per_constellation = topic_uses(handle->topic, VAR_CONSTELLATION);
+
+    for (size_t i = 0; with_fields && i < PAYLOAD_FIELD_CNT; i++) {
+        char *topic = source->field_topics[i];
+        const char *field = payload_field_name(i);
+        int gnssid = payload_field_gnssid(i);
+        int len;
+
+        if (per_constellation && gnssid >= 0) {
+            len = expand_topic(handle, source->source, name, gpsd_gnss_name((uint8_t) gnssid), topic, MAX_TOPIC_SIZE);
+            field = "sats";
+        } else {
+            len = expand_topic(handle, source->source, name, ALL_CONSTELLATIONS, topic, MAX_TOPIC_SIZE);
+        }
+        if (len < 0 || snprintf(topic + len, MAX_TOPIC_SIZE - (size_t) len, "/%s", field) >= MAX_TOPIC_SIZE - len) {
+            log_warning("Failed to create MQTT source: topic too long!");
+            goto err_cleanup;
+        }
+
+        // use a topic level for each part of the field name, homie-style...
+        for (char *p = topic + len + 1; *p; p++) {
+            if (*p == '.') {
+                *p = '/';
+            }
+        }
+    }
+
+    log_debug("Publishing events of %s:%s to %s", source->source, *source->device ? source->device : "GPSD", source->topic);
 
-    mqtt_handle_t *handle = malloc(sizeof(mqtt_handle_t));
+    source->next = handle->sources;
+    handle->sources = source;
+
+    // Update stats...
+    metrics_adjust(METRIC_MQTT_DEVICES, 0, 1);
+
+    return source;
+
+err_cleanup:
+    mem_free(MEM_MQTT, source);
+
+    return NULL;
+}
+
+static inline bool is_source_of(const mqtt_source_t *source, const gps_event_t *event) {
+    return strcmp(source->device, event->device) == 0 && strcmp(source->source, event->source) == 0;
+}
+
+// Looks up the source of an event, creating it when it first appears...
+static mqtt_source_t *get_source(mqtt_handle_t *handle, const gps_event_t *event) {
+    mqtt_source_t *source = handle->last_source;
+
+    // events of the same device typically arrive in bursts...
+    if (!source || !is_source_of(source, event)) {
+        for (source = handle->sources; source; source = source->next) {
+            if (is_source_of(source, event)) {
+                break;
+            }
+        }
+        if (!source) {
+            source = create_source(handle, event);
+        }
+
+        handle->last_source = source;
+    }
+
+    if (source) {
+        source->last_seen = now_sec();
+    }
+
+    return source;
+}
+
+// Publishes the death certificate of a source that was announced, as Sparkplug B device...
+static void sparkplug_device_death(mqtt_handle_t *handle, const mqtt_source_t *source) {
+    if (source->refresh || handle->sparkplug.need_birth) {
+        // Not announced (anymore)...
+        return;
+    }
+
+    char topic[MAX_TOPIC_SIZE];
+    uint8_t payload[PAYLOAD_MAX_SIZE];
+    sparkplug_update_t update;
+
+    int len = sparkplug_encode_device_death(&handle->sparkplug, &update, payload, sizeof(payload));
+    if (len < 0 || sparkplug_topic(handle, source, "DDEATH", topic, sizeof(topic)) < 0) {
+        return;
+    }
+
+    // Best effort: the device is announced again once it reappears...
+    if (mosquitto_publish(handle->mosq, NULL, topic, len, payload, 0 /* qos */, false /* retain */) == MOSQ_ERR_SUCCESS) {
+        sparkplug_commit(&handle->sparkplug, NULL, &update);
+    }
+}
+
+// Removes the retained values of a source, so no stale values remain once its device is gone...
+static void clear_retained(mqtt_handle_t *handle, const mqtt_source_t *source) {
+    if (handle->format == FORMAT_SPARKPLUG) {
+        sparkplug_device_death(handle, source);
+        return;
+    }
+    if (!handle->retain && handle->format != FORMAT_FIELDS) {
+        // Nothing retained...
+        return;
+    }
+    if (!topic_uses(handle->topic, VAR_DEVICE)) {
+        // The topics are shared with the other devices...
+        return;
+    }
+
+    // Best effort: the values are published again once the device reappears...
+    if (handle->format == FORMAT_FIELDS) {
+        for (size_t i = 0; i < PAYLOAD_FIELD_CNT; i++) {
+            if (source->last[i].present) {
+                mosquitto_publish(handle->mosq, NULL, source->field_topics[i], 0, NULL, handle->qos, true /* retain */);
+            }
+        }
+    } else {
+        mosquitto_publish(handle->mosq, NULL, source->topic, 0, NULL, handle->qos, true /* retain */);
+    }
+}
+
+// Tears down the source following a given link...
+static void destroy_source(mqtt_handle_t *handle, mqtt_source_t **link) {
+    mqtt_source_t *source = *link;
+
+    log_debug("No longer publishing events of %s:%s to %s", source->source, *source->device ? source->device : "GPSD", source->topic);
+
+    clear_retained(handle, source);
+
+    *link = source->next;
+    if (handle->last_source == source) {
+        handle->last_source = NULL;
+    }
+    mem_free(MEM_MQTT, source);
+
+    // Update stats...
+    metrics_adjust(METRIC_MQTT_DEVICES, 0, -1);
+}
+
+mqtt_handle_t *mqtt_init(const config_t *cfg, const char *host, uint16_t port) {
+    if (mqtt_lib_refs++ == 0) {
+        mosquitto_lib_init();
+    }
+
+    mqtt_handle_t *handle = mem_malloc(MEM_MQTT, sizeof(mqtt_handle_t));
     if (!handle) {
         log_error("failed to create MQTT handle: out of memory!");
-        return NULL;
+        goto err_cleanup;
     }
     bzero(handle, sizeof(mqtt_handle_t));
 
+    handle->host = mem_strdup(MEM_MQTT, host);
+    if (!handle->host) {
+        log_error("failed to create MQTT handle: out of memory!");
+        goto err_cleanup;
+    }
+
     struct mosquitto *mosq = mosquitto_new(cfg->client_id, true /* clean session */, handle);
     if (!mosq) {
         log_error("failed to create new mosquitto instance");
@@ -89,13 +433,69 @@ mqtt_handle_t *mqtt_init(const config_t *cfg) {
     }
 
     handle->mosq = mosq;
-    handle->host = cfg->mqtt_host;
-    handle->port = cfg->mqtt_port;
+    handle->port = port;
+    handle->connack = -1;
     handle->retain = cfg->retain;
     handle->qos = cfg->qos;
+    handle->format = cfg->format;
+
+    // Everything but the device and constellation is known up front...
+    handle->topic = topic_parse(topic_str(cfg->topic));
+    handle->client_id = mem_strdup(MEM_MQTT, cfg->client_id);
+    handle->group_id = mem_strdup(MEM_MQTT, cfg->group_id);
+    if (!handle->topic || !handle->client_id || !handle->group_id) {
+        log_error("failed to create MQTT handle: out of memory!");
+        goto err_cleanup;
+    }
+    if (gethostname(handle->hostname, sizeof(handle->hostname) - 1)) {
+        strncpy(handle->hostname, "localhost", sizeof(handle->hostname) - 1);
+    }
+    handle->topic_vars[VAR_CLIENT_ID] = handle->client_id;
+    handle->topic_vars[VAR_HOST] = handle->hostname;
 
     int status;
 
+    if (handle->format == FORMAT_SPARKPLUG) {
+        uint8_t death[PAYLOAD_MAX_SIZE];
+
+        snprintf(handle->birth_topic, MAX_TOPIC_SIZE, SPARKPLUG_NAMESPACE "/%s/NBIRTH/%s", cfg->group_id, cfg->client_id);
+        snprintf(handle->death_topic, MAX_TOPIC_SIZE, SPARKPLUG_NAMESPACE "/%s/NDEATH/%s", cfg->group_id, cfg->client_id);
+        snprintf(handle->command_topic, MAX_TOPIC_SIZE, SPARKPLUG_NAMESPACE "/%s/NCMD/%s", cfg->group_id, cfg->client_id);
+
+        // Only consumed once this handle is announced, so racing handles share it...
+        sparkplug_init(&handle->sparkplug, sparkplug_next_bd_seq());
+
+        int len = sparkplug_encode_death(&handle->sparkplug, death, sizeof(death));
+        if (len < 0) {
+            log_error("failed to encode Sparkplug death certificate");
+            goto err_cleanup;
+        }
+
+        // The broker publishes our death certificate when we disappear...
+        status = mosquitto_will_set(handle->mosq, handle->death_topic, len, death, 1 /* qos */, false /* retain */);
+        if (status != MOSQ_ERR_SUCCESS) {
+            log_error("failed to set Sparkplug death certificate: %s", MOSQ_ERROR(status));
+            goto err_cleanup;
+        }
+    } else if (handle->format == FORMAT_FIELDS) {
+        // The state is shared by all sources, use the first one for the placeholders...
+        const gpsd_source_t *first = &cfg->sources[0];
+        const char *name = first->device ? device_name(first->device) : first->name;
+        int len = expand_topic(handle, first->name, name, ALL_CONSTELLATIONS, handle->state_topic, MAX_TOPIC_SIZE);
+        if (len < 0 || snprintf(handle->state_topic + len, MAX_TOPIC_SIZE - (size_t) len, "/$state") >= MAX_TOPIC_SIZE - len) {
+            log_error("failed to create state topic: topic too long!");
+            goto err_cleanup;
+        }
+
+        // The broker marks our topics as lost when we disappear...
+        status = mosquitto_will_set(handle->mosq, handle->state_topic,
+                                    sizeof(STATE_LOST) - 1, STATE_LOST, handle->qos, true /* retain */);
+        if (status != MOSQ_ERR_SUCCESS) {
+            log_error("failed to set MQTT will: %s", MOSQ_ERROR(status));
+            goto err_cleanup;
+        }
+    }
+
     if (cfg->use_tls) {
         log_debug("setting up TLS parameters on mosquitto instance");
 
@@ -132,6 +532,8 @@ mqtt_handle_t *mqtt_init(const config_t *cfg) {
 
     mosquitto_connect_callback_set(handle->mosq, my_connect_cb);
     mosquitto_disconnect_callback_set(handle->mosq, my_disconnect_cb);
+    mosquitto_publish_callback_set(handle->mosq, my_publish_cb);
+    mosquitto_message_callback_set(handle->mosq, my_message_cb);
     mosquitto_log_callback_set(handle->mosq, my_log_callback);
 
     return handle;
@@ -147,10 +549,25 @@ void mqtt_destroy(mqtt_handle_t *handle) {
         mosquitto_destroy(handle->mosq);
         handle->mosq = NULL;
 
-        free(handle);
+        while (handle->sources) {
+            mqtt_source_t *next = handle->sources->next;
+            mem_free(MEM_MQTT, handle->sources);
+            handle->sources = next;
+
+            // Update stats...
+            metrics_adjust(METRIC_MQTT_DEVICES, 0, -1);
+        }
+
+        topic_free(handle->topic);
+        mem_free(MEM_MQTT, handle->client_id);
+        mem_free(MEM_MQTT, handle->group_id);
+        mem_free(MEM_MQTT, handle->host);
+        mem_free(MEM_MQTT, handle);
     }
 
-    mosquitto_lib_cleanup();
+    if (--mqtt_lib_refs == 0) {
+        mosquitto_lib_cleanup();
+    }
 }
 
 int mqtt_connect(mqtt_handle_t *handle) {
@@ -167,6 +584,55 @@ int mqtt_connect(mqtt_handle_t *handle) {
     return 0;
 }
 
+int mqtt_connect_async(mqtt_handle_t *handle) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+
+    int status = mosquitto_connect_async(handle->mosq, handle->host, handle->port, 60 /* keepalive */);
+    if (status != MOSQ_ERR_SUCCESS) {
+        log_debug("failed to connect to MQTT broker %s: %s", handle->host, MOSQ_ERROR(status));
+        return -ENOTCONN;
+    }
+
+    return 0;
+}
+
+int mqtt_connect_status(mqtt_handle_t *handle) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+    if (handle->connack < 0) {
+        return -EINPROGRESS;
+    }
+    return handle->connack ? -ECONNREFUSED : 0;
+}
+
+int mqtt_announce(mqtt_handle_t *handle) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+    if (handle->format == FORMAT_SPARKPLUG) {
+        // The session is established, the next one needs a new bdSeq...
+        metrics_inc(METRIC_MQTT_SPARKPLUG_SESSIONS, 0);
+        return 0;
+    }
+    if (handle->format != FORMAT_FIELDS) {
+        // Nothing to announce...
+        return 0;
+    }
+
+    int status = mosquitto_publish(handle->mosq, NULL /* message id */,
+                                   handle->state_topic,
+                                   sizeof(STATE_READY) - 1, STATE_READY,
+                                   handle->qos, true /* retain */);
+    if (status) {
+        log_warning("Failed to publish state to MQTT broker. Reason: %s", MOSQ_ERROR(status));
+        return mqtt_needs_to_reconnect(status) ? -ENOTCONN : -ENOTRECOVERABLE;
+    }
+    return 0;
+}
+
 int mqtt_disconnect(mqtt_handle_t *handle) {
     if (handle == NULL) {
         return -EINVAL;
@@ -233,6 +699,38 @@ int mqtt_misc_loop(mqtt_handle_t *handle) {
     return 0;
 }
 
+int mqtt_reclaim_sources(mqtt_handle_t *handle, uint32_t idle) {
+    if (handle == NULL) {
+        return -EINVAL;
+    }
+    if (idle == 0) {
+        // Never reclaim...
+        return 0;
+    }
+
+    time_t now = now_sec();
+    int cnt = 0;
+
+    mqtt_source_t **link = &handle->sources;
+    while (*link) {
+        if (now - (*link)->last_seen < (time_t) idle) {
+            link = &(*link)->next;
+            continue;
+        }
+
+        log_info("GPS device %s idle for %u seconds, reclaiming its resources...",
+                 *(*link)->device ? (*link)->device : "GPSD", idle);
+
+        destroy_source(handle, link);
+        cnt++;
+
+        // Update stats...
+        metrics_inc(METRIC_MQTT_DEVICES_RECLAIMED, 0);
+    }
+
+    return cnt;
+}
+
 int mqtt_fd(mqtt_handle_t *handle) {
     if (handle == NULL) {
         return -EINVAL;
@@ -245,41 +743,262 @@ int mqtt_fd(mqtt_handle_t *handle) {
     return fd;
 }
 
-int mqtt_send_event(mqtt_handle_t *handle, const char *event_data) {
-    if (handle == NULL) {
-        return -EINVAL;
+// Publishes the fields that changed to their own retained topic...
+static int mqtt_send_fields(mqtt_handle_t *handle, mqtt_source_t *source, const gps_event_t *event) {
+    payload_value_t values[PAYLOAD_FIELD_CNT];
+    uint64_t bytes_send = 0;
+
+    payload_field_values(event, values);
+
+    for (size_t i = 0; i < PAYLOAD_FIELD_CNT; i++) {
+        payload_value_t *last = &source->last[i];
+
+        if (!source->refresh && last->present == values[i].present &&
+                (!values[i].present || last->bits == values[i].bits)) {
+            // Not changed...
+            continue;
+        }
+
+        char text[64];
+        int len = 0;
+        // an empty retained message removes the value of absent fields...
+        if (values[i].present) {
+            len = payload_format_value(i, &values[i], text, sizeof(text));
+            if (len < 0) {
+                continue;
+            }
+        }
+
+        TRACE2(payload_built, source->field_topics[i], len);
+
+        int mid;
+        int status = mosquitto_publish(handle->mosq, &mid,
+                                       source->field_topics[i],
+                                       len, text,
+                                       handle->qos,
+                                       true /* retain */);
+        if (status) {
+            TRACE2(drop, "mqtt", 0);
+            log_warning("Failed to publish data to MQTT broker. Reason: %s", MOSQ_ERROR(status));
+            return mqtt_needs_to_reconnect(status) ? -ENOTCONN : -ENOTRECOVERABLE;
+        }
+
+        TRACE3(publish_queued, mid, source->field_topics[i], len);
+        metrics_observe(METRIC_MQTT_PAYLOAD_BYTES, (uint64_t) len);
+
+        *last = values[i];
+        bytes_send += (uint64_t) len;
     }
 
-    log_debug("Publishing event %s", event_data);
+    source->refresh = false;
 
-    int status = mosquitto_publish(handle->mosq, NULL /* message id */,
-                                   TOPIC,
-                                   (int) strlen(event_data), event_data,
-                                   handle->qos,
-                                   handle->retain);
+    // Update stats...
+    metrics_inc(METRIC_MQTT_EVENTS_SEND, 0);
+    metrics_add(METRIC_MQTT_BYTES_SEND, 0, bytes_send);
+    metrics_set(METRIC_MQTT_LAST_EVENT, 0, time(NULL));
+
+    return 0;
+}
+
+// Publishes an event that is not a fix as JSON to a subtopic of its device...
+static int mqtt_send_aside(mqtt_handle_t *handle, const gps_event_t *event, const char *constellation, const char *subtopic) {
+    char topic[MAX_TOPIC_SIZE];
+    const char *name = event_device_name(event->source, event->device);
+    int len = expand_topic(handle, event->source, name, constellation, topic, sizeof(topic));
+    if (len < 0 || snprintf(topic + len, sizeof(topic) - (size_t) len, "/%s", subtopic) >= (int) sizeof(topic) - len) {
+        return -ENOMEM;
+    }
+
+    char payload[PAYLOAD_MAX_SIZE];
+    len = payload_encode_json(event, payload, sizeof(payload));
+    if (len < 0) {
+        log_warning("Failed to encode %s event: payload too large!", subtopic);
+        return -ENOMEM;
+    }
+
+    log_debug("Publishing %s event %s", subtopic, payload);
+
+    TRACE2(payload_built, topic, len);
+
+    int mid;
+    int status = mosquitto_publish(handle->mosq, &mid, topic, len, payload, handle->qos, handle->retain);
     if (status) {
+        TRACE2(drop, "mqtt", 0);
         log_warning("Failed to publish data to MQTT broker. Reason: %s", MOSQ_ERROR(status));
         return mqtt_needs_to_reconnect(status) ? -ENOTCONN : -ENOTRECOVERABLE;
     }
 
+    TRACE3(publish_queued, mid, topic, len);
+    metrics_observe(METRIC_MQTT_PAYLOAD_BYTES, (uint64_t) len);
+
     // Update stats...
-    handle->mqtt_events_send++;
-    handle->mqtt_last_event = time(NULL);
+    metrics_inc(METRIC_MQTT_EVENTS_SEND, 0);
+    metrics_add(METRIC_MQTT_BYTES_SEND, 0, (uint64_t) len);
+    metrics_set(METRIC_MQTT_LAST_EVENT, 0, time(NULL));
 
     return 0;
 }
 
-mqtt_stats_t mqtt_dump_stats(mqtt_handle_t *handle) {
+// Publishes a change of a device to its own topic, and reclaims the source of removed devices...
+static int mqtt_send_device(mqtt_handle_t *handle, const gps_event_t *event) {
+    if (event->dev.change == GPS_DEVICE_REMOVED) {
+        for (mqtt_source_t **link = &handle->sources; *link; link = &(*link)->next) {
+            if (is_source_of(*link, event)) {
+                destroy_source(handle, link);
+                break;
+            }
+        }
+    }
+
+    if (handle->format == FORMAT_SPARKPLUG) {
+        // The settings of a device are not part of its Sparkplug B metrics...
+        return 0;
+    }
+
+    return mqtt_send_aside(handle, event, ALL_CONSTELLATIONS, "device");
+}
+
+// Publishes the birth certificate of our Sparkplug B edge node, after which all devices are announced again...
+static int mqtt_send_birth(mqtt_handle_t *handle) {
+    uint8_t payload[PAYLOAD_MAX_SIZE];
+    sparkplug_update_t update;
+
+    int len = sparkplug_encode_birth(&handle->sparkplug, &update, payload, sizeof(payload));
+    if (len < 0) {
+        log_warning("Failed to encode Sparkplug birth certificate!");
+        return -ENOMEM;
+    }
+
+    log_debug("Publishing %d bytes to %s", len, handle->birth_topic);
+
+    TRACE2(payload_built, handle->birth_topic, len);
+
+    int mid;
+    int status = mosquitto_publish(handle->mosq, &mid, handle->birth_topic, len, payload, 0 /* qos */, false /* retain */);
+    if (status) {
+        TRACE2(drop, "mqtt", 0);
+        log_warning("Failed to publish data to MQTT broker. Reason: %s", MOSQ_ERROR(status));
+        return mqtt_needs_to_reconnect(status) ? -ENOTCONN : -ENOTRECOVERABLE;
+    }
+
+    TRACE3(publish_queued, mid, handle->birth_topic, len);
+    metrics_observe(METRIC_MQTT_PAYLOAD_BYTES, (uint64_t) len);
+    metrics_add(METRIC_MQTT_BYTES_SEND, 0, (uint64_t) len);
+
+    sparkplug_commit(&handle->sparkplug, NULL, &update);
+    handle->sparkplug.need_birth = false;
+    for (mqtt_source_t *source = handle->sources; source; source = source->next) {
+        source->refresh = true;
+    }
+
+    return 0;
+}
+
+int mqtt_send_event(mqtt_handle_t *handle, const gps_event_t *event) {
     if (handle == NULL) {
-        return (mqtt_stats_t) {
-            0
-        };
+        return -EINVAL;
+    }
+    if (event->type == GPS_EVENT_DEVICE) {
+        return mqtt_send_device(handle, event);
+    } else if (event->type != GPS_EVENT_FIX) {
+        // Oscillator and C/N0 events are not part of the Sparkplug B metrics either...
+        if (handle->format == FORMAT_SPARKPLUG) {
+            return 0;
+        } else if (event->type == GPS_EVENT_CN0) {
+            return mqtt_send_aside(handle, event, gpsd_gnss_name(event->cn0.gnssid), "cn0");
+        }
+        return mqtt_send_aside(handle, event, ALL_CONSTELLATIONS, "osc");
+    }
+
+    if (handle->format == FORMAT_SPARKPLUG && handle->sparkplug.need_birth) {
+        // The edge node is announced before any of its devices...
+        int status = mqtt_send_birth(handle);
+        if (status) {
+            return status;
+        }
+    }
+
+    mqtt_source_t *source = get_source(handle, event);
+    if (!source) {
+        return -ENOMEM;
+    }
+    if (handle->format == FORMAT_FIELDS) {
+        return mqtt_send_fields(handle, source, event);
+    }
+
+    uint8_t payload[PAYLOAD_MAX_SIZE];
+    char birth_topic[MAX_TOPIC_SIZE];
+    sparkplug_update_t update;
+    const char *topic = source->topic;
+    int qos = handle->qos;
+    bool retain = handle->retain;
+    bool birth = false;
+    int len;
+
+    if (handle->format == FORMAT_SPARKPLUG) {
+        // Sparkplug B mandates QoS 0 and non-retained messages...
+        qos = 0;
+        retain = false;
+
+        if (source->refresh) {
+            len = sparkplug_encode_device_birth(&handle->sparkplug, &source->sparkplug, event, &update, payload, sizeof(payload));
+            if (len >= 0 && sparkplug_topic(handle, source, "DBIRTH", birth_topic, sizeof(birth_topic)) < 0) {
+                len = -ENOMEM;
+            }
+            topic = birth_topic;
+            birth = true;
+        } else {
+            len = sparkplug_encode_device_data(&handle->sparkplug, &source->sparkplug, event, &update, payload, sizeof(payload));
+        }
+        if (len > 0) {
+            log_debug("Publishing %d bytes to %s", len, topic);
+        }
+    } else {
+        len = payload_encode_json(event, (char *) payload, sizeof(payload));
+        if (len > 0) {
+            log_debug("Publishing event %s", (char *) payload);
+        }
     }
 
-    return (mqtt_stats_t) {
-        .events_send = handle->mqtt_events_send,
-        .last_event = handle->mqtt_last_event,
-    };
+    if (len < 0) {
+        log_warning("Failed to encode event: payload too large!");
+        return -ENOMEM;
+    } else if (len == 0) {
+        // Nothing changed...
+        return 0;
+    }
+
+    TRACE2(payload_built, topic, len);
+
+    int mid;
+    int status = mosquitto_publish(handle->mosq, &mid,
+                                   topic,
+                                   len, payload,
+                                   qos,
+                                   retain);
+    if (status) {
+        TRACE2(drop, "mqtt", 0);
+        log_warning("Failed to publish data to MQTT broker. Reason: %s", MOSQ_ERROR(status));
+        return mqtt_needs_to_reconnect(status) ? -ENOTCONN : -ENOTRECOVERABLE;
+    }
+
+    TRACE3(publish_queued, mid, topic, len);
+    metrics_observe(METRIC_MQTT_PAYLOAD_BYTES, (uint64_t) len);
+
+    // Only a published message advances the state, a failed one is encoded again...
+    if (handle->format == FORMAT_SPARKPLUG) {
+        sparkplug_commit(&handle->sparkplug, &source->sparkplug, &update);
+    }
+    if (birth) {
+        source->refresh = false;
+    }
+
+    // Update stats...
+    metrics_inc(METRIC_MQTT_EVENTS_SEND, 0);
+    metrics_add(METRIC_MQTT_BYTES_SEND, 0, (uint64_t) len);
+    metrics_set(METRIC_MQTT_LAST_EVENT, 0, time(NULL));
+
+    return 0;
 }
 
 // EOF
\ No newline at end of file
@@ -0,0 +1,283 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+#include "nmea.h"
+
+// log2(NMEA_MAX_TYPES), the types are kept in an open addressed hash table...
+#define NMEA_TYPE_BITS 5
+
+// packs the last three characters of a five character address...
+#define NMEA_TYPE(a, b, c) \
+    (((uint64_t) (a) << 16) | ((uint64_t) (b) << 24) | ((uint64_t) (c) << 32))
+#define NMEA_TYPE_MASK NMEA_TYPE(0xff, 0xff, 0xff)
+
+typedef struct nmea_type {
+    // the address packed as little endian integer, 0 if unused...
+    _Atomic uint64_t key;
+    _Atomic uint64_t count;
+} nmea_type_t;
+
+struct nmea {
+    uint16_t index;
+
+    // written by the thread feeding the tokenizer only...
+    nmea_type_t types[NMEA_MAX_TYPES];
+    _Atomic uint64_t other;
+
+    // the UTC time of the current cycle, as hhmmss.ss without the dot...
+    bool in_cycle;
+    uint64_t cycle_time;
+    uint32_t cycle_max_gap;
+    uint64_t last_seen;
+
+    nmea_counts_t counts;
+};
+
+static inline int hex_digit(uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Only these sentences carry the UTC time of their cycle as first field...
+static bool has_time(uint64_t key, size_t addr_len) {
+    if (addr_len != 5 || (key & 0xff) == 'P') {
+        return false;
+    }
+
+    switch (key & NMEA_TYPE_MASK) {
+    case NMEA_TYPE('G', 'G', 'A'):
+    case NMEA_TYPE('R', 'M', 'C'):
+    case NMEA_TYPE('G', 'N', 'S'):
+    case NMEA_TYPE('Z', 'D', 'A'):
+    case NMEA_TYPE('G', 'S', 'T'):
+    case NMEA_TYPE('G', 'B', 'S'):
+    case NMEA_TYPE('G', 'R', 'S'):
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void count_type(nmea_t *nmea, uint64_t key) {
+    uint32_t i = (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> (64 - NMEA_TYPE_BITS));
+
+    for (int n = 0; n < NMEA_MAX_TYPES; n++, i = (i + 1) & (NMEA_MAX_TYPES - 1)) {
+        nmea_type_t *type = &nmea->types[i];
+        uint64_t k = atomic_load_explicit(&type->key, memory_order_relaxed);
+
+        if (k == key) {
+            atomic_store_explicit(&type->count, atomic_load_explicit(&type->count, memory_order_relaxed) + 1, memory_order_relaxed);
+            return;
+        } else if (k == 0) {
+            // Publish the key last, so readers never see it without its count...
+            atomic_store_explicit(&type->count, 1, memory_order_relaxed);
+            atomic_store_explicit(&type->key, key, memory_order_release);
+            return;
+        }
+    }
+
+    atomic_store_explicit(&nmea->other, atomic_load_explicit(&nmea->other, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Keeps track of the cycles and the gaps between the sentences within a cycle...
+static void track_cycle(nmea_t *nmea, bool timed, uint64_t time, uint64_t now) {
+    uint64_t gap = (nmea->last_seen && now > nmea->last_seen) ? now - nmea->last_seen : 0;
+    nmea->last_seen = now;
+
+    if (timed && (!nmea->in_cycle || time != nmea->cycle_time)) {
+        if (nmea->in_cycle) {
+            metrics_observe(METRIC_NMEA_GAP_MSEC, nmea->cycle_max_gap);
+        }
+
+        // The gap before the first sentence of a cycle is the idle time between cycles...
+        nmea->in_cycle = true;
+        nmea->cycle_time = time;
+        nmea->cycle_max_gap = 0;
+        return;
+    }
+
+    if (gap > nmea->cycle_max_gap) {
+        nmea->cycle_max_gap = (uint32_t) gap;
+    }
+    if (gap > nmea->counts.max_gap) {
+        nmea->counts.max_gap = (uint32_t) gap;
+    }
+}
+
+// Tokenizes a single sentence, returns the start of the next sentence in the same line, if any...
+static const char *tokenize(nmea_t *nmea, const char *p, const char *end, uint64_t now, nmea_status_t *status) {
+    uint8_t sum = 0;
+    uint64_t key = 0;
+    size_t addr_len = 0;
+    uint64_t time = 0;
+    int time_digits = 0;
+    int field = 0;
+
+    // Skip the start delimiter, it is not part of the checksum...
+    for (p++; p < end; p++) {
+        uint8_t c = (uint8_t) *p;
+
+        if (c == '*') {
+            break;
+        } else if (c == '$' || c == '!') {
+            // Another sentence started before this one ended, characters got lost...
+            *status = NMEA_TRUNCATED;
+            track_cycle(nmea, false, 0, now);
+            return p;
+        }
+
+        sum ^= c;
+
+        if (c == ',') {
+            field++;
+        } else if (field == 0) {
+            if (addr_len < NMEA_ADDRESS_SIZE - 1) {
+                key |= (uint64_t) c << (8 * addr_len++);
+            }
+        } else if (field == 1 && c >= '0' && c <= '9' && time_digits < 12) {
+            time = time * 10 + (uint64_t) (c - '0');
+            time_digits++;
+        }
+    }
+
+    if (end - p < 3) {
+        // No (complete) checksum...
+        *status = NMEA_TRUNCATED;
+        track_cycle(nmea, false, 0, now);
+        return end;
+    }
+
+    int hi = hex_digit((uint8_t) p[1]);
+    int lo = hex_digit((uint8_t) p[2]);
+    if (hi < 0 || lo < 0 || sum != (uint8_t) ((hi << 4) | lo)) {
+        *status = NMEA_CHECKSUM_ERROR;
+    } else {
+        *status = NMEA_OK;
+
+        if (addr_len) {
+            count_type(nmea, key);
+        } else {
+            atomic_store_explicit(&nmea->other, atomic_load_explicit(&nmea->other, memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+    }
+
+    // Sentences with a bad checksum cannot be trusted to start a new cycle...
+    track_cycle(nmea, *status == NMEA_OK && time_digits > 0 && has_time(key, addr_len), time, now);
+
+    // Anything after the checksum is ignored, unless another sentence starts there...
+    for (p += 3; p < end && *p != '$' && *p != '!'; p++) {
+        ;
+    }
+    return p;
+}
+
+nmea_t *nmea_init(uint16_t index) {
+    nmea_t *nmea = mem_malloc(MEM_GPSD, sizeof(nmea_t));
+    if (nmea == NULL) {
+        log_error("failed to create NMEA tokenizer: out of memory!");
+        return NULL;
+    }
+    bzero(nmea, sizeof(nmea_t));
+
+    nmea->index = index;
+
+    return nmea;
+}
+
+void nmea_destroy(nmea_t *nmea) {
+    if (nmea) {
+        mem_free(MEM_GPSD, nmea);
+    }
+}
+
+nmea_status_t nmea_feed(nmea_t *nmea, const char *line, size_t len, uint64_t now) {
+    const char *end = line + len;
+    nmea_status_t status = NMEA_TRUNCATED;
+    uint32_t sentences = 0;
+    uint32_t checksum_errors = 0;
+    uint32_t truncated = 0;
+
+    while (end > line && (end[-1] == '\r' || end[-1] == '\n')) {
+        end--;
+    }
+
+    const char *p = line;
+    while (p < end) {
+        p = tokenize(nmea, p, end, now, &status);
+
+        sentences++;
+        if (status == NMEA_CHECKSUM_ERROR) {
+            checksum_errors++;
+        } else if (status == NMEA_TRUNCATED) {
+            truncated++;
+        }
+    }
+
+    nmea->counts.sentences += sentences;
+    nmea->counts.checksum_errors += checksum_errors;
+    nmea->counts.truncated += truncated;
+
+    // Update stats...
+    metrics_add(METRIC_NMEA_SENTENCES, nmea->index, sentences);
+    if (checksum_errors) {
+        metrics_add(METRIC_NMEA_CHECKSUM_ERRORS, nmea->index, checksum_errors);
+    }
+    if (truncated) {
+        metrics_add(METRIC_NMEA_TRUNCATED, nmea->index, truncated);
+    }
+
+    return status;
+}
+
+nmea_counts_t nmea_take_counts(nmea_t *nmea) {
+    nmea_counts_t counts = nmea->counts;
+    bzero(&nmea->counts, sizeof(nmea_counts_t));
+    return counts;
+}
+
+size_t nmea_dump_types(const nmea_t *nmea, nmea_type_stats_t *types, size_t max) {
+    size_t cnt = 0;
+
+    for (int i = 0; i < NMEA_MAX_TYPES && cnt < max; i++) {
+        uint64_t key = atomic_load_explicit(&nmea->types[i].key, memory_order_acquire);
+        if (key == 0) {
+            continue;
+        }
+
+        nmea_type_stats_t *type = &types[cnt++];
+        bzero(type, sizeof(nmea_type_stats_t));
+        for (size_t j = 0; j < NMEA_ADDRESS_SIZE - 1 && (key >> (8 * j)) & 0xff; j++) {
+            type->address[j] = (char) ((key >> (8 * j)) & 0xff);
+        }
+        type->count = atomic_load_explicit(&nmea->types[i].count, memory_order_relaxed);
+    }
+
+    uint64_t other = atomic_load_explicit(&nmea->other, memory_order_relaxed);
+    if (other && cnt < max) {
+        nmea_type_stats_t *type = &types[cnt++];
+        bzero(type, sizeof(nmea_type_stats_t));
+        strcpy(type->address, "other");
+        type->count = other;
+    }
+
+    return cnt;
+}
+
+// EOF
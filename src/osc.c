@@ -0,0 +1,258 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "log.h"
+#include "mem.h"
+#include "osc.h"
+
+const int osc_delta_bounds[OSC_DELTA_BUCKETS - 1] = { 10, 20, 50, 100, 200, 500, 1000 };
+
+static const char *state_name[OSC_STATE_CNT] = {
+    [OSC_ABSENT] = "absent",
+    [OSC_FREERUN] = "freerun",
+    [OSC_HOLDOVER] = "holdover",
+    [OSC_ACQUIRING] = "acquiring",
+    [OSC_LOCKED] = "locked",
+};
+
+struct osc {
+    // the length of a summary window, in milliseconds...
+    uint64_t window;
+
+    osc_state_t state;
+    // the moment up to which the time of the current state is accounted...
+    uint64_t since;
+    uint64_t last_seen;
+
+    // the window starts once the oscillator is first reported...
+    bool started;
+    uint64_t window_start;
+    osc_summary_t summary;
+    int64_t delta_sum;
+
+    // the totals, read by other threads...
+    _Atomic int total_state;
+    _Atomic uint64_t total_time[OSC_STATE_CNT];
+    _Atomic uint64_t total_transitions;
+    _Atomic uint64_t total_reference_losses;
+};
+
+static inline bool has_reference(osc_state_t state) {
+    return state == OSC_ACQUIRING || state == OSC_LOCKED;
+}
+
+static inline void add_total(_Atomic uint64_t *total, uint64_t value) {
+    atomic_store_explicit(total, atomic_load_explicit(total, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Adds the time since the last call to the current state...
+static void account(osc_t *osc, uint64_t now) {
+    if (!osc->started || now <= osc->since) {
+        return;
+    }
+
+    uint64_t elapsed = now - osc->since;
+    osc->summary.time[osc->state] += elapsed;
+    add_total(&osc->total_time[osc->state], elapsed);
+    osc->since = now;
+}
+
+static void transition(osc_t *osc, osc_state_t next, uint64_t now, osc_state_t *previous) {
+    account(osc, now);
+
+    if (has_reference(osc->state) && !has_reference(next)) {
+        osc->summary.reference_losses++;
+        add_total(&osc->total_reference_losses, 1);
+    }
+    osc->summary.transitions++;
+    add_total(&osc->total_transitions, 1);
+
+    *previous = osc->state;
+    osc->state = next;
+    atomic_store_explicit(&osc->total_state, (int) next, memory_order_relaxed);
+}
+
+static void add_delta(osc_t *osc, int delta) {
+    osc_summary_t *summary = &osc->summary;
+
+    if (summary->delta_cnt == 0 || delta < summary->delta_min) {
+        summary->delta_min = delta;
+    }
+    if (summary->delta_cnt == 0 || delta > summary->delta_max) {
+        summary->delta_max = delta;
+    }
+    summary->delta_cnt++;
+    osc->delta_sum += delta;
+
+    long magnitude = labs((long) delta);
+    int i = 0;
+    while (i < OSC_DELTA_BUCKETS - 1 && magnitude > osc_delta_bounds[i]) {
+        i++;
+    }
+    summary->delta_buckets[i]++;
+}
+
+const char *osc_state_name(osc_state_t state) {
+    if (state >= OSC_STATE_CNT) {
+        return "unknown";
+    }
+    return state_name[state];
+}
+
+osc_t *osc_init(uint32_t window) {
+    osc_t *osc = mem_malloc(MEM_GPSD, sizeof(osc_t));
+    if (osc == NULL) {
+        log_error("failed to create oscillator tracker: out of memory!");
+        return NULL;
+    }
+    bzero(osc, sizeof(osc_t));
+
+    osc->window = (uint64_t) window * 1000;
+    osc->state = OSC_ABSENT;
+
+    return osc;
+}
+
+void osc_destroy(osc_t *osc) {
+    if (osc) {
+        mem_free(MEM_GPSD, osc);
+    }
+}
+
+bool osc_feed(osc_t *osc, bool running, bool reference, bool disciplined, int delta, uint64_t now, osc_state_t *previous) {
+    osc_state_t next;
+
+    if (!running) {
+        next = OSC_ABSENT;
+    } else if (reference) {
+        next = disciplined ? OSC_LOCKED : OSC_ACQUIRING;
+    } else {
+        next = disciplined ? OSC_HOLDOVER : OSC_FREERUN;
+    }
+
+    if (!osc->started) {
+        osc->started = true;
+        osc->since = now;
+        osc->window_start = now;
+    }
+    osc->last_seen = now;
+
+    // The delta is meaningless without the reference it is measured against...
+    if (running && reference) {
+        add_delta(osc, delta);
+    }
+
+    if (next == osc->state) {
+        account(osc, now);
+        return false;
+    }
+
+    transition(osc, next, now, previous);
+    return true;
+}
+
+bool osc_tick(osc_t *osc, uint64_t now, osc_state_t *previous) {
+    if (osc->state == OSC_ABSENT || now < osc->last_seen + OSC_TIMEOUT) {
+        return false;
+    }
+
+    // The oscillator is gone since it was last reported...
+    transition(osc, OSC_ABSENT, osc->last_seen + OSC_TIMEOUT, previous);
+    account(osc, now);
+    return true;
+}
+
+bool osc_take_summary(osc_t *osc, uint64_t now, osc_summary_t *summary) {
+    if (osc->window == 0 || !osc->started || now < osc->window_start + osc->window) {
+        return false;
+    }
+
+    account(osc, now);
+
+    *summary = osc->summary;
+    summary->window = now - osc->window_start;
+    summary->state = osc->state;
+    if (summary->delta_cnt) {
+        summary->delta_mean = (double) osc->delta_sum / summary->delta_cnt;
+    }
+
+    bzero(&osc->summary, sizeof(osc_summary_t));
+    osc->delta_sum = 0;
+    osc->window_start = now;
+
+    return true;
+}
+
+osc_state_t osc_state(const osc_t *osc) {
+    return osc->state;
+}
+
+osc_stats_t osc_dump_stats(const osc_t *osc) {
+    osc_stats_t stats;
+    bzero(&stats, sizeof(osc_stats_t));
+
+    stats.state = (osc_state_t) atomic_load_explicit(&osc->total_state, memory_order_relaxed);
+    for (int i = 0; i < OSC_STATE_CNT; i++) {
+        stats.time[i] = atomic_load_explicit(&osc->total_time[i], memory_order_relaxed);
+    }
+    stats.transitions = atomic_load_explicit(&osc->total_transitions, memory_order_relaxed);
+    stats.reference_losses = atomic_load_explicit(&osc->total_reference_losses, memory_order_relaxed);
+
+    return stats;
+}
+
+void osc_save(const osc_t *osc, uint64_t now, osc_saved_t *saved) {
+    bzero(saved, sizeof(osc_saved_t));
+
+    saved->state = osc->state;
+    saved->totals = osc_dump_stats(osc);
+    saved->started = osc->started;
+    if (osc->started) {
+        saved->window_elapsed = (now > osc->window_start) ? now - osc->window_start : 0;
+        saved->summary = osc->summary;
+        saved->delta_sum = osc->delta_sum;
+
+        // The time of the current state is only accounted up to the last message...
+        if (now > osc->since) {
+            saved->summary.time[osc->state] += now - osc->since;
+            saved->totals.time[osc->state] += now - osc->since;
+        }
+    }
+}
+
+void osc_restore(osc_t *osc, const osc_saved_t *saved, uint64_t now) {
+    if (saved->state >= OSC_STATE_CNT) {
+        return;
+    }
+
+    for (int i = 0; i < OSC_STATE_CNT; i++) {
+        add_total(&osc->total_time[i], saved->totals.time[i]);
+    }
+    add_total(&osc->total_transitions, saved->totals.transitions);
+    add_total(&osc->total_reference_losses, saved->totals.reference_losses);
+
+    if (!saved->started) {
+        return;
+    }
+
+    osc->state = saved->state;
+    atomic_store_explicit(&osc->total_state, (int) saved->state, memory_order_relaxed);
+
+    osc->started = true;
+    osc->since = now;
+    osc->last_seen = now;
+    // a window cannot have started before the clock did...
+    osc->window_start = now - ((saved->window_elapsed < now) ? saved->window_elapsed : now - 1);
+    osc->summary = saved->summary;
+    osc->delta_sum = saved->delta_sum;
+}
+
+// EOF
@@ -0,0 +1,381 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "payload.h"
+
+typedef enum field_id {
+    F_SATS_USED = 0,
+    F_SATS_VISIBLE,
+    F_TDOP,
+    F_AVG_SNR,
+    F_QERR,
+    F_TOFF,
+    F_PPS,
+    F_PPS_CORRECTED,
+    F_SATS, // first of GNSSID_CNT fields
+    F_NMEA_SENTENCES = F_SATS + GNSSID_CNT,
+    F_NMEA_ERRORS,
+    F_NMEA_TRUNCATED,
+    F_NMEA_GAP,
+    F_KERNEL_OFFSET,
+    F_KERNEL_FREQ,
+    F_KERNEL_MAXERROR,
+    F_KERNEL_ESTERROR,
+    F_KERNEL_STATUS,
+    F_CHRONY_OFFSET,
+    F_CHRONY_SD,
+    F_CHRONY_DIFF,
+    F_CHRONY_STRATUM,
+} field_id_t;
+
+typedef struct field_def {
+    const char *name;
+    payload_type_t type;
+} field_def_t;
+
+static const field_def_t field_defs[PAYLOAD_FIELD_CNT] = {
+    [F_SATS_USED] = { "sats_used", TYPE_UINT },
+    [F_SATS_VISIBLE] = { "sats_visible", TYPE_UINT },
+    [F_TDOP] = { "tdop", TYPE_DOUBLE },
+    [F_AVG_SNR] = { "avg_snr", TYPE_DOUBLE },
+    [F_QERR] = { "qErr", TYPE_LONG },
+    [F_TOFF] = { "toff", TYPE_DOUBLE },
+    [F_PPS] = { "pps", TYPE_DOUBLE },
+    [F_PPS_CORRECTED] = { "pps_corrected", TYPE_DOUBLE },
+    [F_SATS + GNSSID_GPS] = { "sats.gps", TYPE_UINT },
+    [F_SATS + GNSSID_SBAS] = { "sats.sbas", TYPE_UINT },
+    [F_SATS + GNSSID_GAL] = { "sats.galileo", TYPE_UINT },
+    [F_SATS + GNSSID_BD] = { "sats.beidou", TYPE_UINT },
+    [F_SATS + GNSSID_IMES] = { "sats.imes", TYPE_UINT },
+    [F_SATS + GNSSID_QZSS] = { "sats.qzss", TYPE_UINT },
+    [F_SATS + GNSSID_GLO] = { "sats.glonass", TYPE_UINT },
+    [F_SATS + GNSSID_IRNSS] = { "sats.irnss", TYPE_UINT },
+    [F_NMEA_SENTENCES] = { "nmea.sentences", TYPE_UINT },
+    [F_NMEA_ERRORS] = { "nmea.errors", TYPE_UINT },
+    [F_NMEA_TRUNCATED] = { "nmea.truncated", TYPE_UINT },
+    [F_NMEA_GAP] = { "nmea.gap", TYPE_UINT },
+    [F_KERNEL_OFFSET] = { "kernel.offset", TYPE_DOUBLE },
+    [F_KERNEL_FREQ] = { "kernel.freq", TYPE_DOUBLE },
+    [F_KERNEL_MAXERROR] = { "kernel.maxerror", TYPE_DOUBLE },
+    [F_KERNEL_ESTERROR] = { "kernel.esterror", TYPE_DOUBLE },
+    [F_KERNEL_STATUS] = { "kernel.status", TYPE_UINT },
+    [F_CHRONY_OFFSET] = { "chrony.offset", TYPE_DOUBLE },
+    [F_CHRONY_SD] = { "chrony.sd", TYPE_DOUBLE },
+    [F_CHRONY_DIFF] = { "chrony.diff", TYPE_DOUBLE },
+    [F_CHRONY_STRATUM] = { "chrony.stratum", TYPE_UINT },
+};
+
+static inline payload_value_t uint_value(bool present, uint64_t v) {
+    return (payload_value_t) {
+        present, v
+    };
+}
+
+static inline payload_value_t int_value(bool present, int64_t v) {
+    return (payload_value_t) {
+        present, (uint64_t) v
+    };
+}
+
+static inline payload_value_t double_value(bool present, double d) {
+    payload_value_t v = { .present = present };
+    memcpy(&v.bits, &d, sizeof(v.bits));
+    return v;
+}
+
+const char *payload_field_name(size_t id) {
+    return (id < PAYLOAD_FIELD_CNT) ? field_defs[id].name : "unknown";
+}
+
+payload_type_t payload_field_type(size_t id) {
+    return (id < PAYLOAD_FIELD_CNT) ? field_defs[id].type : TYPE_UINT;
+}
+
+int payload_field_gnssid(size_t id) {
+    return (id >= F_SATS && id < F_SATS + GNSSID_CNT) ? (int)(id - F_SATS) : -1;
+}
+
+void payload_field_values(const gps_event_t *event, payload_value_t *values) {
+    values[F_SATS_USED] = uint_value(true, (uint64_t) event->sats_used);
+    values[F_SATS_VISIBLE] = uint_value(true, (uint64_t) event->sats_visible);
+    values[F_TDOP] = double_value(true, event->tdop);
+    values[F_AVG_SNR] = double_value(true, event->avg_snr);
+    values[F_QERR] = int_value(event->qErr != 0, event->qErr);
+    values[F_TOFF] = double_value(true, event->toff);
+    values[F_PPS] = double_value(true, event->pps);
+    values[F_PPS_CORRECTED] = double_value(event->pps_corrected_valid, event->pps_corrected);
+
+    for (uint8_t i = 0; i < GNSSID_CNT; i++) {
+        values[F_SATS + i] = uint_value(event->sats_seen[i] > 0, event->sats_seen[i]);
+    }
+
+    values[F_NMEA_SENTENCES] = uint_value(event->nmea_watched, event->nmea.sentences);
+    values[F_NMEA_ERRORS] = uint_value(event->nmea_watched, event->nmea.checksum_errors);
+    values[F_NMEA_TRUNCATED] = uint_value(event->nmea_watched, event->nmea.truncated);
+    values[F_NMEA_GAP] = uint_value(event->nmea_watched, event->nmea.max_gap);
+
+    values[F_KERNEL_OFFSET] = double_value(event->kernel_sampled, event->kernel.offset);
+    values[F_KERNEL_FREQ] = double_value(event->kernel_sampled, event->kernel.freq);
+    values[F_KERNEL_MAXERROR] = double_value(event->kernel_sampled, event->kernel.maxerror);
+    values[F_KERNEL_ESTERROR] = double_value(event->kernel_sampled, event->kernel.esterror);
+    values[F_KERNEL_STATUS] = uint_value(event->kernel_sampled, (uint64_t) event->kernel.status);
+
+    values[F_CHRONY_OFFSET] = double_value(event->chrony_valid, event->chrony.offset);
+    values[F_CHRONY_SD] = double_value(event->chrony_valid, event->chrony.sd);
+    values[F_CHRONY_DIFF] = double_value(event->chrony_valid, event->chrony_diff);
+    values[F_CHRONY_STRATUM] = uint_value(event->chrony_valid, event->chrony.stratum);
+}
+
+int payload_format_value(size_t id, const payload_value_t *value, char *buffer, size_t size) {
+    int len;
+
+    switch (payload_field_type(id)) {
+    case TYPE_DOUBLE: {
+        double d;
+        memcpy(&d, &value->bits, sizeof(d));
+        len = snprintf(buffer, size, "%f", d);
+        break;
+    }
+    case TYPE_INT:
+    case TYPE_LONG:
+        len = snprintf(buffer, size, "%lld", (long long) value->bits);
+        break;
+    case TYPE_BOOL:
+        len = snprintf(buffer, size, "%s", value->bits ? "true" : "false");
+        break;
+    case TYPE_UINT:
+    default:
+        len = snprintf(buffer, size, "%llu", (unsigned long long) value->bits);
+        break;
+    }
+
+    if (len < 0 || (size_t) len >= size) {
+        return -ENOMEM;
+    }
+    return len;
+}
+
+#define BUFFER_ADD(...)                                                        \
+  do {                                                                         \
+    int status;                                                                \
+    status = snprintf(buffer + offset, size - offset, __VA_ARGS__);            \
+    if (status < 1) {                                                          \
+      return -ENOMEM;                                                          \
+    } else if (((size_t)status) >= (size - offset)) {                          \
+      return -ENOMEM;                                                          \
+    } else                                                                     \
+      offset += ((size_t)status);                                              \
+  } while (0)
+
+static const char *device_change_name[] = {
+    [GPS_DEVICE_ADDED] = "added",
+    [GPS_DEVICE_CHANGED] = "changed",
+    [GPS_DEVICE_REMOVED] = "removed",
+};
+
+static int encode_device_json(const gps_event_t *event, char *buffer, size_t size) {
+    size_t offset = 0;
+
+    BUFFER_ADD("{");
+
+    BUFFER_ADD("\"time\":%ld.%.9ld", (long) event->time.tv_sec, event->time.tv_nsec);
+    BUFFER_ADD(",\"device\":\"%s\",\"change\":\"%s\"", event->device, device_change_name[event->dev.change]);
+
+    if (event->dev.change != GPS_DEVICE_REMOVED) {
+        BUFFER_ADD(",\"driver\":\"%s\",\"bps\":%u,\"cycle\":%f",
+                   event->dev.driver,
+                   event->dev.bps,
+                   event->dev.cycle);
+    }
+
+    BUFFER_ADD("}");
+
+    return (int) offset;
+}
+
+static int encode_osc_json(const gps_event_t *event, char *buffer, size_t size) {
+    size_t offset = 0;
+    const osc_summary_t *summary = &event->osc.summary;
+
+    BUFFER_ADD("{");
+
+    BUFFER_ADD("\"time\":%ld.%.9ld", (long) event->time.tv_sec, event->time.tv_nsec);
+    BUFFER_ADD(",\"device\":\"%s\",\"state\":\"%s\"", event->device, osc_state_name(event->osc.state));
+
+    if (event->type == GPS_EVENT_OSC_STATE) {
+        BUFFER_ADD(",\"previous\":\"%s\"}", osc_state_name(event->osc.previous));
+        return (int) offset;
+    }
+
+    BUFFER_ADD(",\"window\":%.3f", (double) summary->window / 1000.0);
+    for (int i = 0; i < OSC_STATE_CNT; i++) {
+        BUFFER_ADD(",\"time.%s\":%.3f", osc_state_name((osc_state_t) i), (double) summary->time[i] / 1000.0);
+    }
+    BUFFER_ADD(",\"transitions\":%u,\"reference_losses\":%u", summary->transitions, summary->reference_losses);
+
+    BUFFER_ADD(",\"delta.cnt\":%u", summary->delta_cnt);
+    if (summary->delta_cnt) {
+        BUFFER_ADD(",\"delta.mean\":%f,\"delta.min\":%d,\"delta.max\":%d",
+                   summary->delta_mean,
+                   summary->delta_min,
+                   summary->delta_max);
+
+        BUFFER_ADD(",\"delta.buckets\":[");
+        for (int i = 0; i < OSC_DELTA_BUCKETS; i++) {
+            BUFFER_ADD("%s%u", i ? "," : "", summary->delta_buckets[i]);
+        }
+        BUFFER_ADD("]");
+    }
+
+    BUFFER_ADD("}");
+
+    return (int) offset;
+}
+
+// Adds a histogram as run-length encoded array, where a negative value -n stands for n empty bins...
+static int encode_bins_json(const char *name, const uint16_t *bins, size_t cnt, char *buffer, size_t size) {
+    size_t offset = 0;
+    size_t empty = 0;
+    bool first = true;
+
+    BUFFER_ADD(",\"%s\":[", name);
+
+    for (size_t i = 0; i < cnt; i++) {
+        if (bins[i] == 0) {
+            empty++;
+            continue;
+        }
+        if (empty) {
+            BUFFER_ADD("%s-%zu", first ? "" : ",", empty);
+            first = false;
+            empty = 0;
+        }
+        BUFFER_ADD("%s%u", first ? "" : ",", bins[i]);
+        first = false;
+    }
+
+    // Trailing empty bins are omitted...
+    BUFFER_ADD("]");
+
+    return (int) offset;
+}
+
+static int encode_cn0_json(const gps_event_t *event, char *buffer, size_t size) {
+    size_t offset = 0;
+    const gps_cn0_info_t *cn0 = &event->cn0;
+
+    BUFFER_ADD("{");
+
+    BUFFER_ADD("\"time\":%ld.%.9ld", (long) event->time.tv_sec, event->time.tv_nsec);
+    BUFFER_ADD(",\"device\":\"%s\",\"constellation\":\"%s\"", event->device, gpsd_gnss_name(cn0->gnssid));
+    BUFFER_ADD(",\"window\":%.3f,\"skyviews\":%u,\"visible\":%u,\"used\":%u",
+               (double) cn0->window / 1000.0,
+               cn0->skyviews,
+               cn0->visible_cnt,
+               cn0->used_cnt);
+
+    int len = encode_bins_json("cn0.visible", cn0->visible, GPS_CN0_BINS, buffer + offset, size - offset);
+    if (len < 0) {
+        return len;
+    }
+    offset += (size_t) len;
+
+    len = encode_bins_json("cn0.used", cn0->used, GPS_CN0_BINS, buffer + offset, size - offset);
+    if (len < 0) {
+        return len;
+    }
+    offset += (size_t) len;
+
+    BUFFER_ADD("}");
+
+    return (int) offset;
+}
+
+int payload_encode_json(const gps_event_t *event, char *buffer, size_t size) {
+    size_t offset = 0;
+
+    if (event->type == GPS_EVENT_DEVICE) {
+        return encode_device_json(event, buffer, size);
+    } else if (event->type == GPS_EVENT_CN0) {
+        return encode_cn0_json(event, buffer, size);
+    } else if (event->type != GPS_EVENT_FIX) {
+        return encode_osc_json(event, buffer, size);
+    }
+
+    BUFFER_ADD("{");
+
+    BUFFER_ADD("\"time\":%ld.%.9ld", (long) event->time.tv_sec, event->time.tv_nsec);
+
+    BUFFER_ADD(",\"sats_used\":%d,\"sats_visible\":%d,\"tdop\":%f,\"avg_snr\":%f",
+               event->sats_used,
+               event->sats_visible,
+               event->tdop,
+               event->avg_snr);
+
+    if (event->qErr != 0) {
+        BUFFER_ADD(",\"qErr\":%ld", event->qErr);
+    }
+
+    BUFFER_ADD(",\"toff\":%f", event->toff);
+    BUFFER_ADD(",\"pps\":%f", event->pps);
+    if (event->pps_corrected_valid) {
+        // the correction is well below a microsecond...
+        BUFFER_ADD(",\"pps_corrected\":%.9f", event->pps_corrected);
+    }
+
+    for (uint8_t i = 0; i < GNSSID_CNT; i++) {
+        uint8_t seen = event->sats_seen[i];
+        if (seen > 0) {
+            BUFFER_ADD(",\"sats.%s\":%d", gpsd_gnss_name(i), seen);
+        }
+    }
+
+    if (event->nmea_watched) {
+        BUFFER_ADD(",\"nmea.sentences\":%u,\"nmea.errors\":%u,\"nmea.truncated\":%u,\"nmea.gap\":%u",
+                   event->nmea.sentences,
+                   event->nmea.checksum_errors,
+                   event->nmea.truncated,
+                   event->nmea.max_gap);
+    }
+
+    if (event->kernel_sampled) {
+        BUFFER_ADD(",\"kernel.offset\":%f,\"kernel.freq\":%f,\"kernel.maxerror\":%f,\"kernel.esterror\":%f,\"kernel.status\":%d",
+                   event->kernel.offset,
+                   event->kernel.freq,
+                   event->kernel.maxerror,
+                   event->kernel.esterror,
+                   event->kernel.status);
+    }
+
+    if (event->chrony_valid) {
+        BUFFER_ADD(",\"chrony.offset\":%f,\"chrony.sd\":%f,\"chrony.diff\":%f,\"chrony.stratum\":%u",
+                   event->chrony.offset,
+                   event->chrony.sd,
+                   event->chrony_diff,
+                   event->chrony.stratum);
+    }
+
+    for (int i = 0; i < event->derived_cnt; i++) {
+        // NaN and infinity cannot be represented in JSON...
+        if (isfinite(event->derived[i])) {
+            BUFFER_ADD(",\"%s\":%f", event->derived_names[i], event->derived[i]);
+        } else {
+            BUFFER_ADD(",\"%s\":null", event->derived_names[i]);
+        }
+    }
+
+    BUFFER_ADD("}");
+
+    return (int) offset;
+}
+
+// EOF
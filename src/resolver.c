@@ -0,0 +1,373 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#include "log.h"
+#include "mem.h"
+#include "resolver.h"
+
+#define RESOLVER_STACK_SIZE (256 * 1024)
+// the delay before retrying a failed refresh, in seconds...
+#define RESOLVER_RETRY_INTERVAL 30
+
+typedef struct resolver_entry {
+    struct resolver_entry *next;
+    char *host;
+    resolver_result_t result;
+    // all in seconds of CLOCK_MONOTONIC...
+    time_t resolved;
+    time_t refresh_at;
+    // cleared for hosts that are no longer configured, @see #resolver_retain...
+    bool retained;
+} resolver_entry_t;
+
+// Protects everything below, lookups and the refresh thread only hold it briefly...
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond;
+static pthread_t resolver_thread;
+static bool resolver_started;
+static bool resolver_stopping;
+static uint32_t resolver_ttl;
+
+// only the refresh thread removes entries, so their host names remain valid without the lock...
+static resolver_entry_t *resolver_entries;
+
+static uint32_t resolver_entry_cnt;
+static uint64_t resolver_hits;
+static uint64_t resolver_misses;
+static uint64_t resolver_stale_hits;
+static uint64_t resolver_refreshes;
+static uint64_t resolver_refresh_failures;
+
+static time_t now_sec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Refresh ahead of the TTL, so lookups rarely see stale entries...
+static time_t next_refresh(time_t now) {
+    return now + (time_t) (resolver_ttl - resolver_ttl / 4);
+}
+
+static int resolve(const char *host, int flags, resolver_result_t *result) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = flags,
+    };
+    struct addrinfo *res = NULL;
+
+    int status = getaddrinfo(host, NULL, &hints, &res);
+    if (status) {
+        return (status == EAI_MEMORY) ? -ENOMEM : -ENOENT;
+    }
+
+    result->cnt = 0;
+    for (const struct addrinfo *ai = res; ai && result->cnt < RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+        if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+                        result->addrs[result->cnt].host, sizeof(result->addrs[result->cnt].host),
+                        NULL, 0, NI_NUMERICHOST) == 0) {
+            result->addrs[result->cnt++].family = ai->ai_family;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    return result->cnt ? 0 : -ENOENT;
+}
+
+static resolver_entry_t *find_entry(const char *host) {
+    for (resolver_entry_t *entry = resolver_entries; entry; entry = entry->next) {
+        if (strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void free_entries(void) {
+    while (resolver_entries) {
+        resolver_entry_t *next = resolver_entries->next;
+        mem_free(MEM_CONFIG, resolver_entries->host);
+        mem_free(MEM_CONFIG, resolver_entries);
+        resolver_entries = next;
+    }
+    resolver_entry_cnt = 0;
+}
+
+// Evicts the entries that are no longer retained and returns the entry that is due first, if any...
+static resolver_entry_t *next_due(void) {
+    resolver_entry_t **link = &resolver_entries;
+    resolver_entry_t *due = NULL;
+
+    while (*link) {
+        resolver_entry_t *entry = *link;
+
+        // Connections can stay up for long, so configured hosts are kept regardless of their last lookup...
+        if (!entry->retained) {
+            log_debug("Evicting %s from resolver cache...", entry->host);
+
+            *link = entry->next;
+            mem_free(MEM_CONFIG, entry->host);
+            mem_free(MEM_CONFIG, entry);
+            resolver_entry_cnt--;
+            continue;
+        }
+
+        if (!due || entry->refresh_at < due->refresh_at) {
+            due = entry;
+        }
+        link = &entry->next;
+    }
+
+    return due;
+}
+
+// Refreshes the entries as they become due...
+static void *resolver_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&resolver_lock);
+
+    while (!resolver_stopping) {
+        if (resolver_ttl == 0) {
+            // Caching got disabled...
+            free_entries();
+            pthread_cond_wait(&resolver_cond, &resolver_lock);
+            continue;
+        }
+
+        time_t now = now_sec();
+        resolver_entry_t *entry = next_due();
+
+        if (entry == NULL) {
+            pthread_cond_wait(&resolver_cond, &resolver_lock);
+            continue;
+        }
+        if (entry->refresh_at > now) {
+            struct timespec until = { .tv_sec = entry->refresh_at };
+            pthread_cond_timedwait(&resolver_cond, &resolver_lock, &until);
+            continue;
+        }
+
+        // Resolving can take long, lookups should not wait for it...
+        resolver_result_t result;
+        pthread_mutex_unlock(&resolver_lock);
+        int status = resolve(entry->host, AI_ADDRCONFIG, &result);
+        pthread_mutex_lock(&resolver_lock);
+
+        now = now_sec();
+        if (status == 0) {
+            entry->result = result;
+            entry->resolved = now;
+            entry->refresh_at = next_refresh(now);
+
+            // Update stats...
+            resolver_refreshes++;
+        } else {
+            log_warning("Failed to refresh address of %s, keeping the last known address...", entry->host);
+            entry->refresh_at = now + ((resolver_ttl < RESOLVER_RETRY_INTERVAL) ? (time_t) resolver_ttl : RESOLVER_RETRY_INTERVAL);
+
+            // Update stats...
+            resolver_refresh_failures++;
+        }
+    }
+
+    pthread_mutex_unlock(&resolver_lock);
+
+    return NULL;
+}
+
+int resolver_start(uint32_t ttl) {
+    pthread_mutex_lock(&resolver_lock);
+    bool started = resolver_started;
+    resolver_ttl = ttl;
+    if (started) {
+        // Let the refresh thread pick up the new TTL...
+        pthread_cond_signal(&resolver_cond);
+    }
+    pthread_mutex_unlock(&resolver_lock);
+
+    if (started || ttl == 0) {
+        return 0;
+    }
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&resolver_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    resolver_stopping = false;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RESOLVER_STACK_SIZE);
+
+    int status = pthread_create(&resolver_thread, &attr, resolver_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (status) {
+        log_error("failed to start resolver: %s", strerror(status));
+        pthread_cond_destroy(&resolver_cond);
+        return -status;
+    }
+    pthread_setname_np(resolver_thread, "gpsstats-dns");
+
+    pthread_mutex_lock(&resolver_lock);
+    resolver_started = true;
+    pthread_mutex_unlock(&resolver_lock);
+
+    return 0;
+}
+
+void resolver_stop(void) {
+    pthread_mutex_lock(&resolver_lock);
+    bool started = resolver_started;
+    resolver_started = false;
+    resolver_stopping = true;
+    if (started) {
+        pthread_cond_signal(&resolver_cond);
+    }
+    pthread_mutex_unlock(&resolver_lock);
+
+    if (!started) {
+        return;
+    }
+
+    pthread_join(resolver_thread, NULL);
+    pthread_cond_destroy(&resolver_cond);
+
+    free_entries();
+}
+
+int resolver_lookup(const char *host, resolver_result_t *result) {
+    if (host == NULL || result == NULL) {
+        return -EINVAL;
+    }
+
+    // Numeric addresses need no resolving, nor caching...
+    if (resolve(host, AI_NUMERICHOST, result) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&resolver_lock);
+
+    time_t now = now_sec();
+    bool caching = resolver_started && resolver_ttl > 0;
+
+    resolver_entry_t *entry = caching ? find_entry(host) : NULL;
+    if (entry) {
+        *result = entry->result;
+
+        // Update stats...
+        resolver_hits++;
+        if (now - entry->resolved >= (time_t) resolver_ttl) {
+            resolver_stale_hits++;
+        }
+
+        pthread_mutex_unlock(&resolver_lock);
+        return 0;
+    }
+
+    // Update stats...
+    resolver_misses++;
+
+    pthread_mutex_unlock(&resolver_lock);
+
+    int status = resolve(host, AI_ADDRCONFIG, result);
+    if (status || !caching) {
+        return status;
+    }
+
+    entry = mem_malloc(MEM_CONFIG, sizeof(resolver_entry_t));
+    if (entry == NULL) {
+        // Not cached, but resolved nonetheless...
+        return 0;
+    }
+    bzero(entry, sizeof(resolver_entry_t));
+
+    entry->host = mem_strdup(MEM_CONFIG, host);
+    if (entry->host == NULL) {
+        mem_free(MEM_CONFIG, entry);
+        return 0;
+    }
+    entry->result = *result;
+
+    pthread_mutex_lock(&resolver_lock);
+
+    if (!resolver_started || find_entry(host)) {
+        // Stopped or already added in the meantime...
+        pthread_mutex_unlock(&resolver_lock);
+        mem_free(MEM_CONFIG, entry->host);
+        mem_free(MEM_CONFIG, entry);
+        return 0;
+    }
+
+    now = now_sec();
+    entry->resolved = now;
+    entry->refresh_at = next_refresh(now);
+    entry->retained = true;
+    entry->next = resolver_entries;
+    resolver_entries = entry;
+    resolver_entry_cnt++;
+
+    // This entry might be due before all others...
+    pthread_cond_signal(&resolver_cond);
+
+    pthread_mutex_unlock(&resolver_lock);
+
+    return 0;
+}
+
+void resolver_retain(const char *const *hosts, size_t cnt) {
+    pthread_mutex_lock(&resolver_lock);
+
+    for (resolver_entry_t *entry = resolver_entries; entry; entry = entry->next) {
+        entry->retained = false;
+        for (size_t i = 0; i < cnt && !entry->retained; i++) {
+            entry->retained = hosts[i] && strcmp(entry->host, hosts[i]) == 0;
+        }
+    }
+
+    // Only the refresh thread removes entries, @see #next_due...
+    if (resolver_started) {
+        pthread_cond_signal(&resolver_cond);
+    }
+
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+resolver_stats_t resolver_dump_stats(void) {
+    pthread_mutex_lock(&resolver_lock);
+
+    resolver_stats_t stats = {
+        .entries = resolver_entry_cnt,
+        .hits = resolver_hits,
+        .misses = resolver_misses,
+        .stale_hits = resolver_stale_hits,
+        .refreshes = resolver_refreshes,
+        .refresh_failures = resolver_refresh_failures,
+    };
+
+    pthread_mutex_unlock(&resolver_lock);
+
+    return stats;
+}
+
+// EOF
@@ -0,0 +1,49 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <math.h>
+#include <strings.h>
+
+#include "rolling.h"
+
+rolling_stats_t rolling_stats(const rolling_t *rolling) {
+    rolling_stats_t stats;
+    bzero(&stats, sizeof(stats));
+
+    if (rolling->cnt == 0) {
+        return stats;
+    }
+
+    stats.cnt = rolling->cnt;
+    stats.min = stats.max = rolling->values[0];
+
+    double sum = 0;
+    for (uint32_t i = 0; i < rolling->cnt; i++) {
+        double v = rolling->values[i];
+
+        sum += v;
+        if (v < stats.min) {
+            stats.min = v;
+        }
+        if (v > stats.max) {
+            stats.max = v;
+        }
+    }
+    stats.mean = sum / rolling->cnt;
+
+    // A second pass avoids cancellation when the spread is tiny compared to the mean...
+    double sum_sq = 0;
+    for (uint32_t i = 0; i < rolling->cnt; i++) {
+        double d = rolling->values[i] - stats.mean;
+        sum_sq += d * d;
+    }
+    stats.stddev = sqrt(sum_sq / rolling->cnt);
+
+    return stats;
+}
+
+// EOF
@@ -0,0 +1,112 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+#include "rt.h"
+
+// Parses a list of CPUs, such as "0,2-3", into the given set (if any)...
+static int parse_cpus(const char *cpus, cpu_set_t *set) {
+    const char *p = cpus;
+
+    if (set) {
+        CPU_ZERO(set);
+    }
+
+    do {
+        char *end;
+        long from = strtol(p, &end, 10);
+        long to = from;
+        if (end == p || from < 0) {
+            return -EINVAL;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from) {
+                return -EINVAL;
+            }
+        }
+        if (to >= CPU_SETSIZE || (*end != ',' && *end != 0)) {
+            return -EINVAL;
+        }
+
+        for (long cpu = from; set && cpu <= to; cpu++) {
+            CPU_SET((size_t) cpu, set);
+        }
+
+        p = end + 1;
+    } while (p[-1] == ',');
+
+    return 0;
+}
+
+int rt_check_cpus(const char *cpus) {
+    if (cpus == NULL) {
+        return -EINVAL;
+    }
+    return parse_cpus(cpus, NULL);
+}
+
+int rt_apply(pthread_t thread, const char *name, const char *cpus, uint8_t priority) {
+    int status;
+    int result = 0;
+
+    if (cpus) {
+        cpu_set_t set;
+        if (parse_cpus(cpus, &set)) {
+            log_warning("Invalid CPU list for %s: %s", name, cpus);
+            return -EINVAL;
+        }
+
+        if ((status = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0) {
+            log_warning("Failed to pin %s to CPUs %s: %s", name, cpus, strerror(status));
+            result = -status;
+        } else {
+            log_debug("Pinned %s to CPUs %s", name, cpus);
+        }
+    }
+
+    if (priority) {
+        struct sched_param param = {
+            .sched_priority = priority,
+        };
+
+        if ((status = pthread_setschedparam(thread, SCHED_FIFO, &param)) != 0) {
+            // EPERM: not privileged, and RLIMIT_RTPRIO is too low...
+            log_warning("Failed to run %s at real-time priority %d: %s", name, priority, strerror(status));
+            result = -status;
+        } else {
+            log_debug("Running %s at real-time priority %d", name, priority);
+        }
+    }
+
+    return result;
+}
+
+int rt_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        int err = errno;
+        log_warning("Failed to lock memory: %s", strerror(err));
+        return -err;
+    }
+
+    log_debug("Locked all memory");
+
+    return 0;
+}
+
+// EOF
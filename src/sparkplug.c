@@ -0,0 +1,464 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "payload.h"
+#include "sparkplug.h"
+
+// Protobuf wire types...
+#define WT_VARINT 0
+#define WT_FIXED64 1
+#define WT_LEN 2
+#define WT_FIXED32 5
+
+// Fields of the Sparkplug B Payload message...
+#define PAYLOAD_TIMESTAMP 1
+#define PAYLOAD_METRICS 2
+#define PAYLOAD_SEQ 3
+
+// Fields of the Sparkplug B Metric message...
+#define METRIC_NAME 1
+#define METRIC_ALIAS 2
+#define METRIC_DATATYPE 4
+#define METRIC_IS_NULL 7
+#define METRIC_INT_VALUE 10
+#define METRIC_LONG_VALUE 11
+#define METRIC_DOUBLE_VALUE 13
+#define METRIC_BOOLEAN_VALUE 14
+
+// Sparkplug B data types...
+#define DT_INT32 3
+#define DT_INT64 4
+#define DT_UINT32 7
+#define DT_UINT64 8
+#define DT_DOUBLE 10
+#define DT_BOOLEAN 11
+
+typedef struct pb_writer {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} pb_writer_t;
+
+static inline void pb_put(pb_writer_t *w, uint8_t b) {
+    if (w->len < w->size) {
+        w->buf[w->len++] = b;
+    } else {
+        w->overflow = true;
+    }
+}
+
+static void pb_varint(pb_writer_t *w, uint64_t v) {
+    while (v >= 0x80) {
+        pb_put(w, (uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    pb_put(w, (uint8_t) v);
+}
+
+static inline void pb_key(pb_writer_t *w, uint32_t field, uint32_t wire_type) {
+    pb_varint(w, (field << 3) | wire_type);
+}
+
+static void pb_fixed64(pb_writer_t *w, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        pb_put(w, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+static void pb_bytes(pb_writer_t *w, const char *s, size_t len) {
+    if (w->len + len > w->size) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+// Starts a length-delimited field, returns the position of its length...
+static size_t pb_begin(pb_writer_t *w, uint32_t field) {
+    pb_key(w, field, WT_LEN);
+    size_t mark = w->len;
+    // most of our messages are shorter than 128 bytes, so reserve one byte...
+    pb_put(w, 0);
+    return mark;
+}
+
+// Ends a length-delimited field by back-patching its length...
+static void pb_end(pb_writer_t *w, size_t mark) {
+    if (w->overflow) {
+        return;
+    }
+
+    size_t body = w->len - mark - 1;
+    size_t extra = 0;
+    for (size_t v = body; v >= 0x80; v >>= 7) {
+        extra++;
+    }
+
+    if (extra > 0) {
+        if (w->len + extra > w->size) {
+            w->overflow = true;
+            return;
+        }
+        memmove(w->buf + mark + 1 + extra, w->buf + mark + 1, body);
+        w->len += extra;
+    }
+
+    size_t v = body;
+    size_t pos = mark;
+    while (v >= 0x80) {
+        w->buf[pos++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    w->buf[pos] = (uint8_t) v;
+}
+
+typedef struct pb_reader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool error;
+} pb_reader_t;
+
+typedef struct pb_field {
+    uint32_t number;
+    uint32_t wire_type;
+    // the value of varints, or the contents of length-delimited fields...
+    uint64_t value;
+    const uint8_t *data;
+    size_t len;
+} pb_field_t;
+
+static uint64_t pb_read_varint(pb_reader_t *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && r->pos < r->len; shift += 7) {
+        uint8_t b = r->buf[r->pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    r->error = true;
+    return 0;
+}
+
+// Reads the next field, returns false at the end of the data or if it is malformed...
+static bool pb_next(pb_reader_t *r, pb_field_t *field) {
+    if (r->error || r->pos >= r->len) {
+        return false;
+    }
+
+    uint64_t key = pb_read_varint(r);
+    field->number = (uint32_t)(key >> 3);
+    field->wire_type = (uint32_t)(key & 7);
+    field->value = 0;
+    field->data = NULL;
+    field->len = 0;
+
+    uint64_t skip;
+    switch (field->wire_type) {
+    case WT_VARINT:
+        field->value = pb_read_varint(r);
+        return !r->error;
+    case WT_FIXED64:
+        skip = 8;
+        break;
+    case WT_FIXED32:
+        skip = 4;
+        break;
+    case WT_LEN:
+        skip = pb_read_varint(r);
+        break;
+    default:
+        r->error = true;
+        return false;
+    }
+
+    if (r->error || skip > r->len - r->pos) {
+        r->error = true;
+        return false;
+    }
+    field->data = r->buf + r->pos;
+    field->len = (size_t) skip;
+    r->pos += (size_t) skip;
+    return true;
+}
+
+static uint64_t timestamp_ms(const gps_event_t *event) {
+    struct timespec ts = { 0 };
+    if (event) {
+        ts = event->time;
+    }
+    if (ts.tv_sec == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+    }
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static uint32_t metric_datatype(size_t id) {
+    switch (payload_field_type(id)) {
+    case TYPE_DOUBLE:
+        return DT_DOUBLE;
+    case TYPE_BOOL:
+        return DT_BOOLEAN;
+    case TYPE_INT:
+        return DT_INT32;
+    case TYPE_LONG:
+        return DT_INT64;
+    case TYPE_UINT:
+    default:
+        return DT_UINT32;
+    }
+}
+
+static void encode_metric(pb_writer_t *w, uint64_t alias_base, size_t id, const payload_value_t *value, bool birth) {
+    uint32_t datatype = metric_datatype(id);
+
+    size_t mark = pb_begin(w, PAYLOAD_METRICS);
+
+    if (birth) {
+        // Only the birth certificate carries the names of our metrics...
+        const char *name = payload_field_name(id);
+        pb_key(w, METRIC_NAME, WT_LEN);
+        pb_varint(w, strlen(name));
+        pb_bytes(w, name, strlen(name));
+    }
+
+    // aliases start at 1, and are unique over all devices...
+    pb_key(w, METRIC_ALIAS, WT_VARINT);
+    pb_varint(w, alias_base + id + 1);
+
+    if (birth) {
+        pb_key(w, METRIC_DATATYPE, WT_VARINT);
+        pb_varint(w, datatype);
+    }
+
+    if (!value->present) {
+        pb_key(w, METRIC_IS_NULL, WT_VARINT);
+        pb_varint(w, 1);
+    } else if (datatype == DT_DOUBLE) {
+        pb_key(w, METRIC_DOUBLE_VALUE, WT_FIXED64);
+        pb_fixed64(w, value->bits);
+    } else if (datatype == DT_BOOLEAN) {
+        pb_key(w, METRIC_BOOLEAN_VALUE, WT_VARINT);
+        pb_varint(w, value->bits ? 1 : 0);
+    } else if (datatype == DT_INT64) {
+        pb_key(w, METRIC_LONG_VALUE, WT_VARINT);
+        pb_varint(w, value->bits);
+    } else {
+        pb_key(w, METRIC_INT_VALUE, WT_VARINT);
+        pb_varint(w, (uint32_t) value->bits);
+    }
+
+    pb_end(w, mark);
+}
+
+static void encode_bd_seq(pb_writer_t *w, uint64_t bd_seq) {
+    static const char name[] = "bdSeq";
+
+    size_t mark = pb_begin(w, PAYLOAD_METRICS);
+    pb_key(w, METRIC_NAME, WT_LEN);
+    pb_varint(w, sizeof(name) - 1);
+    pb_bytes(w, name, sizeof(name) - 1);
+    pb_key(w, METRIC_DATATYPE, WT_VARINT);
+    pb_varint(w, DT_UINT64);
+    pb_key(w, METRIC_LONG_VALUE, WT_VARINT);
+    pb_varint(w, bd_seq);
+    pb_end(w, mark);
+}
+
+static void encode_rebirth(pb_writer_t *w) {
+    static const char name[] = SPARKPLUG_REBIRTH;
+
+    size_t mark = pb_begin(w, PAYLOAD_METRICS);
+    pb_key(w, METRIC_NAME, WT_LEN);
+    pb_varint(w, sizeof(name) - 1);
+    pb_bytes(w, name, sizeof(name) - 1);
+    pb_key(w, METRIC_DATATYPE, WT_VARINT);
+    pb_varint(w, DT_BOOLEAN);
+    pb_key(w, METRIC_BOOLEAN_VALUE, WT_VARINT);
+    pb_varint(w, 0);
+    pb_end(w, mark);
+}
+
+// Returns whether a metric of a command sets the rebirth metric...
+static bool is_rebirth(const uint8_t *data, size_t len) {
+    static const char name[] = SPARKPLUG_REBIRTH;
+    pb_reader_t r = { .buf = data, .len = len };
+    pb_field_t field;
+    bool named = false;
+    bool value = false;
+
+    while (pb_next(&r, &field)) {
+        if (field.number == METRIC_NAME && field.wire_type == WT_LEN) {
+            named = (field.len == sizeof(name) - 1) && memcmp(field.data, name, field.len) == 0;
+        } else if (field.number == METRIC_BOOLEAN_VALUE && field.wire_type == WT_VARINT) {
+            value = (field.value != 0);
+        }
+    }
+    return !r.error && named && value;
+}
+
+void sparkplug_init(sparkplug_state_t *state, uint64_t bd_seq) {
+    bzero(state, sizeof(sparkplug_state_t));
+
+    state->bd_seq = bd_seq % 256;
+    state->need_birth = true;
+}
+
+void sparkplug_device_init(sparkplug_state_t *state, sparkplug_device_t *device) {
+    bzero(device, sizeof(sparkplug_device_t));
+
+    device->alias_base = state->next_alias;
+    state->next_alias += SPARKPLUG_METRIC_CNT;
+}
+
+int sparkplug_encode_birth(const sparkplug_state_t *state, sparkplug_update_t *update, uint8_t *buffer, size_t size) {
+    pb_writer_t w = { .buf = buffer, .size = size };
+
+    // A birth certificate always resets the sequence number...
+    update->seq = 0;
+    update->has_values = false;
+
+    pb_key(&w, PAYLOAD_TIMESTAMP, WT_VARINT);
+    pb_varint(&w, timestamp_ms(NULL));
+
+    encode_bd_seq(&w, state->bd_seq);
+    encode_rebirth(&w);
+
+    pb_key(&w, PAYLOAD_SEQ, WT_VARINT);
+    pb_varint(&w, update->seq);
+
+    if (w.overflow) {
+        return -ENOMEM;
+    }
+    return (int) w.len;
+}
+
+int sparkplug_encode_device_birth(const sparkplug_state_t *state, const sparkplug_device_t *device, const gps_event_t *event,
+                                  sparkplug_update_t *update, uint8_t *buffer, size_t size) {
+    pb_writer_t w = { .buf = buffer, .size = size };
+    payload_value_t *values = update->values;
+
+    payload_field_values(event, values);
+    update->has_values = true;
+
+    pb_key(&w, PAYLOAD_TIMESTAMP, WT_VARINT);
+    pb_varint(&w, timestamp_ms(event));
+
+    for (size_t i = 0; i < SPARKPLUG_METRIC_CNT; i++) {
+        encode_metric(&w, device->alias_base, i, &values[i], true /* birth */);
+    }
+
+    update->seq = (uint8_t) (state->seq + 1); // wraps at 256 as mandated by the specification
+
+    pb_key(&w, PAYLOAD_SEQ, WT_VARINT);
+    pb_varint(&w, update->seq);
+
+    if (w.overflow) {
+        return -ENOMEM;
+    }
+    return (int) w.len;
+}
+
+int sparkplug_encode_device_data(const sparkplug_state_t *state, const sparkplug_device_t *device, const gps_event_t *event,
+                                 sparkplug_update_t *update, uint8_t *buffer, size_t size) {
+    pb_writer_t w = { .buf = buffer, .size = size };
+    payload_value_t *values = update->values;
+    bool changed = false;
+
+    payload_field_values(event, values);
+    update->has_values = true;
+
+    pb_key(&w, PAYLOAD_TIMESTAMP, WT_VARINT);
+    pb_varint(&w, timestamp_ms(event));
+
+    for (size_t i = 0; i < SPARKPLUG_METRIC_CNT; i++) {
+        if (device->last[i].present == values[i].present &&
+                (!values[i].present || device->last[i].bits == values[i].bits)) {
+            // Not changed...
+            continue;
+        }
+
+        encode_metric(&w, device->alias_base, i, &values[i], false /* birth */);
+        changed = true;
+    }
+
+    if (!changed) {
+        return 0;
+    }
+
+    update->seq = (uint8_t) (state->seq + 1); // wraps at 256 as mandated by the specification
+
+    pb_key(&w, PAYLOAD_SEQ, WT_VARINT);
+    pb_varint(&w, update->seq);
+
+    if (w.overflow) {
+        return -ENOMEM;
+    }
+    return (int) w.len;
+}
+
+int sparkplug_encode_device_death(const sparkplug_state_t *state, sparkplug_update_t *update, uint8_t *buffer, size_t size) {
+    pb_writer_t w = { .buf = buffer, .size = size };
+
+    pb_key(&w, PAYLOAD_TIMESTAMP, WT_VARINT);
+    pb_varint(&w, timestamp_ms(NULL));
+
+    update->seq = (uint8_t) (state->seq + 1);
+    update->has_values = false;
+
+    pb_key(&w, PAYLOAD_SEQ, WT_VARINT);
+    pb_varint(&w, update->seq);
+
+    if (w.overflow) {
+        return -ENOMEM;
+    }
+    return (int) w.len;
+}
+
+void sparkplug_commit(sparkplug_state_t *state, sparkplug_device_t *device, const sparkplug_update_t *update) {
+    state->seq = update->seq;
+    if (device && update->has_values) {
+        memcpy(device->last, update->values, sizeof(device->last));
+    }
+}
+
+int sparkplug_encode_death(const sparkplug_state_t *state, uint8_t *buffer, size_t size) {
+    pb_writer_t w = { .buf = buffer, .size = size };
+
+    pb_key(&w, PAYLOAD_TIMESTAMP, WT_VARINT);
+    pb_varint(&w, timestamp_ms(NULL));
+
+    encode_bd_seq(&w, state->bd_seq);
+
+    if (w.overflow) {
+        return -ENOMEM;
+    }
+    return (int) w.len;
+}
+
+bool sparkplug_decode_rebirth(const uint8_t *buffer, size_t size) {
+    pb_reader_t r = { .buf = buffer, .len = size };
+    pb_field_t field;
+    bool rebirth = false;
+
+    while (pb_next(&r, &field)) {
+        if (field.number == PAYLOAD_METRICS && field.wire_type == WT_LEN && is_rebirth(field.data, field.len)) {
+            rebirth = true;
+        }
+    }
+    return !r.error && rebirth;
+}
+
+// EOF
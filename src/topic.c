@@ -0,0 +1,170 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "mem.h"
+#include "topic.h"
+
+#define LITERAL -1
+
+typedef struct topic_segment {
+    int var; // LITERAL or one of topic_var_t
+    size_t len;
+    const char *literal;
+} topic_segment_t;
+
+struct topic_template {
+    char *str;
+    size_t count;
+    topic_segment_t *segments;
+    char buf[]; // holds the literals
+};
+
+static const char *var_names[VAR_CNT] = {
+    [VAR_CLIENT_ID] = "client_id",
+    [VAR_HOST] = "host",
+    [VAR_SOURCE] = "source",
+    [VAR_DEVICE] = "device",
+    [VAR_CONSTELLATION] = "constellation",
+};
+
+topic_template_t *topic_parse(const char *template) {
+    size_t len = strlen(template);
+    if (len == 0) {
+        log_error("invalid topic template: cannot be empty!");
+        return NULL;
+    }
+
+    // at most every other segment is a placeholder...
+    size_t max_segments = len / 2 + 2;
+
+    topic_template_t *tmpl = mem_malloc(MEM_CONFIG, sizeof(topic_template_t) + 2 * (len + 1));
+    topic_segment_t *segments = mem_calloc(MEM_CONFIG, max_segments, sizeof(topic_segment_t));
+    if (!tmpl || !segments) {
+        log_error("failed to parse topic template: out of memory!");
+        mem_free(MEM_CONFIG, tmpl);
+        mem_free(MEM_CONFIG, segments);
+        return NULL;
+    }
+
+    tmpl->str = tmpl->buf + len + 1;
+    memcpy(tmpl->str, template, len + 1);
+    memcpy(tmpl->buf, template, len + 1);
+
+    tmpl->count = 0;
+    tmpl->segments = segments;
+
+    const char *p = tmpl->buf;
+    while (*p) {
+        const char *open = strchr(p, '{');
+        if (open != p) {
+            // literal up to the next placeholder, or the end...
+            size_t n = open ? (size_t)(open - p) : strlen(p);
+            if (memchr(p, '}', n) || memchr(p, '+', n) || memchr(p, '#', n)) {
+                log_error("invalid topic template: %s", template);
+                goto err_cleanup;
+            }
+
+            segments[tmpl->count++] = (topic_segment_t) {
+                LITERAL, n, p
+            };
+            p += n;
+            continue;
+        }
+
+        const char *close = strchr(open, '}');
+        if (!close) {
+            log_error("invalid topic template: unterminated placeholder in %s", template);
+            goto err_cleanup;
+        }
+
+        size_t n = (size_t)(close - open - 1);
+        int var = LITERAL;
+        for (int i = 0; i < VAR_CNT; i++) {
+            if (strlen(var_names[i]) == n && strncmp(open + 1, var_names[i], n) == 0) {
+                var = i;
+                break;
+            }
+        }
+        if (var == LITERAL) {
+            log_error("invalid topic template: unknown placeholder %.*s in %s", (int) n, open + 1, template);
+            goto err_cleanup;
+        }
+
+        segments[tmpl->count++] = (topic_segment_t) {
+            var, 0, NULL
+        };
+        p = close + 1;
+    }
+
+    return tmpl;
+
+err_cleanup:
+    topic_free(tmpl);
+
+    return NULL;
+}
+
+void topic_free(topic_template_t *tmpl) {
+    if (tmpl) {
+        mem_free(MEM_CONFIG, tmpl->segments);
+        mem_free(MEM_CONFIG, tmpl);
+    }
+}
+
+const char *topic_str(const topic_template_t *tmpl) {
+    return tmpl->str;
+}
+
+bool topic_uses(const topic_template_t *tmpl, topic_var_t var) {
+    for (size_t i = 0; i < tmpl->count; i++) {
+        if (tmpl->segments[i].var == (int) var) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int topic_expand(const topic_template_t *tmpl, const char *vars[VAR_CNT], char *buffer, size_t size) {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < tmpl->count; i++) {
+        const topic_segment_t *seg = &tmpl->segments[i];
+
+        if (seg->var == LITERAL) {
+            if (offset + seg->len >= size) {
+                return -ENOMEM;
+            }
+            memcpy(buffer + offset, seg->literal, seg->len);
+            offset += seg->len;
+            continue;
+        }
+
+        const char *val = vars[seg->var];
+        if (!val || !*val) {
+            val = "unknown";
+        }
+
+        for (; *val; val++) {
+            if (offset + 1 >= size) {
+                return -ENOMEM;
+            }
+            char c = *val;
+            buffer[offset++] = (c == '/' || c == '+' || c == '#') ? '_' : c;
+        }
+    }
+
+    buffer[offset] = 0;
+
+    return (int) offset;
+}
+
+// EOF
@@ -0,0 +1,20 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include "trace.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+// The tracer increments the semaphore of a probe while it is attached...
+#define TRACE_DEFINE(name) \
+    volatile unsigned short TRACE_SEMAPHORE(name) __attribute__((unused, section(".probes")));
+
+TRACE_PROBES(TRACE_DEFINE)
+
+#endif /* HAVE_SYS_SDT_H */
+
+// EOF
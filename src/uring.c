@@ -0,0 +1,431 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+#define RING_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define BUF_GROUP 0
+#define BUF_COUNT 1024 // must be a power of two
+#define BUF_SIZE 2048
+
+typedef struct uring_source {
+    struct uring_source *next;
+    struct uring_source *next_rearm;
+
+    int fd;
+    bool active; // false once stopped
+    bool armed;  // whether a multishot receive is in flight
+
+    uring_recv_callback_t callback;
+    void *context;
+} uring_source_t;
+
+struct uring {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    int event_fd;
+
+    uring_source_t *sources;
+    // sources of which the multishot receive terminated while processing...
+    uring_source_t *rearm;
+    bool processing;
+
+    uint32_t uring_sources;
+    uint32_t uring_submits;
+    uint32_t uring_buffers_exhausted;
+    uint64_t uring_completions;
+    uint64_t uring_bytes_recv;
+};
+
+static void submit(uring_t *ring) {
+    if (io_uring_sq_ready(&ring->ring) == 0) {
+        return;
+    }
+
+    int status = io_uring_submit(&ring->ring);
+    if (status < 0) {
+        log_warning("Failed to submit to io_uring: %s", strerror(-status));
+    }
+
+    // Update stats...
+    ring->uring_submits++;
+}
+
+static int arm(uring_t *ring, uring_source_t *source) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+    if (sqe == NULL) {
+        // Submission queue is full: flush it and try again...
+        submit(ring);
+        sqe = io_uring_get_sqe(&ring->ring);
+        if (sqe == NULL) {
+            return -EBUSY;
+        }
+    }
+
+    // the kernel picks a buffer from our buffer ring for each receive...
+    io_uring_prep_recv_multishot(sqe, source->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    io_uring_sqe_set_data(sqe, source);
+
+    source->armed = true;
+
+    return 0;
+}
+
+static void recycle_buffer(uring_t *ring, unsigned bid) {
+    io_uring_buf_ring_add(ring->buf_ring, ring->buffers + (size_t) bid * BUF_SIZE, BUF_SIZE,
+                          (unsigned short) bid, io_uring_buf_ring_mask(BUF_COUNT), 0);
+    io_uring_buf_ring_advance(ring->buf_ring, 1);
+}
+
+static void free_source(uring_t *ring, uring_source_t *source) {
+    uring_source_t **prev = &ring->sources;
+    while (*prev && *prev != source) {
+        prev = &(*prev)->next;
+    }
+    if (*prev) {
+        *prev = source->next;
+    }
+
+    ring->uring_sources--;
+
+    mem_free(MEM_GPSD, source);
+}
+
+static void handle_completion(uring_t *ring, struct io_uring_cqe *cqe) {
+    uring_source_t *source = io_uring_cqe_get_data(cqe);
+    if (source == NULL) {
+        // Result of a cancellation...
+        return;
+    }
+
+    int result = cqe->res;
+    // a multishot receive stays armed as long as the kernel says so...
+    source->armed = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (result > 0 && source->active) {
+            // Update stats...
+            ring->uring_bytes_recv += (uint64_t) result;
+
+            source->callback(ring, ring->buffers + (size_t) bid * BUF_SIZE, result, source->context);
+        }
+
+        recycle_buffer(ring, bid);
+    } else if (result == -ENOBUFS) {
+        // All buffers were in use, they are recycled by now...
+        ring->uring_buffers_exhausted++;
+    } else if (result != -ECANCELED && source->active) {
+        // Remote end closed, or an error occurred...
+        source->callback(ring, NULL, result, source->context);
+        source->active = false;
+    }
+
+    if (!source->armed) {
+        // The multishot receive was terminated, for example, due to running
+        // out of buffers. Rearm (or free) it once all buffers of this batch
+        // are recycled, otherwise it will run out of buffers right away...
+        source->next_rearm = ring->rearm;
+        ring->rearm = source;
+    }
+}
+
+uring_t *uring_init(void) {
+    uring_t *ring = mem_malloc(MEM_GPSD, sizeof(uring_t));
+    if (ring == NULL) {
+        log_error("failed to create io_uring handle: out of memory!");
+        return NULL;
+    }
+    bzero(ring, sizeof(uring_t));
+
+    ring->event_fd = -1;
+
+    struct io_uring_params params = {
+        // we only submit from a single thread, and each source has its own
+        // multishot receive, so we need many more completions than submissions...
+        .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CQSIZE,
+        .cq_entries = CQ_ENTRIES,
+    };
+
+    int status = io_uring_queue_init_params(RING_ENTRIES, &ring->ring, &params);
+    if (status == -EINVAL) {
+        // Older kernel, try again without single issuer...
+        bzero(&params, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        status = io_uring_queue_init_params(RING_ENTRIES, &ring->ring, &params);
+    }
+    if (status < 0) {
+        log_info("io_uring is not available: %s", strerror(-status));
+        mem_free(MEM_GPSD, ring);
+        return NULL;
+    }
+
+    ring->buffers = mem_malloc(MEM_GPSD, (size_t) BUF_COUNT * BUF_SIZE);
+    if (ring->buffers == NULL) {
+        log_error("failed to allocate io_uring buffers: out of memory!");
+        goto error;
+    }
+
+    ring->buf_ring = io_uring_setup_buf_ring(&ring->ring, BUF_COUNT, BUF_GROUP, 0, &status);
+    if (ring->buf_ring == NULL) {
+        log_info("io_uring provided buffers are not available: %s", strerror(-status));
+        goto error;
+    }
+    for (unsigned bid = 0; bid < BUF_COUNT; bid++) {
+        io_uring_buf_ring_add(ring->buf_ring, ring->buffers + (size_t) bid * BUF_SIZE, BUF_SIZE,
+                              (unsigned short) bid, io_uring_buf_ring_mask(BUF_COUNT), (int) bid);
+    }
+    io_uring_buf_ring_advance(ring->buf_ring, BUF_COUNT);
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0 || io_uring_register_eventfd(&ring->ring, ring->event_fd)) {
+        log_warning("failed to register eventfd with io_uring: %s", strerror(errno));
+        goto error;
+    }
+
+    return ring;
+
+error:
+    uring_destroy(ring);
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring) {
+    if (ring) {
+        if (ring->buf_ring) {
+            io_uring_free_buf_ring(&ring->ring, ring->buf_ring, BUF_COUNT, BUF_GROUP);
+        }
+        // Stops all pending receives as well...
+        io_uring_queue_exit(&ring->ring);
+
+        while (ring->sources) {
+            uring_source_t *source = ring->sources;
+            ring->sources = source->next;
+            mem_free(MEM_GPSD, source);
+        }
+
+        if (ring->event_fd >= 0) {
+            close(ring->event_fd);
+        }
+        mem_free(MEM_GPSD, ring->buffers);
+        mem_free(MEM_GPSD, ring);
+    }
+}
+
+int uring_fd(uring_t *ring) {
+    if (ring == NULL) {
+        return -EINVAL;
+    }
+    return ring->event_fd;
+}
+
+int uring_recv_start(uring_t *ring, int fd, uring_recv_callback_t callback, void *context) {
+    if (ring == NULL || fd < 0 || callback == NULL) {
+        return -EINVAL;
+    }
+
+    uring_source_t *source = mem_malloc(MEM_GPSD, sizeof(uring_source_t));
+    if (source == NULL) {
+        log_warning("failed to register fd %d with io_uring: out of memory!", fd);
+        return -ENOMEM;
+    }
+    bzero(source, sizeof(uring_source_t));
+
+    source->fd = fd;
+    source->active = true;
+    source->callback = callback;
+    source->context = context;
+
+    int status = arm(ring, source);
+    if (status) {
+        mem_free(MEM_GPSD, source);
+        return status;
+    }
+
+    source->next = ring->sources;
+    ring->sources = source;
+    ring->uring_sources++;
+
+    if (!ring->processing) {
+        submit(ring);
+    }
+
+    return 0;
+}
+
+int uring_recv_stop(uring_t *ring, int fd) {
+    if (ring == NULL) {
+        return -EINVAL;
+    }
+
+    uring_source_t *source = ring->sources;
+    while (source && (source->fd != fd || !source->active)) {
+        source = source->next;
+    }
+    if (source == NULL) {
+        return -EINVAL;
+    }
+
+    source->active = false;
+
+    if (source->armed) {
+        // the source is freed once the kernel reports the receive as terminated...
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+        if (sqe == NULL) {
+            submit(ring);
+            sqe = io_uring_get_sqe(&ring->ring);
+        }
+        if (sqe) {
+            io_uring_prep_cancel(sqe, source, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+        if (!ring->processing) {
+            submit(ring);
+        }
+    } else if (!ring->processing) {
+        free_source(ring, source);
+    }
+
+    return 0;
+}
+
+int uring_process(uring_t *ring) {
+    if (ring == NULL) {
+        return -EINVAL;
+    }
+
+    // Reset the eventfd, we handle all pending completions anyway...
+    uint64_t cnt;
+    if (read(ring->event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        log_warning("Failed to read io_uring eventfd: %s", strerror(errno));
+    }
+
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned n = 0;
+
+    ring->processing = true;
+
+    do {
+        unsigned batch = 0;
+
+        io_uring_for_each_cqe(&ring->ring, head, cqe) {
+            handle_completion(ring, cqe);
+            batch++;
+        }
+        io_uring_cq_advance(&ring->ring, batch);
+        n += batch;
+
+        // Completions that did not fit in the completion queue are only
+        // flushed (without signalling the eventfd) when we ask for them...
+    } while (io_uring_cq_has_overflow(&ring->ring) && io_uring_get_events(&ring->ring) == 0);
+
+    while (ring->rearm) {
+        uring_source_t *source = ring->rearm;
+        ring->rearm = source->next_rearm;
+
+        if (source->active && arm(ring, source)) {
+            source->callback(ring, NULL, -EBUSY, source->context);
+            source->active = false;
+        }
+        if (!source->active) {
+            free_source(ring, source);
+        }
+    }
+
+    ring->processing = false;
+
+    // (Re)arm or cancel receives queued while handling completions...
+    submit(ring);
+
+    // Update stats...
+    ring->uring_completions += n;
+
+    return (int) n;
+}
+
+uring_stats_t uring_dump_stats(uring_t *ring) {
+    if (ring == NULL) {
+        return (uring_stats_t) {
+            0
+        };
+    }
+
+    return (uring_stats_t) {
+        .sources = ring->uring_sources,
+        .submits = ring->uring_submits,
+        .buffers_exhausted = ring->uring_buffers_exhausted,
+        .completions = ring->uring_completions,
+        .bytes_recv = ring->uring_bytes_recv,
+    };
+}
+
+#else /* !HAVE_LIBURING */
+
+uring_t *uring_init(void) {
+    log_info("io_uring is not available: not compiled with liburing");
+    return NULL;
+}
+
+void uring_destroy(uring_t *ring) {
+    (void)ring;
+}
+
+int uring_fd(uring_t *ring) {
+    (void)ring;
+    return -ENOTSUP;
+}
+
+int uring_recv_start(uring_t *ring, int fd, uring_recv_callback_t callback, void *context) {
+    (void)ring;
+    (void)fd;
+    (void)callback;
+    (void)context;
+    return -ENOTSUP;
+}
+
+int uring_recv_stop(uring_t *ring, int fd) {
+    (void)ring;
+    (void)fd;
+    return -ENOTSUP;
+}
+
+int uring_process(uring_t *ring) {
+    (void)ring;
+    return -ENOTSUP;
+}
+
+uring_stats_t uring_dump_stats(uring_t *ring) {
+    (void)ring;
+    return (uring_stats_t) {
+        0
+    };
+}
+
+#endif /* HAVE_LIBURING */
+
+// EOF
@@ -0,0 +1,345 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+#include "log.h"
+#include "mem.h"
+#include "wheel.h"
+
+// 4 levels of 256 slots each cover 2^32 ticks (~50 days with 1 ms ticks)...
+#define LEVELS 4
+#define SLOT_BITS 8
+#define SLOTS (1u << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define MAX_DELTA ((1ull << (LEVELS * SLOT_BITS)) - 1)
+
+#define NOT_ARMED UINT64_MAX
+
+struct wheel {
+    int timer_fd;
+    uint32_t tick;
+    struct timespec epoch;
+
+    // the last tick of which all timers are handled...
+    uint64_t current;
+    // the tick at which the timer fd is going to fire...
+    uint64_t armed;
+
+    // each slot is a circular list with a sentinel, the bitmap tells which
+    // slots are non-empty, so we can skip over empty slots quickly...
+    wheel_timer_t slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS][SLOTS / 64];
+
+    uint32_t wheel_timers;
+    uint64_t wheel_scheduled;
+    uint64_t wheel_cancelled;
+    uint64_t wheel_expired;
+    uint64_t wheel_cascaded;
+};
+
+// Returns the time since the wheel was created, in nanoseconds...
+static uint64_t elapsed(const wheel_t *wheel) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // the timer fd fires at exactly epoch + tick, so do not round the epoch...
+    return (uint64_t)((int64_t)(now.tv_sec - wheel->epoch.tv_sec) * 1000000000 + (now.tv_nsec - wheel->epoch.tv_nsec));
+}
+
+// Returns the offset of the first non-empty slot at or after a given slot, or -1 if all are empty...
+static int find_occupied(const uint64_t *bits, unsigned from) {
+    for (unsigned i = 0; i < SLOTS;) {
+        unsigned slot = (from + i) & SLOT_MASK;
+        uint64_t word = bits[slot / 64] >> (slot % 64);
+        if (word) {
+            return (int)(i + (unsigned) __builtin_ctzll(word));
+        }
+        i += 64 - (slot % 64);
+    }
+    return -1;
+}
+
+static void unlink_timer(wheel_t *wheel, wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    unsigned level = timer->slot / SLOTS;
+    unsigned slot = timer->slot % SLOTS;
+    wheel_timer_t *head = &wheel->slots[level][slot];
+    if (head->next == head) {
+        wheel->occupied[level][slot / 64] &= ~(1ull << (slot % 64));
+    }
+
+    timer->next = timer->prev = NULL;
+    wheel->wheel_timers--;
+}
+
+static void link_timer(wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t delta = timer->expires - wheel->current;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        timer->expires = wheel->current + delta;
+    }
+
+    // the further away, the coarser the level...
+    unsigned level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << ((level + 1) * SLOT_BITS))) {
+        level++;
+    }
+    unsigned slot = (unsigned)(timer->expires >> (level * SLOT_BITS)) & SLOT_MASK;
+
+    wheel_timer_t *head = &wheel->slots[level][slot];
+    timer->slot = level * SLOTS + slot;
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+
+    wheel->occupied[level][slot / 64] |= 1ull << (slot % 64);
+    wheel->wheel_timers++;
+}
+
+// Moves all timers of a slot to the finer levels...
+static void cascade(wheel_t *wheel, unsigned level) {
+    unsigned slot = (unsigned)(wheel->current >> (level * SLOT_BITS)) & SLOT_MASK;
+    wheel_timer_t *head = &wheel->slots[level][slot];
+
+    while (head->next != head) {
+        wheel_timer_t *timer = head->next;
+        unlink_timer(wheel, timer);
+        link_timer(wheel, timer);
+
+        // Update stats...
+        wheel->wheel_cascaded++;
+    }
+}
+
+// Returns the first tick at which something needs to be done...
+static uint64_t next_tick(const wheel_t *wheel) {
+    uint64_t next = NOT_ARMED;
+
+    for (unsigned level = 0; level < LEVELS; level++) {
+        unsigned shift = level * SLOT_BITS;
+        uint64_t pos = (wheel->current >> shift) + 1;
+
+        int offset = find_occupied(wheel->occupied[level], (unsigned) pos & SLOT_MASK);
+        if (offset >= 0) {
+            // for the coarser levels, this is the tick at which the slot is cascaded...
+            uint64_t tick = (pos + (uint64_t) offset) << shift;
+            if (tick < next) {
+                next = tick;
+            }
+        }
+    }
+
+    return next;
+}
+
+static void arm(wheel_t *wheel, uint64_t tick) {
+    struct itimerspec its = { 0 };
+
+    if (tick != NOT_ARMED) {
+        uint64_t ms = tick * wheel->tick;
+
+        its.it_value.tv_sec = wheel->epoch.tv_sec + (time_t)(ms / 1000);
+        its.it_value.tv_nsec = wheel->epoch.tv_nsec + (long)(ms % 1000) * 1000000;
+        if (its.it_value.tv_nsec >= 1000000000) {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000;
+        }
+    }
+
+    if (timerfd_settime(wheel->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        log_warning("Failed to arm timer: %s", strerror(errno));
+        return;
+    }
+
+    wheel->armed = tick;
+}
+
+wheel_t *wheel_init(uint32_t tick) {
+    if (tick == 0) {
+        return NULL;
+    }
+
+    wheel_t *wheel = mem_malloc(MEM_QUEUES, sizeof(wheel_t));
+    if (wheel == NULL) {
+        log_error("failed to create timing wheel: out of memory!");
+        return NULL;
+    }
+    bzero(wheel, sizeof(wheel_t));
+
+    wheel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->timer_fd < 0) {
+        log_error("failed to create timer: %s", strerror(errno));
+        mem_free(MEM_QUEUES, wheel);
+        return NULL;
+    }
+
+    wheel->tick = tick;
+    wheel->armed = NOT_ARMED;
+    clock_gettime(CLOCK_MONOTONIC, &wheel->epoch);
+
+    for (unsigned level = 0; level < LEVELS; level++) {
+        for (unsigned slot = 0; slot < SLOTS; slot++) {
+            wheel->slots[level][slot].next = wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+
+    return wheel;
+}
+
+void wheel_destroy(wheel_t *wheel) {
+    if (wheel) {
+        close(wheel->timer_fd);
+        mem_free(MEM_QUEUES, wheel);
+    }
+}
+
+int wheel_fd(wheel_t *wheel) {
+    if (wheel == NULL) {
+        return -EINVAL;
+    }
+    return wheel->timer_fd;
+}
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_callback_t callback, void *context) {
+    bzero(timer, sizeof(wheel_timer_t));
+
+    timer->callback = callback;
+    timer->context = context;
+}
+
+bool wheel_pending(const wheel_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+int wheel_schedule(wheel_t *wheel, wheel_timer_t *timer, uint64_t delay) {
+    if (wheel == NULL || timer == NULL || timer->callback == NULL) {
+        return -EINVAL;
+    }
+
+    if (wheel_pending(timer)) {
+        unlink_timer(wheel, timer);
+    }
+
+    // round up, a timer never expires early...
+    uint64_t tick_ns = (uint64_t) wheel->tick * 1000000;
+    uint64_t expires = (elapsed(wheel) + delay * 1000000 + tick_ns - 1) / tick_ns;
+    timer->expires = (expires > wheel->current) ? expires : wheel->current + 1;
+
+    link_timer(wheel, timer);
+
+    // Update stats...
+    wheel->wheel_scheduled++;
+
+    if (timer->expires < wheel->armed) {
+        arm(wheel, next_tick(wheel));
+    }
+
+    return 0;
+}
+
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer) {
+    if (wheel == NULL || timer == NULL || !wheel_pending(timer)) {
+        return;
+    }
+
+    // the timer fd might fire for nothing, which is cheaper than rearming it...
+    unlink_timer(wheel, timer);
+
+    // Update stats...
+    wheel->wheel_cancelled++;
+}
+
+int wheel_advance(wheel_t *wheel, uint64_t now) {
+    if (wheel == NULL) {
+        return -EINVAL;
+    }
+
+    uint64_t target = now / wheel->tick;
+    int n = 0;
+
+    while (wheel->current < target) {
+        uint64_t next = next_tick(wheel);
+        if (next > target) {
+            // Nothing to do until the given time...
+            wheel->current = target;
+            break;
+        }
+        wheel->current = next;
+
+        // Move timers of the coarser levels down once we reach their slot...
+        for (unsigned level = 1; level < LEVELS; level++) {
+            if (wheel->current & ((1ull << (level * SLOT_BITS)) - 1)) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        wheel_timer_t *head = &wheel->slots[0][wheel->current & SLOT_MASK];
+        while (head->next != head) {
+            wheel_timer_t *timer = head->next;
+            unlink_timer(wheel, timer);
+
+            // Update stats...
+            wheel->wheel_expired++;
+            n++;
+
+            // might reschedule the timer, but never in this slot...
+            timer->callback(wheel, timer, timer->context);
+        }
+    }
+
+    return n;
+}
+
+int wheel_process(wheel_t *wheel) {
+    if (wheel == NULL) {
+        return -EINVAL;
+    }
+
+    uint64_t cnt;
+    if (read(wheel->timer_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        log_warning("Failed to read timer: %s", strerror(errno));
+    }
+
+    int n = wheel_advance(wheel, elapsed(wheel) / 1000000);
+
+    uint64_t next = next_tick(wheel);
+    if (next != wheel->armed) {
+        arm(wheel, next);
+    }
+
+    return n;
+}
+
+wheel_stats_t wheel_dump_stats(wheel_t *wheel) {
+    if (wheel == NULL) {
+        return (wheel_stats_t) {
+            0
+        };
+    }
+
+    return (wheel_stats_t) {
+        .timers = wheel->wheel_timers,
+        .scheduled = wheel->wheel_scheduled,
+        .cancelled = wheel->wheel_cancelled,
+        .expired = wheel->wheel_expired,
+        .cascaded = wheel->wheel_cascaded,
+    };
+}
+
+// EOF
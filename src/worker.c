@@ -0,0 +1,563 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "evloop.h"
+#include "log.h"
+#include "mem.h"
+#include "rt.h"
+#include "trace.h"
+#include "worker.h"
+
+#define CACHE_LINE 64
+// both must be a power of two...
+#define MSG_QUEUE_SIZE 256
+#define CMD_QUEUE_SIZE 512
+// keeps the memory footprint small, especially when all memory is locked...
+#define WORKER_STACK_SIZE (256 * 1024)
+
+typedef enum worker_msg_type {
+    CMD_ASSIGN,
+    CMD_RELEASE,
+    MSG_EVENT,
+    MSG_LOST,
+    MSG_RELEASED,
+} worker_msg_type_t;
+
+// commands, sent by the main thread to a worker...
+typedef struct worker_cmd {
+    worker_msg_type_t type;
+    gpsd_handle_t *gpsd;
+    void *source;
+} worker_cmd_t;
+
+// messages, sent by a worker to the main thread...
+typedef struct worker_msg {
+    worker_msg_type_t type;
+    void *source;
+    gps_event_t event;
+} worker_msg_t;
+
+typedef struct worker_source {
+    struct worker_source *next;
+    struct worker *worker;
+
+    gpsd_handle_t *gpsd;
+    void *source;
+    int fd;
+    // whether libgps still buffers messages that did not fit in the last wakeup...
+    bool backlog;
+} worker_source_t;
+
+typedef struct worker {
+    worker_pool_t *pool;
+    pthread_t thread;
+    bool started;
+
+    // only used by the worker thread...
+    evloop_t *loop;
+    int cmd_fd;
+    worker_source_t *sources;
+    bool pending;
+    bool backlog;
+    gps_event_t scratch;
+
+    // only used by the main thread...
+    uint32_t source_cnt;
+    uint64_t events;
+
+    atomic_uint_fast64_t events_dropped;
+    atomic_uint_fast32_t wakeups;
+
+    // single producer/single consumer queues, each index is written by one
+    // thread only, and lives in its own cache line to avoid false sharing...
+    _Alignas(CACHE_LINE) atomic_uint msg_tail;
+    _Alignas(CACHE_LINE) atomic_uint msg_head;
+    _Alignas(CACHE_LINE) atomic_uint cmd_tail;
+    _Alignas(CACHE_LINE) atomic_uint cmd_head;
+
+    worker_cmd_t cmds[CMD_QUEUE_SIZE];
+    worker_msg_t msgs[MSG_QUEUE_SIZE];
+} worker_t;
+
+struct worker_pool {
+    worker_t *workers;
+    uint8_t size;
+
+    int event_fd;
+    atomic_bool stop;
+
+    worker_event_callback_t event_callback;
+    worker_detach_callback_t detach_callback;
+    void *context;
+};
+
+static void notify(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_warning("Failed to notify worker: %s", strerror(errno));
+    }
+}
+
+// Returns the next free message slot, or NULL in case the queue is full...
+static worker_msg_t *reserve_msg(worker_t *worker) {
+    unsigned tail = atomic_load_explicit(&worker->msg_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&worker->msg_head, memory_order_acquire);
+    if (tail - head >= MSG_QUEUE_SIZE) {
+        return NULL;
+    }
+    return &worker->msgs[tail & (MSG_QUEUE_SIZE - 1)];
+}
+
+static void commit_msg(worker_t *worker) {
+    unsigned tail = atomic_load_explicit(&worker->msg_tail, memory_order_relaxed);
+    atomic_store_explicit(&worker->msg_tail, tail + 1, memory_order_release);
+    worker->pending = true;
+}
+
+// Queues a message that cannot be dropped, waits for the main thread if needed...
+static void send_control(worker_t *worker, worker_msg_type_t type, void *source) {
+    worker_msg_t *msg;
+    while ((msg = reserve_msg(worker)) == NULL) {
+        if (atomic_load(&worker->pool->stop)) {
+            return;
+        }
+        notify(worker->pool->event_fd);
+        usleep(1000);
+    }
+
+    msg->type = type;
+    msg->source = source;
+    commit_msg(worker);
+}
+
+static void detach_source(worker_t *worker, worker_source_t *ws, worker_msg_type_t reason) {
+    worker_source_t **prev = &worker->sources;
+    while (*prev && *prev != ws) {
+        prev = &(*prev)->next;
+    }
+    if (*prev) {
+        *prev = ws->next;
+    }
+
+    evloop_remove(worker->loop, ws->fd);
+    send_control(worker, reason, ws->source);
+
+    mem_free(MEM_QUEUES, ws);
+}
+
+// Reads what GPSD has sent, returns false if the connection is lost...
+static bool drain_source(worker_t *worker, worker_source_t *ws) {
+    // Drain what libgps has buffered, yet leave the other sources their turn...
+    int reads = 0;
+    do {
+        // parse directly into the queue, unless it is full...
+        worker_msg_t *msg = reserve_msg(worker);
+        gps_event_t *event = msg ? &msg->event : &worker->scratch;
+
+        int status = gpsd_read_data(ws->gpsd, event);
+        if (status < 0) {
+            ws->backlog = false;
+            return status != -ENOTCONN;
+        } else if (status > 0) {
+            if (msg) {
+                msg->type = MSG_EVENT;
+                msg->source = ws->source;
+                commit_msg(worker);
+            } else {
+                TRACE2(drop, "worker", (int)(worker - worker->pool->workers));
+
+                // Update stats...
+                atomic_fetch_add_explicit(&worker->events_dropped, 1, memory_order_relaxed);
+            }
+        }
+    } while (++reads < GPS_READ_BURST && gpsd_data_waiting(ws->gpsd));
+
+    // The remainder no longer makes the socket readable, it is read once the other sources had their turn...
+    ws->backlog = (reads == GPS_READ_BURST && gpsd_data_waiting(ws->gpsd));
+    worker->backlog |= ws->backlog;
+    return true;
+}
+
+// Called when data of GPSD is received, on the worker thread...
+static void source_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)fd;
+    worker_source_t *ws = context;
+    worker_t *worker = ws->worker;
+
+    bool lost = false;
+
+    if ((events & (EPOLLHUP | EPOLLERR)) != 0) {
+        log_warning("GPSD closed unexpectedly! Remote end closed?");
+        lost = true;
+    } else if (events & EPOLLIN) {
+        lost = !drain_source(worker, ws);
+    }
+
+    if (lost) {
+        detach_source(worker, ws, MSG_LOST);
+    }
+}
+
+// Continues with the sources that were not drained in their last wakeup...
+static void drain_backlog(worker_t *worker) {
+    worker->backlog = false;
+
+    worker_source_t *next;
+    for (worker_source_t *ws = worker->sources; ws; ws = next) {
+        next = ws->next;
+        if (ws->backlog && !drain_source(worker, ws)) {
+            detach_source(worker, ws, MSG_LOST);
+        }
+    }
+}
+
+static void handle_command(worker_t *worker, const worker_cmd_t *cmd) {
+    if (cmd->type == CMD_ASSIGN) {
+        worker_source_t *ws = mem_malloc(MEM_QUEUES, sizeof(worker_source_t));
+        if (ws == NULL) {
+            log_warning("Unable to assign GPSD source to worker: out of memory!");
+            send_control(worker, MSG_LOST, cmd->source);
+            return;
+        }
+        bzero(ws, sizeof(worker_source_t));
+
+        ws->worker = worker;
+        ws->gpsd = cmd->gpsd;
+        ws->source = cmd->source;
+        ws->fd = gpsd_fd(cmd->gpsd);
+
+        // Level-triggered: a burst that is not drained within one wakeup is picked up by the next...
+        if (evloop_add(worker->loop, ws->fd, EPOLLIN, source_callback, ws)) {
+            log_warning("Unable to add GPSD event handler to worker!");
+            send_control(worker, MSG_LOST, cmd->source);
+            mem_free(MEM_QUEUES, ws);
+            return;
+        }
+
+        ws->next = worker->sources;
+        worker->sources = ws;
+    } else if (cmd->type == CMD_RELEASE) {
+        worker_source_t *ws = worker->sources;
+        while (ws && ws->source != cmd->source) {
+            ws = ws->next;
+        }
+        if (ws) {
+            detach_source(worker, ws, MSG_RELEASED);
+        }
+    }
+}
+
+// Called when the main thread has queued commands, on the worker thread...
+static void command_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)events;
+    worker_t *worker = context;
+
+    uint64_t cnt;
+    if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        log_warning("Failed to read worker eventfd: %s", strerror(errno));
+    }
+
+    unsigned head = atomic_load_explicit(&worker->cmd_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&worker->cmd_tail, memory_order_acquire);
+
+    for (; head != tail; head++) {
+        handle_command(worker, &worker->cmds[head & (CMD_QUEUE_SIZE - 1)]);
+    }
+
+    atomic_store_explicit(&worker->cmd_head, head, memory_order_release);
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+
+    while (!atomic_load(&worker->pool->stop)) {
+        // Only poll in case a backlog is waiting...
+        if (evloop_dispatch(worker->loop, worker->backlog ? 0 : -1) < 0) {
+            // Avoid a busy loop in case epoll keeps failing...
+            usleep(100000);
+            continue;
+        }
+
+        // Update stats...
+        atomic_fetch_add_explicit(&worker->wakeups, 1, memory_order_relaxed);
+
+        if (worker->backlog) {
+            drain_backlog(worker);
+        }
+
+        // Wake up the main thread once per batch of events...
+        if (worker->pending) {
+            worker->pending = false;
+            notify(worker->pool->event_fd);
+        }
+    }
+
+    return NULL;
+}
+
+static int send_command(worker_pool_t *pool, int idx, worker_msg_type_t type, gpsd_handle_t *gpsd, void *source) {
+    worker_t *worker = &pool->workers[idx];
+
+    unsigned tail = atomic_load_explicit(&worker->cmd_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&worker->cmd_head, memory_order_acquire);
+    if (tail - head >= CMD_QUEUE_SIZE) {
+        return -EBUSY;
+    }
+
+    worker->cmds[tail & (CMD_QUEUE_SIZE - 1)] = (worker_cmd_t) {
+        .type = type,
+        .gpsd = gpsd,
+        .source = source,
+    };
+    atomic_store_explicit(&worker->cmd_tail, tail + 1, memory_order_release);
+
+    notify(worker->cmd_fd);
+
+    return 0;
+}
+
+worker_pool_t *worker_pool_init(uint8_t workers, worker_event_callback_t event_callback,
+                                worker_detach_callback_t detach_callback, void *context) {
+    if (workers == 0 || event_callback == NULL || detach_callback == NULL) {
+        return NULL;
+    }
+
+    worker_pool_t *pool = mem_malloc(MEM_QUEUES, sizeof(worker_pool_t));
+    if (pool == NULL) {
+        log_error("failed to create worker pool: out of memory!");
+        return NULL;
+    }
+    bzero(pool, sizeof(worker_pool_t));
+
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->event_callback = event_callback;
+    pool->detach_callback = detach_callback;
+    pool->context = context;
+
+    pool->workers = mem_aligned_alloc(MEM_QUEUES, CACHE_LINE, workers * sizeof(worker_t));
+    if (pool->workers == NULL || pool->event_fd < 0) {
+        log_error("failed to create worker pool: %s", strerror(pool->event_fd < 0 ? errno : ENOMEM));
+        goto error;
+    }
+    bzero(pool->workers, workers * sizeof(worker_t));
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+    for (pool->size = 0; pool->size < workers; pool->size++) {
+        worker_t *worker = &pool->workers[pool->size];
+
+        worker->pool = pool;
+        worker->cmd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->loop = evloop_init();
+
+        if (worker->cmd_fd < 0 || worker->loop == NULL ||
+                evloop_add(worker->loop, worker->cmd_fd, EPOLLIN, command_callback, worker)) {
+            log_error("failed to create worker #%d!", pool->size);
+            pool->size++;
+            goto error;
+        }
+
+        int status = pthread_create(&worker->thread, &attr, worker_main, worker);
+        if (status) {
+            log_error("failed to start worker #%d: %s", pool->size, strerror(status));
+            pool->size++;
+            goto error;
+        }
+        worker->started = true;
+
+        char name[16];
+        snprintf(name, sizeof(name), "gpsstats-w%d", pool->size);
+        pthread_setname_np(worker->thread, name);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return pool;
+
+error:
+    pthread_attr_destroy(&attr);
+    worker_pool_destroy(pool);
+    return NULL;
+}
+
+void worker_pool_destroy(worker_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    atomic_store(&pool->stop, true);
+
+    for (uint8_t i = 0; i < pool->size; i++) {
+        worker_t *worker = &pool->workers[i];
+
+        if (worker->started) {
+            notify(worker->cmd_fd);
+            pthread_join(worker->thread, NULL);
+        }
+
+        while (worker->sources) {
+            worker_source_t *ws = worker->sources;
+            worker->sources = ws->next;
+            mem_free(MEM_QUEUES, ws);
+        }
+
+        evloop_destroy(worker->loop);
+        if (worker->cmd_fd >= 0) {
+            close(worker->cmd_fd);
+        }
+    }
+
+    if (pool->event_fd >= 0) {
+        close(pool->event_fd);
+    }
+    mem_free(MEM_QUEUES, pool->workers);
+    mem_free(MEM_QUEUES, pool);
+}
+
+int worker_pool_fd(worker_pool_t *pool) {
+    if (pool == NULL) {
+        return -EINVAL;
+    }
+    return pool->event_fd;
+}
+
+int worker_pool_assign(worker_pool_t *pool, gpsd_handle_t *gpsd, void *source) {
+    if (pool == NULL || gpsd == NULL || source == NULL) {
+        return -EINVAL;
+    }
+
+    // Pick the worker with the fewest sources, and of those, the one that
+    // handled the fewest events. As sources are (re)assigned whenever they
+    // reconnect, this rebalances the workers over time...
+    int idx = 0;
+    for (int i = 1; i < pool->size; i++) {
+        const worker_t *worker = &pool->workers[i];
+        const worker_t *best = &pool->workers[idx];
+
+        if (worker->source_cnt < best->source_cnt ||
+                (worker->source_cnt == best->source_cnt && worker->events < best->events)) {
+            idx = i;
+        }
+    }
+
+    int status = send_command(pool, idx, CMD_ASSIGN, gpsd, source);
+    if (status) {
+        return status;
+    }
+
+    pool->workers[idx].source_cnt++;
+
+    return idx;
+}
+
+int worker_pool_release(worker_pool_t *pool, int worker, void *source) {
+    if (pool == NULL || worker < 0 || worker >= pool->size || source == NULL) {
+        return -EINVAL;
+    }
+    return send_command(pool, worker, CMD_RELEASE, NULL, source);
+}
+
+int worker_pool_process(worker_pool_t *pool) {
+    if (pool == NULL) {
+        return -EINVAL;
+    }
+
+    // Reset the eventfd, we handle all queued messages anyway...
+    uint64_t cnt;
+    if (read(pool->event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        log_warning("Failed to read worker pool eventfd: %s", strerror(errno));
+    }
+
+    int n = 0;
+
+    for (uint8_t i = 0; i < pool->size; i++) {
+        worker_t *worker = &pool->workers[i];
+
+        unsigned head = atomic_load_explicit(&worker->msg_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&worker->msg_tail, memory_order_acquire);
+
+        for (; head != tail; head++) {
+            worker_msg_t *msg = &worker->msgs[head & (MSG_QUEUE_SIZE - 1)];
+
+            if (msg->type == MSG_EVENT) {
+                // Update stats...
+                worker->events++;
+                n++;
+
+                pool->event_callback(&msg->event, msg->source, pool->context);
+            } else {
+                worker->source_cnt--;
+
+                pool->detach_callback(msg->source, msg->type == MSG_LOST, pool->context);
+            }
+        }
+
+        // Release the whole batch at once...
+        atomic_store_explicit(&worker->msg_head, head, memory_order_release);
+    }
+
+    return n;
+}
+
+int worker_pool_set_rt(worker_pool_t *pool, const char *cpus, uint8_t priority) {
+    if (pool == NULL) {
+        return -EINVAL;
+    }
+
+    int result = 0;
+    for (uint8_t i = 0; i < pool->size; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "worker #%d", i);
+
+        int status = rt_apply(pool->workers[i].thread, name, cpus, priority);
+        if (status) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+uint8_t worker_pool_size(worker_pool_t *pool) {
+    return pool ? pool->size : 0;
+}
+
+worker_stats_t worker_pool_dump_stats(worker_pool_t *pool, int worker) {
+    if (pool == NULL || worker < 0 || worker >= pool->size) {
+        return (worker_stats_t) {
+            0
+        };
+    }
+
+    worker_t *w = &pool->workers[worker];
+
+    return (worker_stats_t) {
+        .sources = w->source_cnt,
+        .events = w->events,
+        .events_dropped = atomic_load_explicit(&w->events_dropped, memory_order_relaxed),
+        .wakeups = (uint32_t) atomic_load_explicit(&w->wakeups, memory_order_relaxed),
+    };
+}
+
+// EOF
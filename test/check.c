@@ -0,0 +1,674 @@
+/*
+ * gpsstats - statistics for GPS daemon
+ *
+ * Copyright: (C) 2020 jawi
+ *   License: Apache License 2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+
+// The resolver cache is checked against a stand-in for the resolver and the
+// clock, so an outage of hours takes no time at all...
+static int check_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+static int check_clock_gettime(clockid_t clock, struct timespec *ts);
+
+#define getaddrinfo check_getaddrinfo
+#define clock_gettime check_clock_gettime
+#include "resolver.c"
+#undef getaddrinfo
+#undef clock_gettime
+
+// The poller of chronyd is checked against a stand-in chronyd, using its wire format...
+#include "chrony.c"
+
+#include "checkpoint.h"
+#include "gpsd.h"
+#include "sparkplug.h"
+
+// the maximum time to wait for a background thread, in milliseconds...
+#define WAIT_MSEC 2000
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+typedef int (*check_fn_t)(void);
+
+typedef struct check {
+    const char *name;
+    check_fn_t fn;
+} check_t;
+
+// Resolver cache...
+
+#define CHECK_HOST "gpsd.example"
+#define CHECK_ADDR "192.0.2.1"
+
+static _Atomic bool resolver_down;
+static _Atomic time_t clock_offset;
+
+static int check_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+    // Numeric addresses are never looked up...
+    if (hints && (hints->ai_flags & AI_NUMERICHOST)) {
+        return getaddrinfo(node, service, hints, res);
+    }
+    if (atomic_load(&resolver_down)) {
+        return EAI_AGAIN;
+    }
+    if (node == NULL || strcmp(node, CHECK_HOST) != 0) {
+        return EAI_NONAME;
+    }
+
+    struct addrinfo numeric = *hints;
+    numeric.ai_flags = AI_NUMERICHOST;
+    return getaddrinfo(CHECK_ADDR, service, &numeric, res);
+}
+
+static int check_clock_gettime(clockid_t clock, struct timespec *ts) {
+    int status = clock_gettime(clock, ts);
+    if (status == 0 && clock == CLOCK_MONOTONIC) {
+        ts->tv_sec += atomic_load(&clock_offset);
+    }
+    return status;
+}
+
+// Lets time pass for the resolver cache, and wakes up its refresh thread...
+static void advance_clock(time_t seconds) {
+    pthread_mutex_lock(&resolver_lock);
+    atomic_fetch_add(&clock_offset, seconds);
+    pthread_cond_signal(&resolver_cond);
+    pthread_mutex_unlock(&resolver_lock);
+}
+
+static void sleep_msec(long msec) {
+    struct timespec ts = { .tv_sec = msec / 1000, .tv_nsec = (msec % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static bool wait_refresh_failures(uint64_t cnt) {
+    for (int i = 0; i < WAIT_MSEC / 10; i++) {
+        if (resolver_dump_stats().refresh_failures >= cnt) {
+            return true;
+        }
+        sleep_msec(10);
+    }
+    return false;
+}
+
+static bool wait_entries(uint32_t cnt) {
+    for (int i = 0; i < WAIT_MSEC / 10; i++) {
+        if (resolver_dump_stats().entries == cnt) {
+            return true;
+        }
+        sleep_msec(10);
+    }
+    return false;
+}
+
+static bool has_check_addr(const resolver_result_t *result) {
+    return result->cnt == 1 && strcmp(result->addrs[0].host, CHECK_ADDR) == 0;
+}
+
+// A connection that stays up for long keeps the address of its host, even when the resolver is down by then...
+static int check_resolver_outage(void) {
+    int failures = 0;
+    resolver_result_t result;
+
+    atomic_store(&resolver_down, false);
+    CHECK(resolver_start(300) == 0);
+
+    bzero(&result, sizeof(result));
+    CHECK(resolver_lookup(CHECK_HOST, &result) == 0);
+    CHECK(has_check_addr(&result));
+
+    // Idle for well past what used to be the eviction age (ten TTLs), with a failing resolver...
+    atomic_store(&resolver_down, true);
+    advance_clock(300 * 10 + 60);
+    CHECK(wait_refresh_failures(1));
+
+    bzero(&result, sizeof(result));
+    CHECK(resolver_lookup(CHECK_HOST, &result) == 0);
+    CHECK(has_check_addr(&result));
+
+    resolver_stats_t stats = resolver_dump_stats();
+    CHECK(stats.entries == 1);
+    CHECK(stats.misses == 1);
+    CHECK(stats.hits == 1);
+    CHECK(stats.stale_hits == 1);
+
+    // Hosts that are no longer configured are dropped...
+    const char *hosts[] = { "broker.example" };
+    resolver_retain(hosts, 1);
+    CHECK(wait_entries(0));
+    CHECK(resolver_lookup(CHECK_HOST, &result) == -ENOENT);
+
+    resolver_stop();
+    atomic_store(&resolver_down, false);
+
+    return failures;
+}
+
+// chronyd stand-in...
+
+typedef enum chronyd_mode {
+    CHRONYD_OK = 0,
+    // the tracking reply lacks most of its data...
+    CHRONYD_SHORT,
+    // each reply is preceded by one with the sequence number of the previous request, and bogus data...
+    CHRONYD_STALE,
+} chronyd_mode_t;
+
+// the view of the stand-in, all exactly representable in the floating point format of chrony...
+#define CHRONYD_REF_ID 0x50505300 // "PPS"
+#define CHRONYD_STRATUM 1
+#define CHRONYD_FREQ -2.5
+#define CHRONYD_SD 0x1p-20
+#define CHRONYD_OFFSET -0x1p-12
+// of its two sources, only the second one is selected...
+#define CHRONYD_SOURCES 2
+#define CHRONYD_SELECTED 1
+#define RPY_SD_ST_UNSELECTED 4
+
+typedef struct chronyd {
+    chronyd_mode_t mode;
+    int fd;
+    uint32_t requests;
+
+    char dir[32];
+    char path[64];
+
+    evloop_t *loop;
+    wheel_t *wheel;
+    chrony_t *chrony;
+} chronyd_t;
+
+// Encodes the 32-bit floating point format of chrony, @see #get_float...
+static void put_float(uint8_t *p, double value) {
+    int exp = 0;
+    double frac = frexp(value, &exp);
+    int32_t coef = (int32_t) lround(frac * 0x1p24);
+    if (coef == 0x1000000 || coef == -0x1000000) {
+        coef /= 2;
+        exp++;
+    }
+    if (coef == 0) {
+        exp = -63;
+    }
+    put_u32(p, ((uint32_t) (exp + 1) & 0x7f) << 25 | ((uint32_t) coef & 0x1ffffff));
+}
+
+static void chronyd_reply(chronyd_t *chronyd, const struct sockaddr_un *to, socklen_t to_len,
+                          uint16_t command, uint32_t sequence, uint32_t index, bool bogus) {
+    uint8_t buf[MAX_PACKET_SIZE];
+    uint8_t *data = buf + REPLY_HEADER_SIZE;
+    uint16_t reply;
+    size_t size;
+
+    bzero(buf, sizeof(buf));
+
+    switch (command) {
+    case REQ_TRACKING:
+        reply = RPY_TRACKING;
+        size = (chronyd->mode == CHRONYD_SHORT) ? TRACKING_SIZE / 2 : TRACKING_SIZE;
+        put_u32(data, bogus ? 0x42414400 : CHRONYD_REF_ID); // "BAD"
+        put_u16(data + 24, bogus ? 15 : CHRONYD_STRATUM);
+        put_float(data + 52, bogus ? 100.0 : CHRONYD_FREQ);
+        break;
+
+    case REQ_N_SOURCES:
+        reply = RPY_N_SOURCES;
+        size = N_SOURCES_SIZE;
+        put_u32(data, CHRONYD_SOURCES);
+        break;
+
+    case REQ_SOURCE_DATA:
+        reply = RPY_SOURCE_DATA;
+        size = SOURCE_DATA_SIZE;
+        put_u16(data + 24, (bogus || index == CHRONYD_SELECTED) ? RPY_SD_ST_SELECTED : RPY_SD_ST_UNSELECTED);
+        break;
+
+    case REQ_SOURCESTATS:
+        reply = RPY_SOURCESTATS;
+        size = SOURCESTATS_SIZE;
+        put_float(data + 36, bogus ? 1.0 : CHRONYD_SD);
+        put_float(data + 48, bogus ? 1.0 : CHRONYD_OFFSET);
+        break;
+
+    default:
+        return;
+    }
+
+    buf[0] = PROTO_VERSION;
+    buf[1] = PKT_TYPE_CMD_REPLY;
+    put_u16(buf + 4, command);
+    put_u16(buf + 6, reply);
+    put_u16(buf + 8, STT_SUCCESS);
+    put_u32(buf + 16, sequence);
+
+    sendto(chronyd->fd, buf, REPLY_HEADER_SIZE + size, MSG_DONTWAIT, (const struct sockaddr *) to, to_len);
+}
+
+static void chronyd_callback(evloop_t *loop, int fd, uint32_t events, void *context) {
+    (void)loop;
+    (void)events;
+    chronyd_t *chronyd = context;
+    uint8_t buf[MAX_PACKET_SIZE];
+    struct sockaddr_un from;
+    socklen_t from_len = sizeof(from);
+
+    ssize_t len = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &from, &from_len);
+    if (len < REQUEST_HEADER_SIZE || buf[0] != PROTO_VERSION || buf[1] != PKT_TYPE_CMD_REQUEST) {
+        return;
+    }
+    chronyd->requests++;
+
+    uint16_t command = get_u16(buf + 4);
+    uint32_t sequence = get_u32(buf + 8);
+    uint32_t index = (len >= REQUEST_HEADER_SIZE + INDEX_SIZE) ? get_u32(buf + REQUEST_HEADER_SIZE) : 0;
+
+    if (chronyd->mode == CHRONYD_STALE) {
+        chronyd_reply(chronyd, &from, from_len, command, sequence - 1, index, true);
+    }
+    chronyd_reply(chronyd, &from, from_len, command, sequence, index, false);
+}
+
+static void chronyd_stop(chronyd_t *chronyd) {
+    chrony_destroy(chronyd->chrony);
+    if (chronyd->fd >= 0) {
+        evloop_remove(chronyd->loop, chronyd->fd);
+        close(chronyd->fd);
+        unlink(chronyd->path);
+    }
+    wheel_destroy(chronyd->wheel);
+    evloop_destroy(chronyd->loop);
+    if (chronyd->dir[0]) {
+        rmdir(chronyd->dir);
+    }
+}
+
+// Starts a stand-in chronyd, along with a poller for it...
+static int chronyd_start(chronyd_t *chronyd, chronyd_mode_t mode) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    bzero(chronyd, sizeof(chronyd_t));
+    chronyd->mode = mode;
+    chronyd->fd = -1;
+
+    strcpy(chronyd->dir, "/tmp/gpsstats-check.XXXXXX");
+    if (mkdtemp(chronyd->dir) == NULL) {
+        chronyd->dir[0] = 0;
+        return -errno;
+    }
+    snprintf(chronyd->path, sizeof(chronyd->path), "%s/chronyd.sock", chronyd->dir);
+
+    chronyd->loop = evloop_init();
+    chronyd->wheel = wheel_init(10);
+    if (chronyd->loop == NULL || chronyd->wheel == NULL) {
+        chronyd_stop(chronyd);
+        return -ENOMEM;
+    }
+
+    chronyd->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    strcpy(addr.sun_path, chronyd->path);
+    if (chronyd->fd < 0 || bind(chronyd->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            evloop_add(chronyd->loop, chronyd->fd, EPOLLIN, chronyd_callback, chronyd)) {
+        int status = errno ? -errno : -EINVAL;
+        if (chronyd->fd >= 0) {
+            close(chronyd->fd);
+            chronyd->fd = -1;
+        }
+        chronyd_stop(chronyd);
+        return status;
+    }
+
+    chronyd->chrony = chrony_init(chronyd->loop, chronyd->wheel);
+    if (chronyd->chrony == NULL) {
+        chronyd_stop(chronyd);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Runs a single poll, until neither side has anything left to say...
+static void chronyd_poll(chronyd_t *chronyd) {
+    if (chrony_start(chronyd->chrony, chronyd->path, 60)) {
+        return;
+    }
+    // the first poll is due right away...
+    wheel_advance(chronyd->wheel, 100);
+
+    while (evloop_dispatch(chronyd->loop, 100) > 0) {
+        // keep going...
+    }
+}
+
+static void keep_event(gps_event_t *event, void *context) {
+    *(gps_event_t *) context = *event;
+}
+
+// The reading of a poll ends up in the events of GPSD, next to the offset of GPSD...
+static int check_chrony_diff(void) {
+    int failures = 0;
+    static gps_event_t event;
+
+    gpsd_source_t source = {
+        .name = "check", .host = "localhost", .port = "2947", .chrony = true,
+    };
+    gpsd_handle_t *handle = gpsd_init(&source);
+    CHECK(handle != NULL);
+    if (handle == NULL) {
+        return failures;
+    }
+
+    char msgs[] =
+        "{\"class\":\"TPV\",\"device\":\"/dev/ttyACM0\",\"mode\":3,\"time\":\"2020-01-01T00:00:00.000Z\"}\n"
+        "{\"class\":\"SKY\",\"device\":\"/dev/ttyACM0\",\"satellites\":["
+        "{\"PRN\":1,\"el\":40,\"az\":100,\"ss\":30,\"used\":true,\"gnssid\":0,\"svid\":1}]}\n"
+        // the system clock is 500 us ahead of the GPS...
+        "{\"class\":\"TOFF\",\"device\":\"/dev/ttyACM0\",\"real_sec\":1577836800,\"real_nsec\":0,"
+        "\"clock_sec\":1577836800,\"clock_nsec\":500000,\"precision\":-1}\n";
+
+    bzero(&event, sizeof(event));
+    CHECK(gpsd_feed_data(handle, msgs, strlen(msgs), keep_event, &event) > 0);
+    CHECK(fabs(event.toff - 0.0005) < 1e-9);
+    CHECK(event.chrony_valid);
+    CHECK(event.chrony.offset == CHRONYD_OFFSET);
+    CHECK(fabs(event.chrony_diff - (0.0005 - CHRONYD_OFFSET)) < 1e-9);
+
+    gpsd_destroy(handle);
+
+    return failures;
+}
+
+static int check_chrony_poll(void) {
+    int failures = 0;
+    chronyd_t chronyd;
+    chrony_reading_t reading;
+
+    CHECK(chronyd_start(&chronyd, CHRONYD_OK) == 0);
+    chronyd_poll(&chronyd);
+
+    CHECK(chrony_latest(&reading));
+    CHECK(reading.ref_id == CHRONYD_REF_ID);
+    CHECK(reading.stratum == CHRONYD_STRATUM);
+    CHECK(reading.freq == CHRONYD_FREQ);
+    CHECK(reading.sd == CHRONYD_SD);
+    CHECK(reading.offset == CHRONYD_OFFSET);
+    CHECK(chronyd.chrony && chronyd.chrony->selected == CHRONYD_SELECTED);
+
+    // tracking, the number of sources, the data of both sources, and the statistics of the selected one...
+    chrony_stats_t stats = chrony_dump_stats(chronyd.chrony);
+    CHECK(stats.polls == 1);
+    CHECK(stats.polls_failed == 0);
+    CHECK(stats.requests == 5);
+    CHECK(chronyd.requests == 5);
+
+    failures += check_chrony_diff();
+
+    chronyd_stop(&chronyd);
+
+    return failures;
+}
+
+static int check_chrony_short_reply(void) {
+    int failures = 0;
+    chronyd_t chronyd;
+    chrony_reading_t reading;
+
+    CHECK(chronyd_start(&chronyd, CHRONYD_SHORT) == 0);
+    chronyd_poll(&chronyd);
+
+    // A poll that fails leaves no reading at all...
+    CHECK(!chrony_latest(&reading));
+
+    chrony_stats_t stats = chrony_dump_stats(chronyd.chrony);
+    CHECK(stats.polls == 1);
+    CHECK(stats.polls_failed == 1);
+    CHECK(stats.requests == 1);
+
+    chronyd_stop(&chronyd);
+
+    return failures;
+}
+
+static int check_chrony_stale_reply(void) {
+    int failures = 0;
+    chronyd_t chronyd;
+    chrony_reading_t reading;
+
+    CHECK(chronyd_start(&chronyd, CHRONYD_STALE) == 0);
+    chronyd_poll(&chronyd);
+
+    // Replies to earlier requests are ignored, had they been taken, the first source would be selected...
+    CHECK(chrony_latest(&reading));
+    CHECK(reading.ref_id == CHRONYD_REF_ID);
+    CHECK(reading.stratum == CHRONYD_STRATUM);
+    CHECK(reading.offset == CHRONYD_OFFSET);
+    CHECK(chronyd.chrony && chronyd.chrony->selected == CHRONYD_SELECTED);
+
+    chrony_stats_t stats = chrony_dump_stats(chronyd.chrony);
+    CHECK(stats.polls_failed == 0);
+    CHECK(stats.requests == 5);
+
+    chronyd_stop(&chronyd);
+
+    return failures;
+}
+
+// Checkpoint...
+
+static size_t save_handle(gpsd_saved_device_t *devices, size_t max, void *context) {
+    return gpsd_save_devices(context, devices, max);
+}
+
+static void count_event(gps_event_t *event, void *context) {
+    (void)event;
+    (*(int *) context)++;
+}
+
+// Feeds a number of TOFF messages, with offsets of 1, 2, ... microseconds...
+static void feed_toff(gpsd_handle_t *handle, int cnt) {
+    char msg[256];
+    int events = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        int len = snprintf(msg, sizeof(msg), "{\"class\":\"TOFF\",\"device\":\"/dev/ttyACM0\",\"real_sec\":%d,"
+                           "\"real_nsec\":0,\"clock_sec\":%d,\"clock_nsec\":%d,\"precision\":-1}\n",
+                           1577836800 + i, 1577836800 + i, 1000 * (i + 1));
+        gpsd_feed_data(handle, msg, (size_t) len, count_event, &events);
+    }
+}
+
+// The rolling windows of a device continue where the previous run left off...
+static int check_checkpoint_devices(void) {
+    int failures = 0;
+    char file[] = "/tmp/gpsstats-check.XXXXXX";
+    gpsd_device_stats_t devices[GPS_MAX_DEVICES];
+
+    int fd = mkstemp(file);
+    CHECK(fd >= 0);
+    if (fd < 0) {
+        return failures;
+    }
+    close(fd);
+
+    gpsd_source_t source = {
+        .name = "check", .host = "localhost", .port = "2947",
+    };
+    // Earlier checks keep the state of their devices...
+    gpsd_restore_devices(NULL, 0);
+
+    gpsd_handle_t *handle = gpsd_init(&source);
+    CHECK(handle != NULL);
+    feed_toff(handle, 10);
+
+    checkpoint_t *cp = checkpoint_open(file);
+    CHECK(cp != NULL);
+    CHECK(checkpoint_write(cp, save_handle, handle) == 0);
+    checkpoint_close(cp);
+    gpsd_destroy(handle);
+
+    // The next run...
+    cp = checkpoint_open(file);
+    CHECK(cp != NULL);
+    CHECK(checkpoint_restore(cp, 0) == 0);
+    checkpoint_close(cp);
+
+    handle = gpsd_init(&source);
+    CHECK(handle != NULL);
+    feed_toff(handle, 1);
+
+    CHECK(gpsd_dump_devices(handle, devices, GPS_MAX_DEVICES) == 1);
+    CHECK(devices[0].offsets.toff.cnt == 11);
+    CHECK(fabs(devices[0].offsets.toff.max - 10e-6) < 1e-12);
+
+    gpsd_destroy(handle);
+    unlink(file);
+
+    return failures;
+}
+
+// Feeds TOFF messages until the offsets of the device cover a full window, returns the number of messages...
+static int feed_until_warm(gpsd_handle_t *handle) {
+    gpsd_device_stats_t devices[GPS_MAX_DEVICES];
+
+    for (int i = 1; i <= 2 * ROLLING_WINDOW; i++) {
+        feed_toff(handle, 1);
+        if (gpsd_dump_devices(handle, devices, GPS_MAX_DEVICES) == 1 && devices[0].warmup_msec) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A source that reconnects continues with the state of its devices, so its statistics are meaningful right away...
+static int check_checkpoint_reconnect(void) {
+    int failures = 0;
+    gpsd_device_stats_t devices[GPS_MAX_DEVICES];
+    gpsd_saved_device_t saved[GPS_SAVED_DEVICES];
+
+    gpsd_source_t source = {
+        .name = "check", .host = "localhost", .port = "2947",
+    };
+    gpsd_restore_devices(NULL, 0);
+
+    gpsd_handle_t *handle = gpsd_init(&source);
+    CHECK(handle != NULL);
+    CHECK(feed_until_warm(handle) == ROLLING_WINDOW);
+    gpsd_destroy(handle);
+
+    CHECK(gpsd_save_kept_devices(saved, GPS_SAVED_DEVICES) == 1);
+    CHECK(saved[0].toff.cnt == ROLLING_WINDOW);
+
+    // The reconnect...
+    handle = gpsd_init(&source);
+    CHECK(handle != NULL);
+    CHECK(gpsd_dump_devices(handle, devices, GPS_MAX_DEVICES) == 0);
+    CHECK(feed_until_warm(handle) == 1);
+    CHECK(gpsd_dump_devices(handle, devices, GPS_MAX_DEVICES) == 1);
+    CHECK(devices[0].offsets.toff.cnt == ROLLING_WINDOW);
+    CHECK(gpsd_save_kept_devices(saved, GPS_SAVED_DEVICES) == 0);
+
+    gpsd_destroy(handle);
+    gpsd_restore_devices(NULL, 0);
+    CHECK(gpsd_save_kept_devices(saved, GPS_SAVED_DEVICES) == 0);
+
+    return failures;
+}
+
+// Host applications request a rebirth by setting the metric announced in our NBIRTH...
+static int check_sparkplug_rebirth(void) {
+    int failures = 0;
+    sparkplug_state_t state;
+    sparkplug_update_t update;
+    uint8_t birth[PAYLOAD_MAX_SIZE];
+
+    // timestamp, and a metric with name, data type (boolean) and value...
+    uint8_t ncmd[] = {
+        0x08, 0x01,
+        0x12, 0x1a,
+        0x0a, 0x14, 'N', 'o', 'd', 'e', ' ', 'C', 'o', 'n', 't', 'r', 'o', 'l', '/', 'R', 'e', 'b', 'i', 'r', 't', 'h',
+        0x20, 0x0b,
+        0x70, 0x01,
+    };
+
+    CHECK(sparkplug_decode_rebirth(ncmd, sizeof(ncmd)));
+    // truncated...
+    CHECK(!sparkplug_decode_rebirth(ncmd, sizeof(ncmd) - 3));
+    // set to false...
+    ncmd[sizeof(ncmd) - 1] = 0x00;
+    CHECK(!sparkplug_decode_rebirth(ncmd, sizeof(ncmd)));
+    // another metric...
+    ncmd[sizeof(ncmd) - 1] = 0x01;
+    ncmd[6] = 'M';
+    CHECK(!sparkplug_decode_rebirth(ncmd, sizeof(ncmd)));
+
+    // Our NBIRTH announces the metric, but does not set it...
+    sparkplug_init(&state, 0);
+    int len = sparkplug_encode_birth(&state, &update, birth, sizeof(birth));
+    CHECK(len > 0);
+    CHECK(memmem(birth, (size_t) len, SPARKPLUG_REBIRTH, strlen(SPARKPLUG_REBIRTH)) != NULL);
+    CHECK(!sparkplug_decode_rebirth(birth, (size_t) len));
+
+    return failures;
+}
+
+// Harness...
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    static const check_t checks[] = {
+        { "resolver/outage", check_resolver_outage },
+        { "chrony/poll", check_chrony_poll },
+        { "chrony/short_reply", check_chrony_short_reply },
+        { "chrony/stale_reply", check_chrony_stale_reply },
+        { "checkpoint/devices", check_checkpoint_devices },
+        { "checkpoint/reconnect", check_checkpoint_reconnect },
+        { "sparkplug/rebirth", check_sparkplug_rebirth },
+    };
+    int failed = 0;
+
+    // The checks only report their own failures...
+    log_async_set_debug(false);
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        int failures = checks[i].fn();
+
+        fprintf(stderr, "%-10s %s\n", failures ? "FAILED" : "ok", checks[i].name);
+        if (failures) {
+            failed++;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "%d check(s) failed!\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+// EOF